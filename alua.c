@@ -452,15 +452,16 @@ static int alua_sync_state(struct tcmu_device *dev,
 	return TCMU_STS_OK;
 }
 
-int tcmu_emulate_report_tgt_port_grps(struct tcmu_device *dev,
-				      struct list_head *group_list,
-				      struct tcmulib_cmd *cmd)
+int __tcmu_emulate_report_tgt_port_grps(struct tcmu_device *dev,
+					struct list_head *group_list,
+					uint8_t *cdb, struct iovec *iovec,
+					size_t iov_cnt)
 {
 	struct alua_grp *group;
 	struct tgt_port *port, *enabled_port;
-	int ext_hdr = cmd->cdb[1] & 0x20;
+	int ext_hdr = cdb[1] & 0x20;
 	uint32_t off = 4, ret_data_len = 0, ret32;
-	uint32_t alloc_len = tcmu_cdb_get_xfer_length(cmd->cdb);
+	uint32_t alloc_len = tcmu_cdb_get_xfer_length(cdb);
 	uint8_t *buf;
 	int ret;
 
@@ -529,13 +530,21 @@ int tcmu_emulate_report_tgt_port_grps(struct tcmu_device *dev,
 	ret32 = htobe32(ret_data_len);
 	memcpy(&buf[0], &ret32, 4);
 
-	tcmu_memcpy_into_iovec(cmd->iovec, cmd->iov_cnt, buf, alloc_len);
+	tcmu_memcpy_into_iovec(iovec, iov_cnt, buf, alloc_len);
 	ret = TCMU_STS_OK;
 free_buf:
 	free(buf);
 	return ret;
 }
 
+int tcmu_emulate_report_tgt_port_grps(struct tcmu_device *dev,
+				      struct list_head *group_list,
+				      struct tcmulib_cmd *cmd)
+{
+	return __tcmu_emulate_report_tgt_port_grps(dev, group_list, cmd->cdb,
+						   cmd->iovec, cmd->iov_cnt);
+}
+
 bool lock_is_required(struct tcmu_device *dev)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
@@ -565,14 +574,13 @@ int alua_implicit_transition(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 		/* For both read/write cases in this state is good */
 		goto done;
 	} else if (rdev->lock_state == TCMUR_DEV_LOCK_WRITE_LOCKING) {
-		/* For both read/write cases in this state should return busy */
+		/* park behind the in-flight handoff instead of BUSY */
 		tcmu_dev_dbg(dev, "Write lock acquisition operation is already in process.\n");
-		ret = TCMU_STS_BUSY;
+		ret = tcmur_park_cmd(dev, cmd);
 		goto done;
 	} else if (rdev->lock_state == TCMUR_DEV_LOCK_READ_LOCKING) {
-		/* For both read/write they need to retry */
 		tcmu_dev_dbg(dev, "Read lock acquisition operation is already in process.\n");
-		ret = TCMU_STS_BUSY;
+		ret = tcmur_park_cmd(dev, cmd);
 		goto done;
 	} else if (is_read) {
 		if (rdev->lock_state == TCMUR_DEV_LOCK_READ_LOCKED)
@@ -613,7 +621,8 @@ int alua_implicit_transition(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 		rdev->lock_state = TCMUR_DEV_LOCK_UNLOCKED;
 		ret = TCMU_STS_IMPL_TRANSITION_ERR;
 	} else {
-		ret = TCMU_STS_BUSY;
+		/* the triggering command waits for the handoff too */
+		ret = tcmur_park_cmd(dev, cmd);
 	}
 
 done:
@@ -36,6 +36,10 @@ struct alua_grp {
 	struct list_head tgt_ports;
 };
 
+int __tcmu_emulate_report_tgt_port_grps(struct tcmu_device *dev,
+					struct list_head *group_list,
+					uint8_t *cdb, struct iovec *iovec,
+					size_t iov_cnt);
 int tcmu_emulate_report_tgt_port_grps(struct tcmu_device *dev,
 				      struct list_head *group_list,
 				      struct tcmulib_cmd *cmd);
@@ -26,6 +26,7 @@
 #include "libtcmu_log.h"
 #include "libtcmu_common.h"
 #include "libtcmu_priv.h"
+#include "libtcmu_simd.h"
 #include "be_byteshift.h"
 
 __thread int __tcmu_is_ework_thread = 0;
@@ -105,30 +106,16 @@ uint32_t tcmu_cdb_get_xfer_length(uint8_t *cdb)
 off_t tcmu_iovec_compare(void *mem, struct iovec *iovec, size_t size)
 {
 	off_t mem_off;
-	int ret;
 
 	mem_off = 0;
 	while (size) {
 		size_t part = min(size, iovec->iov_len);
+		size_t pos;
 
-		ret = memcmp(mem + mem_off, iovec->iov_base, part);
-		if (ret) {
-			size_t pos;
-			char *spos = mem + mem_off;
-			char *dpos = iovec->iov_base;
-
-			/*
-			 * Data differed, this is assumed to be 'rare'
-			 * so use a much more expensive byte-by-byte
-			 * comparison to find out at which offset the
-			 * data differs.
-			 */
-			for (pos = 0; pos < part && *spos++ == *dpos++;
-			     pos++)
-				;
-
+		pos = tcmu_first_mismatch(mem + mem_off, iovec->iov_base,
+					  part);
+		if (pos != part)
 			return pos + mem_off;
-		}
 
 		size -= part;
 		mem_off += part;
@@ -232,14 +219,7 @@ void tcmu_iovec_zero(struct iovec *iovec, size_t iov_cnt)
 
 static inline bool tcmu_zeroed_mem(const char *buf, size_t size)
 {
-    int i;
-
-    for (i = 0; i < size; i++) {
-        if (buf[i])
-		return false;
-    }
-
-    return true;
+    return tcmu_zeroed(buf, size);
 }
 
 bool tcmu_iovec_zeroed(struct iovec *iovec, size_t iov_cnt)
@@ -265,13 +245,19 @@ size_t tcmu_memcpy_into_iovec(
 	void *src,
 	size_t len)
 {
+	/* decided once per transfer, not per segment */
+	bool nt = len >= TCMU_NT_COPY_MIN;
 	size_t copied = 0;
 
 	while (len && iov_cnt) {
 		size_t to_copy = min(iovec->iov_len, len);
 
 		if (to_copy) {
-			memcpy(iovec->iov_base, src + copied, to_copy);
+			if (nt)
+				tcmu_copy_nt(iovec->iov_base, src + copied,
+					     to_copy);
+			else
+				memcpy(iovec->iov_base, src + copied, to_copy);
 
 			len -= to_copy;
 			copied += to_copy;
@@ -295,13 +281,20 @@ size_t tcmu_memcpy_from_iovec(
 	struct iovec *iovec,
 	size_t iov_cnt)
 {
+	/* decided once per transfer, not per segment */
+	bool nt = len >= TCMU_NT_COPY_MIN;
 	size_t copied = 0;
 
 	while (len && iov_cnt) {
 		size_t to_copy = min(iovec->iov_len, len);
 
 		if (to_copy) {
-			memcpy(dest + copied, iovec->iov_base, to_copy);
+			if (nt)
+				tcmu_copy_nt(dest + copied, iovec->iov_base,
+					     to_copy);
+			else
+				memcpy(dest + copied, iovec->iov_base,
+				       to_copy);
 
 			len -= to_copy;
 			copied += to_copy;
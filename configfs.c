@@ -57,13 +57,97 @@ int tcmu_cfgfs_get_int(const char *path)
 	return val;
 }
 
+/*
+ * Attribute snapshot: attrib ints and the WWN are read from configfs
+ * once and then served from memory, so command paths (ALUA checks,
+ * reconfigure checks, INQUIRY) never touch the VFS. The snapshot is
+ * dropped when a netlink reconfig event tells us the device changed.
+ */
+int tcmu_cfgfs_dev_cache_setup(struct tcmu_device *dev)
+{
+	int ret;
+
+	ret = pthread_mutex_init(&dev->cfgfs_cache.lock, NULL);
+	if (ret)
+		return -ret;
+
+	darray_init(dev->cfgfs_cache.attrs);
+	dev->cfgfs_cache.wwn = NULL;
+
+	return 0;
+}
+
+/* drop the cached values, must not race command dispatch teardown */
+void tcmu_cfgfs_dev_cache_invalidate(struct tcmu_device *dev)
+{
+	struct tcmu_cfgfs_cached_attr *attr;
+
+	pthread_mutex_lock(&dev->cfgfs_cache.lock);
+
+	darray_foreach(attr, dev->cfgfs_cache.attrs)
+		free(attr->name);
+	darray_free(dev->cfgfs_cache.attrs);
+	darray_init(dev->cfgfs_cache.attrs);
+
+	free(dev->cfgfs_cache.wwn);
+	dev->cfgfs_cache.wwn = NULL;
+
+	pthread_mutex_unlock(&dev->cfgfs_cache.lock);
+}
+
+void tcmu_cfgfs_dev_cache_destroy(struct tcmu_device *dev)
+{
+	tcmu_cfgfs_dev_cache_invalidate(dev);
+	pthread_mutex_destroy(&dev->cfgfs_cache.lock);
+}
+
 int tcmu_cfgfs_dev_get_attr_int(struct tcmu_device *dev, const char *name)
 {
+	struct tcmu_cfgfs_cached_attr *attr, new_attr;
 	char path[PATH_MAX];
+	int val;
+
+	pthread_mutex_lock(&dev->cfgfs_cache.lock);
+	darray_foreach(attr, dev->cfgfs_cache.attrs) {
+		if (!strcmp(attr->name, name)) {
+			val = attr->val;
+			pthread_mutex_unlock(&dev->cfgfs_cache.lock);
+			return val;
+		}
+	}
+	pthread_mutex_unlock(&dev->cfgfs_cache.lock);
 
 	snprintf(path, sizeof(path), CFGFS_CORE"/%s/%s/attrib/%s",
 		 dev->tcm_hba_name, dev->tcm_dev_name, name);
-	return tcmu_cfgfs_get_int(path);
+	val = tcmu_cfgfs_get_int(path);
+	if (val < 0)
+		/* don't cache errors */
+		return val;
+
+	new_attr.name = strdup(name);
+	new_attr.val = val;
+	if (new_attr.name) {
+		pthread_mutex_lock(&dev->cfgfs_cache.lock);
+		darray_append(dev->cfgfs_cache.attrs, new_attr);
+		pthread_mutex_unlock(&dev->cfgfs_cache.lock);
+	}
+
+	return val;
+}
+
+int tcmu_cfgfs_dev_set_attr_int(struct tcmu_device *dev, const char *name,
+				uint32_t val)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	snprintf(path, sizeof(path), CFGFS_CORE"/%s/%s/attrib/%s",
+		 dev->tcm_hba_name, dev->tcm_dev_name, name);
+	ret = tcmu_cfgfs_set_u32(path, val);
+	if (!ret)
+		/* the snapshot now holds the old value */
+		tcmu_cfgfs_dev_cache_invalidate(dev);
+	return ret;
 }
 
 uint64_t tcmu_cfgfs_dev_get_info_u64(struct tcmu_device *dev, const char *name,
@@ -168,6 +252,14 @@ char *tcmu_cfgfs_dev_get_wwn(struct tcmu_device *dev)
 	char *ret_buf;
 	int ret;
 
+	pthread_mutex_lock(&dev->cfgfs_cache.lock);
+	if (dev->cfgfs_cache.wwn) {
+		ret_buf = strdup(dev->cfgfs_cache.wwn);
+		pthread_mutex_unlock(&dev->cfgfs_cache.lock);
+		return ret_buf;
+	}
+	pthread_mutex_unlock(&dev->cfgfs_cache.lock);
+
 	snprintf(path, sizeof(path),
 		 CFGFS_CORE"/%s/%s/wwn/vpd_unit_serial",
 		 dev->tcm_hba_name, dev->tcm_dev_name);
@@ -206,6 +298,11 @@ char *tcmu_cfgfs_dev_get_wwn(struct tcmu_device *dev)
 		return NULL;
 	}
 
+	pthread_mutex_lock(&dev->cfgfs_cache.lock);
+	if (!dev->cfgfs_cache.wwn)
+		dev->cfgfs_cache.wwn = strdup(ret_buf);
+	pthread_mutex_unlock(&dev->cfgfs_cache.lock);
+
 	return ret_buf;
 }
 
@@ -37,14 +37,394 @@
 #include "tcmu-runner.h"
 #include "tcmur_device.h"
 
+#include <pthread.h>
+
+#ifdef HAVE_LINUX_FALLOC
+#include <linux/falloc.h>
+#endif
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+/*
+ * O_DIRECT needs the buffer, length and file offset aligned to the
+ * backing device's logical block size. Ring iovecs normally satisfy
+ * that, so the common case is zero-copy straight from the data area;
+ * the odd unaligned request bounces through a pooled aligned buffer.
+ */
+#define FILE_DIRECT_ALIGN 4096
+#define FILE_DIRECT_LEN_ALIGN 512
+#define FILE_BUF_POOL_SIZE 4
+
 struct file_state {
 	int fd;
+
+	bool o_direct;
+	pthread_mutex_t buf_lock;
+	void *buf_pool[FILE_BUF_POOL_SIZE];
+	unsigned int buf_pool_cnt;
+	size_t buf_size;
+
+#ifdef HAVE_LIBURING
+	struct io_uring ring;
+	pthread_mutex_t sq_lock;
+	pthread_t cq_thread;
+	bool ring_ok;
+	bool stopping;
+#endif
 };
 
+static bool file_iovec_direct_ok(struct iovec *iov, size_t iov_cnt)
+{
+	size_t i;
+
+	for (i = 0; i < iov_cnt; i++) {
+		if ((uintptr_t)iov[i].iov_base % FILE_DIRECT_LEN_ALIGN ||
+		    iov[i].iov_len % FILE_DIRECT_LEN_ALIGN)
+			return false;
+	}
+
+	return true;
+}
+
+static void *file_get_direct_buf(struct file_state *state)
+{
+	void *buf = NULL;
+
+	pthread_mutex_lock(&state->buf_lock);
+	if (state->buf_pool_cnt)
+		buf = state->buf_pool[--state->buf_pool_cnt];
+	pthread_mutex_unlock(&state->buf_lock);
+
+	if (!buf && posix_memalign(&buf, FILE_DIRECT_ALIGN, state->buf_size))
+		return NULL;
+
+	return buf;
+}
+
+static void file_put_direct_buf(struct file_state *state, void *buf)
+{
+	pthread_mutex_lock(&state->buf_lock);
+	if (state->buf_pool_cnt < FILE_BUF_POOL_SIZE) {
+		state->buf_pool[state->buf_pool_cnt++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&state->buf_lock);
+
+	free(buf);
+}
+
+static void file_drain_direct_bufs(struct file_state *state)
+{
+	while (state->buf_pool_cnt)
+		free(state->buf_pool[--state->buf_pool_cnt]);
+	pthread_mutex_destroy(&state->buf_lock);
+}
+
+#ifdef HAVE_LIBURING
+
+/*
+ * io_uring engine: commands are submitted on the cmdproc thread
+ * (nr_threads is 0 so there is no handler thread pool), the ring
+ * iovecs go to the kernel as-is, and a per-device reaper thread
+ * completes commands from the CQ via tcmur_cmd_complete().
+ */
+
+#define FILE_URING_QD 128
+
+enum file_uring_op {
+	FILE_URING_READ,
+	FILE_URING_WRITE,
+	FILE_URING_FSYNC,
+};
+
+struct file_uring_io {
+	struct tcmu_device *dev;
+	struct tcmur_cmd *cmd;
+	enum file_uring_op op;
+	struct iovec *iov;
+	size_t iov_cnt;
+	size_t remaining;
+	off_t offset;
+	int rw_flags;
+
+	/* set when an unaligned O_DIRECT request had to bounce */
+	void *bounce;
+	struct iovec bounce_iov;
+	struct iovec *user_iov;
+	size_t user_iov_cnt;
+	size_t requested;
+};
+
+static int file_uring_submit(struct file_state *state,
+			     struct file_uring_io *io)
+{
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	pthread_mutex_lock(&state->sq_lock);
+
+	sqe = io_uring_get_sqe(&state->ring);
+	if (!sqe) {
+		/* SQ full: flush it to the kernel and retry once */
+		io_uring_submit(&state->ring);
+		sqe = io_uring_get_sqe(&state->ring);
+	}
+	if (!sqe) {
+		pthread_mutex_unlock(&state->sq_lock);
+		return TCMU_STS_NO_RESOURCE;
+	}
+
+	/* fd 0 below is an index into the registered file table */
+	switch (io->op) {
+	case FILE_URING_READ:
+		io_uring_prep_readv(sqe, 0, io->iov, io->iov_cnt, io->offset);
+		break;
+	case FILE_URING_WRITE:
+		io_uring_prep_writev(sqe, 0, io->iov, io->iov_cnt, io->offset);
+		sqe->rw_flags = io->rw_flags;
+		break;
+	case FILE_URING_FSYNC:
+		io_uring_prep_fsync(sqe, 0, 0);
+		break;
+	}
+	sqe->flags |= IOSQE_FIXED_FILE;
+	io_uring_sqe_set_data(sqe, io);
+
+	ret = io_uring_submit(&state->ring);
+
+	pthread_mutex_unlock(&state->sq_lock);
+
+	if (ret < 0) {
+		tcmu_err("io_uring submit failed: %s\n", strerror(-ret));
+		return io->op == FILE_URING_READ ? TCMU_STS_RD_ERR :
+						   TCMU_STS_WR_ERR;
+	}
+
+	return TCMU_STS_OK;
+}
+
+static void file_uring_complete(struct file_state *state,
+				struct io_uring_cqe *cqe)
+{
+	struct file_uring_io *io = io_uring_cqe_get_data(cqe);
+	struct tcmu_device *dev = io->dev;
+	int result = cqe->res;
+	int ret;
+
+	if (result < 0) {
+		tcmu_err("io_uring io failed: %s\n", strerror(-result));
+		ret = io->op == FILE_URING_READ ? TCMU_STS_RD_ERR :
+						  TCMU_STS_WR_ERR;
+		goto done;
+	}
+
+	if (io->op == FILE_URING_FSYNC) {
+		ret = TCMU_STS_OK;
+		goto done;
+	}
+
+	if (result == 0 && io->op == FILE_URING_READ) {
+		/* EOF, then zeros the iovecs left */
+		tcmu_iovec_zero(io->iov, io->iov_cnt);
+		ret = TCMU_STS_OK;
+		goto done;
+	}
+
+	tcmu_iovec_seek(io->iov, result);
+	io->offset += result;
+	io->remaining -= result;
+
+	if (io->remaining) {
+		/* short transfer: push the rest back into the ring */
+		ret = file_uring_submit(state, io);
+		if (ret == TCMU_STS_OK)
+			return;
+		goto done;
+	}
+
+	ret = TCMU_STS_OK;
+done:
+	if (io->bounce) {
+		if (io->op == FILE_URING_READ && ret == TCMU_STS_OK)
+			tcmu_memcpy_into_iovec(io->user_iov, io->user_iov_cnt,
+					       io->bounce, io->requested);
+		file_put_direct_buf(state, io->bounce);
+	}
+	tcmur_cmd_complete(dev, io->cmd, ret);
+	free(io);
+}
+
+static void *file_uring_cq_thread_fn(void *arg)
+{
+	struct tcmu_device *dev = arg;
+	struct file_state *state = tcmur_dev_get_private(dev);
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	tcmu_set_thread_name("file-cq", dev);
+
+	while (1) {
+		ret = io_uring_wait_cqe(&state->ring, &cqe);
+		if (ret < 0) {
+			if (ret == -EINTR)
+				continue;
+			tcmu_err("io_uring_wait_cqe failed: %s\n",
+				 strerror(-ret));
+			break;
+		}
+
+		if (io_uring_cqe_get_data(cqe))
+			file_uring_complete(state, cqe);
+		io_uring_cqe_seen(&state->ring, cqe);
+
+		/* a dataless NOP from file_close() means shut down */
+		if (state->stopping)
+			break;
+	}
+
+	return NULL;
+}
+
+static int file_uring_queue_flags(struct tcmu_device *dev,
+				  struct tcmur_cmd *cmd,
+				  enum file_uring_op op, struct iovec *iov,
+				  size_t iov_cnt, size_t length, off_t offset,
+				  int rw_flags)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+	struct file_uring_io *io;
+	int ret;
+
+	io = calloc(1, sizeof(*io));
+	if (!io)
+		return TCMU_STS_NO_RESOURCE;
+
+	io->dev = dev;
+	io->cmd = cmd;
+	io->op = op;
+	io->iov = iov;
+	io->iov_cnt = iov_cnt;
+	io->remaining = length;
+	io->offset = offset;
+	io->requested = length;
+	io->rw_flags = rw_flags;
+
+	if (state->o_direct && op != FILE_URING_FSYNC &&
+	    !file_iovec_direct_ok(iov, iov_cnt)) {
+		io->bounce = file_get_direct_buf(state);
+		if (!io->bounce) {
+			free(io);
+			return TCMU_STS_NO_RESOURCE;
+		}
+
+		if (op == FILE_URING_WRITE)
+			tcmu_memcpy_from_iovec(io->bounce, length, iov,
+					       iov_cnt);
+
+		io->user_iov = iov;
+		io->user_iov_cnt = iov_cnt;
+		io->bounce_iov.iov_base = io->bounce;
+		io->bounce_iov.iov_len = length;
+		io->iov = &io->bounce_iov;
+		io->iov_cnt = 1;
+	}
+
+	ret = file_uring_submit(state, io);
+	if (ret != TCMU_STS_OK) {
+		if (io->bounce)
+			file_put_direct_buf(state, io->bounce);
+		free(io);
+		return ret;
+	}
+
+	/* the cq thread completes the command via tcmur_cmd_complete() */
+	return TCMU_STS_OK;
+}
+
+static int file_uring_queue(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			    enum file_uring_op op, struct iovec *iov,
+			    size_t iov_cnt, size_t length, off_t offset)
+{
+	return file_uring_queue_flags(dev, cmd, op, iov, iov_cnt, length,
+				      offset, 0);
+}
+
+static int file_uring_setup(struct tcmu_device *dev, struct file_state *state)
+{
+	int ret;
+
+	ret = io_uring_queue_init(FILE_URING_QD, &state->ring, 0);
+	if (ret < 0) {
+		tcmu_err("io_uring_queue_init failed: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	ret = io_uring_register_files(&state->ring, &state->fd, 1);
+	if (ret < 0) {
+		tcmu_err("io_uring_register_files failed: %s\n",
+			 strerror(-ret));
+		goto exit_ring;
+	}
+
+	ret = pthread_mutex_init(&state->sq_lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto unregister_files;
+	}
+
+	ret = pthread_create(&state->cq_thread, NULL, file_uring_cq_thread_fn,
+			     dev);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+
+	state->ring_ok = true;
+	return 0;
+
+destroy_lock:
+	pthread_mutex_destroy(&state->sq_lock);
+unregister_files:
+	io_uring_unregister_files(&state->ring);
+exit_ring:
+	io_uring_queue_exit(&state->ring);
+	return ret;
+}
+
+static void file_uring_destroy(struct file_state *state)
+{
+	struct io_uring_sqe *sqe;
+
+	state->stopping = true;
+
+	/* wake the cq thread with a NOP that carries no io */
+	pthread_mutex_lock(&state->sq_lock);
+	sqe = io_uring_get_sqe(&state->ring);
+	if (sqe) {
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe, NULL);
+		io_uring_submit(&state->ring);
+	}
+	pthread_mutex_unlock(&state->sq_lock);
+
+	pthread_join(state->cq_thread, NULL);
+
+	io_uring_unregister_files(&state->ring);
+	io_uring_queue_exit(&state->ring);
+	pthread_mutex_destroy(&state->sq_lock);
+	state->ring_ok = false;
+}
+
+#endif /* HAVE_LIBURING */
+
 static int file_open(struct tcmu_device *dev, bool reopen)
 {
 	struct file_state *state;
+	int flags = O_CREAT | O_RDWR;
 	char *config;
+	size_t max_io;
 
 	state = calloc(1, sizeof(*state));
 	if (!state)
@@ -59,18 +439,42 @@ static int file_open(struct tcmu_device *dev, bool reopen)
 	}
 	config += 1; /* get past '/' */
 
+	/* "file/direct@<path>" opens the backstore with O_DIRECT */
+	if (!strncmp(config, "direct@", 7)) {
+		state->o_direct = true;
+		flags |= O_DIRECT;
+		config += 7;
+	}
+
 	tcmu_dev_set_write_cache_enabled(dev, 1);
 
-	state->fd = open(config, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	state->fd = open(config, flags, S_IRUSR | S_IWUSR);
 	if (state->fd == -1) {
 		tcmu_err("could not open %s: %m\n", config);
 		goto err;
 	}
 
+	if (state->o_direct) {
+		if (pthread_mutex_init(&state->buf_lock, NULL))
+			goto err_close;
+
+		max_io = tcmu_lba_to_byte(dev,
+					  tcmu_dev_get_max_xfer_len(dev));
+		state->buf_size = max_io > FILE_DIRECT_ALIGN ?
+				  max_io : FILE_DIRECT_ALIGN;
+	}
+
+#ifdef HAVE_LIBURING
+	if (file_uring_setup(dev, state))
+		tcmu_dev_warn(dev, "io_uring unavailable, falling back to blocking I/O\n");
+#endif
+
 	tcmu_dbg("config %s\n", tcmu_dev_get_cfgstring(dev));
 
 	return 0;
 
+err_close:
+	close(state->fd);
 err:
 	free(state);
 	return -EINVAL;
@@ -80,10 +484,100 @@ static void file_close(struct tcmu_device *dev)
 {
 	struct file_state *state = tcmur_dev_get_private(dev);
 
+#ifdef HAVE_LIBURING
+	if (state->ring_ok)
+		file_uring_destroy(state);
+#endif
+
+	if (state->o_direct)
+		file_drain_direct_bufs(state);
+
 	close(state->fd);
 	free(state);
 }
 
+#ifdef HAVE_LIBURING
+/*
+ * With nr_threads 0 there is no aio thread to run the done callback,
+ * so successes from the blocking fallback are completed here and the
+ * scheduler treats the command as async handled.
+ */
+static int file_blocking_done(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			      int ret)
+{
+	if (ret == TCMU_STS_OK)
+		tcmur_cmd_complete(dev, cmd, TCMU_STS_OK);
+	return ret;
+}
+#endif
+
+static int file_read_bounce(struct file_state *state, struct iovec *iov,
+			    size_t iov_cnt, size_t length, off_t offset)
+{
+	size_t remaining = length;
+	char *p, *buf;
+	ssize_t ret;
+
+	buf = file_get_direct_buf(state);
+	if (!buf)
+		return TCMU_STS_NO_RESOURCE;
+
+	p = buf;
+	while (remaining) {
+		ret = pread(state->fd, p, remaining, offset);
+		if (ret < 0) {
+			tcmu_err("read failed: %m\n");
+			ret = TCMU_STS_RD_ERR;
+			goto done;
+		}
+		if (ret == 0) {
+			/* EOF, then zeros the buffer left */
+			memset(p, 0, remaining);
+			break;
+		}
+		p += ret;
+		offset += ret;
+		remaining -= ret;
+	}
+
+	tcmu_memcpy_into_iovec(iov, iov_cnt, buf, length);
+	ret = TCMU_STS_OK;
+done:
+	file_put_direct_buf(state, buf);
+	return ret;
+}
+
+static int file_write_bounce(struct file_state *state, struct iovec *iov,
+			     size_t iov_cnt, size_t length, off_t offset)
+{
+	size_t remaining = length;
+	char *p, *buf;
+	ssize_t ret;
+
+	buf = file_get_direct_buf(state);
+	if (!buf)
+		return TCMU_STS_NO_RESOURCE;
+
+	tcmu_memcpy_from_iovec(buf, length, iov, iov_cnt);
+
+	p = buf;
+	while (remaining) {
+		ret = pwrite(state->fd, p, remaining, offset);
+		if (ret < 0) {
+			tcmu_err("write failed: %m\n");
+			ret = TCMU_STS_WR_ERR;
+			goto done;
+		}
+		p += ret;
+		offset += ret;
+		remaining -= ret;
+	}
+	ret = TCMU_STS_OK;
+done:
+	file_put_direct_buf(state, buf);
+	return ret;
+}
+
 static int file_read(struct tcmu_device *dev, struct tcmur_cmd *cmd,
 		     struct iovec *iov, size_t iov_cnt, size_t length,
 		     off_t offset)
@@ -92,6 +586,17 @@ static int file_read(struct tcmu_device *dev, struct tcmur_cmd *cmd,
 	size_t remaining = length;
 	ssize_t ret;
 
+#ifdef HAVE_LIBURING
+	if (state->ring_ok)
+		return file_uring_queue(dev, cmd, FILE_URING_READ, iov,
+					iov_cnt, length, offset);
+#endif
+
+	if (state->o_direct && !file_iovec_direct_ok(iov, iov_cnt)) {
+		ret = file_read_bounce(state, iov, iov_cnt, length, offset);
+		goto done;
+	}
+
 	while (remaining) {
 		ret = preadv(state->fd, iov, iov_cnt, offset);
 		if (ret < 0) {
@@ -112,7 +617,11 @@ static int file_read(struct tcmu_device *dev, struct tcmur_cmd *cmd,
 	}
 	ret = TCMU_STS_OK;
 done:
+#ifdef HAVE_LIBURING
+	return file_blocking_done(dev, cmd, ret);
+#else
 	return ret;
+#endif
 }
 
 static int file_write(struct tcmu_device *dev, struct tcmur_cmd *cmd,
@@ -123,6 +632,17 @@ static int file_write(struct tcmu_device *dev, struct tcmur_cmd *cmd,
 	size_t remaining = length;
 	ssize_t ret;
 
+#ifdef HAVE_LIBURING
+	if (state->ring_ok)
+		return file_uring_queue(dev, cmd, FILE_URING_WRITE, iov,
+					iov_cnt, length, offset);
+#endif
+
+	if (state->o_direct && !file_iovec_direct_ok(iov, iov_cnt)) {
+		ret = file_write_bounce(state, iov, iov_cnt, length, offset);
+		goto done;
+	}
+
 	while (remaining) {
 		ret = pwritev(state->fd, iov, iov_cnt, offset);
 		if (ret < 0) {
@@ -136,7 +656,61 @@ static int file_write(struct tcmu_device *dev, struct tcmur_cmd *cmd,
 	}
 	ret = TCMU_STS_OK;
 done:
+#ifdef HAVE_LIBURING
+	return file_blocking_done(dev, cmd, ret);
+#else
 	return ret;
+#endif
+}
+
+static int file_write_flags(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			    struct iovec *iov, size_t iov_cnt, size_t length,
+			    off_t offset, uint32_t flags)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+	size_t remaining = length;
+	ssize_t r;
+	int ret;
+
+	if (!(flags & TCMUR_WRITE_FLAG_FUA))
+		return file_write(dev, cmd, iov, iov_cnt, length, offset);
+
+#ifdef HAVE_LIBURING
+	/* FUA maps straight to a per-write RWF_DSYNC on the sqe */
+	if (state->ring_ok)
+		return file_uring_queue_flags(dev, cmd, FILE_URING_WRITE, iov,
+					      iov_cnt, length, offset,
+					      RWF_DSYNC);
+#endif
+
+	if (state->o_direct && !file_iovec_direct_ok(iov, iov_cnt)) {
+		ret = file_write_bounce(state, iov, iov_cnt, length, offset);
+	} else {
+		ret = TCMU_STS_OK;
+		while (remaining) {
+			r = pwritev(state->fd, iov, iov_cnt, offset);
+			if (r < 0) {
+				tcmu_err("write failed: %m\n");
+				ret = TCMU_STS_WR_ERR;
+				break;
+			}
+			tcmu_iovec_seek(iov, r);
+			offset += r;
+			remaining -= r;
+		}
+	}
+
+	/* force unit access: the data must be durable when we complete */
+	if (ret == TCMU_STS_OK && fdatasync(state->fd)) {
+		tcmu_err("FUA sync failed: %m\n");
+		ret = TCMU_STS_WR_ERR;
+	}
+
+#ifdef HAVE_LIBURING
+	return file_blocking_done(dev, cmd, ret);
+#else
+	return ret;
+#endif
 }
 
 static int file_flush(struct tcmu_device *dev, struct tcmur_cmd *cmd)
@@ -144,6 +718,12 @@ static int file_flush(struct tcmu_device *dev, struct tcmur_cmd *cmd)
 	struct file_state *state = tcmur_dev_get_private(dev);
 	int ret;
 
+#ifdef HAVE_LIBURING
+	if (state->ring_ok)
+		return file_uring_queue(dev, cmd, FILE_URING_FSYNC, NULL, 0,
+					0, 0);
+#endif
+
 	if (fsync(state->fd)) {
 		tcmu_err("sync failed\n");
 		ret = TCMU_STS_WR_ERR;
@@ -151,8 +731,81 @@ static int file_flush(struct tcmu_device *dev, struct tcmur_cmd *cmd)
 	}
 	ret = TCMU_STS_OK;
 done:
+#ifdef HAVE_LIBURING
+	return file_blocking_done(dev, cmd, ret);
+#else
 	return ret;
+#endif
+}
+
+static int file_copy_range(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			   struct tcmu_device *src_dev, uint64_t src_off,
+			   uint64_t dst_off, uint64_t len)
+{
+	struct file_state *dst_state = tcmur_dev_get_private(dev);
+	struct file_state *src_state = tcmur_dev_get_private(src_dev);
+	off_t in = src_off, out = dst_off;
+	int sts = TCMU_STS_OK;
+	ssize_t ret;
+
+	while (len) {
+		ret = copy_file_range(src_state->fd, &in, dst_state->fd,
+				      &out, len, 0);
+		if (ret < 0) {
+			if (errno == EXDEV || errno == ENOSYS ||
+			    errno == EINVAL || errno == EOPNOTSUPP) {
+				/* let the generic copy engine bounce it */
+				return TCMU_STS_NOT_HANDLED;
+			}
+			tcmu_err("copy_file_range failed: %m\n");
+			sts = TCMU_STS_WR_ERR;
+			break;
+		}
+		if (ret == 0) {
+			/*
+			 * Source EOF mid-range (sparse backstore): the
+			 * generic engine zero-fills past EOF, redo the
+			 * whole copy there.
+			 */
+			return TCMU_STS_NOT_HANDLED;
+		}
+		len -= ret;
+	}
+
+#ifdef HAVE_LIBURING
+	return file_blocking_done(dev, cmd, sts);
+#else
+	return sts;
+#endif
+}
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+static int file_unmap_ranges(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			     struct tcmur_unmap_range *ranges,
+			     size_t nr_ranges)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+	int sts = TCMU_STS_OK;
+	size_t i;
+
+	/* all the descriptors of one UNMAP in a single punch-hole loop */
+	for (i = 0; i < nr_ranges; i++) {
+		if (fallocate(state->fd,
+			      FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      ranges[i].off, ranges[i].len)) {
+			tcmu_err("punch hole failed: %m\n");
+			sts = TCMU_STS_WR_ERR;
+			break;
+		}
+	}
+
+#ifdef HAVE_LIBURING
+	return file_blocking_done(dev, cmd, sts);
+#else
+	return sts;
+#endif
 }
+#endif /* FALLOC_FL_PUNCH_HOLE */
 
 static int file_reconfig(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 {
@@ -172,7 +825,9 @@ static int file_reconfig(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 }
 
 static const char file_cfg_desc[] =
-	"The path to the file to use as a backstore.";
+	"The path to the file to use as a backstore.\n"
+	"Prefix the path with \"direct@\" to open it with O_DIRECT and\n"
+	"bypass the page cache.";
 
 static struct tcmur_handler file_handler = {
 	.cfg_desc = file_cfg_desc,
@@ -183,10 +838,20 @@ static struct tcmur_handler file_handler = {
 	.close = file_close,
 	.read = file_read,
 	.write = file_write,
+	.write_flags = file_write_flags,
 	.flush = file_flush,
+	.copy_range = file_copy_range,
+#ifdef FALLOC_FL_PUNCH_HOLE
+	.unmap_ranges = file_unmap_ranges,
+#endif
 	.name = "File-backed Handler (example code)",
 	.subtype = "file",
+#ifdef HAVE_LIBURING
+	/* io_uring submits from the cmdproc thread, no pool needed */
+	.nr_threads = 0,
+#else
 	.nr_threads = 2,
+#endif
 };
 
 /* Entry point must be named "handler_init". */
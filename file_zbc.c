@@ -277,6 +277,23 @@ struct zbc_dev {
 
 	struct zbc_zone		*zones;
 	unsigned int		nr_zones;
+
+	/* zone-state journal (see zbc_journal_flush) */
+	int			jnl_fd;
+	struct zbc_zone		*zones_shadow;
+
+	/*
+	 * io_rwlock is held shared by the write fast path and by
+	 * reads, which additionally take the hashed zone-group mutexes
+	 * they touch; anything that can change zone conditions takes
+	 * it exclusively, which alone excludes every shared-mode user.
+	 * So reads and in-order writes only ever contend on their own
+	 * zone group, and transitions never sweep the mutex array.
+	 */
+#define ZBC_ZONE_LOCKS 64
+	pthread_rwlock_t	io_rwlock;
+	pthread_mutex_t		zone_locks[ZBC_ZONE_LOCKS];
+
 	unsigned int		nr_conv_zones;
 	unsigned int		nr_open_zones;
 	unsigned int		nr_imp_open;
@@ -476,9 +493,13 @@ static int zbc_map_meta(struct zbc_dev *zdev)
 {
 	int ret;
 
-	/* Mmap metadata */
+	/*
+	 * Map privately: zone updates live in memory and are persisted
+	 * through the journal/checkpoint path, so steady-state zone
+	 * bookkeeping generates no interleaved metadata writeback.
+	 */
 	zdev->meta = mmap(NULL, zdev->meta_size, PROT_READ | PROT_WRITE,
-			  MAP_SHARED, zdev->fd, 0);
+			  MAP_PRIVATE, zdev->fd, 0);
 	if (zdev->meta == MAP_FAILED) {
 		ret = -errno;
 		tcmu_dev_err(zdev->dev, "mmap %s failed (%m)\n",
@@ -507,22 +528,175 @@ static void zbc_unmap_meta(struct zbc_dev *zdev)
 }
 
 /*
- * Flush metadata.
+ * Zone-state persistence: deltas against a shadow copy are appended
+ * to a sidecar journal in batches (on FLUSH, zone finish and close),
+ * and the full metadata is checkpointed back into the backstore file
+ * once the journal grows past ZBC_JNL_CHECKPOINT_BYTES. The journal
+ * is replayed over the metadata at open, so a crash between
+ * checkpoints only loses the deltas that were never flushed.
+ */
+struct zbc_jnl_rec {
+	__u32 zno;
+	struct zbc_zone zone;
+};
+
+#define ZBC_JNL_CHECKPOINT_BYTES (1024 * 1024)
+
+static int zbc_checkpoint_meta(struct zbc_dev *zdev)
+{
+	ssize_t ret;
+
+	ret = pwrite(zdev->fd, zdev->meta, zdev->meta_size, 0);
+	if (ret != zdev->meta_size) {
+		tcmu_dev_err(zdev->dev, "checkpoint write failed (%m)\n");
+		return -EIO;
+	}
+
+	if (fdatasync(zdev->fd)) {
+		tcmu_dev_err(zdev->dev, "checkpoint sync failed (%m)\n");
+		return -errno;
+	}
+
+	/* formatting checkpoints before the journal exists */
+	if (zdev->jnl_fd >= 0) {
+		if (ftruncate(zdev->jnl_fd, 0)) {
+			tcmu_dev_err(zdev->dev, "journal truncate failed (%m)\n");
+			return -errno;
+		}
+		/*
+		 * The fd is not O_APPEND: rewind it or the next delta
+		 * would land at the stale offset, leaving a zero hole
+		 * that replays as a bogus zone 0 record.
+		 */
+		if (lseek(zdev->jnl_fd, 0, SEEK_SET) == (off_t)-1) {
+			tcmu_dev_err(zdev->dev, "journal rewind failed (%m)\n");
+			return -errno;
+		}
+	}
+
+	if (zdev->zones_shadow)
+		memcpy(zdev->zones_shadow, zdev->zones,
+		       zdev->nr_zones * sizeof(struct zbc_zone));
+
+	return 0;
+}
+
+/*
+ * Append every zone that changed since the last flush to the journal.
  */
 static int zbc_flush_meta(struct zbc_dev *zdev)
 {
-	int ret;
+	struct zbc_jnl_rec rec;
+	unsigned int i;
+	off_t jnl_size;
+	ssize_t ret;
+	bool wrote = false;
 
-	ret = msync(zdev->meta, zdev->meta_size, MS_SYNC | MS_INVALIDATE);
-	if (ret) {
-		ret = -errno;
-		tcmu_dev_err(zdev->dev, "msync metadata failed (%m)\n");
-		return ret;
+	for (i = 0; i < zdev->nr_zones; i++) {
+		if (!memcmp(&zdev->zones[i], &zdev->zones_shadow[i],
+			    sizeof(struct zbc_zone)))
+			continue;
+
+		rec.zno = i;
+		memcpy(&rec.zone, &zdev->zones[i], sizeof(rec.zone));
+
+		ret = write(zdev->jnl_fd, &rec, sizeof(rec));
+		if (ret != sizeof(rec)) {
+			tcmu_dev_err(zdev->dev, "journal append failed (%m)\n");
+			return -EIO;
+		}
+
+		memcpy(&zdev->zones_shadow[i], &zdev->zones[i],
+		       sizeof(struct zbc_zone));
+		wrote = true;
 	}
 
+	if (!wrote)
+		return 0;
+
+	if (fdatasync(zdev->jnl_fd)) {
+		tcmu_dev_err(zdev->dev, "journal sync failed (%m)\n");
+		return -errno;
+	}
+
+	jnl_size = lseek(zdev->jnl_fd, 0, SEEK_END);
+	if (jnl_size >= ZBC_JNL_CHECKPOINT_BYTES)
+		return zbc_checkpoint_meta(zdev);
+
 	return 0;
 }
 
+static int zbc_journal_open(struct zbc_dev *zdev)
+{
+	char *jnl_path;
+	unsigned int nr = 0;
+	struct zbc_jnl_rec rec;
+	ssize_t ret;
+
+	if (asprintf(&jnl_path, "%s.jnl", zdev->cfg.path) < 0)
+		return -ENOMEM;
+
+	zdev->jnl_fd = open(jnl_path, O_CREAT | O_RDWR | O_LARGEFILE,
+			    S_IRUSR | S_IWUSR);
+	free(jnl_path);
+	if (zdev->jnl_fd == -1) {
+		tcmu_dev_err(zdev->dev, "journal open failed (%m)\n");
+		return -errno;
+	}
+
+	zdev->zones_shadow = calloc(zdev->nr_zones,
+				    sizeof(struct zbc_zone));
+	if (!zdev->zones_shadow) {
+		close(zdev->jnl_fd);
+		zdev->jnl_fd = -1;
+		return -ENOMEM;
+	}
+
+	/* replay deltas that never made it into a checkpoint */
+	while ((ret = read(zdev->jnl_fd, &rec, sizeof(rec))) ==
+	       sizeof(rec)) {
+		/*
+		 * Stop at the first record that cannot be real: a
+		 * torn tail or a hole would otherwise replay as a
+		 * zeroed zone 0 and corrupt the metadata.
+		 */
+		if (rec.zno >= zdev->nr_zones)
+			break;
+		if (rec.zone.type != ZBC_ZONE_TYPE_CONVENTIONAL &&
+		    rec.zone.type != ZBC_ZONE_TYPE_SEQWRITE_PREF &&
+		    rec.zone.type != ZBC_ZONE_TYPE_SEQWRITE_REQ)
+			break;
+		if (rec.zone.start != zdev->zones[rec.zno].start ||
+		    rec.zone.len != zdev->zones[rec.zno].len)
+			break;
+		memcpy(&zdev->zones[rec.zno], &rec.zone, sizeof(rec.zone));
+		nr++;
+	}
+
+	if (nr)
+		tcmu_dev_dbg(zdev->dev, "replayed %u journaled zones\n", nr);
+
+	memcpy(zdev->zones_shadow, zdev->zones,
+	       zdev->nr_zones * sizeof(struct zbc_zone));
+
+	/* reconcile so the journal starts empty */
+	return zbc_checkpoint_meta(zdev);
+}
+
+static void zbc_journal_close(struct zbc_dev *zdev)
+{
+	if (zdev->jnl_fd < 0)
+		return;
+
+	zbc_flush_meta(zdev);
+	zbc_checkpoint_meta(zdev);
+
+	close(zdev->jnl_fd);
+	zdev->jnl_fd = -1;
+	free(zdev->zones_shadow);
+	zdev->zones_shadow = NULL;
+}
+
 /*
  * Check a zone metadata.
  */
@@ -731,7 +905,7 @@ static int zbc_format_meta(struct zbc_dev *zdev)
 
 	}
 
-	ret = zbc_flush_meta(zdev);
+	ret = zbc_checkpoint_meta(zdev);
 	if (ret) {
 		zbc_unmap_meta(zdev);
 		return ret;
@@ -805,6 +979,8 @@ static int zbc_open_backstore(struct tcmu_device *dev)
 	if (!zbc_check_meta(zdev, &st))
 		cfg->need_format = true;
 
+	zdev->jnl_fd = -1;
+
 	if (cfg->need_format)
 		ret = zbc_format_meta(zdev);
 	else
@@ -812,6 +988,12 @@ static int zbc_open_backstore(struct tcmu_device *dev)
 	if (ret)
 		goto err;
 
+	ret = zbc_journal_open(zdev);
+	if (ret) {
+		zbc_unmap_meta(zdev);
+		goto err;
+	}
+
 	tcmu_dev_set_block_size(dev, zdev->lba_size);
 	tcmu_dev_set_num_lbas(dev, zdev->capacity);
 
@@ -877,6 +1059,13 @@ static int zbc_open(struct tcmu_device *dev, bool reopen)
 	tcmur_dev_set_private(dev, zdev);
 	zdev->dev = dev;
 
+	if (pthread_rwlock_init(&zdev->io_rwlock, NULL)) {
+		free(zdev);
+		return -ENOMEM;
+	}
+	for (ret = 0; ret < ZBC_ZONE_LOCKS; ret++)
+		pthread_mutex_init(&zdev->zone_locks[ret], NULL);
+
 	/* Parse config */
 	if (!zbc_parse_config(tcmu_dev_get_cfgstring(dev), &zdev->cfg, &err)) {
 		if (err) {
@@ -913,7 +1102,13 @@ err:
 static void zbc_close(struct tcmu_device *dev)
 {
 	struct zbc_dev *zdev = tcmur_dev_get_private(dev);
+	int i;
 
+	for (i = 0; i < ZBC_ZONE_LOCKS; i++)
+		pthread_mutex_destroy(&zdev->zone_locks[i]);
+	pthread_rwlock_destroy(&zdev->io_rwlock);
+
+	zbc_journal_close(zdev);
 	zbc_unmap_meta(zdev);
 
 	close(zdev->fd);
@@ -1564,6 +1759,7 @@ static int zbc_finish_zone(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 		/* Finish all zones */
 		for (i = 0; i < zdev->nr_zones; i++)
 			__zbc_finish_zone(zdev, &zdev->zones[i], false);
+		zbc_flush_meta(zdev);
 		return TCMU_STS_OK;
 	}
 
@@ -1581,6 +1777,7 @@ static int zbc_finish_zone(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 					   ASC_INVALID_FIELD_IN_CDB);
 
 	__zbc_finish_zone(zdev, zone, true);
+	zbc_flush_meta(zdev);
 
 	return TCMU_STS_OK;
 }
@@ -2209,7 +2406,129 @@ static int zbc_flush(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
  * Handle command emulation.
  * Return scsi status or TCMU_STS_NOT_HANDLED
  */
-static int zbc_handle_cmd(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+static inline pthread_mutex_t *zbc_zone_lock(struct zbc_dev *zdev,
+					     struct zbc_zone *zone)
+{
+	return &zdev->zone_locks[(zone - zdev->zones) % ZBC_ZONE_LOCKS];
+}
+
+/*
+ * Take the zone-group mutexes spanned by an LBA range, in ascending
+ * group order. Must be called with io_rwlock held shared.
+ */
+static void zbc_lock_zone_range(struct zbc_dev *zdev, uint64_t lba,
+				size_t nr_lbas, bool mask[ZBC_ZONE_LOCKS])
+{
+	uint64_t z_start = lba / zdev->zone_size;
+	uint64_t z_end = (lba + (nr_lbas ? nr_lbas - 1 : 0)) /
+			 zdev->zone_size;
+	uint64_t z;
+	int g;
+
+	memset(mask, 0, ZBC_ZONE_LOCKS * sizeof(*mask));
+	if (z_end - z_start + 1 >= ZBC_ZONE_LOCKS) {
+		for (g = 0; g < ZBC_ZONE_LOCKS; g++)
+			mask[g] = true;
+	} else {
+		for (z = z_start; z <= z_end; z++)
+			mask[z % ZBC_ZONE_LOCKS] = true;
+	}
+
+	for (g = 0; g < ZBC_ZONE_LOCKS; g++) {
+		if (mask[g])
+			pthread_mutex_lock(&zdev->zone_locks[g]);
+	}
+}
+
+static void zbc_unlock_zone_range(struct zbc_dev *zdev,
+				  bool mask[ZBC_ZONE_LOCKS])
+{
+	int g;
+
+	for (g = ZBC_ZONE_LOCKS - 1; g >= 0; g--) {
+		if (mask[g])
+			pthread_mutex_unlock(&zdev->zone_locks[g]);
+	}
+}
+
+/*
+ * Fast path for the common SMR-staging case: a write that stays in
+ * one zone, lands exactly on the write pointer of an already open
+ * zone (or a conventional zone) and does not fill it. Validation is
+ * one compare against the cached write pointer under the zone-group
+ * lock; anything that needs a condition transition falls back to the
+ * fully locked state machine.
+ */
+static int zbc_write_fast(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct zbc_dev *zdev = tcmur_dev_get_private(dev);
+	uint64_t lba = tcmu_cdb_get_lba(cmd->cdb);
+	size_t nr_lbas = tcmu_cdb_get_xfer_length(cmd->cdb);
+	size_t count, lba_count;
+	struct iovec *iovec = cmd->iovec;
+	pthread_mutex_t *lock;
+	struct zbc_zone *zone;
+	ssize_t ret;
+
+	ret = zbc_check_rdwr(dev, cmd);
+	if (ret != TCMU_STS_OK)
+		return ret;
+
+	zone = zbc_get_zone(zdev, lba, false);
+	if (!zone || lba + nr_lbas > zone->start + zone->len)
+		return TCMU_STS_NOT_HANDLED;
+
+	pthread_rwlock_rdlock(&zdev->io_rwlock);
+	lock = zbc_zone_lock(zdev, zone);
+	pthread_mutex_lock(lock);
+
+	if (!zbc_zone_conv(zone)) {
+		if (!zbc_zone_is_open(zone) ||
+		    (zbc_zone_seq_req(zone) && lba != zone->wp) ||
+		    lba + nr_lbas >= zone->start + zone->len) {
+			/* condition transition needed, go the long way */
+			pthread_mutex_unlock(lock);
+			pthread_rwlock_unlock(&zdev->io_rwlock);
+			return TCMU_STS_NOT_HANDLED;
+		}
+	}
+
+	while (nr_lbas) {
+		count = nr_lbas;
+		lba_count = iovec->iov_len / zdev->lba_size;
+		if (lba_count < count)
+			count = lba_count;
+
+		ret = pwrite(zdev->fd, iovec->iov_base,
+			     count * zdev->lba_size,
+			     zdev->meta_size + lba * zdev->lba_size);
+		if (ret <= 0) {
+			tcmu_dev_err(dev, "Write failed: %m\n");
+			pthread_mutex_unlock(lock);
+			pthread_rwlock_unlock(&zdev->io_rwlock);
+			return tcmu_sense_set_data(cmd->sense_buf,
+						   MEDIUM_ERROR,
+						   ASC_WRITE_ERROR);
+		}
+
+		iovec += tcmu_iovec_seek(iovec, ret);
+		count = ret / zdev->lba_size;
+
+		if (zbc_zone_seq_req(zone))
+			zone->wp += count;
+		else if (zbc_zone_seq_pref(zone) && lba + count >= zone->wp)
+			zone->wp = lba + count;
+
+		lba += count;
+		nr_lbas -= count;
+	}
+
+	pthread_mutex_unlock(lock);
+	pthread_rwlock_unlock(&zdev->io_rwlock);
+	return TCMU_STS_OK;
+}
+
+static int __zbc_handle_cmd(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
 {
 	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
 	uint8_t *cdb = cmd->cdb;
@@ -2266,6 +2585,49 @@ static int zbc_handle_cmd(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
 	return TCMU_STS_NOT_HANDLED;
 }
 
+static int zbc_handle_cmd(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+{
+	struct zbc_dev *zdev = tcmur_dev_get_private(dev);
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+	bool mask[ZBC_ZONE_LOCKS];
+	int ret;
+
+	switch (cmd->cdb[0]) {
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		ret = zbc_write_fast(dev, cmd);
+		if (ret != TCMU_STS_NOT_HANDLED)
+			return ret;
+		break;
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		/*
+		 * Reads never change zone state: shared mode plus the
+		 * zone groups they span, so they only contend with
+		 * writers of the same groups.
+		 */
+		pthread_rwlock_rdlock(&zdev->io_rwlock);
+		zbc_lock_zone_range(zdev, tcmu_cdb_get_lba(cmd->cdb),
+				    tcmu_cdb_get_xfer_length(cmd->cdb),
+				    mask);
+		ret = __zbc_handle_cmd(dev, tcmur_cmd);
+		zbc_unlock_zone_range(zdev, mask);
+		pthread_rwlock_unlock(&zdev->io_rwlock);
+		return ret;
+	default:
+		break;
+	}
+
+	/* transitions and management run exclusively */
+	pthread_rwlock_wrlock(&zdev->io_rwlock);
+	ret = __zbc_handle_cmd(dev, tcmur_cmd);
+	pthread_rwlock_unlock(&zdev->io_rwlock);
+
+	return ret;
+}
+
 static const char zbc_cfg_desc[] =
 	"ZBC emulation device configuration string must be of the form:\n"
 	"\"[opt1[/opt2][...]@]<backstore file path>\n"
@@ -2294,7 +2656,7 @@ static struct tcmur_handler zbc_handler = {
 	.open = zbc_open,
 	.close = zbc_close,
 	.handle_cmd = zbc_handle_cmd,
-	.nr_threads = 0,
+	.nr_threads = 4,
 };
 
 /*
@@ -34,8 +34,49 @@
 #define TCMU_GLFS_LOG_FILENAME "tcmu-runner-glfs.log"  /* MAX 32 CHAR */
 #define TCMU_GLFS_DEBUG_LEVEL  7
 
-/* cache protection */
-pthread_mutex_t glfs_lock;
+/* cache protection: read-mostly, writers only on connection set changes */
+static pthread_rwlock_t glfs_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * A slot being brought up holds this marker until glfs_init()
+ * succeeds: with parallel bring-up, publishing the raw glfs_new()
+ * handle before init would hand racing opens an uninitialized
+ * connection. Racers wait on glfs_init_cond when every slot is
+ * still initializing.
+ */
+#define GLFS_CONN_INITIALIZING ((glfs_t *)-1)
+
+static pthread_mutex_t glfs_init_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t glfs_init_cond = PTHREAD_COND_INITIALIZER;
+
+static inline bool glfs_conn_ready(glfs_t *fs)
+{
+	return fs && fs != GLFS_CONN_INITIALIZING;
+}
+
+/*
+ * Number of gfapi connections opened per volume. Devices are striped
+ * across them round-robin so a single connection's event threads are
+ * no longer the per-volume throughput ceiling. Connections are
+ * created lazily as the stripe first lands on them.
+ */
+#define TCMU_GLFS_MAX_CONNS 16
+
+static unsigned int tcmu_glfs_conns(void)
+{
+	char *env = getenv("TCMU_GLFS_CONNECTIONS");
+	int n;
+
+	if (!env)
+		return 1;
+
+	n = atoi(env);
+	if (n < 1)
+		return 1;
+	if (n > TCMU_GLFS_MAX_CONNS)
+		return TCMU_GLFS_MAX_CONNS;
+	return n;
+}
 
 #if GFAPI_VERSION766
 #define GF_ENFORCE_MANDATORY_LOCK "trusted.glusterfs.enforce-mandatory-lock"
@@ -100,7 +141,12 @@ typedef struct glfs_cbk_cookie {
 struct gluster_cacheconn {
 	char *volname;
 	gluster_hostdef *server;
-	glfs_t *fs;
+
+	/* striped connections, created lazily; NULL means not set up */
+	glfs_t **fs;
+	unsigned int nr_conns;
+	unsigned int next_conn;
+
 	darray(char *) cfgstring;
 } gluster_cacheconn;
 
@@ -157,15 +203,19 @@ gluster_compare_hosts(gluster_hostdef *src_server, gluster_hostdef *dst_server)
 	return false;
 }
 
-static int gluster_cache_add(gluster_server *dst, glfs_t *fs, char* cfgstring)
+static struct gluster_cacheconn *gluster_cache_add(gluster_server *dst)
 {
 	struct gluster_cacheconn *entry;
-	char* cfg_copy = NULL;
 
 	entry = calloc(1, sizeof(gluster_cacheconn));
 	if (!entry)
 		goto error;
 
+	entry->nr_conns = tcmu_glfs_conns();
+	entry->fs = calloc(entry->nr_conns, sizeof(*entry->fs));
+	if (!entry->fs)
+		goto free_entry;
+
 	entry->volname = strdup(dst->volname);
 
 	entry->server = calloc(1, sizeof(gluster_hostdef));
@@ -181,76 +231,137 @@ static int gluster_cache_add(gluster_server *dst, glfs_t *fs, char* cfgstring)
 		entry->server->u.inet.port = strdup(dst->server->u.inet.port);
 	}
 
-	entry->fs = fs;
-
-	cfg_copy = strdup(cfgstring);
 	darray_init(entry->cfgstring);
-	darray_append(entry->cfgstring, cfg_copy);
-
 	darray_append(glfs_cache, entry);
 
-	return 0;
+	return entry;
 
 free_entry:
 	if (entry->volname)
 		free(entry->volname);
+	free(entry->fs);
 	free(entry);
 error:
-	return -1;
+	return NULL;
 }
 
 static bool tcmu_glfs_update_logdir(void)
 {
 	struct gluster_cacheconn **entry;
 	char logfilepath[PATH_MAX];
+	unsigned int i;
+	bool ok = true;
 	int ret;
 
+	pthread_rwlock_rdlock(&glfs_cache_lock);
 	darray_foreach(entry, glfs_cache) {
 		ret = tcmu_make_absolute_logfile(logfilepath, TCMU_GLFS_LOG_FILENAME);
 		if (ret < 0) {
 			tcmu_err("tcmu_make_absolute_logfile failed: %d\n", ret);
-			return false;
+			ok = false;
+			break;
 		}
 
-		if (glfs_set_logging((*entry)->fs, logfilepath, TCMU_GLFS_DEBUG_LEVEL)) {
-			tcmu_err("glfs_set_logging() on %s failed[%s]",
-				 (*entry)->volname, strerror(errno));
-			return false;
+		for (i = 0; i < (*entry)->nr_conns; i++) {
+			if (!glfs_conn_ready((*entry)->fs[i]))
+				continue;
+
+			if (glfs_set_logging((*entry)->fs[i], logfilepath,
+					     TCMU_GLFS_DEBUG_LEVEL)) {
+				tcmu_err("glfs_set_logging() on %s failed[%s]",
+					 (*entry)->volname, strerror(errno));
+				ok = false;
+				break;
+			}
 		}
+		if (!ok)
+			break;
 	}
+	pthread_rwlock_unlock(&glfs_cache_lock);
 
-	return true;
+	return ok;
 }
 
-static glfs_t* gluster_cache_query(gluster_server *dst, char *cfgstring)
+static struct gluster_cacheconn *gluster_cache_find(gluster_server *dst)
 {
 	struct gluster_cacheconn **entry;
-	char** config;
-	char* cfg_copy = NULL;
-	bool cfgmatch = false;
 
 	darray_foreach(entry, glfs_cache) {
 		if (strcmp((*entry)->volname, dst->volname))
 			continue;
-		if (gluster_compare_hosts((*entry)->server, dst->server)) {
+		if (gluster_compare_hosts((*entry)->server, dst->server))
+			return *entry;
+	}
 
-			darray_foreach(config, (*entry)->cfgstring) {
-				if (!strcmp(*config, cfgstring)) {
-					cfgmatch = true;
-					break;
-				}
-			}
-			if (!cfgmatch) {
-				cfg_copy = strdup(cfgstring);
-				darray_append((*entry)->cfgstring, cfg_copy);
-			}
-			return (*entry)->fs;
+	return NULL;
+}
+
+/*
+ * Read-side lookup: succeeds only when the volume entry, the device's
+ * cfgstring and the striped connection all exist already, so device
+ * setup on a warm volume never takes the cache write lock.
+ */
+static glfs_t* gluster_cache_query(gluster_server *dst, char *cfgstring)
+{
+	struct gluster_cacheconn *entry;
+	char** config;
+	bool cfgmatch = false;
+	unsigned int slot;
+
+	entry = gluster_cache_find(dst);
+	if (!entry)
+		return NULL;
+
+	darray_foreach(config, entry->cfgstring) {
+		if (!strcmp(*config, cfgstring)) {
+			cfgmatch = true;
+			break;
 		}
 	}
+	if (!cfgmatch)
+		return NULL;
 
-	return NULL;
+	slot = __atomic_fetch_add(&entry->next_conn, 1, __ATOMIC_RELAXED) %
+	       entry->nr_conns;
+	return glfs_conn_ready(entry->fs[slot]) ? entry->fs[slot] : NULL;
+}
+
+static bool gluster_entry_has_conn(struct gluster_cacheconn *entry,
+				   glfs_t *fs)
+{
+	unsigned int c;
+
+	for (c = 0; c < entry->nr_conns; c++) {
+		if (glfs_conn_ready(entry->fs[c]) && entry->fs[c] == fs)
+			return true;
+	}
+
+	return false;
 }
 
+/* tear one entry down; called with the cache write lock held */
+static void __gluster_cache_drop_entry(struct gluster_cacheconn *conn,
+				       size_t idx)
+{
+	unsigned int c;
+
+	free(conn->volname);
+	for (c = 0; c < conn->nr_conns; c++) {
+		if (glfs_conn_ready(conn->fs[c]))
+			glfs_fini(conn->fs[c]);
+	}
+	free(conn->fs);
+	gluster_free_host(conn->server);
+	free(conn->server);
+	free(conn);
+
+	darray_remove(glfs_cache, idx);
+}
+
+/*
+ * Drop one cfgstring user of the entry owning fs. The last cfgstring
+ * user takes the whole entry with it.
+ */
 static void gluster_cache_refresh(glfs_t *fs, const char *cfgstring)
 {
 	struct gluster_cacheconn **entry;
@@ -261,8 +372,10 @@ static void gluster_cache_refresh(glfs_t *fs, const char *cfgstring)
 	if (!fs)
 		return;
 
+	pthread_rwlock_wrlock(&glfs_cache_lock);
+
 	darray_foreach(entry, glfs_cache) {
-		if ((*entry)->fs == fs) {
+		if (gluster_entry_has_conn(*entry, fs)) {
 			if (cfgstring) {
 				darray_foreach(config, (*entry)->cfgstring) {
 					if (!strcmp(*config, cfgstring)) {
@@ -274,23 +387,75 @@ static void gluster_cache_refresh(glfs_t *fs, const char *cfgstring)
 				}
 			}
 
-			if (darray_size((*entry)->cfgstring))
-				return;
-
-			free((*entry)->volname);
-			glfs_fini((*entry)->fs);
-			(*entry)->fs = NULL;
-			gluster_free_host((*entry)->server);
-			free((*entry)->server);
-			(*entry)->server = NULL;
-			free((*entry));
-
-			darray_remove(glfs_cache, i);
-			return;
+			if (!darray_size((*entry)->cfgstring))
+				__gluster_cache_drop_entry(*entry, i);
+			goto unlock;
 		} else {
 			i++;
 		}
 	}
+
+unlock:
+	pthread_rwlock_unlock(&glfs_cache_lock);
+}
+
+/* wake opens waiting for a connection to finish initializing */
+static void gluster_cache_init_done(void)
+{
+	pthread_mutex_lock(&glfs_init_lock);
+	pthread_cond_broadcast(&glfs_init_cond);
+	pthread_mutex_unlock(&glfs_init_lock);
+}
+
+/* make a fully initialized connection visible to other opens */
+static void gluster_cache_publish(gluster_server *dst, int slot, glfs_t *fs)
+{
+	struct gluster_cacheconn *conn;
+
+	pthread_rwlock_wrlock(&glfs_cache_lock);
+	conn = gluster_cache_find(dst);
+	if (conn && conn->fs[slot] == GLFS_CONN_INITIALIZING)
+		conn->fs[slot] = fs;
+	pthread_rwlock_unlock(&glfs_cache_lock);
+
+	gluster_cache_init_done();
+}
+
+/* undo a claimed slot and this open's cfgstring registration */
+static void gluster_cache_init_failed(gluster_server *dst, const char *config,
+				      int slot)
+{
+	struct gluster_cacheconn **entry;
+	char **known_cfg;
+	size_t i = 0, j = 0;
+
+	pthread_rwlock_wrlock(&glfs_cache_lock);
+
+	darray_foreach(entry, glfs_cache) {
+		if (!strcmp((*entry)->volname, dst->volname) &&
+		    gluster_compare_hosts((*entry)->server, dst->server)) {
+			if ((*entry)->fs[slot] == GLFS_CONN_INITIALIZING)
+				(*entry)->fs[slot] = NULL;
+
+			darray_foreach(known_cfg, (*entry)->cfgstring) {
+				if (!strcmp(*known_cfg, config)) {
+					free(*known_cfg);
+					darray_remove((*entry)->cfgstring, j);
+					break;
+				}
+				j++;
+			}
+
+			if (!darray_size((*entry)->cfgstring))
+				__gluster_cache_drop_entry(*entry, i);
+			break;
+		}
+		i++;
+	}
+
+	pthread_rwlock_unlock(&glfs_cache_lock);
+
+	gluster_cache_init_done();
 }
 
 static void gluster_thread_cleanup(void *arg)
@@ -300,39 +465,118 @@ static void gluster_thread_cleanup(void *arg)
 
 static int gluster_cache_query_or_add(struct tcmu_device *dev,
                                       glfs_t **fs, gluster_server *entry,
-                                      char *config, bool *init)
+                                      char *config, bool *init, int *slot)
 {
+	struct gluster_cacheconn *conn;
+	char *cfg_copy, **known_cfg;
+	struct timespec ts;
+	bool cfgmatch, initializing, wait_retry;
+	unsigned int i, rr;
 	int ret = -1;
 
-	pthread_cleanup_push(gluster_thread_cleanup, &glfs_lock);
-	pthread_mutex_lock(&glfs_lock);
-
+	/* fast path: warm volume and known cfgstring, readers only */
+	pthread_cleanup_push(gluster_thread_cleanup, &glfs_cache_lock);
+	pthread_rwlock_rdlock(&glfs_cache_lock);
 	*fs = gluster_cache_query(entry, config);
+	pthread_rwlock_unlock(&glfs_cache_lock);
+	pthread_cleanup_pop(0);
+
 	if (*fs) {
+		*init = false;
+		return 0;
+	}
+
+retry:
+	wait_retry = false;
+	ret = -1;
+	pthread_cleanup_push(gluster_thread_cleanup, &glfs_cache_lock);
+	pthread_rwlock_wrlock(&glfs_cache_lock);
+
+	conn = gluster_cache_find(entry);
+	if (!conn) {
+		conn = gluster_cache_add(entry);
+		if (!conn) {
+			tcmu_dev_err(dev, "gluster_cache_add(vol=%s, config=%s) failed: %m\n",
+				     entry->volname, config);
+			goto out;
+		}
+	}
+
+	/* the fast path only hits for cfgstrings recorded here */
+	cfgmatch = false;
+	darray_foreach(known_cfg, conn->cfgstring) {
+		if (!strcmp(*known_cfg, config)) {
+			cfgmatch = true;
+			break;
+		}
+	}
+	if (!cfgmatch) {
+		cfg_copy = strdup(config);
+		if (!cfg_copy)
+			goto out;
+		darray_append(conn->cfgstring, cfg_copy);
+	}
+
+	/* prefer the round-robin slot, else any initialized one */
+	rr = __atomic_fetch_add(&conn->next_conn, 1, __ATOMIC_RELAXED) %
+	     conn->nr_conns;
+	if (glfs_conn_ready(conn->fs[rr])) {
+		*fs = conn->fs[rr];
 		*init = false;
 		ret = 0;
 		goto out;
 	}
 
-	*fs = glfs_new(entry->volname);
-	if (!*fs) {
-		tcmu_dev_err(dev, "glfs_new(vol=%s) failed: %m\n", entry->volname);
-		goto out;
+	initializing = false;
+	for (i = 0; i < conn->nr_conns; i++) {
+		if (glfs_conn_ready(conn->fs[i])) {
+			*fs = conn->fs[i];
+			*init = false;
+			ret = 0;
+			goto out;
+		}
+		if (conn->fs[i] == GLFS_CONN_INITIALIZING)
+			initializing = true;
 	}
 
-	ret = gluster_cache_add(entry, *fs, config);
-	if (ret) {
-		tcmu_dev_err(dev, "gluster_cache_add(vol=%s, config=%s) failed: %m\n",
-		             entry->volname, config);
-		glfs_fini(*fs);
-		*fs = NULL;
+	/* claim a free slot; the caller initializes it off the lock */
+	for (i = 0; i < conn->nr_conns; i++) {
+		if (conn->fs[i])
+			continue;
+
+		*fs = glfs_new(entry->volname);
+		if (!*fs) {
+			tcmu_dev_err(dev, "glfs_new(vol=%s) failed: %m\n",
+				     entry->volname);
+			goto out;
+		}
+		conn->fs[i] = GLFS_CONN_INITIALIZING;
+		*slot = i;
+		*init = true;
+		ret = 0;
 		goto out;
 	}
 
+	/* every slot is being brought up by racing opens: wait */
+	wait_retry = initializing;
+
 out:
-	pthread_mutex_unlock(&glfs_lock);
+	pthread_rwlock_unlock(&glfs_cache_lock);
 	pthread_cleanup_pop(0);
 
+	if (wait_retry) {
+		pthread_mutex_lock(&glfs_init_lock);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100 * 1000 * 1000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&glfs_init_cond, &glfs_init_lock, &ts);
+		pthread_mutex_unlock(&glfs_init_lock);
+		goto retry;
+	}
+
 	return ret;
 }
 
@@ -430,6 +674,7 @@ static glfs_t* tcmu_create_glfs_object(struct tcmu_device *dev,
 	char logfilepath[PATH_MAX];
 	glfs_t *fs =  NULL;
 	int ret = -1;
+	int slot = -1;
 	bool init = true;
 
 	if (parse_imagepath(config, hosts) == -1) {
@@ -439,7 +684,8 @@ static glfs_t* tcmu_create_glfs_object(struct tcmu_device *dev,
 	}
 	entry = *hosts;
 
-	ret = gluster_cache_query_or_add(dev, &fs, entry, config, &init);
+	ret = gluster_cache_query_or_add(dev, &fs, entry, config, &init,
+					 &slot);
 	if (ret) {
 		tcmu_dev_err(dev, "gluster_cache_query_or_add(vol=%s, config=%s) failed\n",
 		             entry->volname, config);
@@ -478,10 +724,14 @@ static glfs_t* tcmu_create_glfs_object(struct tcmu_device *dev,
 		goto unref;
 	}
 
+	/* only now is the connection safe for other opens to share */
+	gluster_cache_publish(entry, slot, fs);
+
 	return fs;
 
 unref:
-	gluster_cache_refresh(fs, config);
+	gluster_cache_init_failed(entry, config, slot);
+	glfs_fini(fs);
 
 fail:
 	gluster_free_server(hosts);
@@ -1002,13 +1252,7 @@ int handler_init(void)
 {
 	int ret;
 
-	ret = pthread_mutex_init(&glfs_lock, NULL);
-	if (ret != 0)
-		return -1;
-
 	ret = tcmur_register_handler(&glfs_handler);
-	if (ret != 0)
-		pthread_mutex_destroy(&glfs_lock);
 
 	return ret;
 }
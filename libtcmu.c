@@ -24,7 +24,10 @@
 #include <libnl3/netlink/genl/ctrl.h>
 #include <libnl3/netlink/errno.h>
 
+#include "ccan/list/list.h"
+
 #include "target_core_user_local.h"
+#include "tcmu_tracepoints.h"
 #include "libtcmu.h"
 #include "libtcmu_log.h"
 #include "libtcmu_priv.h"
@@ -47,9 +50,40 @@ static int device_add(struct tcmulib_context *ctx, char *dev_name,
 		      char *cfgstring, bool reopen);
 static void device_remove(struct tcmulib_context *ctx, char *dev_name,
 			  bool should_block);
+static void tcmu_state_file_update(struct tcmulib_context *ctx);
+static void tcmu_cmd_blks_drain(struct tcmu_device *dev);
 static int handle_netlink(struct nl_cache_ops *unused, struct genl_cmd *cmd,
 			  struct genl_info *info, void *arg);
 
+/*
+ * Netlink device operations are queued to a small pool of workers,
+ * keyed by device name so operations on one device stay ordered, and
+ * the reply is sent when the operation finishes. The netlink socket
+ * is drained immediately, so one handler open hanging on a sick
+ * backend no longer blocks creation and removal of every other LUN.
+ */
+#define TCMU_NL_WORKERS 4
+
+struct tcmu_nl_op {
+	struct list_node entry;
+	struct tcmulib_context *ctx;
+	int cmd_id;
+	int reply_cmd;
+	uint32_t dev_id;
+	bool send_reply;
+	char dev_name[32];
+	char *cfgstring;		/* device add */
+	struct tcmulib_cfg_info cfg;	/* device reconfig */
+	char *cfg_str;			/* backing storage for cfg strings */
+};
+
+struct tcmu_nl_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head ops;
+};
+
 static struct genl_cmd tcmu_cmds[] = {
 	{
 		.c_id		= TCMU_CMD_ADDED_DEVICE,
@@ -106,7 +140,9 @@ static int send_netlink_reply(struct tcmulib_context *ctx, int reply_cmd,
 		goto free_msg;
 
 	/* Ignore ack. There is nothing we can do. */
+	pthread_mutex_lock(&ctx->nl_send_lock);
 	ret = nl_send_auto(sock, msg);
+	pthread_mutex_unlock(&ctx->nl_send_lock);
 free_msg:
 	nlmsg_free(msg);
 
@@ -144,59 +180,113 @@ static const char *const tcmulib_cfg_type_lookup[] = {
 };
 
 static int reconfig_device(struct tcmulib_context *ctx, char *dev_name,
-			   struct genl_info *info)
+			   struct tcmulib_cfg_info *cfg)
 {
 	struct tcmu_device *dev;
-	struct tcmulib_cfg_info cfg;
 	int i, ret;
 
-	memset(&cfg, 0, sizeof(cfg));
-
+	pthread_mutex_lock(&ctx->dev_lock);
 	dev = lookup_dev_by_name(ctx, dev_name, &i);
+	pthread_mutex_unlock(&ctx->dev_lock);
 	if (!dev) {
 		tcmu_err("Could not reconfigure device %s: not found.\n",
 			 dev_name);
 		return -ENODEV;
 	}
 
-	if (info->attrs[TCMU_ATTR_DEV_CFG]) {
-		cfg.type = TCMULIB_CFG_DEV_CFGSTR;
-		cfg.data.dev_cfgstring =
-				nla_get_string(info->attrs[TCMU_ATTR_DEV_CFG]);
-	} else if (info->attrs[TCMU_ATTR_DEV_SIZE]) {
-		cfg.type = TCMULIB_CFG_DEV_SIZE;
-		cfg.data.dev_size = nla_get_u64(info->attrs[TCMU_ATTR_DEV_SIZE]);
-	} else if (info->attrs[TCMU_ATTR_WRITECACHE]) {
-		cfg.type = TCMULIB_CFG_WRITE_CACHE;
-		cfg.data.write_cache =
-				nla_get_u8(info->attrs[TCMU_ATTR_WRITECACHE]);
-	} else {
-		tcmu_dev_err(dev,
-			     "Unknown reconfig attr. Try updating libtcmu.\n");
-		return -EOPNOTSUPP;
-	}
+	/* the snapshot may describe the old configuration */
+	tcmu_cfgfs_dev_cache_invalidate(dev);
 
 	if (!dev->handler->reconfig) {
 		tcmu_dev_dbg(dev, "Reconfiguration is not supported with this device. "
-		             "Request for %s.\n", tcmulib_cfg_type_lookup[cfg.type]);
+		             "Request for %s.\n", tcmulib_cfg_type_lookup[cfg->type]);
 		return -EOPNOTSUPP;
 	}
 
-	ret = dev->handler->reconfig(dev, &cfg);
+	ret = dev->handler->reconfig(dev, cfg);
 	if (ret < 0) {
 		tcmu_dev_dbg(dev, "Handler reconfig for %s failed with error %s.\n",
-		             tcmulib_cfg_type_lookup[cfg.type], strerror(-ret));
+		             tcmulib_cfg_type_lookup[cfg->type], strerror(-ret));
 		return ret;
 	}
 
 	return 0;
 }
 
+static void tcmu_nl_op_execute(struct tcmu_nl_op *op)
+{
+	struct tcmulib_context *ctx = op->ctx;
+	int ret = 0;
+
+	switch (op->cmd_id) {
+	case TCMU_CMD_ADDED_DEVICE:
+		ret = device_add(ctx, op->dev_name, op->cfgstring, false);
+		break;
+	case TCMU_CMD_REMOVED_DEVICE:
+		device_remove(ctx, op->dev_name, false);
+		break;
+	case TCMU_CMD_RECONFIG_DEVICE:
+		ret = reconfig_device(ctx, op->dev_name, &op->cfg);
+		break;
+	}
+
+	if (op->cmd_id == TCMU_CMD_ADDED_DEVICE ||
+	    op->cmd_id == TCMU_CMD_REMOVED_DEVICE)
+		tcmu_state_file_update(ctx);
+
+	if (op->send_reply)
+		send_netlink_reply(ctx, op->reply_cmd, op->dev_id, ret);
+
+	free(op->cfgstring);
+	free(op->cfg_str);
+	free(op);
+}
+
+static void *tcmu_nl_worker_fn(void *arg)
+{
+	struct tcmu_nl_worker *worker = arg;
+	struct tcmu_nl_op *op;
+
+	tcmu_set_thread_name("nl-work", NULL);
+
+	while (1) {
+		pthread_mutex_lock(&worker->lock);
+		while (list_empty(&worker->ops))
+			pthread_cond_wait(&worker->cond, &worker->lock);
+		op = list_first_entry(&worker->ops, struct tcmu_nl_op, entry);
+		list_del(&op->entry);
+		pthread_mutex_unlock(&worker->lock);
+
+		tcmu_nl_op_execute(op);
+	}
+
+	return NULL;
+}
+
+/* same device always lands on the same worker to keep ops ordered */
+static void tcmu_nl_op_queue(struct tcmulib_context *ctx,
+			     struct tcmu_nl_op *op)
+{
+	struct tcmu_nl_worker *worker;
+	unsigned int hash = 0;
+	char *p;
+
+	for (p = op->dev_name; *p; p++)
+		hash = hash * 31 + *p;
+	worker = &ctx->nl_workers[hash % ctx->nr_nl_workers];
+
+	pthread_mutex_lock(&worker->lock);
+	list_add_tail(&worker->ops, &op->entry);
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+}
+
 static int handle_netlink(struct nl_cache_ops *unused, struct genl_cmd *cmd,
 			  struct genl_info *info, void *arg)
 {
 	struct tcmulib_context *ctx = arg;
-	int ret, reply_cmd, version = info->genlhdr->version;
+	int version = info->genlhdr->version;
+	struct tcmu_nl_op *op;
 	char buf[32];
 
 	tcmu_dbg("cmd %d. Got header version %d. Supported %d.\n",
@@ -214,34 +304,74 @@ static int handle_netlink(struct nl_cache_ops *unused, struct genl_cmd *cmd,
 
 	snprintf(buf, sizeof(buf), "uio%d", nla_get_u32(info->attrs[TCMU_ATTR_MINOR]));
 
+	op = calloc(1, sizeof(*op));
+	if (!op) {
+		tcmu_err("Failed to allocate netlink op, dropping command %d.\n",
+			 cmd->c_id);
+		return -ENOMEM;
+	}
+
+	op->ctx = ctx;
+	op->cmd_id = cmd->c_id;
+	snprintf(op->dev_name, sizeof(op->dev_name), "%s", buf);
+	op->send_reply = version > 1;
+	if (op->send_reply)
+		op->dev_id = nla_get_u32(info->attrs[TCMU_ATTR_DEVICE_ID]);
+
 	switch (cmd->c_id) {
 	case TCMU_CMD_ADDED_DEVICE:
-		reply_cmd = TCMU_CMD_ADDED_DEVICE_DONE;
-		ret = device_add(ctx, buf,
-				 nla_get_string(info->attrs[TCMU_ATTR_DEVICE]),
-				 false);
+		op->reply_cmd = TCMU_CMD_ADDED_DEVICE_DONE;
+		op->cfgstring =
+			strdup(nla_get_string(info->attrs[TCMU_ATTR_DEVICE]));
+		if (!op->cfgstring)
+			goto free_op;
 		break;
 	case TCMU_CMD_REMOVED_DEVICE:
-		reply_cmd = TCMU_CMD_REMOVED_DEVICE_DONE;
-		device_remove(ctx, buf, false);
-		ret = 0;
+		op->reply_cmd = TCMU_CMD_REMOVED_DEVICE_DONE;
 		break;
 	case TCMU_CMD_RECONFIG_DEVICE:
-		reply_cmd = TCMU_CMD_RECONFIG_DEVICE_DONE;
-		ret = reconfig_device(ctx, buf, info);
+		op->reply_cmd = TCMU_CMD_RECONFIG_DEVICE_DONE;
+
+		/* attrs only live for this callback, copy them out */
+		if (info->attrs[TCMU_ATTR_DEV_CFG]) {
+			op->cfg.type = TCMULIB_CFG_DEV_CFGSTR;
+			op->cfg_str = strdup(nla_get_string(
+						info->attrs[TCMU_ATTR_DEV_CFG]));
+			if (!op->cfg_str)
+				goto free_op;
+			op->cfg.data.dev_cfgstring = op->cfg_str;
+		} else if (info->attrs[TCMU_ATTR_DEV_SIZE]) {
+			op->cfg.type = TCMULIB_CFG_DEV_SIZE;
+			op->cfg.data.dev_size =
+				nla_get_u64(info->attrs[TCMU_ATTR_DEV_SIZE]);
+		} else if (info->attrs[TCMU_ATTR_WRITECACHE]) {
+			op->cfg.type = TCMULIB_CFG_WRITE_CACHE;
+			op->cfg.data.write_cache =
+				nla_get_u8(info->attrs[TCMU_ATTR_WRITECACHE]);
+		} else {
+			tcmu_err("Unknown reconfig attr. Try updating libtcmu.\n");
+			if (op->send_reply)
+				send_netlink_reply(ctx, op->reply_cmd,
+						   op->dev_id, -EOPNOTSUPP);
+			free(op);
+			return -EOPNOTSUPP;
+		}
 		break;
 	default:
 		tcmu_err("Unknown netlink command %d. Netlink header received version %d. libtcmu supports %d\n",
 			 cmd->c_id, version, TCMU_NL_VERSION);
+		free(op);
 		return -EOPNOTSUPP;
 	}
 
-	if (version > 1)
-		ret = send_netlink_reply(ctx, reply_cmd,
-				nla_get_u32(info->attrs[TCMU_ATTR_DEVICE_ID]),
-				ret);
+	/* executed and replied to by the keyed worker */
+	tcmu_nl_op_queue(ctx, op);
 
-	return ret;
+	return 0;
+
+free_op:
+	free(op);
+	return -ENOMEM;
 }
 
 static int set_genl_features(struct nl_sock *sock)
@@ -347,6 +477,124 @@ err_free:
 	return NULL;
 }
 
+/*
+ * Warm-restart state cache: a small file mapping each uio device to
+ * its cfgstring, rewritten on device add/remove. A restarting daemon
+ * uses it to bring up the devices that were serving I/O before the
+ * restart first. The live sysfs uio name is always read and is the
+ * only cfgstring ever handed to device_add() - uio minors can be
+ * reassigned while the daemon is down, and trusting a stale entry
+ * could attach a LUN to the wrong backstore.
+ */
+#define TCMU_STATE_FILE "/run/tcmu-runner.state"
+
+static pthread_mutex_t tcmu_state_file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* rewrite the state file to match ctx->devices; takes dev_lock */
+static void tcmu_state_file_update(struct tcmulib_context *ctx)
+{
+	struct tcmu_device **dev_ptr;
+	struct tcmu_device *dev;
+	char tmp_path[64];
+	FILE *f;
+
+	/* netlink workers can update concurrently, one writer at a time */
+	pthread_mutex_lock(&tcmu_state_file_lock);
+
+	snprintf(tmp_path, sizeof(tmp_path), TCMU_STATE_FILE".tmp");
+	f = fopen(tmp_path, "w");
+	if (!f) {
+		tcmu_dbg("could not write state file: %m\n");
+		pthread_mutex_unlock(&tcmu_state_file_lock);
+		return;
+	}
+
+	pthread_mutex_lock(&ctx->dev_lock);
+	darray_foreach(dev_ptr, ctx->devices) {
+		dev = *dev_ptr;
+		/* tcm_hba_name carries the "user_" prefix */
+		fprintf(f, "%s tcm-user/%s/%s/%s\n", dev->dev_name,
+			dev->tcm_hba_name + 5, dev->tcm_dev_name,
+			dev->cfgstring);
+	}
+	pthread_mutex_unlock(&ctx->dev_lock);
+
+	fclose(f);
+	if (rename(tmp_path, TCMU_STATE_FILE))
+		tcmu_dbg("could not publish state file: %m\n");
+
+	pthread_mutex_unlock(&tcmu_state_file_lock);
+}
+
+struct tcmu_state_ent {
+	char *uio;
+	char *cfgstring;
+};
+
+static darray(struct tcmu_state_ent) tcmu_state_ents;
+
+static void tcmu_state_file_load(void)
+{
+	char uio[64], cfg[PATH_MAX];
+	struct tcmu_state_ent ent;
+	FILE *f;
+
+	f = fopen(TCMU_STATE_FILE, "r");
+	if (!f)
+		return;
+
+	darray_init(tcmu_state_ents);
+	/* one "<uio> <cfgstring>" pair per line; cfgstrings may
+	 * contain anything but a newline */
+	while (fgets(cfg, sizeof(cfg), f)) {
+		char *sep = strchr(cfg, ' ');
+		char *nl = strchr(cfg, '\n');
+
+		if (!sep)
+			continue;
+		if (nl)
+			*nl = '\0';
+		*sep = '\0';
+		if (snprintf(uio, sizeof(uio), "%s", cfg) >=
+		    (int)sizeof(uio))
+			continue;
+
+		ent.uio = strdup(uio);
+		ent.cfgstring = strdup(sep + 1);
+		if (!ent.uio || !ent.cfgstring) {
+			free(ent.uio);
+			free(ent.cfgstring);
+			break;
+		}
+		darray_append(tcmu_state_ents, ent);
+	}
+	fclose(f);
+}
+
+static const char *tcmu_state_lookup(const char *uio)
+{
+	struct tcmu_state_ent *ent;
+
+	darray_foreach(ent, tcmu_state_ents) {
+		if (!strcmp(ent->uio, uio))
+			return ent->cfgstring;
+	}
+
+	return NULL;
+}
+
+static void tcmu_state_ents_free(void)
+{
+	struct tcmu_state_ent *ent;
+
+	darray_foreach(ent, tcmu_state_ents) {
+		free(ent->uio);
+		free(ent->cfgstring);
+	}
+	darray_free(tcmu_state_ents);
+	darray_init(tcmu_state_ents);
+}
+
 static void teardown_netlink(struct nl_sock *sock)
 {
 	int ret;
@@ -482,10 +730,20 @@ err_recompile: /* consider expanding string lengths in dev */
 	return false;
 }
 
+static unsigned int tcmulib_mmap_flags;
+
+void tcmulib_set_mmap_options(unsigned int flags)
+{
+	tcmulib_mmap_flags = flags;
+}
+
 static void device_close_shm(struct tcmu_device *dev)
 {
 	int ret;
 
+	tcmu_cmd_blks_drain(dev);
+	pthread_spin_destroy(&dev->cmd_blk_lock);
+
 	ret = close(dev->fd);
 	if (ret != 0) {
 		tcmu_err("could not close device fd for %s: %d\n", dev->dev_name, errno);
@@ -530,6 +788,25 @@ static bool device_open_shm(struct tcmu_device *dev)
 		goto err_munmap;
 	}
 
+	if (tcmulib_mmap_flags & TCMULIB_MMAP_HUGEPAGE) {
+		if (madvise(dev->map, dev->map_len, MADV_HUGEPAGE))
+			tcmu_dbg("MADV_HUGEPAGE for %s failed: %m\n",
+				 dev->dev_name);
+	}
+
+	if (tcmulib_mmap_flags & TCMULIB_MMAP_MLOCK) {
+		if (mlock(dev->map, dev->map_len))
+			tcmu_warn("mlock of %s mapping failed: %m\n",
+				  dev->dev_name);
+	}
+
+	if (pthread_spin_init(&dev->cmd_blk_lock, 0)) {
+		tcmu_err("could not init cmd block lock for %s\n",
+			 dev->dev_name);
+		goto err_munmap;
+	}
+	dev->free_cmd_blks = NULL;
+
 	free(mmap_name);
 	return true;
 
@@ -560,10 +837,13 @@ static int device_add(struct tcmulib_context *ctx, char *dev_name,
 	if (!device_parse_cfg(dev, dev_name, cfgstring))
 		goto err_free;
 
+	if (tcmu_cfgfs_dev_cache_setup(dev))
+		goto err_free;
+
 	dev->handler = find_handler(ctx, dev->cfgstring);
 	if (!dev->handler) {
 		tcmu_err("could not find handler for %s\n", dev->dev_name);
-		goto err_free;
+		goto err_free_cache;
 	}
 
 	if (dev->handler->check_config &&
@@ -571,7 +851,7 @@ static int device_add(struct tcmulib_context *ctx, char *dev_name,
 		/* It may be handled by other handlers */
 		tcmu_err("check_config failed for %s because of %s\n", dev->dev_name, reason);
 		free(reason);
-		goto err_free;
+		goto err_free_cache;
 	}
 
 	if (reopen) {
@@ -611,7 +891,9 @@ static int device_add(struct tcmulib_context *ctx, char *dev_name,
 		goto err_closeshm;
 	}
 
+	pthread_mutex_lock(&ctx->dev_lock);
 	darray_append(ctx->devices, dev);
+	pthread_mutex_unlock(&ctx->dev_lock);
 
 	if (reopen && reset_supp)
 		tcmu_cfgfs_dev_exec_action(dev, "block_dev", 0);
@@ -623,6 +905,8 @@ err_closeshm:
 err_unblock:
 	if (reopen && reset_supp)
 		tcmu_cfgfs_dev_exec_action(dev, "block_dev", 0);
+err_free_cache:
+	tcmu_cfgfs_dev_cache_destroy(dev);
 err_free:
 	free(dev);
 	return -ENOENT;
@@ -645,7 +929,12 @@ static void device_remove(struct tcmulib_context *ctx, char *dev_name,
 	struct tcmu_device *dev;
 	int i;
 
+	pthread_mutex_lock(&ctx->dev_lock);
 	dev = lookup_dev_by_name(ctx, dev_name, &i);
+	if (dev)
+		darray_remove(ctx->devices, i);
+	pthread_mutex_unlock(&ctx->dev_lock);
+
 	if (!dev) {
 		tcmu_err("Could not remove device %s: not found.\n", dev_name);
 		return;
@@ -661,10 +950,10 @@ static void device_remove(struct tcmulib_context *ctx, char *dev_name,
 		tcmu_dev_flush_ring(dev);
 	}
 
-	darray_remove(ctx->devices, i);
-
 	dev->handler->removed(dev);
 
+	tcmu_cfgfs_dev_cache_destroy(dev);
+
 	device_close_shm(dev);
 
 	if (should_block)
@@ -732,42 +1021,209 @@ out:
 	return ret;
 }
 
-static int open_devices(struct tcmulib_context *ctx)
-{
+/*
+ * Bring-up runs device_add() from a small pool of threads, so after
+ * a restart with hundreds of devices the startup time scales with
+ * the slowest handler open (e.g. one rbd image open over the
+ * network) rather than the sum of all of them.
+ */
+#define TCMULIB_OPEN_DEV_WORKERS 8
+
+struct open_devices_work {
+	struct tcmulib_context *ctx;
 	struct dirent **dirent_list;
 	int num_devs;
-	int num_good_devs = 0;
+	int next;
+	int num_good;
+	pthread_mutex_t lock;
+};
+
+static void *open_devices_worker(void *arg)
+{
+	struct open_devices_work *work = arg;
+	const char *cached;
+	char *dev_name;
 	int i;
 
-	num_devs = scandir("/dev", &dirent_list, is_uio, alphasort);
-	if (num_devs == -1)
-		return -1;
+	while (1) {
+		pthread_mutex_lock(&work->lock);
+		i = work->next++;
+		pthread_mutex_unlock(&work->lock);
 
-	for (i = 0; i < num_devs; i++) {
-		char *dev_name = NULL;
+		if (i >= work->num_devs)
+			break;
 
-		if (read_uio_name(dirent_list[i]->d_name, &dev_name))
+		/*
+		 * Always use the live sysfs name: the state file only
+		 * drives bring-up ordering, never the cfgstring, since
+		 * uio minors can be reassigned while we were down.
+		 */
+		dev_name = NULL;
+		if (read_uio_name(work->dirent_list[i]->d_name, &dev_name))
 			continue;
 
-		if (device_add(ctx, dirent_list[i]->d_name, dev_name, true) < 0) {
-			free (dev_name);
+		cached = tcmu_state_lookup(work->dirent_list[i]->d_name);
+		if (cached && strcmp(cached, dev_name))
+			tcmu_dbg("stale state entry for %s, using live name\n",
+				 work->dirent_list[i]->d_name);
+
+		if (device_add(work->ctx, work->dirent_list[i]->d_name,
+			       dev_name, true) < 0) {
+			free(dev_name);
 			continue;
 		}
 		free(dev_name);
 
-		num_good_devs++;
+		pthread_mutex_lock(&work->lock);
+		work->num_good++;
+		pthread_mutex_unlock(&work->lock);
+	}
+
+	return NULL;
+}
+
+static int dirent_warm_cmp(const void *a, const void *b)
+{
+	const struct dirent * const *da = a;
+	const struct dirent * const *db = b;
+	bool ka = tcmu_state_lookup((*da)->d_name) != NULL;
+	bool kb = tcmu_state_lookup((*db)->d_name) != NULL;
+
+	/* devices that were serving I/O before the restart go first */
+	if (ka != kb)
+		return ka ? -1 : 1;
+	return alphasort((const struct dirent **)da,
+			 (const struct dirent **)db);
+}
+
+static int open_devices(struct tcmulib_context *ctx)
+{
+	pthread_t workers[TCMULIB_OPEN_DEV_WORKERS];
+	struct open_devices_work work;
+	int num_devs;
+	int nr_workers, i;
+
+	num_devs = scandir("/dev", &work.dirent_list, is_uio, alphasort);
+	if (num_devs == -1)
+		return -1;
+
+	tcmu_state_file_load();
+	qsort(work.dirent_list, num_devs, sizeof(*work.dirent_list),
+	      dirent_warm_cmp);
+
+	work.ctx = ctx;
+	work.num_devs = num_devs;
+	work.next = 0;
+	work.num_good = 0;
+
+	if (pthread_mutex_init(&work.lock, NULL)) {
+		work.num_good = -1;
+		goto free_list;
+	}
+
+	nr_workers = min(num_devs, TCMULIB_OPEN_DEV_WORKERS);
+	for (i = 0; i < nr_workers; i++) {
+		if (pthread_create(&workers[i], NULL, open_devices_worker,
+				   &work)) {
+			nr_workers = i;
+			break;
+		}
 	}
 
+	if (!nr_workers && num_devs)
+		/* no workers could start, do the scan inline */
+		open_devices_worker(&work);
+
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(workers[i], NULL);
+
+	pthread_mutex_destroy(&work.lock);
+
+free_list:
 	for (i = 0; i < num_devs; i++)
-		free(dirent_list[i]);
-	free(dirent_list);
+		free(work.dirent_list[i]);
+	free(work.dirent_list);
+
+	tcmu_state_ents_free();
+	tcmu_state_file_update(ctx);
 
-	return num_good_devs;
+	return work.num_good;
+}
+
+static void teardown_nl_workers(struct tcmulib_context *ctx);
+
+static int setup_nl_workers(struct tcmulib_context *ctx)
+{
+	struct tcmu_nl_worker *worker;
+	int i;
+
+	ctx->nl_workers = calloc(TCMU_NL_WORKERS, sizeof(*ctx->nl_workers));
+	if (!ctx->nl_workers)
+		return -1;
+
+	for (i = 0; i < TCMU_NL_WORKERS; i++) {
+		worker = &ctx->nl_workers[i];
+
+		list_head_init(&worker->ops);
+		if (pthread_mutex_init(&worker->lock, NULL))
+			goto err;
+		if (pthread_cond_init(&worker->cond, NULL)) {
+			pthread_mutex_destroy(&worker->lock);
+			goto err;
+		}
+		if (pthread_create(&worker->thread, NULL, tcmu_nl_worker_fn,
+				   worker)) {
+			pthread_cond_destroy(&worker->cond);
+			pthread_mutex_destroy(&worker->lock);
+			goto err;
+		}
+		ctx->nr_nl_workers = i + 1;
+	}
+
+	return 0;
+
+err:
+	teardown_nl_workers(ctx);
+	return -1;
+}
+
+static void teardown_nl_workers(struct tcmulib_context *ctx)
+{
+	struct tcmu_nl_worker *worker;
+	struct tcmu_nl_op *op;
+	int i;
+
+	if (!ctx->nl_workers)
+		return;
+
+	for (i = 0; i < ctx->nr_nl_workers; i++) {
+		worker = &ctx->nl_workers[i];
+
+		tcmu_thread_cancel(worker->thread);
+
+		while (!list_empty(&worker->ops)) {
+			op = list_first_entry(&worker->ops, struct tcmu_nl_op,
+					      entry);
+			list_del(&op->entry);
+			free(op->cfgstring);
+			free(op->cfg_str);
+			free(op);
+		}
+		pthread_cond_destroy(&worker->cond);
+		pthread_mutex_destroy(&worker->lock);
+	}
+
+	free(ctx->nl_workers);
+	ctx->nl_workers = NULL;
+	ctx->nr_nl_workers = 0;
 }
 
 static void release_resources(struct tcmulib_context *ctx)
 {
+	teardown_nl_workers(ctx);
 	teardown_netlink(ctx->nl_sock);
+	pthread_mutex_destroy(&ctx->nl_send_lock);
+	pthread_mutex_destroy(&ctx->dev_lock);
 	darray_free(ctx->handlers);
 	darray_free(ctx->devices);
 	free(ctx);
@@ -791,6 +1247,27 @@ struct tcmulib_context *tcmulib_initialize(
 		return NULL;
 	}
 
+	if (pthread_mutex_init(&ctx->dev_lock, NULL)) {
+		teardown_netlink(ctx->nl_sock);
+		free(ctx);
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&ctx->nl_send_lock, NULL)) {
+		pthread_mutex_destroy(&ctx->dev_lock);
+		teardown_netlink(ctx->nl_sock);
+		free(ctx);
+		return NULL;
+	}
+
+	if (setup_nl_workers(ctx)) {
+		pthread_mutex_destroy(&ctx->nl_send_lock);
+		pthread_mutex_destroy(&ctx->dev_lock);
+		teardown_netlink(ctx->nl_sock);
+		free(ctx);
+		return NULL;
+	}
+
 	darray_init(ctx->handlers);
 	darray_init(ctx->devices);
 
@@ -811,6 +1288,8 @@ struct tcmulib_context *tcmulib_initialize(
 
 void tcmulib_close(struct tcmulib_context *ctx)
 {
+	/* stop the nl workers so nothing races the ordered shutdown */
+	teardown_nl_workers(ctx);
 	close_devices(ctx);
 	release_resources(ctx);
 }
@@ -820,6 +1299,18 @@ int tcmulib_get_master_fd(struct tcmulib_context *ctx)
 	return nl_socket_get_fd(ctx->nl_sock);
 }
 
+void tcmulib_foreach_device(struct tcmulib_context *ctx,
+			    void (*fn)(struct tcmu_device *dev, void *data),
+			    void *data)
+{
+	struct tcmu_device **dev_ptr;
+
+	pthread_mutex_lock(&ctx->dev_lock);
+	darray_foreach(dev_ptr, ctx->devices)
+		fn(*dev_ptr, data);
+	pthread_mutex_unlock(&ctx->dev_lock);
+}
+
 int tcmulib_master_fd_ready(struct tcmulib_context *ctx)
 {
 	return nl_recvmsgs_default(ctx->nl_sock);
@@ -1110,6 +1601,66 @@ device_cmd_tail(struct tcmu_device *dev)
 	return (struct tcmu_cmd_entry *) ((char *) mb + mb->cmdr_off + dev->cmd_tail);
 }
 
+/*
+ * Command blocks hold everything tcmulib_get_next_command() used to
+ * malloc per command: the tcmulib_cmd, the translated iovec array,
+ * the cdb copy and the handler area. Completed blocks go onto a
+ * per-device freelist sized by the ring depth, so the steady-state
+ * fetch path allocates nothing; a block is only replaced when a
+ * command needs more room than the recycled one offers.
+ */
+struct tcmu_cmd_blk {
+	struct tcmu_cmd_blk *next_free;
+	size_t size;
+};
+
+static struct tcmulib_cmd *tcmu_cmd_blk_get(struct tcmu_device *dev,
+					    size_t size)
+{
+	struct tcmu_cmd_blk *blk;
+
+	pthread_spin_lock(&dev->cmd_blk_lock);
+	blk = dev->free_cmd_blks;
+	if (blk)
+		dev->free_cmd_blks = blk->next_free;
+	pthread_spin_unlock(&dev->cmd_blk_lock);
+
+	if (blk && blk->size < size) {
+		free(blk);
+		blk = NULL;
+	}
+
+	if (!blk) {
+		blk = malloc(sizeof(*blk) + size);
+		if (!blk)
+			return NULL;
+		blk->size = size;
+	}
+
+	return (struct tcmulib_cmd *)(blk + 1);
+}
+
+static void tcmu_cmd_blk_put(struct tcmu_device *dev,
+			     struct tcmulib_cmd *cmd)
+{
+	struct tcmu_cmd_blk *blk = (struct tcmu_cmd_blk *)cmd - 1;
+
+	pthread_spin_lock(&dev->cmd_blk_lock);
+	blk->next_free = dev->free_cmd_blks;
+	dev->free_cmd_blks = blk;
+	pthread_spin_unlock(&dev->cmd_blk_lock);
+}
+
+static void tcmu_cmd_blks_drain(struct tcmu_device *dev)
+{
+	struct tcmu_cmd_blk *blk;
+
+	while ((blk = dev->free_cmd_blks)) {
+		dev->free_cmd_blks = blk->next_free;
+		free(blk);
+	}
+}
+
 /* update the tcmu_device's tail */
 #define TCMU_UPDATE_DEV_TAIL(dev, mb, ent) \
 do { \
@@ -1143,9 +1694,11 @@ struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev,
 				break;
 			}
 
-			/* Alloc memory for cmd itself, iovec and cdb */
-			cmd = malloc(sizeof(*cmd) + hm_cmd_size + cdb_len +
-				     sizeof(*cmd->iovec) * ent->req.iov_cnt);
+			/* Grab a recycled block for cmd, iovec and cdb */
+			cmd = tcmu_cmd_blk_get(dev, sizeof(*cmd) +
+					       hm_cmd_size + cdb_len +
+					       sizeof(*cmd->iovec) *
+					       ent->req.iov_cnt);
 			if (!cmd)
 				return NULL;
 			cmd->cmd_id = ent->hdr.cmd_id;
@@ -1168,6 +1721,8 @@ struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev,
 				cmd->hm_private = cmd->cdb + cdb_len;
 
 			TCMU_UPDATE_DEV_TAIL(dev, mb, ent);
+			TCMU_PROBE3(cmd_fetch, dev->dev_name, cmd->cmd_id,
+				    cmd->cdb[0]);
 			return cmd;
 		}
 		default:
@@ -1181,6 +1736,60 @@ struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev,
 	return NULL;
 }
 
+/*
+ * Peek at the cmd_id of the first real (non-PAD) entry at the ring
+ * tail without consuming it. Returns false if the ring has no
+ * uncompleted entries. Used by callers completing in strict ring
+ * order on kernels without TCMU_MAILBOX_FLAG_CAP_OOOC.
+ */
+/*
+ * Cheap check for whether the kernel has produced entries we have not
+ * fetched yet. Safe to call from a busy-poll loop; does not touch the
+ * uio fd or consume anything.
+ */
+bool tcmulib_command_pending(struct tcmu_device *dev)
+{
+	struct tcmu_mailbox *mb = dev->map;
+
+	return __atomic_load_n(&mb->cmd_head, __ATOMIC_ACQUIRE) !=
+	       dev->cmd_tail;
+}
+
+bool tcmulib_peek_tail_cmd_id(struct tcmu_device *dev, uint16_t *cmd_id)
+{
+	struct tcmu_mailbox *mb = dev->map;
+	uint32_t cmd_tail = mb->cmd_tail;
+	struct tcmu_cmd_entry *ent = (void *) mb + mb->cmdr_off + cmd_tail;
+
+	while (ent != (void *) mb + mb->cmdr_off + mb->cmd_head) {
+		if (tcmu_hdr_get_op(ent->hdr.len_op) == TCMU_OP_CMD) {
+			*cmd_id = ent->hdr.cmd_id;
+			return true;
+		}
+		cmd_tail = (cmd_tail + tcmu_hdr_get_len(ent->hdr.len_op)) %
+			   mb->cmdr_size;
+		ent = (void *) mb + mb->cmdr_off + cmd_tail;
+	}
+
+	return false;
+}
+
+int tcmulib_get_next_commands(struct tcmu_device *dev,
+			      struct tcmulib_cmd **cmds, int max_cmds,
+			      int hm_cmd_size)
+{
+	int cnt = 0;
+
+	while (cnt < max_cmds) {
+		cmds[cnt] = tcmulib_get_next_command(dev, hm_cmd_size);
+		if (!cmds[cnt])
+			break;
+		cnt++;
+	}
+
+	return cnt;
+}
+
 static int tcmu_sts_to_scsi(int tcmu_sts, uint8_t *sense)
 {
 	switch (tcmu_sts) {
@@ -1305,20 +1914,27 @@ do { \
 	mb->cmd_tail = (mb->cmd_tail + tcmu_hdr_get_len((ent)->hdr.len_op)) % mb->cmdr_size; \
 } while (0)
 
-void tcmulib_command_complete(
+/*
+ * Fill in the response entry for one command, starting the PAD/entry
+ * walk at cmd_tail instead of the mailbox tail, and return the new
+ * tail. Lets batched callers advance a local tail and publish it once.
+ */
+static uint32_t tcmulib_command_complete_tail(
 	struct tcmu_device *dev,
 	struct tcmulib_cmd *cmd,
-	int result)
+	int result,
+	uint32_t cmd_tail)
 {
 	struct tcmu_mailbox *mb = dev->map;
-	struct tcmu_cmd_entry *ent = (void *) mb + mb->cmdr_off + mb->cmd_tail;
+	struct tcmu_cmd_entry *ent = (void *) mb + mb->cmdr_off + cmd_tail;
 
 	/* current command could be PAD in async case */
 	while (ent != (void *) mb + mb->cmdr_off + mb->cmd_head) {
 		if (tcmu_hdr_get_op(ent->hdr.len_op) == TCMU_OP_CMD)
 			break;
-		TCMU_UPDATE_RB_TAIL(mb, ent);
-		ent = (void *) mb + mb->cmdr_off + mb->cmd_tail;
+		cmd_tail = (cmd_tail + tcmu_hdr_get_len(ent->hdr.len_op)) %
+			   mb->cmdr_size;
+		ent = (void *) mb + mb->cmdr_off + cmd_tail;
 	}
 
 	/* cmd_id could be different in async case */
@@ -1332,8 +1948,49 @@ void tcmulib_command_complete(
 		       TCMU_SENSE_BUFFERSIZE);
 	}
 
-	TCMU_UPDATE_RB_TAIL(mb, ent);
-	free(cmd);
+	cmd_tail = (cmd_tail + tcmu_hdr_get_len(ent->hdr.len_op)) %
+		   mb->cmdr_size;
+	tcmu_cmd_blk_put(dev, cmd);
+
+	return cmd_tail;
+}
+
+void tcmulib_command_complete(
+	struct tcmu_device *dev,
+	struct tcmulib_cmd *cmd,
+	int result)
+{
+	struct tcmu_mailbox *mb = dev->map;
+
+	TCMU_PROBE3(cmd_complete, dev->dev_name, cmd->cmd_id, cmd->cdb[0]);
+
+	mb->cmd_tail = tcmulib_command_complete_tail(dev, cmd, result,
+						     mb->cmd_tail);
+}
+
+void tcmulib_commands_complete(struct tcmu_device *dev,
+			       struct tcmulib_cmd **cmds, int *results,
+			       int cnt)
+{
+	struct tcmu_mailbox *mb = dev->map;
+	uint32_t cmd_tail = mb->cmd_tail;
+	int i;
+
+	if (!cnt)
+		return;
+
+	for (i = 0; i < cnt; i++) {
+		TCMU_PROBE3(cmd_complete, dev->dev_name, cmds[i]->cmd_id,
+			    cmds[i]->cdb[0]);
+		cmd_tail = tcmulib_command_complete_tail(dev, cmds[i],
+							 results[i], cmd_tail);
+	}
+
+	/* publish every completed entry with a single tail update */
+	__atomic_store_n(&mb->cmd_tail, cmd_tail, __ATOMIC_RELEASE);
+
+	/* and ring the doorbell once for the whole batch */
+	tcmulib_processing_complete(dev);
 }
 
 void tcmulib_processing_start(struct tcmu_device *dev)
@@ -102,6 +102,11 @@ int tcmulib_get_master_fd(struct tcmulib_context *ctx);
  */
 int tcmulib_master_fd_ready(struct tcmulib_context *ctx);
 
+/* Run fn on every registered device, with the device list held stable. */
+void tcmulib_foreach_device(struct tcmulib_context *ctx,
+			    void (*fn)(struct tcmu_device *dev, void *data),
+			    void *data);
+
 /*
  * When a device fd becomes ready, call this to get SCSI cmd info in
  * 'cmd' struct. libtcmu will allocate hm_cmd_size bytes for each cmd
@@ -113,6 +118,30 @@ int tcmulib_master_fd_ready(struct tcmulib_context *ctx);
 struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev,
 					     int hm_cmd_size);
 
+/*
+ * Batch variant of tcmulib_get_next_command(): drains up to max_cmds
+ * ready entries from the ring into the caller-provided cmds array in
+ * one pass. Returns the number of commands fetched; fewer than
+ * max_cmds means the ring is empty.
+ */
+int tcmulib_get_next_commands(struct tcmu_device *dev,
+			      struct tcmulib_cmd **cmds, int max_cmds,
+			      int hm_cmd_size);
+
+/*
+ * Peek at the cmd_id the kernel expects to be completed next, without
+ * consuming it. Returns false if there is nothing left to complete.
+ * Only needed when completing in ring order because the kernel does
+ * not support out-of-order completions.
+ */
+bool tcmulib_peek_tail_cmd_id(struct tcmu_device *dev, uint16_t *cmd_id);
+
+/*
+ * Returns true if the ring has entries that have not been fetched
+ * with tcmulib_get_next_command() yet. Cheap enough to busy-poll.
+ */
+bool tcmulib_command_pending(struct tcmu_device *dev);
+
 /*
  * Mark the command as complete.
  * Must be called before get_next_command() is called again.
@@ -122,12 +151,30 @@ struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev,
  */
 void tcmulib_command_complete(struct tcmu_device *dev, struct tcmulib_cmd *cmd, int result);
 
+/*
+ * Batch variant of tcmulib_command_complete(): completes cnt commands
+ * with their matching results, updates the ring tail once and rings
+ * the uio doorbell once for the whole batch, so there is no need to
+ * also call tcmulib_processing_complete().
+ */
+void tcmulib_commands_complete(struct tcmu_device *dev,
+			       struct tcmulib_cmd **cmds, int *results,
+			       int cnt);
+
 /* Call when start processing commands (before calling tcmulib_get_next_command()) */
 void tcmulib_processing_start(struct tcmu_device *dev);
 
 /* Call when complete processing commands (tcmulib_get_next_command() returned NULL) */
 void tcmulib_processing_complete(struct tcmu_device *dev);
 
+/*
+ * Optional treatment for the per-device uio mappings, applied as
+ * devices are opened. Set before devices are added.
+ */
+#define TCMULIB_MMAP_HUGEPAGE	(1 << 0)
+#define TCMULIB_MMAP_MLOCK	(1 << 1)
+void tcmulib_set_mmap_options(unsigned int flags);
+
 /* Clean up loose ends when exiting */
 void tcmulib_close(struct tcmulib_context *ctx);
 
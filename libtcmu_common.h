@@ -148,6 +148,11 @@ int tcmu_cfgfs_set_str(const char *path, const char *val, int val_len);
 int tcmu_cfgfs_get_int(const char *path);
 int tcmu_cfgfs_set_u32(const char *path, uint32_t val);
 int tcmu_cfgfs_dev_get_attr_int(struct tcmu_device *dev, const char *name);
+int tcmu_cfgfs_dev_set_attr_int(struct tcmu_device *dev, const char *name,
+				uint32_t val);
+int tcmu_cfgfs_dev_cache_setup(struct tcmu_device *dev);
+void tcmu_cfgfs_dev_cache_invalidate(struct tcmu_device *dev);
+void tcmu_cfgfs_dev_cache_destroy(struct tcmu_device *dev);
 int tcmu_cfgfs_dev_exec_action(struct tcmu_device *dev, const char *name,
 			       uint32_t val);
 int tcmu_cfgfs_dev_set_ctrl_u64(struct tcmu_device *dev, const char *key,
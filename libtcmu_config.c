@@ -99,6 +99,21 @@ struct tcmu_conf_option {
 
 static LIST_HEAD(tcmu_options);
 
+/*
+ * Readers get an immutable snapshot through one atomic pointer load;
+ * reloads build a fresh snapshot and publish it with a release
+ * store. The previous snapshot is retired one reload later, which
+ * gives short option reads a comfortable grace period without any
+ * reader-side bookkeeping.
+ */
+static struct tcmu_config *tcmu_active_snapshot;
+static struct tcmu_config *tcmu_retired_snapshot;
+
+struct tcmu_config *tcmu_get_config(void)
+{
+	return __atomic_load_n(&tcmu_active_snapshot, __ATOMIC_ACQUIRE);
+}
+
 static struct tcmu_conf_option * tcmu_get_option(const char *key)
 {
 	struct tcmu_conf_option *option;
@@ -191,6 +206,39 @@ static void tcmu_conf_set_options(struct tcmu_config *cfg)
 	TCMU_PARSE_CFG_STR(cfg, log_dir);
 	tcmu_resetup_log_file(cfg, cfg->log_dir);
 
+	/* set shared_io_threads option (only read at daemon start) */
+	TCMU_PARSE_CFG_INT(cfg, shared_io_threads);
+
+	/* set cmdproc_spin_us option (applied to devices as they are added) */
+	TCMU_PARSE_CFG_INT(cfg, cmdproc_spin_us);
+
+	/* set xcopy_window option */
+	TCMU_PARSE_CFG_INT(cfg, xcopy_window);
+
+	/* set read_ahead_kb option (applied to devices as they are added) */
+	TCMU_PARSE_CFG_INT(cfg, read_ahead_kb);
+
+	/* set read_cache_mb option (applied to devices as they are added) */
+	TCMU_PARSE_CFG_INT(cfg, read_cache_mb);
+
+	/* set write_coalesce_kb option (applied to devices as they are added) */
+	TCMU_PARSE_CFG_INT(cfg, write_coalesce_kb);
+
+	/* uio mapping options, applied to devices as they are added */
+	TCMU_PARSE_CFG_BOOL(cfg, mmap_prefault);
+	TCMU_PARSE_CFG_BOOL(cfg, mmap_hugepages);
+	TCMU_PARSE_CFG_BOOL(cfg, mmap_mlock);
+
+	/* set cpuset option (applied to devices as they are added) */
+	TCMU_PARSE_CFG_STR(cfg, cpuset);
+
+	/* set event_loops option (only read at daemon start) */
+	TCMU_PARSE_CFG_INT(cfg, event_loops);
+
+	/* default QoS limits, applied to devices as they are added */
+	TCMU_PARSE_CFG_INT(cfg, qos_iops_limit);
+	TCMU_PARSE_CFG_INT(cfg, qos_bps_limit_mb);
+
 	/* add your new config options */
 }
 
@@ -352,6 +400,7 @@ static void tcmu_parse_options(struct tcmu_config *cfg, char *buf, int len)
 
 int tcmu_load_config(struct tcmu_config *cfg)
 {
+	struct tcmu_config *snap, *prev;
 	int ret = -1;
 	int fd, len;
 	char *buf;
@@ -385,7 +434,21 @@ int tcmu_load_config(struct tcmu_config *cfg)
 
 	buf[len] = '\0';
 
-	tcmu_parse_options(cfg, buf, len);
+	/* build a fresh snapshot, leaving the published one untouched */
+	snap = malloc(sizeof(*snap));
+	if (!snap)
+		goto free_buf;
+	memcpy(snap, cfg, sizeof(*snap));
+
+	tcmu_parse_options(snap, buf, len);
+
+	prev = __atomic_exchange_n(&tcmu_active_snapshot, snap,
+				   __ATOMIC_ACQ_REL);
+
+	/* retire the generation before last; see tcmu_get_config() */
+	if (tcmu_retired_snapshot && tcmu_retired_snapshot != cfg)
+		free(tcmu_retired_snapshot);
+	tcmu_retired_snapshot = prev;
 
 	ret = 0;
 free_buf:
@@ -485,7 +548,20 @@ struct tcmu_config* tcmu_initialize_config(void)
 	log_dir = getenv("TCMU_LOGDIR");
 	snprintf(cfg->def_log_dir, PATH_MAX, "%s",
 		 log_dir ? log_dir : TCMU_LOG_DIR_DEFAULT);
+
+	/* serve reads from the master until the first load publishes */
+	__atomic_store_n(&tcmu_active_snapshot, cfg, __ATOMIC_RELEASE);
 	cfg->def_log_level = TCMU_CONF_LOG_INFO;
+	cfg->def_shared_io_threads = 0;
+	cfg->def_cmdproc_spin_us = 0;
+	cfg->def_xcopy_window = 2;
+	cfg->def_read_ahead_kb = 0;
+	cfg->def_read_cache_mb = 0;
+	cfg->def_write_coalesce_kb = 0;
+	cfg->def_cpuset[0] = '\0';
+	cfg->def_event_loops = 0;
+	cfg->def_qos_iops_limit = 0;
+	cfg->def_qos_bps_limit_mb = 0;
 
 	return cfg;
 }
@@ -493,10 +569,19 @@ struct tcmu_config* tcmu_initialize_config(void)
 void tcmu_free_config(struct tcmu_config *cfg)
 {
 	struct tcmu_conf_option *option, *next;
+	struct tcmu_config *snap;
 
 	if (!cfg)
 		return;
 
+	snap = __atomic_exchange_n(&tcmu_active_snapshot, NULL,
+				   __ATOMIC_ACQ_REL);
+	if (snap && snap != cfg)
+		free(snap);
+	if (tcmu_retired_snapshot && tcmu_retired_snapshot != cfg)
+		free(tcmu_retired_snapshot);
+	tcmu_retired_snapshot = NULL;
+
 	list_for_each_safe(&tcmu_options, option, next, list) {
 		list_del(&option->list);
 
@@ -20,6 +20,45 @@ struct tcmu_config {
 	int log_level;
 	int def_log_level;
 
+	int shared_io_threads;
+	int def_shared_io_threads;
+
+	int cmdproc_spin_us;
+	int def_cmdproc_spin_us;
+
+	int xcopy_window;
+	int def_xcopy_window;
+
+	int read_ahead_kb;
+	int def_read_ahead_kb;
+
+	int read_cache_mb;
+	int def_read_cache_mb;
+
+	int write_coalesce_kb;
+	int def_write_coalesce_kb;
+
+	bool mmap_prefault;
+	bool def_mmap_prefault;
+
+	bool mmap_hugepages;
+	bool def_mmap_hugepages;
+
+	bool mmap_mlock;
+	bool def_mmap_mlock;
+
+	char cpuset[64];
+	char def_cpuset[64];
+
+	int event_loops;
+	int def_event_loops;
+
+	int qos_iops_limit;
+	int def_qos_iops_limit;
+
+	int qos_bps_limit_mb;
+	int def_qos_bps_limit_mb;
+
 	char log_dir[PATH_MAX];
 	char def_log_dir[PATH_MAX];
 
@@ -56,6 +95,13 @@ static const char *const log_level_lookup[] = {
 };
 
 struct tcmu_config* tcmu_initialize_config(void);
+
+/*
+ * Immutable snapshot of the current configuration, swapped atomically
+ * on reload. Cheap enough to consult per command; do not cache
+ * across blocking calls and do not free.
+ */
+struct tcmu_config *tcmu_get_config(void);
 void tcmu_free_config(struct tcmu_config *cfg);
 int tcmu_load_config(struct tcmu_config *cfg);
 int tcmu_watch_config(struct tcmu_config *cfg);
@@ -24,10 +24,9 @@
 #include "libtcmu.h"
 #include "string_priv.h"
 
-/* tcmu ring buffer for log */
-#define LOG_ENTRY_LEN 256 /* rb[0] is reserved for pri */
-#define LOG_MSG_LEN (LOG_ENTRY_LEN - 1) /* the length of the log message */
-#define LOG_ENTRYS (1024 * 32)
+/* tcmu per-thread log segments */
+#define LOG_MSG_LEN 255 /* the length of the log message */
+#define LOG_SEG_ENTRYS 256
 
 #define TCMU_LOG_FILENAME_MAX	32
 #define TCMU_LOG_FILENAME	"tcmu-runner.log"
@@ -47,17 +46,41 @@ struct log_buf {
 	pthread_cond_t cond;
 	pthread_mutex_t lock;
 
-	bool thread_active;
-
-	unsigned int head;
-	unsigned int tail;
-	char buf[LOG_ENTRYS][LOG_ENTRY_LEN];
 	struct log_output *syslog_out;
 	struct log_output *file_out;
 	pthread_mutex_t file_out_lock;
 	pthread_t thread_id;
 };
 
+/*
+ * Each thread owns an SPSC log segment: the producer formats the
+ * message body and stores the raw prefix fields with no lock taken,
+ * and the background thread drains all segments, doing the
+ * timestamp/prefix formatting off the data path. Segments of dead
+ * threads are parked for reuse, never freed while logging runs.
+ */
+struct log_entry {
+	uint8_t pri;
+	bool has_dev;
+	int linenr;
+	const char *funcname;
+	char subtype[16];
+	char dev_name[64];
+	char msg[LOG_MSG_LEN];
+};
+
+struct log_seg {
+	struct log_seg *next;
+	bool in_use;
+	unsigned int head;	/* free running, producer owned */
+	unsigned int tail;	/* free running, consumer owned */
+	struct log_entry rb[LOG_SEG_ENTRYS];
+};
+
+static struct log_seg *log_segs;
+static pthread_key_t log_seg_key;
+static __thread struct log_seg *tcmu_log_seg;
+
 static int tcmu_log_level = TCMU_LOG_INFO;
 static struct log_buf *tcmu_logbuf;
 
@@ -88,7 +111,8 @@ static inline int to_syslog_level(int level)
 /* get the log level of tcmu-runner */
 unsigned int tcmu_get_log_level(void)
 {
-	return tcmu_log_level;
+	/* relaxed: a disabled level costs one predictable branch */
+	return __atomic_load_n(&tcmu_log_level, __ATOMIC_RELAXED);
 }
 
 void tcmu_set_log_level(int level)
@@ -104,46 +128,8 @@ void tcmu_set_log_level(int level)
 		level = TCMU_CONF_LOG_LEVEL_MIN;
 
 	tcmu_crit("log level now is %s\n", log_level_lookup[level]);
-	tcmu_log_level = to_syslog_level(level);
-}
-
-static inline uint8_t rb_get_pri(struct log_buf *logbuf, unsigned int cur)
-{
-	return logbuf->buf[cur][0];
-}
-
-static inline void rb_set_pri(struct log_buf *logbuf, unsigned int cur, uint8_t pri)
-{
-	logbuf->buf[cur][0] = (char)pri;
-}
-
-static inline char *rb_get_msg(struct log_buf *logbuf, unsigned int cur)
-{
-	return logbuf->buf[cur] + 1;
-}
-
-static inline bool rb_is_empty(struct log_buf *logbuf)
-{
-	return logbuf->tail == logbuf->head;
-}
-
-static inline bool rb_is_full(struct log_buf *logbuf)
-{
-	return logbuf->tail == (logbuf->head + 1) % LOG_ENTRYS;
-}
-
-static inline void rb_update_tail(struct log_buf *logbuf)
-{
-	logbuf->tail = (logbuf->tail + 1) % LOG_ENTRYS;
-}
-
-static inline void rb_update_head(struct log_buf *logbuf)
-{
-	/* when the ring buffer is full, the oldest log will be dropped */
-	if (rb_is_full(logbuf))
-		rb_update_tail(logbuf);
-
-	logbuf->head = (logbuf->head + 1) % LOG_ENTRYS;
+	__atomic_store_n(&tcmu_log_level, to_syslog_level(level),
+			 __ATOMIC_RELAXED);
 }
 
 static void log_cleanup_output(struct log_output *output)
@@ -164,6 +150,13 @@ static void tcmu_log_dir_free(void)
 static void log_cleanup(void *arg)
 {
 	struct log_buf *logbuf = arg;
+	struct log_seg *seg;
+
+	while ((seg = log_segs)) {
+		log_segs = seg->next;
+		free(seg);
+	}
+	pthread_key_delete(log_seg_key);
 
 	pthread_cond_destroy(&logbuf->cond);
 	pthread_mutex_destroy(&logbuf->lock);
@@ -192,41 +185,67 @@ static void log_output(struct log_buf *logbuf, int pri, const char *msg,
 	output->output_fn(pri, timestamp, msg, output->data);
 }
 
-static void log_queue_msg(struct log_buf *logbuf, int pri, char *buf)
+static void cleanup_file_out_lock(void *arg)
 {
-	unsigned int head;
-	char *msg;
-
-	pthread_mutex_lock(&logbuf->lock);
+	struct log_buf *logbuf = arg;
 
-	head = logbuf->head;
-	rb_set_pri(logbuf, head, pri);
-	msg = rb_get_msg(logbuf, head);
-	memcpy(msg, buf, LOG_MSG_LEN);
-	rb_update_head(logbuf);
+	pthread_mutex_unlock(&logbuf->file_out_lock);
+}
 
-	if (logbuf->thread_active == false)
-		pthread_cond_signal(&logbuf->cond);
+static void log_seg_release(void *arg)
+{
+	struct log_seg *seg = arg;
 
-	pthread_mutex_unlock(&logbuf->lock);
+	/* park the dead thread's segment for reuse */
+	__atomic_store_n(&seg->in_use, false, __ATOMIC_RELEASE);
 }
 
-static void cleanup_file_out_lock(void *arg)
+static struct log_seg *log_seg_get(void)
 {
-	struct log_buf *logbuf = arg;
+	struct log_seg *seg = tcmu_log_seg, *old;
+	bool expected;
 
-	pthread_mutex_unlock(&logbuf->file_out_lock);
+	if (seg)
+		return seg;
+
+	/* reuse a segment left behind by a dead thread */
+	for (seg = __atomic_load_n(&log_segs, __ATOMIC_ACQUIRE); seg;
+	     seg = seg->next) {
+		expected = false;
+		if (__atomic_compare_exchange_n(&seg->in_use, &expected, true,
+						false, __ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED))
+			goto found;
+	}
+
+	seg = calloc(1, sizeof(*seg));
+	if (!seg)
+		return NULL;
+	seg->in_use = true;
+
+	old = __atomic_load_n(&log_segs, __ATOMIC_RELAXED);
+	do {
+		seg->next = old;
+	} while (!__atomic_compare_exchange_n(&log_segs, &old, seg, false,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+found:
+	tcmu_log_seg = seg;
+	pthread_setspecific(log_seg_key, seg);
+	return seg;
 }
 
 static void
 log_internal(int pri, struct tcmu_device *dev, const char *funcname,
 	     int linenr, const char *fmt, va_list args)
 {
-	char buf[LOG_MSG_LEN];
-	int n;
 	struct tcmulib_handler *handler;
+	struct log_entry *ent;
+	struct log_seg *seg;
+	unsigned int head;
 
-	if (pri > tcmu_log_level)
+	if (pri > __atomic_load_n(&tcmu_log_level, __ATOMIC_RELAXED))
 		return;
 
 	if (!fmt)
@@ -238,31 +257,42 @@ log_internal(int pri, struct tcmu_device *dev, const char *funcname,
 		return;
 	}
 
-	/* Format the log msg */
-	if (dev) {
-		handler = tcmu_dev_get_handler(dev);
-		n = sprintf(buf, "%s:%d %s/%s: ", funcname, linenr,
-		            handler ? handler->subtype: "",
-		            dev ? dev->tcm_dev_name: "");
-	} else {
-		n = sprintf(buf, "%s:%d: ", funcname, linenr);
-	}
+	seg = log_seg_get();
+	if (!seg)
+		return;
 
-	vsnprintf(buf + n, LOG_MSG_LEN - n, fmt, args);
+	head = seg->head;
+	if (head - __atomic_load_n(&seg->tail, __ATOMIC_ACQUIRE) >=
+	    LOG_SEG_ENTRYS)
+		/* segment full, drop the newest message */
+		return;
 
 	/*
-	 * Avoid overflowing the log buf with SCSI CDBs.
+	 * Only the message body is formatted here; the timestamp and
+	 * the funcname/dev prefix are rendered by the log thread.
 	 */
-	if (pri < TCMU_LOG_DEBUG_SCSI_CMD)
-		log_queue_msg(tcmu_logbuf, pri, buf);
-
-	pthread_cleanup_push(cleanup_file_out_lock, tcmu_logbuf);
-	pthread_mutex_lock(&tcmu_logbuf->file_out_lock);
+	ent = &seg->rb[head % LOG_SEG_ENTRYS];
+	ent->pri = pri;
+	ent->funcname = funcname;
+	ent->linenr = linenr;
+	ent->has_dev = !!dev;
+	if (dev) {
+		handler = tcmu_dev_get_handler(dev);
+		snprintf(ent->subtype, sizeof(ent->subtype), "%s",
+			 handler ? handler->subtype : "");
+		snprintf(ent->dev_name, sizeof(ent->dev_name), "%s",
+			 dev->tcm_dev_name);
+	}
+	vsnprintf(ent->msg, sizeof(ent->msg), fmt, args);
 
-	log_output(tcmu_logbuf, pri, buf, tcmu_logbuf->file_out);
+	__atomic_store_n(&seg->head, head + 1, __ATOMIC_RELEASE);
 
-	pthread_mutex_unlock(&tcmu_logbuf->file_out_lock);
-	pthread_cleanup_pop(0);
+	/* get urgent messages out promptly */
+	if (pri <= TCMU_LOG_ERROR) {
+		pthread_mutex_lock(&tcmu_logbuf->lock);
+		pthread_cond_signal(&tcmu_logbuf->cond);
+		pthread_mutex_unlock(&tcmu_logbuf->lock);
+	}
 }
 
 void tcmu_crit_message(struct tcmu_device *dev, const char *funcname,
@@ -486,51 +516,82 @@ static int create_file_output(struct log_buf *logbuf, int pri,
 	return 0;
 }
 
-static bool log_dequeue_msg(struct log_buf *logbuf)
+static void log_output_entry(struct log_buf *logbuf, struct log_entry *ent)
 {
-	unsigned int tail;
-	uint8_t pri;
-	char *msg, buf[LOG_MSG_LEN];
-
-	pthread_mutex_lock(&logbuf->lock);
-	if (rb_is_empty(logbuf)) {
-		logbuf->thread_active = false;
-		pthread_mutex_unlock(&logbuf->lock);
-		return false;
-	}
+	char buf[LOG_MSG_LEN + 128];
+	int n;
 
-	tail = logbuf->tail;
-	pri = rb_get_pri(logbuf, tail);
-	msg = rb_get_msg(logbuf, tail);
-	memcpy(buf, msg, LOG_MSG_LEN);
-	rb_update_tail(logbuf);
-	pthread_mutex_unlock(&logbuf->lock);
+	/* deferred prefix formatting happens here, off the data path */
+	if (ent->has_dev)
+		n = sprintf(buf, "%s:%d %s/%s: ", ent->funcname, ent->linenr,
+			    ent->subtype, ent->dev_name);
+	else
+		n = sprintf(buf, "%s:%d: ", ent->funcname, ent->linenr);
+	snprintf(buf + n, sizeof(buf) - n, "%s", ent->msg);
 
 	/*
-	 * This may block due to rsyslog and syslog-ng, etc.
-	 * And the log productors could still insert their log
-	 * messages into the ring buffer without blocking. But
-	 * the ring buffer may lose some old log rbs if the
-	 * ring buffer is full.
+	 * This may block due to rsyslog and syslog-ng, etc. The log
+	 * producers keep inserting into their segments without
+	 * blocking, dropping the newest entries if a segment fills.
+	 *
+	 * Avoid overflowing syslog with SCSI CDBs.
 	 */
-	log_output(logbuf, pri, buf, logbuf->syslog_out);
+	if (ent->pri < TCMU_LOG_DEBUG_SCSI_CMD)
+		log_output(logbuf, ent->pri, buf, logbuf->syslog_out);
 
-	return true;
+	pthread_mutex_lock(&logbuf->file_out_lock);
+	log_output(logbuf, ent->pri, buf, logbuf->file_out);
+	pthread_mutex_unlock(&logbuf->file_out_lock);
+}
+
+static bool log_drain_segs(struct log_buf *logbuf)
+{
+	struct log_seg *seg;
+	struct log_entry *ent;
+	unsigned int tail;
+	bool drained = false;
+
+	for (seg = __atomic_load_n(&log_segs, __ATOMIC_ACQUIRE); seg;
+	     seg = seg->next) {
+		while (1) {
+			tail = seg->tail;
+			if (tail == __atomic_load_n(&seg->head,
+						    __ATOMIC_ACQUIRE))
+				break;
+
+			ent = &seg->rb[tail % LOG_SEG_ENTRYS];
+			log_output_entry(logbuf, ent);
+			__atomic_store_n(&seg->tail, tail + 1,
+					 __ATOMIC_RELEASE);
+			drained = true;
+		}
+	}
+
+	return drained;
 }
 
 static void *log_thread_start(void *arg)
 {
+	struct timespec ts;
+
 	tcmu_set_thread_name("logger", NULL);
 
 	pthread_cleanup_push(log_cleanup, arg);
 
 	while (1) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100 * 1000 * 1000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
 		pthread_mutex_lock(&tcmu_logbuf->lock);
-		pthread_cond_wait(&tcmu_logbuf->cond, &tcmu_logbuf->lock);
-		tcmu_logbuf->thread_active = true;
+		pthread_cond_timedwait(&tcmu_logbuf->cond,
+				       &tcmu_logbuf->lock, &ts);
 		pthread_mutex_unlock(&tcmu_logbuf->lock);
 
-		while (log_dequeue_msg(tcmu_logbuf));
+		while (log_drain_segs(tcmu_logbuf));
 	}
 
 	pthread_cleanup_pop(1);
@@ -671,13 +732,14 @@ int tcmu_setup_log(char *log_dir)
 		return ret;
 	}
 
+	ret = pthread_key_create(&log_seg_key, log_seg_release);
+	if (ret)
+		goto free_log_dir;
+
 	logbuf = calloc(1, sizeof(struct log_buf));
 	if (!logbuf)
 		goto free_log_dir;
 
-	logbuf->thread_active = false;
-	logbuf->head = 0;
-	logbuf->tail = 0;
 	pthread_cond_init(&logbuf->cond, NULL);
 	pthread_mutex_init(&logbuf->lock, NULL);
 	pthread_mutex_init(&logbuf->file_out_lock, NULL);
@@ -23,6 +23,14 @@
 
 #define KERN_IFACE_VER 2
 
+struct tcmu_cmd_blk;
+
+/* one cached configfs attribute (attrib/<name>) */
+struct tcmu_cfgfs_cached_attr {
+	char *name;
+	int val;
+};
+
 // The full (private) declaration
 struct tcmulib_context {
 	darray(struct tcmulib_handler) handlers;
@@ -30,6 +38,14 @@ struct tcmulib_context {
 	/* Just keep ptrs b/c we hand these to clients */
 	darray(struct tcmu_device*) devices;
 
+	/* guards ->devices during the parallel bring-up phase */
+	pthread_mutex_t dev_lock;
+
+	/* netlink ops run on these workers, keyed by device name */
+	struct tcmu_nl_worker *nl_workers;
+	int nr_nl_workers;
+	pthread_mutex_t nl_send_lock;
+
 	struct nl_sock *nl_sock;
 
 	GDBusConnection *connection;
@@ -64,6 +80,25 @@ struct tcmu_device {
 	struct tcmulib_handler *handler;
 	struct tcmulib_context *ctx;
 
+	/*
+	 * Freelist of command blocks (tcmulib_cmd + iovec array + cdb
+	 * + handler area) recycled at completion, so steady state
+	 * fetches allocate nothing (see tcmu_cmd_blk_get).
+	 */
+	struct tcmu_cmd_blk *free_cmd_blks;
+	pthread_spinlock_t cmd_blk_lock;
+
+	/*
+	 * Snapshot of configfs attributes so hot paths read from
+	 * memory instead of doing an open/read/close per call.
+	 * Invalidated on netlink reconfig (see configfs.c).
+	 */
+	struct {
+		pthread_mutex_t lock;
+		darray(struct tcmu_cfgfs_cached_attr) attrs;
+		char *wwn;
+	} cfgfs_cache;
+
 	void *hm_private; /* private ptr for handler module */
 };
 
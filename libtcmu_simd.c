@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+
+#include "libtcmu_simd.h"
+
+static size_t tcmu_first_mismatch_scalar(const void *a, const void *b,
+					 size_t len)
+{
+	const unsigned char *pa = a, *pb = b;
+	size_t pos;
+
+	if (!memcmp(a, b, len))
+		return len;
+
+	/*
+	 * Data differed, this is assumed to be 'rare' so use a much
+	 * more expensive byte-by-byte comparison to find out at which
+	 * offset the data differs.
+	 */
+	for (pos = 0; pos < len && pa[pos] == pb[pos]; pos++)
+		;
+
+	return pos;
+}
+
+static void tcmu_copy_nt_scalar(void *dst, const void *src, size_t len)
+{
+	memcpy(dst, src, len);
+}
+
+static bool tcmu_zeroed_scalar(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const uint64_t *w;
+
+	while (len && ((uintptr_t)p & 7)) {
+		if (*p++)
+			return false;
+		len--;
+	}
+
+	w = (const uint64_t *)p;
+	while (len >= 8) {
+		if (*w++)
+			return false;
+		len -= 8;
+	}
+
+	p = (const unsigned char *)w;
+	while (len) {
+		if (*p++)
+			return false;
+		len--;
+	}
+
+	return true;
+}
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static size_t tcmu_first_mismatch_avx2(const void *a, const void *b,
+				       size_t len)
+{
+	const unsigned char *pa = a, *pb = b;
+	size_t off = 0;
+
+	while (len - off >= 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(pa + off));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(pb + off));
+		uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+
+		if (eq != 0xffffffffu)
+			return off + __builtin_ctz(~eq);
+		off += 32;
+	}
+
+	return off + tcmu_first_mismatch_scalar(pa + off, pb + off,
+						len - off);
+}
+
+__attribute__((target("avx2")))
+static void tcmu_copy_nt_avx2(void *dst, const void *src, size_t len)
+{
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+
+	/* line the destination up for the streaming stores */
+	while (len && ((uintptr_t)d & 31)) {
+		*d++ = *s++;
+		len--;
+	}
+
+	while (len >= 32) {
+		_mm256_stream_si256((__m256i *)d,
+				    _mm256_loadu_si256((const __m256i *)s));
+		d += 32;
+		s += 32;
+		len -= 32;
+	}
+
+	/* order the streaming stores before completion is reported */
+	_mm_sfence();
+
+	if (len)
+		memcpy(d, s, len);
+}
+
+__attribute__((target("avx2")))
+static bool tcmu_zeroed_avx2(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	__m256i acc = _mm256_setzero_si256();
+
+	while (len >= 32) {
+		acc = _mm256_or_si256(acc,
+				      _mm256_loadu_si256((const __m256i *)p));
+		p += 32;
+		len -= 32;
+	}
+
+	if (!_mm256_testz_si256(acc, acc))
+		return false;
+
+	return tcmu_zeroed_scalar(p, len);
+}
+
+#elif defined(__aarch64__)
+
+#include <arm_neon.h>
+
+static size_t tcmu_first_mismatch_neon(const void *a, const void *b,
+				       size_t len)
+{
+	const unsigned char *pa = a, *pb = b;
+	size_t off = 0;
+
+	while (len - off >= 16) {
+		uint8x16_t va = vld1q_u8(pa + off);
+		uint8x16_t vb = vld1q_u8(pb + off);
+
+		if (vmaxvq_u8(veorq_u8(va, vb)))
+			break;
+		off += 16;
+	}
+
+	return off + tcmu_first_mismatch_scalar(pa + off, pb + off,
+						len - off);
+}
+
+static bool tcmu_zeroed_neon(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint8x16_t acc = vdupq_n_u8(0);
+
+	while (len >= 16) {
+		acc = vorrq_u8(acc, vld1q_u8(p));
+		p += 16;
+		len -= 16;
+	}
+
+	if (vmaxvq_u8(acc))
+		return false;
+
+	return tcmu_zeroed_scalar(p, len);
+}
+
+#endif
+
+size_t (*tcmu_first_mismatch)(const void *a, const void *b, size_t len) =
+	tcmu_first_mismatch_scalar;
+bool (*tcmu_zeroed)(const void *buf, size_t len) = tcmu_zeroed_scalar;
+/* aarch64 has no true non-temporal store, cached copies stay */
+void (*tcmu_copy_nt)(void *dst, const void *src, size_t len) =
+	tcmu_copy_nt_scalar;
+
+static void __attribute__((constructor)) tcmu_simd_select(void)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2")) {
+		tcmu_first_mismatch = tcmu_first_mismatch_avx2;
+		tcmu_zeroed = tcmu_zeroed_avx2;
+		tcmu_copy_nt = tcmu_copy_nt_avx2;
+	}
+#elif defined(__aarch64__)
+	/* NEON is architecturally mandatory */
+	tcmu_first_mismatch = tcmu_first_mismatch_neon;
+	tcmu_zeroed = tcmu_zeroed_neon;
+#endif
+}
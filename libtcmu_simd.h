@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __LIBTCMU_SIMD_H
+#define __LIBTCMU_SIMD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Vector kernels for the data-path byte scans: first-mismatch compare
+ * (CAW and WRITE VERIFY need the exact miscompare offset for the
+ * sense data) and all-zero detection (WRITE SAME zero patterns). The
+ * best implementation for the host CPU is selected once at startup,
+ * callers always go through these entry points.
+ */
+
+/* returns the offset of the first differing byte, or len if equal */
+extern size_t (*tcmu_first_mismatch)(const void *a, const void *b, size_t len);
+
+/* returns true if buf is all zero bytes */
+extern bool (*tcmu_zeroed)(const void *buf, size_t len);
+
+/*
+ * Copy with non-temporal stores where the CPU supports them, so
+ * multi-megabyte transfers stop evicting the whole LLC. Callers
+ * should only switch to it for transfers of at least
+ * TCMU_NT_COPY_MIN bytes; below that, cached stores win.
+ */
+#define TCMU_NT_COPY_MIN (2UL << 20)
+extern void (*tcmu_copy_nt)(void *dst, const void *src, size_t len);
+
+#endif /* __LIBTCMU_SIMD_H */
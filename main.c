@@ -30,6 +30,7 @@
 #include <gio/gio.h>
 #include <getopt.h>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <time.h>
 #include <scsi/scsi.h>
 #include <sys/time.h>
@@ -52,10 +53,15 @@
 
 #define TCMU_LOCK_FILE   "/run/tcmu.lock"
 
+/* max ring entries fetched and completed per dispatch pass */
+#define TCMUR_CMD_BATCH_SIZE 64
+
 static char *handler_path = DEFAULT_HANDLER_PATH;
 
 static struct tcmu_config *tcmu_cfg;
 
+static void tcmur_tune_device(struct tcmu_device *dev);
+
 darray(struct tcmur_handler *) g_runner_handlers = darray_new();
 
 struct tcmur_handler *tcmu_get_runner_handler(struct tcmu_device *dev)
@@ -246,6 +252,47 @@ gboolean tcmulib_callback(GIOChannel *source,
 
 static GDBusObjectManagerServer *manager = NULL;
 
+static struct tcmulib_context *g_tcmulib_context;
+
+struct stats_iter {
+	struct tcmur_handler *handler;
+	GString *str;
+};
+
+static void stats_append_dev(struct tcmu_device *dev, void *data)
+{
+	struct stats_iter *iter = data;
+	char buf[8192];
+
+	if (tcmu_get_runner_handler(dev) != iter->handler)
+		return;
+
+	if (tcmur_stats_format(dev, buf, sizeof(buf)) > 0)
+		g_string_append(iter->str, buf);
+}
+
+static gboolean
+on_get_stats(TCMUService1 *interface,
+	     GDBusMethodInvocation *invocation,
+	     gpointer user_data)
+{
+	struct tcmur_handler *handler = user_data;
+	struct stats_iter iter;
+
+	iter.handler = handler;
+	iter.str = g_string_new(NULL);
+
+	if (g_tcmulib_context)
+		tcmulib_foreach_device(g_tcmulib_context, stats_append_dev,
+				       &iter);
+
+	g_dbus_method_invocation_return_value(invocation,
+			g_variant_new("(s)", iter.str->str));
+	g_string_free(iter.str, TRUE);
+
+	return TRUE;
+}
+
 static gboolean
 on_check_config(TCMUService1 *interface,
 		GDBusMethodInvocation *invocation,
@@ -287,6 +334,10 @@ dbus_export_handler(struct tcmur_handler *handler, GCallback check_config)
 			 "handle-check-config",
 			 check_config,
 			 handler); /* user_data */
+	g_signal_connect(interface,
+			 "handle-get-stats",
+			 G_CALLBACK(on_get_stats),
+			 handler); /* user_data */
 	tcmuservice1_set_config_desc(interface, handler->cfg_desc);
 	g_dbus_object_manager_server_export(manager, G_DBUS_OBJECT_SKELETON(object));
 	g_object_unref(object);
@@ -672,8 +723,7 @@ static bool get_next_cmd_timeout(struct tcmu_device *dev,
 				 struct timespec *tmo)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	int run_time, cmd_tmo = rdev->cmd_time_out;
-	struct tcmur_cmd *tcmur_cmd;
+	int i, slot, cmd_tmo = rdev->cmd_time_out;
 	bool has_timeout = false;
 
 	if (!cmd_tmo)
@@ -681,28 +731,23 @@ static bool get_next_cmd_timeout(struct tcmu_device *dev,
 
 	memset(tmo, 0, sizeof(*tmo));
 
+	/*
+	 * Sweep the wheel for the first armed bucket. A bucket further
+	 * out than the timeout horizon holds an already overdue (or
+	 * wrapped) command, so force an immediate recheck for it.
+	 */
 	pthread_spin_lock(&rdev->lock);
-	list_for_each(&rdev->cmds_list, tcmur_cmd, cmds_list_entry) {
-		if (tcmur_cmd->timed_out)
+	for (i = 0; i < TCMUR_TIMEOUT_WHEEL_SLOTS; i++) {
+		slot = (curr_time->tv_sec + i) % TCMUR_TIMEOUT_WHEEL_SLOTS;
+		if (list_empty(&rdev->timeout_wheel[slot]))
 			continue;
 
 		has_timeout = true;
-		run_time = difftime(curr_time->tv_sec,
-				    tcmur_cmd->start_time.tv_sec);
-		if (cmd_tmo > run_time) {
-			tmo->tv_sec = cmd_tmo - run_time;
-		} else {
-			/*
-			 * We do not do a clock call for every command, so
-			 * cmds can time out while we were processing new
-			 * cmds. Force a recheck.
-			 */
-			tmo->tv_sec = 0;
-		}
+		tmo->tv_sec = i > cmd_tmo ? 0 : i;
 
-		tcmu_dev_dbg(dev, "Next cmd id %hu timeout in %"PRIdMAX" secs. Current time %"PRIdMAX". Start time %"PRIdMAX"\n",
-			     tcmur_cmd->lib_cmd->cmd_id, (intmax_t)tmo->tv_sec,
-			     (intmax_t)curr_time->tv_sec, (intmax_t)tcmur_cmd->start_time.tv_sec);
+		tcmu_dev_dbg(dev, "Next cmd timeout in %"PRIdMAX" secs. Current time %"PRIdMAX"\n",
+			     (intmax_t)tmo->tv_sec,
+			     (intmax_t)curr_time->tv_sec);
 		break;
 	}
 	pthread_spin_unlock(&rdev->lock);
@@ -710,15 +755,44 @@ static bool get_next_cmd_timeout(struct tcmu_device *dev,
 	return has_timeout;
 }
 
+/* called with rdev->lock held */
+static void expire_cmd(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+{
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+	uint8_t *cdb;
+
+	if (tcmu_get_log_level() == TCMU_LOG_DEBUG_SCSI_CMD) {
+		tcmu_cdb_print_info(dev, cmd, "timed out.");
+	} else {
+		cdb = cmd->cdb;
+		tcmu_dev_info(dev, "Command %hu SCSI CDB 0x%x at LBA %"PRIu64" for %u blocks timed out.\n",
+			      cmd->cmd_id, cdb[0],
+			      tcmu_cdb_get_lba(cdb),
+			      tcmu_cdb_get_xfer_length(cdb));
+	}
+
+	tcmur_cmd->timed_out = true;
+
+	/* leave the node usable for the completion's list_del */
+	list_del(&tcmur_cmd->cmds_list_entry);
+	list_node_init(&tcmur_cmd->cmds_list_entry);
+
+	/*
+	 * These time outs are only currently used for diagnostic
+	 * purposes right now, so we do not want to escalate the
+	 * error handler and just return true here.
+	 */
+	tcmu_notify_cmd_timed_out(dev);
+}
+
 static void check_for_timed_out_cmds(struct tcmu_device *dev)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	int cmd_tmo = rdev->cmd_time_out;
-	struct tcmur_cmd *tcmur_cmd;
+	struct tcmur_cmd *tcmur_cmd, *next_cmd;
 	struct timespec curr_time;
-	struct tcmulib_cmd *cmd;
-	int run_time;
-	uint8_t *cdb;
+	int tick, nticks, slot;
+	time_t now;
 
 	if (!cmd_tmo)
 		return;
@@ -729,35 +803,31 @@ static void check_for_timed_out_cmds(struct tcmu_device *dev)
 		return;
 
 	pthread_spin_lock(&rdev->lock);
-	list_for_each(&rdev->cmds_list, tcmur_cmd, cmds_list_entry) {
-		if (tcmur_cmd->timed_out)
-			continue;
 
-		run_time = difftime(curr_time.tv_sec,
-				    tcmur_cmd->start_time.tv_sec);
-		if (run_time < cmd_tmo)
-			continue;
+	now = curr_time.tv_sec;
+	if (!rdev->timeout_last_check)
+		rdev->timeout_last_check = now - 1;
 
-		cmd = tcmur_cmd->lib_cmd;
+	nticks = now - rdev->timeout_last_check;
+	if (nticks > TCMUR_TIMEOUT_WHEEL_SLOTS)
+		nticks = TCMUR_TIMEOUT_WHEEL_SLOTS;
 
-		if (tcmu_get_log_level() == TCMU_LOG_DEBUG_SCSI_CMD) {
-			tcmu_cdb_print_info(dev, cmd, "timed out.");
-		} else {
-			cdb = cmd->cdb;
-			tcmu_dev_info(dev, "Command %hu SCSI CDB 0x%x at LBA %"PRIu64" for %u blocks timed out.\n",
-				      cmd->cmd_id, cdb[0],
-				      tcmu_cdb_get_lba(cdb),
-				      tcmu_cdb_get_xfer_length(cdb));
-		}
+	/* only the buckets whose tick passed since the last check */
+	for (tick = 1; tick <= nticks; tick++) {
+		slot = (rdev->timeout_last_check + tick) %
+		       TCMUR_TIMEOUT_WHEEL_SLOTS;
 
-		tcmur_cmd->timed_out = true;
-		/*
-		 * These time outs are only currently used for diagnostic
-		 * purposes right now, so we do not want to escalate the
-		 * error handler and just return true here.
-		 */
-	       tcmu_notify_cmd_timed_out(dev);
+		list_for_each_safe(&rdev->timeout_wheel[slot], tcmur_cmd,
+				   next_cmd, cmds_list_entry) {
+			if (tcmur_cmd->start_time.tv_sec + cmd_tmo > now)
+				/* wrapped entry, not due for another lap */
+				continue;
+
+			expire_cmd(dev, tcmur_cmd);
+		}
 	}
+	rdev->timeout_last_check = now;
+
 	pthread_spin_unlock(&rdev->lock);
 }
 
@@ -772,42 +842,105 @@ static void tcmur_tcmulib_cmd_start(struct tcmu_device *dev,
 	tcmur_cmd->lib_cmd = cmd;
 	list_node_init(&tcmur_cmd->cmds_list_entry);
 
+	tcmur_stats_cmd_start(dev, cmd);
+
 	if (rdev->cmd_time_out) {
+		int slot;
+
 		tcmur_cmd->start_time.tv_sec = curr_time->tv_sec;
+		slot = (curr_time->tv_sec + rdev->cmd_time_out) %
+		       TCMUR_TIMEOUT_WHEEL_SLOTS;
 
 		pthread_spin_lock(&rdev->lock);
-		list_add_tail(&rdev->cmds_list, &tcmur_cmd->cmds_list_entry);
+		list_add_tail(&rdev->timeout_wheel[slot],
+			      &tcmur_cmd->cmds_list_entry);
 		pthread_spin_unlock(&rdev->lock);
 	}
 }
 
-static void *tcmur_cmdproc_thread(void *arg)
+/*
+ * Hybrid NAPI-style polling: after the ring runs dry, spin on the
+ * mailbox head for a bounded window before falling back to sleeping
+ * in ppoll(), saving the wakeup syscall and uio interrupt round-trip
+ * when the next command arrives quickly. Returns true if a command
+ * showed up within the window.
+ */
+static bool tcmur_spin_for_cmds(struct tcmu_device *dev, int spin_us)
 {
-	struct tcmu_device *dev = arg;
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
-	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	struct pollfd pfd;
-	int ret;
-	bool dev_stopping = false;
-
-	tcmu_set_thread_name("cmdproc", dev);
+	uint64_t elapsed_ns, limit_ns = (uint64_t)spin_us * 1000;
+	struct timespec start, now;
 
-	pthread_cleanup_push(tcmur_stop_device, dev);
+	if (clock_gettime(CLOCK_MONOTONIC, &start))
+		return false;
 
 	while (1) {
-		int completed = 0;
-		struct tcmulib_cmd *cmd;
-		struct timespec tmo, curr_time;
-		bool set_tmo;
+		if (tcmulib_command_pending(dev))
+			return true;
 
-		tcmulib_processing_start(dev);
+		if (clock_gettime(CLOCK_MONOTONIC, &now))
+			return false;
 
-		if (rdev->cmd_time_out)
-			tcmur_get_time(dev, &curr_time);
+		elapsed_ns = (now.tv_sec - start.tv_sec) * 1000000000ULL +
+			     (now.tv_nsec - start.tv_nsec);
+		if (elapsed_ns >= limit_ns)
+			return false;
+
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+}
+
+/*
+ * Touch every page of the uio mapping from the device's own cmdproc
+ * thread: the first I/Os stop paying minor faults, and with thread
+ * pinning the first-touch policy places the pages on the right NUMA
+ * node.
+ */
+static void tcmur_prefault_mmap(struct tcmu_device *dev)
+{
+	volatile const char *p;
+	size_t len, off;
+	void *base;
+	char *name;
+	long pg_size = sysconf(_SC_PAGESIZE);
+
+	name = tcmu_dev_get_memory_info(dev, &base, &len, NULL);
+	if (!name)
+		return;
+	free(name);
 
-		while (!dev_stopping &&
-		       (cmd = tcmulib_get_next_command(dev,
-					sizeof(struct tcmur_cmd))) != NULL) {
+	p = base;
+	for (off = 0; off < len; off += pg_size)
+		(void)p[off];
+
+	tcmu_dev_dbg(dev, "prefaulted %zu bytes of uio mapping\n", len);
+}
+
+/* one full drain-and-dispatch pass over the device's ring */
+static void tcmur_dispatch_ring(struct tcmu_device *dev, bool dev_stopping)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmulib_cmd *cmds[TCMUR_CMD_BATCH_SIZE];
+	struct tcmulib_cmd *done[TCMUR_CMD_BATCH_SIZE];
+	int done_rcs[TCMUR_CMD_BATCH_SIZE];
+	struct timespec curr_time;
+	int i, nr_cmds, nr_done, ret;
+
+	tcmulib_processing_start(dev);
+
+	if (rdev->cmd_time_out)
+		tcmur_get_time(dev, &curr_time);
+
+	while (!dev_stopping &&
+	       (nr_cmds = tcmulib_get_next_commands(dev, cmds,
+				TCMUR_CMD_BATCH_SIZE,
+				sizeof(struct tcmur_cmd)))) {
+		nr_done = 0;
+
+		for (i = 0; i < nr_cmds; i++) {
+			struct tcmulib_cmd *cmd = cmds[i];
 
 			tcmur_tcmulib_cmd_start(dev, cmd, &curr_time);
 
@@ -830,13 +963,231 @@ static void *tcmur_cmdproc_thread(void *arg)
 			 *			   and on errors when calling tcmur handler.
 			 */
 			if (ret != TCMU_STS_ASYNC_HANDLED) {
-				completed = 1;
-				tcmur_tcmulib_cmd_complete(dev, cmd, ret);
+				done[nr_done] = cmd;
+				done_rcs[nr_done++] = ret;
 			}
 		}
 
-		if (completed)
-			tcmulib_processing_complete(dev);
+		/* one tail update and one doorbell for the batch */
+		tcmur_tcmulib_cmds_complete(dev, done, done_rcs, nr_done);
+	}
+}
+
+/*
+ * Shared event-loop mode (event_loops in tcmu.conf): a small set of
+ * epoll loops own the uio fds of all devices instead of one blocking
+ * cmdproc thread per device, dispatching through the same ring path.
+ * Devices are assigned round-robin at add time.
+ */
+struct tcmur_evloop {
+	pthread_t thread;
+	int epoll_fd;
+	pthread_mutex_t lock;
+	darray(struct tcmu_device *) devs;
+};
+
+static struct tcmur_evloop *tcmur_evloops;
+static int tcmur_nr_evloops;
+static unsigned int tcmur_next_evloop;
+
+static void *tcmur_evloop_thread(void *arg)
+{
+	struct tcmur_evloop *loop = arg;
+	struct epoll_event events[16];
+	struct tcmu_device **dev_ptr;
+	struct tcmu_device *dev;
+	struct tcmur_device *rdev;
+	bool stopping;
+	int i, n;
+
+	tcmu_set_thread_name("evloop", NULL);
+
+	while (1) {
+		/* the 1s timeout drives the command timeout wheel */
+		n = epoll_wait(loop->epoll_fd, events, ARRAY_SIZE(events),
+			       1000);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			tcmu_err("epoll_wait failed: %m\n");
+			break;
+		}
+
+		if (!n) {
+			pthread_mutex_lock(&loop->lock);
+			darray_foreach(dev_ptr, loop->devs)
+				check_for_timed_out_cmds(*dev_ptr);
+			pthread_mutex_unlock(&loop->lock);
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			dev = events[i].data.ptr;
+			rdev = tcmu_dev_get_private(dev);
+
+			/*
+			 * The busy flag is taken under the same lock
+			 * hold as the STOPPING check, so removal either
+			 * sees us busy and waits, or we see STOPPING
+			 * and never touch the dying device.
+			 */
+			pthread_mutex_lock(&rdev->state_lock);
+			stopping = rdev->flags & TCMUR_DEV_FLAG_STOPPING;
+			if (!stopping)
+				rdev->evloop_busy = true;
+			pthread_mutex_unlock(&rdev->state_lock);
+			if (stopping)
+				/* dev_removed() deregisters the fd */
+				continue;
+
+			tcmur_dispatch_ring(dev, false);
+			tcmur_wc_idle_submit(dev);
+
+			pthread_mutex_lock(&rdev->state_lock);
+			rdev->evloop_busy = false;
+			pthread_cond_broadcast(&rdev->evloop_cond);
+			pthread_mutex_unlock(&rdev->state_lock);
+		}
+	}
+
+	return NULL;
+}
+
+int tcmur_evloop_setup(int nr_loops)
+{
+	struct tcmur_evloop *loop;
+	int i;
+
+	if (nr_loops <= 0)
+		return 0;
+
+	tcmur_evloops = calloc(nr_loops, sizeof(*tcmur_evloops));
+	if (!tcmur_evloops)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_loops; i++) {
+		loop = &tcmur_evloops[i];
+
+		loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (loop->epoll_fd < 0)
+			return -errno;
+		if (pthread_mutex_init(&loop->lock, NULL))
+			return -ENOMEM;
+		darray_init(loop->devs);
+		if (pthread_create(&loop->thread, NULL, tcmur_evloop_thread,
+				   loop))
+			return -ENOMEM;
+		tcmur_nr_evloops = i + 1;
+	}
+
+	tcmu_info("sharing %d event loops across all devices\n", nr_loops);
+	return 0;
+}
+
+static bool tcmur_evloop_enabled(void)
+{
+	return tcmur_nr_evloops > 0;
+}
+
+static int tcmur_evloop_add_dev(struct tcmu_device *dev)
+{
+	struct tcmur_evloop *loop;
+	struct epoll_event ev;
+	unsigned int n;
+
+	n = __atomic_fetch_add(&tcmur_next_evloop, 1, __ATOMIC_RELAXED);
+	loop = &tcmur_evloops[n % tcmur_nr_evloops];
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = dev;
+
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, tcmu_dev_get_fd(dev),
+		      &ev)) {
+		tcmu_dev_err(dev, "could not add device to event loop: %m\n");
+		return -errno;
+	}
+
+	pthread_mutex_lock(&loop->lock);
+	darray_append(loop->devs, dev);
+	pthread_mutex_unlock(&loop->lock);
+
+	tcmu_dev_dbg(dev, "assigned to event loop %u\n",
+		     n % tcmur_nr_evloops);
+	return 0;
+}
+
+static void tcmur_evloop_del_dev(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmu_device **dev_ptr;
+	struct tcmur_evloop *loop;
+	int i, j;
+
+	for (i = 0; i < tcmur_nr_evloops; i++) {
+		loop = &tcmur_evloops[i];
+
+		pthread_mutex_lock(&loop->lock);
+		j = 0;
+		darray_foreach(dev_ptr, loop->devs) {
+			if (*dev_ptr == dev) {
+				epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL,
+					  tcmu_dev_get_fd(dev), NULL);
+				darray_remove(loop->devs, j);
+				pthread_mutex_unlock(&loop->lock);
+				goto wait_idle;
+			}
+			j++;
+		}
+		pthread_mutex_unlock(&loop->lock);
+	}
+
+wait_idle:
+	/*
+	 * STOPPING is already set, so no new dispatch can start; wait
+	 * out any dispatch the loop thread still has in flight before
+	 * teardown unmaps the ring.
+	 */
+	pthread_mutex_lock(&rdev->state_lock);
+	while (rdev->evloop_busy)
+		pthread_cond_wait(&rdev->evloop_cond, &rdev->state_lock);
+	pthread_mutex_unlock(&rdev->state_lock);
+}
+
+static void *tcmur_cmdproc_thread(void *arg)
+{
+	struct tcmu_device *dev = arg;
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct pollfd pfd;
+	int ret;
+	bool dev_stopping = false;
+
+	tcmu_set_thread_name("cmdproc", dev);
+
+	tcmur_apply_cpuset(dev, "cmdproc");
+
+	if (tcmu_get_config()->mmap_prefault)
+		tcmur_prefault_mmap(dev);
+
+	pthread_cleanup_push(tcmur_stop_device, dev);
+
+	while (1) {
+		struct timespec tmo, curr_time;
+		bool set_tmo;
+
+		tcmur_dispatch_ring(dev, dev_stopping);
+
+		/* spin briefly for the next command before sleeping */
+		if (rdev->cmdproc_spin_us && !dev_stopping &&
+		    tcmur_spin_for_cmds(dev, rdev->cmdproc_spin_us))
+			continue;
+
+		/* ring went idle: let buffered writes head to the backend */
+		tcmur_wc_idle_submit(dev);
+
+		memset(&curr_time, 0, sizeof(curr_time));
+		if (rdev->cmd_time_out)
+			tcmur_get_time(dev, &curr_time);
 
 		set_tmo = get_next_cmd_timeout(dev, &curr_time, &tmo);
 
@@ -908,16 +1259,29 @@ static int dev_resize(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 static int dev_reconfig(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	int ret;
 
 	if (!rhandler->reconfig)
 		return -EOPNOTSUPP;
 
+	/* the cached responses may describe the old configuration */
+	tcmur_inq_cache_invalidate(dev);
+	tcmur_rtpg_cache_invalidate(dev);
+
 	switch (cfg->type) {
 	case TCMULIB_CFG_DEV_SIZE:
-		return dev_resize(dev, cfg);
+		ret = dev_resize(dev, cfg);
+		break;
 	default:
-		return rhandler->reconfig(dev, cfg);
+		ret = rhandler->reconfig(dev, cfg);
+		break;
 	}
+
+	/* the backend's advertised capabilities may have changed */
+	if (!ret)
+		tcmur_tune_device(dev);
+
+	return ret;
 }
 
 static void parse_tcmu_runner_args(struct tcmu_device *dev)
@@ -942,6 +1306,32 @@ static void parse_tcmu_runner_args(struct tcmu_device *dev)
 			found = true;
 		}
 
+		if (!strncmp(arg, "tcmur_iops_limit=", 17)) {
+			rdev->qos.iops_limit = strtoull(arg + 17, NULL, 10);
+
+			tcmu_dev_dbg(dev, "Using tcmur_iops_limit %"PRIu64"\n",
+				     rdev->qos.iops_limit);
+			found = true;
+		}
+
+		if (!strncmp(arg, "tcmur_bps_limit_mb=", 19)) {
+			rdev->qos.bps_limit =
+				strtoull(arg + 19, NULL, 10) << 20;
+
+			tcmu_dev_dbg(dev, "Using tcmur_bps_limit_mb %"PRIu64"\n",
+				     rdev->qos.bps_limit >> 20);
+			found = true;
+		}
+
+		if (!strncmp(arg, "tcmur_cpuset=", 13)) {
+			snprintf(rdev->cpuset, sizeof(rdev->cpuset), "%.*s",
+				 (int)strcspn(arg + 13, ";"), arg + 13);
+
+			tcmu_dev_dbg(dev, "Using tcmur_cpuset %s\n",
+				     rdev->cpuset);
+			found = true;
+		}
+
 		arg_end = strstr(arg, ";");
 		if (!arg_end) {
 			arg_end = cfg_end;
@@ -960,6 +1350,29 @@ static void parse_tcmu_runner_args(struct tcmu_device *dev)
 		     tcmu_dev_get_cfgstring(dev));
 }
 
+/*
+ * Tune the kernel attributes that can still be changed on a live
+ * device. By the time the runner sees a device (netlink add or
+ * reconfig) it is already enabled, and target_core_user rejects
+ * hw_max_sectors and max_data_area_mb changes on an enabled device,
+ * so transfer/data-area sizing must be configured by the tool that
+ * creates the device; only qfull_time_out is tunable from here.
+ */
+static void tcmur_tune_device(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	/* make qfull push back before the command timeout fires */
+	if (rdev->cmd_time_out > 1) {
+		if (tcmu_cfgfs_dev_set_attr_int(dev, "qfull_time_out",
+						rdev->cmd_time_out / 2))
+			tcmu_dev_warn(dev, "could not set qfull_time_out\n");
+		else
+			tcmu_dev_info(dev, "set qfull_time_out to %d\n",
+				      rdev->cmd_time_out / 2);
+	}
+}
+
 static int dev_added(struct tcmu_device *dev)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
@@ -967,7 +1380,7 @@ static int dev_added(struct tcmu_device *dev)
 	struct tcmur_device *rdev;
 	int32_t block_size, max_sectors;
 	int64_t dev_size;
-	int ret;
+	int ret, i;
 
 	rdev = calloc(1, sizeof(*rdev));
 	if (!rdev)
@@ -975,8 +1388,26 @@ static int dev_added(struct tcmu_device *dev)
 
 	tcmu_dev_set_private(dev, rdev);
 	list_node_init(&rdev->recovery_entry);
-	list_head_init(&rdev->cmds_list);
+	for (i = 0; i < TCMUR_TIMEOUT_WHEEL_SLOTS; i++)
+		list_head_init(&rdev->timeout_wheel[i]);
+	list_head_init(&rdev->parked_cmds);
+	list_head_init(&rdev->flush_merge.waiters);
+	list_head_init(&rdev->lock_waiters.cmds);
+	list_head_init(&rdev->qos.deferred);
+	list_node_init(&rdev->qos.gov_entry);
 	rdev->dev = dev;
+	{
+		struct tcmu_config *cfg = tcmu_get_config();
+
+		rdev->cmdproc_spin_us = cfg->cmdproc_spin_us;
+		snprintf(rdev->cpuset, sizeof(rdev->cpuset), "%s",
+			 cfg->cpuset);
+		rdev->qos.iops_limit = cfg->qos_iops_limit > 0 ?
+				       cfg->qos_iops_limit : 0;
+		rdev->qos.bps_limit = cfg->qos_bps_limit_mb > 0 ?
+				      (uint64_t)cfg->qos_bps_limit_mb << 20 :
+				      0;
+	}
 
 	parse_tcmu_runner_args(dev);
 
@@ -1014,7 +1445,7 @@ static int dev_added(struct tcmu_device *dev)
 	 */
 	tcmu_dev_set_opt_xcopy_rw_len(dev, max_sectors);
 
-	if (rhandler->unmap)
+	if (rhandler->unmap || rhandler->unmap_ranges)
 		tcmu_dev_set_unmap_enabled(dev, true);
 
 	tcmu_dev_dbg(dev, "Got block_size %d, size in bytes %"PRId64"\n",
@@ -1026,11 +1457,18 @@ static int dev_added(struct tcmu_device *dev)
 		goto free_rdev;
 	}
 
-	ret = pthread_mutex_init(&rdev->caw_lock, NULL);
+	ret = pthread_mutex_init(&rdev->caw_ranges.lock, NULL);
 	if (ret) {
 		ret = -ret;
 		goto cleanup_dev_lock;
 	}
+	ret = pthread_cond_init(&rdev->caw_ranges.cond, NULL);
+	if (ret) {
+		ret = -ret;
+		pthread_mutex_destroy(&rdev->caw_ranges.lock);
+		goto cleanup_dev_lock;
+	}
+	list_head_init(&rdev->caw_ranges.ranges);
 
 	ret = pthread_mutex_init(&rdev->format_lock, NULL);
 	if (ret) {
@@ -1044,17 +1482,71 @@ static int dev_added(struct tcmu_device *dev)
 		goto cleanup_format_lock;
 	}
 
+	ret = pthread_cond_init(&rdev->evloop_cond, NULL);
+	if (ret) {
+		ret = -ret;
+		goto cleanup_state_lock;
+	}
+
+	ret = pthread_mutex_init(&rdev->inq_cache.lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto cleanup_evloop_cond;
+	}
+
+	ret = pthread_mutex_init(&rdev->rtpg_cache.lock, NULL);
+	if (ret) {
+		ret = -ret;
+		pthread_mutex_destroy(&rdev->inq_cache.lock);
+		goto cleanup_evloop_cond;
+	}
+
+	ret = pthread_mutex_init(&rdev->flush_merge.lock, NULL);
+	if (ret) {
+		ret = -ret;
+		pthread_mutex_destroy(&rdev->rtpg_cache.lock);
+		pthread_mutex_destroy(&rdev->inq_cache.lock);
+		goto cleanup_evloop_cond;
+	}
+
+	ret = pthread_mutex_init(&rdev->qos.lock, NULL);
+	if (ret) {
+		ret = -ret;
+		pthread_mutex_destroy(&rdev->flush_merge.lock);
+		pthread_mutex_destroy(&rdev->rtpg_cache.lock);
+		pthread_mutex_destroy(&rdev->inq_cache.lock);
+		goto cleanup_evloop_cond;
+	}
+
 	ret = setup_io_work_queue(dev);
 	if (ret < 0)
-		goto cleanup_state_lock;
+		goto cleanup_inq_lock;
 
 	ret = setup_aio_tracking(rdev);
 	if (ret < 0)
 		goto cleanup_io_work_queue;
 
+	tcmur_dispatch_table_setup(dev);
+
+	ret = tcmur_cmd_slab_setup(dev);
+	if (ret < 0)
+		goto cleanup_aio_tracking;
+
+	ret = tcmur_ra_setup(dev, tcmu_get_config()->read_ahead_kb);
+	if (ret < 0)
+		goto cleanup_cmd_slab;
+
+	ret = tcmur_rc_setup(dev, tcmu_get_config()->read_cache_mb);
+	if (ret < 0)
+		goto cleanup_ra;
+
 	ret = rhandler->open(dev, false);
 	if (ret)
-		goto cleanup_aio_tracking;
+		goto cleanup_rc;
+
+	ret = tcmur_wc_setup(dev, tcmu_get_config()->write_coalesce_kb);
+	if (ret < 0)
+		goto close_dev;
 	/*
 	 * On the initial creation ALUA will probably not yet have been setup,
 	 * but for reopens it will be so we need to sync our failover state.
@@ -1065,12 +1557,21 @@ static int dev_added(struct tcmu_device *dev)
 
 	rdev->flags |= TCMUR_DEV_FLAG_IS_OPEN;
 
+	tcmur_tune_device(dev);
+
 	rdev->event_work = tcmur_create_work();
 	if (!rdev->event_work) {
 		ret = -ENOMEM;
 		goto close_dev;
 	}
 
+	if (tcmur_evloop_enabled()) {
+		ret = tcmur_evloop_add_dev(dev);
+		if (ret)
+			goto cleanup_event_work;
+		return 0;
+	}
+
 	ret = pthread_create(&rdev->cmdproc_thread, NULL, tcmur_cmdproc_thread,
 			     dev);
 	if (ret) {
@@ -1082,18 +1583,33 @@ static int dev_added(struct tcmu_device *dev)
 
 cleanup_event_work:
 	tcmur_destroy_work(rdev->event_work);
+	tcmur_wc_cleanup(dev);
 close_dev:
 	rhandler->close(dev);
+cleanup_rc:
+	tcmur_rc_cleanup(dev);
+cleanup_ra:
+	tcmur_ra_cleanup(dev);
+cleanup_cmd_slab:
+	tcmur_cmd_slab_cleanup(dev);
 cleanup_aio_tracking:
 	cleanup_aio_tracking(rdev);
 cleanup_io_work_queue:
 	cleanup_io_work_queue(dev, true);
+cleanup_inq_lock:
+	pthread_mutex_destroy(&rdev->qos.lock);
+	pthread_mutex_destroy(&rdev->flush_merge.lock);
+	pthread_mutex_destroy(&rdev->rtpg_cache.lock);
+	pthread_mutex_destroy(&rdev->inq_cache.lock);
+cleanup_evloop_cond:
+	pthread_cond_destroy(&rdev->evloop_cond);
 cleanup_state_lock:
 	pthread_mutex_destroy(&rdev->state_lock);
 cleanup_format_lock:
 	pthread_mutex_destroy(&rdev->format_lock);
 cleanup_caw_lock:
-	pthread_mutex_destroy(&rdev->caw_lock);
+	pthread_cond_destroy(&rdev->caw_ranges.cond);
+	pthread_mutex_destroy(&rdev->caw_ranges.lock);
 cleanup_dev_lock:
 	pthread_spin_destroy(&rdev->lock);
 free_rdev:
@@ -1110,6 +1626,15 @@ static void dev_removed(struct tcmu_device *dev)
 	rdev->flags |= TCMUR_DEV_FLAG_STOPPING;
 	pthread_mutex_unlock(&rdev->state_lock);
 
+	/* push out any coalesced writes while the aio path still runs */
+	tcmur_wc_drain(dev, 0, UINT64_MAX);
+
+	/* release QoS-deferred requests or the queue can never drain */
+	tcmur_qos_drain(dev);
+
+	/* likewise commands parked on an ALUA lock handoff */
+	tcmur_fail_parked_cmds(dev);
+
 	/*
 	 * The order of cleaning up worker threads and calling ->removed()
 	 * is important: for sync handlers, the worker thread needs to be
@@ -1122,14 +1647,43 @@ static void dev_removed(struct tcmu_device *dev)
 	if (aio_wait_for_empty_queue(rdev))
 		tcmu_dev_err(dev, "could not flush queue.\n");
 
-	tcmu_thread_cancel(rdev->cmdproc_thread);
+	if (tcmur_evloop_enabled())
+		tcmur_evloop_del_dev(dev);
+	else
+		tcmu_thread_cancel(rdev->cmdproc_thread);
 	tcmur_stop_device(dev);
 
 	cleanup_io_work_queue(dev, false);
+	tcmur_wc_cleanup(dev);
+	tcmur_rc_cleanup(dev);
+	tcmur_ra_cleanup(dev);
+	tcmur_cmd_slab_cleanup(dev);
 	cleanup_aio_tracking(rdev);
 
+	tcmur_inq_cache_invalidate(dev);
+	ret = pthread_mutex_destroy(&rdev->inq_cache.lock);
+	if (ret != 0)
+		tcmu_err("could not cleanup inquiry cache lock %d\n", ret);
+
+	tcmur_rtpg_cache_invalidate(dev);
+	ret = pthread_mutex_destroy(&rdev->rtpg_cache.lock);
+	if (ret != 0)
+		tcmu_err("could not cleanup rtpg cache lock %d\n", ret);
+
+	ret = pthread_mutex_destroy(&rdev->flush_merge.lock);
+	if (ret != 0)
+		tcmu_err("could not cleanup flush merge lock %d\n", ret);
+
+	ret = pthread_mutex_destroy(&rdev->qos.lock);
+	if (ret != 0)
+		tcmu_err("could not cleanup qos lock %d\n", ret);
+
 	tcmur_destroy_work(rdev->event_work);
 
+	ret = pthread_cond_destroy(&rdev->evloop_cond);
+	if (ret != 0)
+		tcmu_err("could not cleanup evloop cond %d\n", ret);
+
 	ret = pthread_mutex_destroy(&rdev->state_lock);
 	if (ret != 0)
 		tcmu_err("could not cleanup state lock %d\n", ret);
@@ -1138,9 +1692,13 @@ static void dev_removed(struct tcmu_device *dev)
 	if (ret != 0)
 		tcmu_err("could not cleanup format lock %d\n", ret);
 
-	ret = pthread_mutex_destroy(&rdev->caw_lock);
+	ret = pthread_cond_destroy(&rdev->caw_ranges.cond);
+	if (ret != 0)
+		tcmu_err("could not cleanup caw range cond %d\n", ret);
+
+	ret = pthread_mutex_destroy(&rdev->caw_ranges.lock);
 	if (ret != 0)
-		tcmu_err("could not cleanup caw lock %d\n", ret);
+		tcmu_err("could not cleanup caw range lock %d\n", ret);
 
 	ret = pthread_spin_destroy(&rdev->lock);
 	if (ret != 0)
@@ -1323,6 +1881,22 @@ int main(int argc, char **argv)
 		goto close_fd;
 	}
 
+	if (tcmur_shared_pool_setup(tcmu_cfg->shared_io_threads) < 0) {
+		tcmu_err("couldn't setup shared io thread pool\n");
+		goto close_fd;
+	}
+
+	tcmur_set_xcopy_window(tcmu_cfg->xcopy_window);
+
+	if (tcmur_evloop_setup(tcmu_cfg->event_loops) < 0) {
+		tcmu_err("couldn't setup shared event loops\n");
+		goto close_fd;
+	}
+
+	tcmulib_set_mmap_options(
+		(tcmu_cfg->mmap_hugepages ? TCMULIB_MMAP_HUGEPAGE : 0) |
+		(tcmu_cfg->mmap_mlock ? TCMULIB_MMAP_MLOCK : 0));
+
 	tcmu_dbg("handler path: %s\n", handler_path);
 
 	/*
@@ -1386,6 +1960,7 @@ int main(int argc, char **argv)
 		goto err_free_handlers;
 	}
 
+	g_tcmulib_context = tcmulib_context;
 	tcmu_cfg->ctx = tcmulib_context;
 	if (tcmu_watch_config(tcmu_cfg)) {
 		tcmu_warn("Dynamic config file changes is not supported.\n");
@@ -1446,6 +2021,8 @@ err_free_handlers:
 	}
 	darray_free(handlers);
 close_fd:
+	tcmur_shared_pool_cleanup();
+
 	if (reset_nl_supp)
 		tcmu_cfgfs_mod_param_set_u32("block_netlink", 0);
 
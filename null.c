@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Null/ramdisk handler for isolating runner-core overhead.
+ *
+ * Two modes, picked by the cfgstring:
+ *   null/null          - complete every command immediately, no data
+ *                        touched: a ceiling measurement for the ring,
+ *                        aio and dispatch path.
+ *   null/ram@<MiB>     - serve reads and writes from a preallocated
+ *                        arena with memcpy to/from the ring iovecs:
+ *                        adds exactly one memory pass to the above.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <scsi/scsi.h>
+
+#include "scsi_defs.h"
+#include "libtcmu.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+
+struct null_state {
+	char *arena;		/* NULL in null mode */
+	uint64_t arena_size;
+};
+
+static int null_open(struct tcmu_device *dev, bool reopen)
+{
+	struct null_state *state;
+	uint64_t mib;
+	char *config;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return -ENOMEM;
+
+	tcmur_dev_set_private(dev, state);
+
+	config = strchr(tcmu_dev_get_cfgstring(dev), '/');
+	if (!config) {
+		tcmu_err("no configuration found in cfgstring\n");
+		goto err;
+	}
+	config += 1; /* get past '/' */
+
+	if (!strncmp(config, "ram@", 4)) {
+		mib = strtoull(config + 4, NULL, 0);
+		if (!mib) {
+			tcmu_err("invalid ram arena size in %s\n", config);
+			goto err;
+		}
+
+		state->arena_size = mib << 20;
+		state->arena = calloc(1, state->arena_size);
+		if (!state->arena) {
+			tcmu_err("could not allocate %"PRIu64" MiB arena\n",
+				 mib);
+			goto err;
+		}
+	} else if (strcmp(config, "null")) {
+		tcmu_err("invalid null handler config %s\n", config);
+		goto err;
+	}
+
+	tcmu_dev_set_write_cache_enabled(dev, 1);
+
+	return 0;
+
+err:
+	free(state);
+	return -EINVAL;
+}
+
+static void null_close(struct tcmu_device *dev)
+{
+	struct null_state *state = tcmur_dev_get_private(dev);
+
+	free(state->arena);
+	free(state);
+}
+
+static int null_read(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		     struct iovec *iov, size_t iov_cnt, size_t length,
+		     off_t offset)
+{
+	struct null_state *state = tcmur_dev_get_private(dev);
+
+	if (state->arena) {
+		if (offset + length > state->arena_size) {
+			/* reads past the arena come back as zeros */
+			tcmu_iovec_zero(iov, iov_cnt);
+			goto done;
+		}
+
+		tcmu_memcpy_into_iovec(iov, iov_cnt, state->arena + offset,
+				       length);
+	}
+
+done:
+	tcmur_cmd_complete(dev, cmd, TCMU_STS_OK);
+	return TCMU_STS_OK;
+}
+
+static int null_write(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		      struct iovec *iov, size_t iov_cnt, size_t length,
+		      off_t offset)
+{
+	struct null_state *state = tcmur_dev_get_private(dev);
+
+	if (state->arena && offset + length <= state->arena_size)
+		tcmu_memcpy_from_iovec(state->arena + offset, length, iov,
+				       iov_cnt);
+
+	tcmur_cmd_complete(dev, cmd, TCMU_STS_OK);
+	return TCMU_STS_OK;
+}
+
+static int null_flush(struct tcmu_device *dev, struct tcmur_cmd *cmd)
+{
+	tcmur_cmd_complete(dev, cmd, TCMU_STS_OK);
+	return TCMU_STS_OK;
+}
+
+static const char null_cfg_desc[] =
+	"null for immediate completion with no data movement, or\n"
+	"ram@<MiB> to serve I/O from a preallocated arena of that size.";
+
+static struct tcmur_handler null_handler = {
+	.cfg_desc = null_cfg_desc,
+
+	.open = null_open,
+	.close = null_close,
+	.read = null_read,
+	.write = null_write,
+	.flush = null_flush,
+	.name = "Null/ramdisk benchmark handler",
+	.subtype = "null",
+	/* complete from the dispatch context, no thread pool hops */
+	.nr_threads = 0,
+};
+
+/* Entry point must be named "handler_init". */
+int handler_init(void)
+{
+	return tcmur_register_handler(&null_handler);
+}
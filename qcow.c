@@ -83,6 +83,10 @@ struct bdev {
 	int64_t size;
 	uint32_t block_size;
 
+	/* metadata cache sizing from the cfgstring, in MB (0 = default) */
+	unsigned int l2_cache_mb;
+	unsigned int rc_cache_mb;
+
 	int fd;		/* image file descriptor */
 };
 
@@ -191,6 +195,22 @@ static void qcow2_header_bswap(struct qcow2_header *be, struct qcow2_header *dst
 
 #define RC_CACHE_SIZE L2_CACHE_SIZE
 
+/*
+ * Sized metadata block cache with CLOCK replacement. The offsets and
+ * reference bits live in flat arrays so the lookup scan and the hand
+ * sweep stay cache-line friendly even for caches holding thousands
+ * of blocks.
+ */
+struct qcow_cache {
+	uint8_t *blocks;
+	uint64_t *offsets;
+	uint8_t *refs;
+	bool *dirty;
+	unsigned int nb_blocks;
+	size_t block_size;
+	unsigned int hand;
+};
+
 struct qcow_state
 {
 	int fd;
@@ -208,9 +228,7 @@ struct qcow_state
 	uint64_t *l1_table;
 
 	/* L2 cache */
-	uint64_t *l2_cache;
-	uint64_t l2_cache_offsets[L2_CACHE_SIZE];
-	int l2_cache_counts[L2_CACHE_SIZE];
+	struct qcow_cache l2_cache;
 
 	/* cluster decompression cache */
 	uint8_t *cluster_cache;
@@ -229,9 +247,7 @@ struct qcow_state
 
 	/* refcount block cache */
 	unsigned int refcount_order;
-	void *rc_cache;
-	uint64_t rc_cache_offsets[RC_CACHE_SIZE];
-	int rc_cache_counts[RC_CACHE_SIZE];
+	struct qcow_cache rc_cache;
 
 	uint64_t (*block_alloc) (struct qcow_state *s, size_t size);
 	int (*set_refcount) (struct qcow_state *s, uint64_t cluster_offset, uint64_t value);
@@ -246,6 +262,23 @@ static int qcow_no_refcount(struct qcow_state *s, uint64_t cluster_offset, uint6
 	return 0;
 }
 static int qcow2_set_refcount(struct qcow_state *s, uint64_t cluster_offset, uint64_t value);
+static int qcow_sync_metadata(struct qcow_state *s);
+static int qcow_cache_init(struct qcow_cache *c, unsigned int nb_blocks,
+			   size_t block_size);
+static void qcow_cache_release(struct qcow_cache *c);
+
+/* how many blocks a cache sized in MB holds, 0 meaning the default */
+static unsigned int qcow_cache_blocks(unsigned int mb, size_t block_size,
+				      unsigned int def_blocks)
+{
+	uint64_t nb;
+
+	if (!mb)
+		return def_blocks;
+
+	nb = ((uint64_t)mb << 20) / block_size;
+	return nb ? nb : 1;
+}
 
 static int qcow_probe(struct bdev *bdev, int dirfd, const char *pathname)
 {
@@ -513,8 +546,11 @@ static int qcow_image_open(struct bdev *bdev, int dirfd, const char *pathname, i
 		goto fail;
 	}
 
-	s->l2_cache = calloc(L2_CACHE_SIZE, s->l2_size * sizeof(uint64_t));
-	if (s->l2_cache == NULL) {
+	if (qcow_cache_init(&s->l2_cache,
+			    qcow_cache_blocks(bdev->l2_cache_mb,
+					      s->l2_size * sizeof(uint64_t),
+					      L2_CACHE_SIZE),
+			    s->l2_size * sizeof(uint64_t))) {
 		tcmu_err("Failed to allocate L2 cache\n");
 		goto fail;
 	}
@@ -542,7 +578,7 @@ fail:
 	close(bdev->fd);
 	free(s->cluster_cache);
 	free(s->cluster_data);
-	free(s->l2_cache);
+	qcow_cache_release(&s->l2_cache);
 	free(s->l1_table);
 fail_nofd:
 	free(s);
@@ -634,12 +670,15 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 		goto fail;
 	}
 
-	s->l2_cache = calloc(L2_CACHE_SIZE, s->l2_size * sizeof(uint64_t));
-	if (s->l2_cache == NULL) {
+	if (qcow_cache_init(&s->l2_cache,
+			    qcow_cache_blocks(bdev->l2_cache_mb,
+					      s->l2_size * sizeof(uint64_t),
+					      L2_CACHE_SIZE),
+			    s->l2_size * sizeof(uint64_t))) {
 		tcmu_err("Failed to allocate L2 cache\n");
 		goto fail;
 	}
-	tcmu_dbg("s->l2_cache = %p\n", s->l2_cache);
+	tcmu_dbg("l2 cache of %u tables\n", s->l2_cache.nb_blocks);
 
 	/* cluster decompression cache */
 	s->cluster_cache = calloc(1, s->cluster_size);
@@ -667,12 +706,15 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 	}
 
 	s->refcount_order = header.refcount_order;
-	s->rc_cache = calloc(RC_CACHE_SIZE, s->cluster_size);
-	if (s->rc_cache == NULL) {
+	if (qcow_cache_init(&s->rc_cache,
+			    qcow_cache_blocks(bdev->rc_cache_mb,
+					      s->cluster_size,
+					      RC_CACHE_SIZE),
+			    s->cluster_size)) {
 		tcmu_err("Failed to allocate refcount cache\n");
 		goto fail;
 	}
-	tcmu_dbg("s->rc_cache = %p\n", s->rc_cache);
+	tcmu_dbg("rc cache of %u blocks\n", s->rc_cache.nb_blocks);
 
 	if (qcow2_setup_backing_file(bdev, &header) == -1)
 		goto fail;
@@ -689,9 +731,9 @@ fail:
 	close(bdev->fd);
 	free(s->cluster_cache);
 	free(s->cluster_data);
-	free(s->rc_cache);
+	qcow_cache_release(&s->rc_cache);
 	free(s->refcount_table);
-	free(s->l2_cache);
+	qcow_cache_release(&s->l2_cache);
 	free(s->l1_table);
 fail_nofd:
 	free(s);
@@ -702,6 +744,9 @@ static void qcow_image_close(struct bdev *bdev)
 {
 	struct qcow_state *s = bdev->private;
 
+	if (qcow_sync_metadata(s) < 0)
+		tcmu_err("failed to sync metadata on close\n");
+
 	if (s->backing_image) {
 		s->backing_image->ops->close(s->backing_image);
 		free(s->backing_image);
@@ -710,48 +755,120 @@ static void qcow_image_close(struct bdev *bdev)
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	free(s->l1_table);
-	free(s->l2_cache);
+	qcow_cache_release(&s->l2_cache);
 	free(s->refcount_table);
-	free(s->rc_cache);
+	qcow_cache_release(&s->rc_cache);
 	free(s);
 }
 
-static uint64_t *l2_cache_lookup(struct qcow_state *s, uint64_t l2_offset)
+/*
+ * Dirty metadata blocks are modified in the cache only and coalesced
+ * into whole-block writebacks on eviction, SYNCHRONIZE CACHE or
+ * close, instead of hitting the disk for every 8-byte entry update.
+ */
+static int qcow_cache_init(struct qcow_cache *c, unsigned int nb_blocks,
+			   size_t block_size)
 {
-	int i, j;
-	int min_index = 0;
-	int min_count = INT_MAX;
-	uint64_t *l2_table;
+	c->nb_blocks = nb_blocks;
+	c->block_size = block_size;
+	c->hand = 0;
+
+	c->blocks = calloc(nb_blocks, block_size);
+	c->offsets = calloc(nb_blocks, sizeof(*c->offsets));
+	c->refs = calloc(nb_blocks, sizeof(*c->refs));
+	c->dirty = calloc(nb_blocks, sizeof(*c->dirty));
+	if (!c->blocks || !c->offsets || !c->refs || !c->dirty)
+		return -1;
+
+	return 0;
+}
+
+static void qcow_cache_release(struct qcow_cache *c)
+{
+	free(c->blocks);
+	free(c->offsets);
+	free(c->refs);
+	free(c->dirty);
+}
+
+static int qcow_cache_writeback(struct qcow_state *s, struct qcow_cache *c,
+				unsigned int index)
+{
+	ssize_t written;
+
+	if (!c->dirty[index])
+		return 0;
+
+	written = pwrite(s->fd, c->blocks + index * c->block_size,
+			 c->block_size, c->offsets[index]);
+	if (written != c->block_size) {
+		tcmu_err("%s: error, metadata writeback failed (%zd)\n",
+			 __func__, written);
+		return -1;
+	}
+	c->dirty[index] = false;
+
+	return 0;
+}
+
+static void *qcow_cache_lookup(struct qcow_state *s, struct qcow_cache *c,
+			       uint64_t offset)
+{
+	unsigned int i;
 	ssize_t read;
 
-	/* l2 cache lookup */
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (l2_offset == s->l2_cache_offsets[i]) {
-			if (++s->l2_cache_counts[i] == INT_MAX) {
-				for (j = 0; i < L2_CACHE_SIZE; j++) {
-					s->l2_cache_counts[j] >>= 1;
-				}
-			}
-			l2_table = s->l2_cache + (i << s->l2_bits);
-			tcmu_dbg("%s: l2 hit %"PRIx64" at index %d\n", __func__, *l2_table, i);
-			return l2_table;
+	for (i = 0; i < c->nb_blocks; i++) {
+		if (offset == c->offsets[i]) {
+			c->refs[i] = 1;
+			return c->blocks + i * c->block_size;
 		}
 	}
-	/* not found, evict least used entry */
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (s->l2_cache_counts[i] < min_count) {
-			min_count = s->l2_cache_counts[i];
-			min_index = i;
-		}
+
+	/* not found: sweep the CLOCK hand to a victim slot */
+	while (c->refs[c->hand]) {
+		c->refs[c->hand] = 0;
+		c->hand = (c->hand + 1) % c->nb_blocks;
 	}
-	l2_table = s->l2_cache + (min_index << s->l2_bits);
-	read = pread(s->fd, l2_table, s->l2_size * sizeof(uint64_t), l2_offset);
-	if (read != s->l2_size * sizeof(uint64_t))
+	i = c->hand;
+	c->hand = (c->hand + 1) % c->nb_blocks;
+
+	if (qcow_cache_writeback(s, c, i) < 0)
+		return NULL;
+
+	read = pread(s->fd, c->blocks + i * c->block_size, c->block_size,
+		     offset);
+	if (read != c->block_size) {
+		/* slot no longer matches what the offset array claims */
+		c->offsets[i] = 0;
 		return NULL;
-	s->l2_cache_offsets[min_index] = l2_offset;
-	s->l2_cache_counts[min_index] = 1;
+	}
+	c->offsets[i] = offset;
+	c->refs[i] = 1;
 
-	return l2_table;
+	return c->blocks + i * c->block_size;
+}
+
+static void qcow_cache_mark_dirty(struct qcow_cache *c, void *block)
+{
+	c->dirty[((uint8_t *)block - c->blocks) / c->block_size] = true;
+}
+
+static int qcow_cache_sync(struct qcow_state *s, struct qcow_cache *c)
+{
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < c->nb_blocks; i++) {
+		if (qcow_cache_writeback(s, c, i) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+static uint64_t *l2_cache_lookup(struct qcow_state *s, uint64_t l2_offset)
+{
+	return qcow_cache_lookup(s, &s->l2_cache, l2_offset);
 }
 
 static uint64_t qcow_cluster_alloc(struct qcow_state *s)
@@ -862,39 +979,7 @@ static void set_refcount(unsigned int order, void *rcblock, size_t index, uint64
 
 static void *rc_cache_lookup(struct qcow_state *s, uint64_t rc_offset)
 {
-	int i, j;
-	int min_index = 0;
-	int min_count = INT_MAX;
-	void *rc_table;
-	ssize_t read;
-
-	/* rc cache lookup */
-	for (i = 0; i < RC_CACHE_SIZE; i++) {
-		if (rc_offset == s->rc_cache_offsets[i]) {
-			if (++s->rc_cache_counts[i] == INT_MAX) {
-				for (j = 0; i < RC_CACHE_SIZE; j++) {
-					s->rc_cache_counts[j] >>= 1;
-				}
-			}
-			rc_table = s->rc_cache + (i << s->cluster_bits);
-			return rc_table;
-		}
-	}
-	/* not found, evict least used entry */
-	for (i = 0; i < RC_CACHE_SIZE; i++) {
-		if (s->rc_cache_counts[i] < min_count) {
-			min_count = s->rc_cache_counts[i];
-			min_index = i;
-		}
-	}
-	rc_table = s->rc_cache + (min_index << s->cluster_bits);
-	read = pread(s->fd, rc_table, 1 << s->cluster_bits, rc_offset);
-	if (read != 1 << s->cluster_bits)
-		return NULL;
-	s->rc_cache_offsets[min_index] = rc_offset;
-	s->rc_cache_counts[min_index] = 1;
-
-	return rc_table;
+	return qcow_cache_lookup(s, &s->rc_cache, rc_offset);
 }
 
 static uint64_t qcow2_get_refcount(struct qcow_state *s, int64_t cluster_offset)
@@ -947,7 +1032,6 @@ static int qcow2_set_refcount(struct qcow_state *s, uint64_t cluster_offset, uin
 	uint64_t refblock_offset;
 	uint64_t refblock_index;
 	void *refblock;
-	ssize_t ret;
 
 	refcount_bits = s->cluster_bits - s->refcount_order + 3;
 	rc_index = cluster_offset >> (s->cluster_bits + refcount_bits);
@@ -974,12 +1058,10 @@ static int qcow2_set_refcount(struct qcow_state *s, uint64_t cluster_offset, uin
 
 	set_refcount(s->refcount_order, refblock, refblock_index, value);
 
-	/* for now this writes back the entire block */
-	ret = pwrite(s->fd, refblock, s->cluster_size, refblock_offset);
-	if (ret != s->cluster_size)
-		tcmu_err("%s: error, refblock writeback failed (%zd)\n", __func__, ret);
-	fdatasync(s->fd);
-	return ret;
+	/* modified in cache only, written back as a whole dirty block */
+	qcow_cache_mark_dirty(&s->rc_cache, refblock);
+
+	return 0;
 }
 
 /* qcow 2 uses the refcount table to find free clusters */
@@ -1014,21 +1096,26 @@ static int l2_table_update(struct qcow_state *s,
 			   uint64_t *l2_table, uint64_t l2_table_offset,
 			   unsigned int l2_index, uint64_t cluster_offset)
 {
-	ssize_t ret;
-
 	tcmu_dbg("%s: setting %"PRIx64"[%u] to %"PRIx64"\n",
 		__func__, l2_table_offset, l2_index, cluster_offset);
 	l2_table[l2_index] = htobe64(cluster_offset);
 
-	ret = pwrite(s->fd,
-		&(l2_table[l2_index]),
-		sizeof(uint64_t),
-		l2_table_offset + (l2_index * sizeof(uint64_t)));
+	/* modified in cache only, written back as a whole dirty table */
+	qcow_cache_mark_dirty(&s->l2_cache, l2_table);
 
-	if (ret != sizeof(uint64_t))
-		tcmu_err("%s: error, L2 writeback failed (%zd)\n", __func__, ret);
+	return 0;
+}
+
+/* flush every dirty L2 table and refcount block to the image file */
+static int qcow_sync_metadata(struct qcow_state *s)
+{
+	int ret = 0;
+
+	if (qcow_cache_sync(s, &s->l2_cache) < 0)
+		ret = -1;
+	if (qcow_cache_sync(s, &s->rc_cache) < 0)
+		ret = -1;
 
-	fdatasync(s->fd);
 	return ret;
 }
 
@@ -1087,7 +1174,8 @@ static int decompress_cluster(struct qcow_state *s, uint64_t cluster_offset)
  * offset: virtual image sector offset
  * allocate: true if new cluster and L2 table allocations should happen (writes)
  */
-static uint64_t get_cluster_offset(struct qcow_state *s, const uint64_t offset, bool allocate)
+static uint64_t get_cluster_offset(struct qcow_state *s, const uint64_t offset, bool allocate,
+				   bool *allocated)
 {
 	unsigned int l1_index;
 	unsigned int l2_index;
@@ -1095,6 +1183,9 @@ static uint64_t get_cluster_offset(struct qcow_state *s, const uint64_t offset,
 	uint64_t *l2_table;
 	uint64_t cluster_offset;
 
+	if (allocated)
+		*allocated = false;
+
 	tcmu_dbg("%s: %"PRIx64" %s\n", __func__, offset, allocate ? "write" : "read");
 
 	l1_index = offset >> (s->l2_bits + s->cluster_bits);
@@ -1126,6 +1217,8 @@ static uint64_t get_cluster_offset(struct qcow_state *s, const uint64_t offset,
 			return 0;
 		l2_table_update(s, l2_table, l2_offset, l2_index, cluster_offset | s->cluster_copied);
 		s->set_refcount(s, cluster_offset, 1);
+		if (allocated)
+			*allocated = true;
 	} else if ((cluster_offset & s->cluster_compressed) && allocate) {
 		tcmu_err("re-allocating compressed cluster for writing\n");
 		/* reallocate a compressed cluster for writing */
@@ -1233,7 +1326,7 @@ static ssize_t qcow_preadv(struct bdev *bdev, struct iovec *iov, int iovcnt, off
 
 		_cnt = iovec_segment(iov, _iov, _off, n * 512);
 
-		cluster_offset = get_cluster_offset(s, sector_num << 9, false);
+		cluster_offset = get_cluster_offset(s, sector_num << 9, false, NULL);
 		if (!cluster_offset) {
 			if (!s->backing_image) {
 				/* read unallocated sectors as 0s */
@@ -1267,6 +1360,65 @@ static ssize_t qcow_preadv(struct bdev *bdev, struct iovec *iov, int iovcnt, off
 	return _off ? _off : -1;
 }
 
+/*
+ * Copy the parts of a freshly allocated cluster that the write does
+ * not cover from the backing image, so a partial write to a
+ * backed-by-clone cluster does not lose the clone's data. Only the
+ * head and tail around the written range are read and written - a
+ * write covering the whole cluster touches nothing here, so the
+ * common sequential case stays copy-free.
+ */
+static int qcow_backing_cow(struct bdev *bdev, struct qcow_state *s,
+			    uint64_t cluster_offset, uint64_t sector_num,
+			    uint64_t sector_index, uint64_t n)
+{
+	uint64_t cluster_start = sector_num - sector_index;
+	uint64_t cluster_sectors = s->cluster_sectors;
+	size_t head = sector_index * 512;
+	size_t tail_off = (sector_index + n) * 512;
+	size_t tail_len;
+	struct iovec iov;
+	char *buf;
+	int err = 0;
+
+	/* the last cluster may sit past the end of the device */
+	if (cluster_start + cluster_sectors > s->size / 512)
+		cluster_sectors = s->size / 512 - cluster_start;
+	tail_len = cluster_sectors * 512 - tail_off;
+
+	if (!head && !tail_len)
+		return 0;
+
+	buf = calloc(1, head > tail_len ? head : tail_len);
+	if (!buf)
+		return -ENOMEM;
+
+	if (head) {
+		iov.iov_base = buf;
+		iov.iov_len = head;
+		/* short backing reads leave zeros, like a backing miss */
+		s->backing_image->ops->preadv(s->backing_image, &iov, 1,
+					      (off_t)cluster_start * 512);
+		if (pwrite(s->fd, buf, head, cluster_offset) != head)
+			err = -EIO;
+	}
+
+	if (tail_len && !err) {
+		memset(buf, 0, tail_len);
+		iov.iov_base = buf;
+		iov.iov_len = tail_len;
+		s->backing_image->ops->preadv(s->backing_image, &iov, 1,
+					      (off_t)cluster_start * 512 +
+					      tail_off);
+		if (pwrite(s->fd, buf, tail_len, cluster_offset + tail_off) !=
+		    tail_len)
+			err = -EIO;
+	}
+
+	free(buf);
+	return err;
+}
+
 static ssize_t qcow_pwritev(struct bdev *bdev, struct iovec *iov, int iovcnt, off_t offset)
 {
 	uint64_t cluster_offset;
@@ -1276,6 +1428,7 @@ static ssize_t qcow_pwritev(struct bdev *bdev, struct iovec *iov, int iovcnt, of
 	ssize_t written;
 
 	struct qcow_state *s = bdev->private;
+	bool allocated;
 
 	struct iovec _iov[iovcnt];
 	size_t _cnt;
@@ -1298,7 +1451,8 @@ static ssize_t qcow_pwritev(struct bdev *bdev, struct iovec *iov, int iovcnt, of
 
 		_cnt = iovec_segment(iov, _iov, _off, n * 512);
 
-		cluster_offset = get_cluster_offset(s, sector_num << 9, true);
+		cluster_offset = get_cluster_offset(s, sector_num << 9, true,
+						    &allocated);
 		if (!cluster_offset) {
 			tcmu_err("cluster not allocated for writes\n");
 			return -1;
@@ -1308,6 +1462,13 @@ static ssize_t qcow_pwritev(struct bdev *bdev, struct iovec *iov, int iovcnt, of
 			tcmu_err("cluster decompression CoW failure\n");
 			return -1;
 		} else {
+			if (allocated && s->backing_image &&
+			    qcow_backing_cow(bdev, s, cluster_offset,
+					     sector_num, sector_index, n)) {
+				tcmu_err("backing file CoW failed\n");
+				return -1;
+			}
+
 			written = pwritev(bdev->fd, _iov, _cnt, cluster_offset + (sector_index * 512));
 			if (written < 0)
 				break;
@@ -1411,6 +1572,29 @@ static int qcow_open(struct tcmu_device *dev, bool reopen)
 	}
 	config += 1; /* get past '/' */
 
+	/* optional cache sizing: qcow/l2cache-<MB>/rccache-<MB>@<path> */
+	if (strchr(config, '@')) {
+		while (*config && *config != '@') {
+			if (!strncmp(config, "l2cache-", 8)) {
+				bdev->l2_cache_mb = strtoul(config + 8,
+							    &config, 10);
+			} else if (!strncmp(config, "rccache-", 8)) {
+				bdev->rc_cache_mb = strtoul(config + 8,
+							    &config, 10);
+			} else {
+				tcmu_err("invalid option: %s\n", config);
+				goto err;
+			}
+			if (*config == '/')
+				config++;
+		}
+		if (*config != '@') {
+			tcmu_err("bad cache option syntax in cfgstring\n");
+			goto err;
+		}
+		config++; /* get past '@' */
+	}
+
 	tcmu_dbg("%s\n", tcmu_dev_get_cfgstring(dev));
 	tcmu_dbg("%s\n", config);
 
@@ -1486,8 +1670,16 @@ done:
 static int qcow_flush(struct tcmu_device *dev, struct tcmur_cmd *cmd)
 {
 	struct bdev *bdev = tcmur_dev_get_private(dev);
+	struct qcow_state *s = bdev->private;
 	int ret;
 
+	/* raw images have no metadata to write back */
+	if (s && qcow_sync_metadata(s) < 0) {
+		tcmu_dev_err(dev, "metadata sync failed\n");
+		ret = TCMU_STS_WR_ERR;
+		goto done;
+	}
+
 	if (fsync(bdev->fd)) {
 		tcmu_dev_err(dev, "sync failed\n");
 		ret = TCMU_STS_WR_ERR;
@@ -1498,7 +1690,11 @@ done:
 	return ret;
 }
 
-static const char qcow_cfg_desc[] = "The path to the QEMU QCOW image file.";
+static const char qcow_cfg_desc[] =
+	"The path to the QEMU QCOW image file.\n"
+	"The metadata caches can be sized with optional leading options,\n"
+	"e.g. l2cache-32/rccache-8@/path/to/image to cache 32 MB of L2\n"
+	"tables and 8 MB of refcount blocks.";
 
 static struct tcmur_handler qcow_handler = {
 	.name = "QEMU Copy-On-Write image file",
@@ -25,6 +25,7 @@
 
 #include <scsi/scsi.h>
 
+#include "ccan/list/list.h"
 #include "darray.h"
 #include "tcmu-runner.h"
 #include "tcmur_cmd_handler.h"
@@ -73,6 +74,7 @@
 
 struct tcmu_rbd_state {
 	rados_t cluster;
+	struct tcmu_rbd_cluster *cluster_entry;
 	rados_ioctx_t io_ctx;
 	rbd_image_t image;
 
@@ -82,12 +84,18 @@ struct tcmu_rbd_state {
 	char *conf_path;
 	char *id;
 	char *addrs;
+
+	/* freelist of aio_cbs recycled by the completion path */
+	pthread_spinlock_t aio_cb_lock;
+	struct rbd_aio_cb *free_aio_cbs;
 };
 
 enum rbd_aio_type {
 	RBD_AIO_TYPE_WRITE = 0,
 	RBD_AIO_TYPE_READ,
-	RBD_AIO_TYPE_CAW
+	RBD_AIO_TYPE_CAW,
+	/* write that must chain a flush before completing (FUA) */
+	RBD_AIO_TYPE_WRITE_FUA,
 };
 
 struct rbd_aio_cb {
@@ -103,15 +111,114 @@ struct rbd_aio_cb {
 			uint64_t offset;
 			uint64_t miscompare_offset;
 		} caw;
+		struct {
+			int pending;
+			int64_t result;
+		} batch;
 	};
 	char *bounce_buffer;
 	struct iovec *iov;
 	size_t iov_cnt;
+
+	struct rbd_aio_cb *next_free;
 };
 
 static pthread_mutex_t blacklist_caches_lock = PTHREAD_MUTEX_INITIALIZER;
 static darray(char *) blacklist_caches;
 
+/*
+ * One rados cluster connection is shared by every device with the
+ * same (conf_path, id, osd_op_timeout) tuple, refcounted against
+ * device close, so 300 LUNs on one cluster cost one connection's
+ * sockets, threads and authentication instead of 300.
+ */
+struct tcmu_rbd_cluster {
+	struct list_node entry;
+	char *conf_path;
+	char *id;
+	char *osd_op_timeout;
+	rados_t cluster;
+	int refcnt;
+	/* delisted after a blacklist event; freed when refs drain */
+	bool dead;
+};
+
+static pthread_mutex_t cluster_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(cluster_list);
+
+static bool str_match(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+	return !strcmp(a, b);
+}
+
+static struct tcmu_rbd_cluster *
+tcmu_rbd_cluster_find(struct tcmu_rbd_state *state)
+{
+	struct tcmu_rbd_cluster *conn;
+
+	list_for_each(&cluster_list, conn, entry) {
+		if (str_match(conn->conf_path, state->conf_path) &&
+		    str_match(conn->id, state->id) &&
+		    str_match(conn->osd_op_timeout, state->osd_op_timeout))
+			return conn;
+	}
+
+	return NULL;
+}
+
+static void tcmu_rbd_cluster_put(struct tcmu_rbd_state *state)
+{
+	struct tcmu_rbd_cluster *conn = state->cluster_entry;
+
+	if (!conn)
+		return;
+	state->cluster_entry = NULL;
+	state->cluster = NULL;
+
+	pthread_mutex_lock(&cluster_list_lock);
+	if (--conn->refcnt) {
+		pthread_mutex_unlock(&cluster_list_lock);
+		return;
+	}
+	/* a dead connection was already delisted at blacklist time */
+	if (!conn->dead)
+		list_del(&conn->entry);
+	pthread_mutex_unlock(&cluster_list_lock);
+
+	rados_shutdown(conn->cluster);
+	free(conn->conf_path);
+	free(conn->id);
+	free(conn->osd_op_timeout);
+	free(conn);
+}
+
+/*
+ * The cluster got us blacklisted: escaping requires a fresh rados
+ * client (new nonce), so delist this connection from the cache.
+ * Devices that reopen now build a new connection while the old one
+ * drains with the remaining sharers' closes; without this, a shared
+ * reopen would be handed the same blacklisted client back and no
+ * LUN on the connection could ever recover.
+ */
+static void tcmu_rbd_cluster_invalidate(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	struct tcmu_rbd_cluster *conn = state->cluster_entry;
+
+	if (!conn)
+		return;
+
+	pthread_mutex_lock(&cluster_list_lock);
+	if (!conn->dead) {
+		tcmu_dev_warn(dev, "dropping blacklisted cluster connection from the cache\n");
+		conn->dead = true;
+		list_del(&conn->entry);
+	}
+	pthread_mutex_unlock(&cluster_list_lock);
+}
+
 #ifdef LIBRADOS_SUPPORTS_SERVICES
 
 #ifdef RBD_LOCK_ACQUIRE_SUPPORT
@@ -209,6 +316,9 @@ static int tcmu_rbd_service_register(struct tcmu_device *dev)
 
 	ret = rados_service_register(state->cluster, "tcmu-runner",
 				     daemon_buf, metadata_buf);
+	if (ret == -EEXIST)
+		/* already registered by another device on this cluster */
+		ret = 0;
 	if (ret < 0) {
 		tcmu_dev_err(dev, "Could not register service to cluster. (Err %d)\n",
 			     ret);
@@ -489,9 +599,8 @@ static void tcmu_rbd_image_close(struct tcmu_device *dev)
 
 	rbd_close(state->image);
 	rados_ioctx_destroy(state->io_ctx);
-	rados_shutdown(state->cluster);
+	tcmu_rbd_cluster_put(state);
 
-	state->cluster = NULL;
 	state->io_ctx = NULL;
 	state->image = NULL;
 }
@@ -567,26 +676,55 @@ set:
 			      state->osd_op_timeout);
 }
 
-static int tcmu_rbd_image_open(struct tcmu_device *dev)
+static int tcmu_rbd_cluster_get(struct tcmu_device *dev)
 {
 	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	struct tcmu_rbd_cluster *conn, *race;
 	int ret;
 
-	ret = rados_create(&state->cluster, state->id);
+	pthread_mutex_lock(&cluster_list_lock);
+	conn = tcmu_rbd_cluster_find(state);
+	if (conn) {
+		conn->refcnt++;
+		pthread_mutex_unlock(&cluster_list_lock);
+		state->cluster_entry = conn;
+		state->cluster = conn->cluster;
+		return 0;
+	}
+	pthread_mutex_unlock(&cluster_list_lock);
+
+	/*
+	 * Connect outside the lock so parallel bring-up opens of
+	 * different clusters (or a racing open of the same one) are
+	 * not serialized behind authentication round trips.
+	 */
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		return -ENOMEM;
+	conn->refcnt = 1;
+	if (state->conf_path)
+		conn->conf_path = strdup(state->conf_path);
+	if (state->id)
+		conn->id = strdup(state->id);
+	if (state->osd_op_timeout)
+		conn->osd_op_timeout = strdup(state->osd_op_timeout);
+
+	ret = rados_create(&conn->cluster, state->id);
 	if (ret < 0) {
 		tcmu_dev_err(dev, "Could not create cluster. (Err %d)\n", ret);
-		return ret;
+		goto free_conn;
 	}
+	state->cluster = conn->cluster;
 
 	/* Try default location when conf_path=NULL, but ignore failure */
-	ret = rados_conf_read_file(state->cluster, state->conf_path);
+	ret = rados_conf_read_file(conn->cluster, state->conf_path);
 	if (state->conf_path && ret < 0) {
 		tcmu_dev_err(dev, "Could not read config %s (Err %d)",
 			     state->conf_path, ret);
-		goto rados_shutdown;
+		goto shutdown_conn;
 	}
 
-	rados_conf_set(state->cluster, "rbd_cache", "false");
+	rados_conf_set(conn->cluster, "rbd_cache", "false");
 
 	ret = timer_check_and_set_def(dev);
 	if (ret)
@@ -594,12 +732,55 @@ static int tcmu_rbd_image_open(struct tcmu_device *dev)
 			      "Could not set rados osd op timeout to %s (Err %d. Failover may be delayed.)\n",
 			      state->osd_op_timeout, ret);
 
-	ret = rados_connect(state->cluster);
+	ret = rados_connect(conn->cluster);
 	if (ret < 0) {
 		tcmu_dev_err(dev, "Could not connect to cluster. (Err %d)\n",
 			     ret);
-		goto rados_shutdown;
+		goto shutdown_conn;
+	}
+
+	pthread_mutex_lock(&cluster_list_lock);
+	race = tcmu_rbd_cluster_find(state);
+	if (race) {
+		/* another open beat us to it, share theirs */
+		race->refcnt++;
+		pthread_mutex_unlock(&cluster_list_lock);
+
+		rados_shutdown(conn->cluster);
+		free(conn->conf_path);
+		free(conn->id);
+		free(conn->osd_op_timeout);
+		free(conn);
+
+		state->cluster_entry = race;
+		state->cluster = race->cluster;
+		return 0;
 	}
+	list_add_tail(&cluster_list, &conn->entry);
+	pthread_mutex_unlock(&cluster_list_lock);
+
+	state->cluster_entry = conn;
+	return 0;
+
+shutdown_conn:
+	rados_shutdown(conn->cluster);
+free_conn:
+	free(conn->conf_path);
+	free(conn->id);
+	free(conn->osd_op_timeout);
+	free(conn);
+	state->cluster = NULL;
+	return ret;
+}
+
+static int tcmu_rbd_image_open(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	int ret;
+
+	ret = tcmu_rbd_cluster_get(dev);
+	if (ret < 0)
+		return ret;
 
 	tcmu_rbd_detect_device_class(dev);
 	ret = rados_ioctx_create(state->cluster, state->pool_name,
@@ -630,8 +811,7 @@ rados_destroy:
 	rados_ioctx_destroy(state->io_ctx);
 	state->io_ctx = NULL;
 rados_shutdown:
-	rados_shutdown(state->cluster);
-	state->cluster = NULL;
+	tcmu_rbd_cluster_put(state);
 	return ret;
 }
 
@@ -654,6 +834,8 @@ static int tcmu_rbd_has_lock(struct tcmu_device *dev)
 	if (ret < 0) {
 		if (ret == -ESHUTDOWN) {
 			tcmu_dev_dbg(dev, "Client is blacklisted. Could not check lock ownership.\n");
+			/* the reopen must get a fresh rados client */
+			tcmu_rbd_cluster_invalidate(dev);
 		} else {
 			tcmu_dev_err(dev, "Could not check lock ownership. Error: %s.\n",
 				     strerror(-ret));
@@ -981,6 +1163,14 @@ static void tcmu_rbd_check_excl_lock_enabled(struct tcmu_device *dev)
 
 static void tcmu_rbd_state_free(struct tcmu_rbd_state *state)
 {
+	struct rbd_aio_cb *aio_cb;
+
+	while ((aio_cb = state->free_aio_cbs)) {
+		state->free_aio_cbs = aio_cb->next_free;
+		free(aio_cb);
+	}
+	pthread_spin_destroy(&state->aio_cb_lock);
+
 	if (state->conf_path)
 		free(state->conf_path);
 	if (state->osd_op_timeout)
@@ -1031,6 +1221,12 @@ static int tcmu_rbd_open(struct tcmu_device *dev, bool reopen)
 	state = calloc(1, sizeof(*state));
 	if (!state)
 		return -ENOMEM;
+
+	ret = pthread_spin_init(&state->aio_cb_lock, 0);
+	if (ret) {
+		free(state);
+		return -ret;
+	}
 	tcmur_dev_set_private(dev, state);
 
 	dev_cfg_dup = strdup(tcmu_dev_get_cfgstring(dev));
@@ -1200,6 +1396,7 @@ static void tcmu_rbd_close(struct tcmu_device *dev)
 
 static int tcmu_rbd_handle_blacklisted_cmd(struct tcmu_device *dev)
 {
+	tcmu_rbd_cluster_invalidate(dev);
 	tcmu_notify_lock_lost(dev);
 	/*
 	 * This will happen during failback normally, because
@@ -1234,7 +1431,15 @@ static int tcmu_rbd_handle_timedout_cmd(struct tcmu_device *dev)
 	return TCMU_STS_TIMEOUT;
 }
 
-#ifdef RBD_IOVEC_SUPPORT
+/*
+ * The iovec variants submit the ring data area pages to librbd as-is,
+ * with no bounce buffer and no extra memory pass. The old
+ * rbd_aio_read/rbd_aio_write bounce path is gone; building against a
+ * librbd that old is not supported any more.
+ */
+#ifndef RBD_IOVEC_SUPPORT
+#error librbd with iovec support (LIBRBD_SUPPORTS_IOVEC) is required
+#endif
 
 static rbd_image_t tcmu_dev_to_image(struct tcmu_device *dev)
 {
@@ -1248,52 +1453,43 @@ static rbd_image_t tcmu_dev_to_image(struct tcmu_device *dev)
 #define tcmu_rbd_aio_write(dev, aio_cb, completion, iov, iov_cnt, length, offset) \
 	rbd_aio_writev(tcmu_dev_to_image(dev), iov, iov_cnt, offset, completion);
 
-#else
-
-static int tcmu_rbd_aio_read(struct tcmu_device *dev, struct rbd_aio_cb *aio_cb,
-			     rbd_completion_t completion, struct iovec *iov,
-			     size_t iov_cnt, size_t length, off_t offset)
+/*
+ * aio_cbs are recycled through a per-device freelist so the
+ * steady-state data path stops hammering the allocator; the list
+ * naturally sizes itself to the device queue depth. librbd
+ * completions are one-shot (rbd_aio_release destroys them), so they
+ * cannot be pooled the same way.
+ */
+static struct rbd_aio_cb *tcmu_rbd_aio_cb_get(struct tcmu_device *dev)
 {
 	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
-	int ret;
+	struct rbd_aio_cb *aio_cb;
 
-	aio_cb->bounce_buffer = malloc(length);
-	if (!aio_cb->bounce_buffer) {
-		tcmu_dev_err(dev, "Could not allocate bounce buffer.\n");
-		return -ENOMEM;
-	}
+	pthread_spin_lock(&state->aio_cb_lock);
+	aio_cb = state->free_aio_cbs;
+	if (aio_cb)
+		state->free_aio_cbs = aio_cb->next_free;
+	pthread_spin_unlock(&state->aio_cb_lock);
 
-	ret = rbd_aio_read(state->image, offset, length, aio_cb->bounce_buffer,
-			   completion);
-	if (ret < 0)
-		free(aio_cb->bounce_buffer);
-	return ret;
+	if (aio_cb)
+		memset(aio_cb, 0, sizeof(*aio_cb));
+	else
+		aio_cb = calloc(1, sizeof(*aio_cb));
+
+	return aio_cb;
 }
 
-static int tcmu_rbd_aio_write(struct tcmu_device *dev, struct rbd_aio_cb *aio_cb,
-			      rbd_completion_t completion, struct iovec *iov,
-			      size_t iov_cnt, size_t length, off_t offset)
+static void tcmu_rbd_aio_cb_put(struct tcmu_device *dev,
+				struct rbd_aio_cb *aio_cb)
 {
 	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
-	int ret;
-
-	aio_cb->bounce_buffer = malloc(length);
-	if (!aio_cb->bounce_buffer) {
-		tcmu_dev_err(dev, "Failed to allocate bounce buffer.\n");
-		return -ENOMEM;;
-	}
 
-	tcmu_memcpy_from_iovec(aio_cb->bounce_buffer, length, iov, iov_cnt);
-
-	ret = rbd_aio_write(state->image, offset, length, aio_cb->bounce_buffer,
-			    completion);
-	if (ret < 0)
-		free(aio_cb->bounce_buffer);
-	return ret;
+	pthread_spin_lock(&state->aio_cb_lock);
+	aio_cb->next_free = state->free_aio_cbs;
+	state->free_aio_cbs = aio_cb;
+	pthread_spin_unlock(&state->aio_cb_lock);
 }
 
-#endif
-
 /*
  * NOTE: RBD async APIs almost always return 0 (success), except
  * when allocation (via new) fails - which is not caught. So,
@@ -1314,6 +1510,26 @@ static void rbd_finish_aio_generic(rbd_completion_t completion,
 	ret = rbd_aio_get_return_value(completion);
 	rbd_aio_release(completion);
 
+	if (aio_cb->type == RBD_AIO_TYPE_WRITE_FUA) {
+		/* make just this write durable with a chained flush */
+		aio_cb->type = RBD_AIO_TYPE_WRITE;
+		if (ret >= 0) {
+			struct tcmu_rbd_state *state =
+						tcmur_dev_get_private(dev);
+			rbd_completion_t fcomp;
+
+			if (!rbd_aio_create_completion(aio_cb,
+					(rbd_callback_t) rbd_finish_aio_generic,
+					&fcomp)) {
+				if (rbd_aio_flush(state->image, fcomp) >= 0)
+					return;
+				rbd_aio_release(fcomp);
+			}
+			tcmu_dev_err(dev, "Could not chain FUA flush.\n");
+			ret = -EIO;
+		}
+	}
+
 	if (ret == -ETIMEDOUT) {
 		tcmu_r = tcmu_rbd_handle_timedout_cmd(dev);
 	} else if (ret == -ESHUTDOWN || ret == -EROFS) {
@@ -1348,7 +1564,7 @@ static void rbd_finish_aio_generic(rbd_completion_t completion,
 
 	if (aio_cb->bounce_buffer)
 		free(aio_cb->bounce_buffer);
-	free(aio_cb);
+	tcmu_rbd_aio_cb_put(dev, aio_cb);
 }
 
 static int tcmu_rbd_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
@@ -1359,7 +1575,7 @@ static int tcmu_rbd_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
 	rbd_completion_t completion;
 	ssize_t ret;
 
-	aio_cb = calloc(1, sizeof(*aio_cb));
+	aio_cb = tcmu_rbd_aio_cb_get(dev);
 	if (!aio_cb) {
 		tcmu_dev_err(dev, "Could not allocate aio_cb.\n");
 		goto out;
@@ -1388,27 +1604,28 @@ static int tcmu_rbd_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
 out_release_tracked_aio:
 	rbd_aio_release(completion);
 out_free_aio_cb:
-	free(aio_cb);
+	tcmu_rbd_aio_cb_put(dev, aio_cb);
 out:
 	return TCMU_STS_NO_RESOURCE;
 }
 
-static int tcmu_rbd_write(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
-			  struct iovec *iov, size_t iov_cnt, size_t length,
-			  off_t offset)
+static int __tcmu_rbd_write(struct tcmu_device *dev,
+			    struct tcmur_cmd *tcmur_cmd, struct iovec *iov,
+			    size_t iov_cnt, size_t length, off_t offset,
+			    enum rbd_aio_type type)
 {
 	struct rbd_aio_cb *aio_cb;
 	rbd_completion_t completion;
 	ssize_t ret;
 
-	aio_cb = calloc(1, sizeof(*aio_cb));
+	aio_cb = tcmu_rbd_aio_cb_get(dev);
 	if (!aio_cb) {
 		tcmu_dev_err(dev, "Could not allocate aio_cb.\n");
 		goto out;
 	}
 
 	aio_cb->dev = dev;
-	aio_cb->type = RBD_AIO_TYPE_WRITE;
+	aio_cb->type = type;
 	aio_cb->tcmur_cmd = tcmur_cmd;
 
 	ret = rbd_aio_create_completion
@@ -1428,11 +1645,29 @@ static int tcmu_rbd_write(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
 out_release_tracked_aio:
 	rbd_aio_release(completion);
 out_free_aio_cb:
-	free(aio_cb);
+	tcmu_rbd_aio_cb_put(dev, aio_cb);
 out:
 	return TCMU_STS_NO_RESOURCE;
 }
 
+static int tcmu_rbd_write(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			  struct iovec *iov, size_t iov_cnt, size_t length,
+			  off_t offset)
+{
+	return __tcmu_rbd_write(dev, tcmur_cmd, iov, iov_cnt, length, offset,
+				RBD_AIO_TYPE_WRITE);
+}
+
+static int tcmu_rbd_write_flags(struct tcmu_device *dev,
+				struct tcmur_cmd *tcmur_cmd,
+				struct iovec *iov, size_t iov_cnt,
+				size_t length, off_t offset, uint32_t flags)
+{
+	return __tcmu_rbd_write(dev, tcmur_cmd, iov, iov_cnt, length, offset,
+				(flags & TCMUR_WRITE_FLAG_FUA) ?
+				RBD_AIO_TYPE_WRITE_FUA : RBD_AIO_TYPE_WRITE);
+}
+
 #ifdef RBD_DISCARD_SUPPORT
 static int tcmu_rbd_unmap(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
 			  uint64_t off, uint64_t len)
@@ -1442,7 +1677,7 @@ static int tcmu_rbd_unmap(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
 	rbd_completion_t completion;
 	ssize_t ret;
 
-	aio_cb = calloc(1, sizeof(*aio_cb));
+	aio_cb = tcmu_rbd_aio_cb_get(dev);
 	if (!aio_cb) {
 		tcmu_dev_err(dev, "Could not allocate aio_cb.\n");
 		goto out;
@@ -1467,10 +1702,112 @@ static int tcmu_rbd_unmap(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
 out_remove_tracked_aio:
 	rbd_aio_release(completion);
 out_free_aio_cb:
-	free(aio_cb);
+	tcmu_rbd_aio_cb_put(dev, aio_cb);
 out:
 	return TCMU_STS_NO_RESOURCE;
 }
+
+/*
+ * One completion for a whole batch of discards: the last discard to
+ * finish completes the command with the first recorded error.
+ */
+static void rbd_finish_aio_batch(rbd_completion_t completion,
+				 struct rbd_aio_cb *aio_cb)
+{
+	struct tcmu_device *dev = aio_cb->dev;
+	struct tcmur_cmd *tcmur_cmd = aio_cb->tcmur_cmd;
+	int64_t ret, expected = 0;
+	int tcmu_r;
+
+	ret = rbd_aio_get_return_value(completion);
+	rbd_aio_release(completion);
+
+	if (ret < 0)
+		__atomic_compare_exchange_n(&aio_cb->batch.result, &expected,
+					    ret, false, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED);
+
+	if (__atomic_sub_fetch(&aio_cb->batch.pending, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	ret = __atomic_load_n(&aio_cb->batch.result, __ATOMIC_RELAXED);
+	if (ret == -ETIMEDOUT) {
+		tcmu_r = tcmu_rbd_handle_timedout_cmd(dev);
+	} else if (ret == -ESHUTDOWN || ret == -EROFS) {
+		tcmu_r = tcmu_rbd_handle_blacklisted_cmd(dev);
+	} else if (ret < 0) {
+		tcmu_dev_err(dev, "Got fatal discard error %"PRId64".\n", ret);
+		tcmu_r = TCMU_STS_WR_ERR;
+	} else {
+		tcmu_r = TCMU_STS_OK;
+	}
+
+	tcmur_cmd_complete(dev, tcmur_cmd, tcmu_r);
+	tcmu_rbd_aio_cb_put(dev, aio_cb);
+}
+
+static int tcmu_rbd_unmap_ranges(struct tcmu_device *dev,
+				 struct tcmur_cmd *tcmur_cmd,
+				 struct tcmur_unmap_range *ranges,
+				 size_t nr_ranges)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	struct rbd_aio_cb *aio_cb;
+	rbd_completion_t completion;
+	size_t i;
+	ssize_t ret;
+
+	aio_cb = tcmu_rbd_aio_cb_get(dev);
+	if (!aio_cb) {
+		tcmu_dev_err(dev, "Could not allocate aio_cb.\n");
+		return TCMU_STS_NO_RESOURCE;
+	}
+
+	aio_cb->dev = dev;
+	aio_cb->tcmur_cmd = tcmur_cmd;
+	aio_cb->type = RBD_AIO_TYPE_WRITE;
+	aio_cb->batch.pending = nr_ranges;
+	aio_cb->batch.result = 0;
+
+	for (i = 0; i < nr_ranges; i++) {
+		ret = rbd_aio_create_completion
+			(aio_cb, (rbd_callback_t) rbd_finish_aio_batch,
+			 &completion);
+		if (ret < 0)
+			goto drop_rest;
+
+		ret = rbd_aio_discard(state->image, ranges[i].off,
+				      ranges[i].len, completion);
+		if (ret < 0) {
+			rbd_aio_release(completion);
+			goto drop_rest;
+		}
+	}
+
+	return TCMU_STS_OK;
+
+drop_rest:
+	/*
+	 * Account for the ranges that will never be submitted; the
+	 * already-submitted ones still complete the command.
+	 */
+	__atomic_compare_exchange_n(&aio_cb->batch.result,
+				    &(int64_t){0}, ret, false,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	if (!__atomic_sub_fetch(&aio_cb->batch.pending, nr_ranges - i,
+				__ATOMIC_ACQ_REL)) {
+		if (!i) {
+			/* nothing was in flight at all, fail synchronously */
+			tcmu_rbd_aio_cb_put(dev, aio_cb);
+			return TCMU_STS_NO_RESOURCE;
+		}
+		/* every submitted discard already finished */
+		tcmur_cmd_complete(dev, tcmur_cmd, TCMU_STS_WR_ERR);
+		tcmu_rbd_aio_cb_put(dev, aio_cb);
+	}
+
+	return TCMU_STS_OK;
+}
 #endif /* RBD_DISCARD_SUPPORT */
 
 #ifdef LIBRBD_SUPPORTS_AIO_FLUSH
@@ -1482,7 +1819,7 @@ static int tcmu_rbd_flush(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
 	rbd_completion_t completion;
 	ssize_t ret;
 
-	aio_cb = calloc(1, sizeof(*aio_cb));
+	aio_cb = tcmu_rbd_aio_cb_get(dev);
 	if (!aio_cb) {
 		tcmu_dev_err(dev, "Could not allocate aio_cb.\n");
 		goto out;
@@ -1509,7 +1846,7 @@ static int tcmu_rbd_flush(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
 out_remove_tracked_aio:
 	rbd_aio_release(completion);
 out_free_aio_cb:
-	free(aio_cb);
+	tcmu_rbd_aio_cb_put(dev, aio_cb);
 out:
 	return TCMU_STS_NO_RESOURCE;
 }
@@ -1526,9 +1863,10 @@ static int tcmu_rbd_aio_writesame(struct tcmu_device *dev,
 	struct rbd_aio_cb *aio_cb;
 	rbd_completion_t completion;
 	size_t length = tcmu_iovec_length(iov, iov_cnt);
+	char *pattern;
 	ssize_t ret;
 
-	aio_cb = calloc(1, sizeof(*aio_cb));
+	aio_cb = tcmu_rbd_aio_cb_get(dev);
 	if (!aio_cb) {
 		tcmu_dev_err(dev, "Could not allocate aio_cb.\n");
 		goto out;
@@ -1538,13 +1876,24 @@ static int tcmu_rbd_aio_writesame(struct tcmu_device *dev,
 	aio_cb->tcmur_cmd = tcmur_cmd;
 	aio_cb->type = RBD_AIO_TYPE_WRITE;
 
-	aio_cb->bounce_buffer = malloc(length);
-	if (!aio_cb->bounce_buffer) {
-		tcmu_dev_err(dev, "Failed to allocate bounce buffer.\n");
-		goto out_free_aio_cb;
-	}
+	/*
+	 * The pattern block is valid in the ring data area until the
+	 * command completes, so a single-segment pattern goes to librbd
+	 * as-is and only a pattern straddling data blocks is copied.
+	 */
+	if (iov_cnt == 1) {
+		pattern = iov->iov_base;
+	} else {
+		aio_cb->bounce_buffer = malloc(length);
+		if (!aio_cb->bounce_buffer) {
+			tcmu_dev_err(dev, "Failed to allocate bounce buffer.\n");
+			goto out_free_aio_cb;
+		}
 
-	tcmu_memcpy_from_iovec(aio_cb->bounce_buffer, length, iov, iov_cnt);
+		tcmu_memcpy_from_iovec(aio_cb->bounce_buffer, length, iov,
+				       iov_cnt);
+		pattern = aio_cb->bounce_buffer;
+	}
 
 	ret = rbd_aio_create_completion
 		(aio_cb, (rbd_callback_t) rbd_finish_aio_generic, &completion);
@@ -1553,7 +1902,7 @@ static int tcmu_rbd_aio_writesame(struct tcmu_device *dev,
 
 	tcmu_dev_dbg(dev, "Start write same off:%"PRIu64", len:%"PRIu64"\n", off, len);
 
-	ret = rbd_aio_writesame(state->image, off, len, aio_cb->bounce_buffer,
+	ret = rbd_aio_writesame(state->image, off, len, pattern,
 				length, completion, 0);
 	if (ret < 0)
 		goto out_remove_tracked_aio;
@@ -1565,7 +1914,7 @@ out_remove_tracked_aio:
 out_free_bounce_buffer:
 	free(aio_cb->bounce_buffer);
 out_free_aio_cb:
-	free(aio_cb);
+	tcmu_rbd_aio_cb_put(dev, aio_cb);
 out:
 	return TCMU_STS_NO_RESOURCE;
 }
@@ -1582,7 +1931,7 @@ static int tcmu_rbd_aio_caw(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd
 	uint64_t buffer_length = 2 * len;
 	ssize_t ret;
 
-	aio_cb = calloc(1, sizeof(*aio_cb));
+	aio_cb = tcmu_rbd_aio_cb_get(dev);
 	if (!aio_cb) {
 		tcmu_dev_err(dev, "Could not allocate aio_cb.\n");
 		goto out;
@@ -1625,7 +1974,7 @@ out_remove_tracked_aio:
 out_free_bounce_buffer:
 	free(aio_cb->bounce_buffer);
 out_free_aio_cb:
-	free(aio_cb);
+	tcmu_rbd_aio_cb_put(dev, aio_cb);
 out:
 	return TCMU_STS_NO_RESOURCE;
 }
@@ -1703,6 +2052,7 @@ struct tcmur_handler tcmu_rbd_handler = {
 	.close	       = tcmu_rbd_close,
 	.read	       = tcmu_rbd_read,
 	.write	       = tcmu_rbd_write,
+	.write_flags   = tcmu_rbd_write_flags,
 	.reconfig      = tcmu_rbd_reconfig,
 #ifdef LIBRADOS_SUPPORTS_SERVICES
 	.report_event  = tcmu_rbd_report_event,
@@ -1712,6 +2062,7 @@ struct tcmur_handler tcmu_rbd_handler = {
 #endif
 #ifdef RBD_DISCARD_SUPPORT
 	.unmap         = tcmu_rbd_unmap,
+	.unmap_ranges  = tcmu_rbd_unmap_ranges,
 #endif
 #ifdef RBD_WRITE_SAME_SUPPORT
 	.writesame     = tcmu_rbd_aio_writesame,
@@ -0,0 +1,511 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Benchmark harness that drives a tcmur handler module in-process,
+ * with no kernel device and no initiator rig: it dlopens the same
+ * handler_*.so files tcmu-runner loads, fabricates a device, and
+ * calls the read/write/flush callouts directly from a configurable
+ * number of worker threads. Reports IOPS and latency percentiles.
+ *
+ * Generated workloads are random-offset with a configurable block
+ * size and read percentage; --replay feeds a trace instead, one
+ * "R|W <sector> <nr_sectors>" line per I/O as produced by
+ * blkparse -f "%d %S %n\n".
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "libtcmu.h"
+#include "libtcmu_common.h"
+#include "libtcmu_priv.h"
+#include "libtcmu_log.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+
+#define BENCH_MAX_LATS (1024 * 1024)
+
+static struct tcmur_handler *bench_handler;
+
+static struct {
+	char *handler_path;
+	char *cfgstring;
+	uint64_t dev_size;
+	uint32_t block_size;
+	uint32_t io_size;
+	int nr_workers;
+	int read_pct;
+	int runtime_secs;
+	char *replay_path;
+} opts = {
+	.dev_size = 1ULL << 30,
+	.block_size = 512,
+	.io_size = 4096,
+	.nr_workers = 1,
+	.read_pct = 100,
+	.runtime_secs = 10,
+};
+
+/*
+ * The handler .so resolves its tcmur_* imports from us, so provide
+ * the handful the data path needs instead of linking the runner.
+ */
+int tcmur_register_handler(struct tcmur_handler *handler)
+{
+	if (handler->init && handler->init())
+		return -1;
+
+	bench_handler = handler;
+	return 0;
+}
+
+void tcmur_dev_set_private(struct tcmu_device *dev, void *private)
+{
+	struct tcmur_device *rdev = dev->hm_private;
+
+	rdev->hm_private = private;
+}
+
+void *tcmur_dev_get_private(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = dev->hm_private;
+
+	return rdev->hm_private;
+}
+
+/* one in-flight benchmark I/O wrapping the tcmur command contract */
+struct bench_cmd {
+	struct tcmur_cmd cmd;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool finished;
+	int result;
+};
+
+static void bench_cmd_done(struct tcmu_device *dev,
+			   struct tcmur_cmd *tcmur_cmd, int rc)
+{
+	struct bench_cmd *bcmd = (struct bench_cmd *)tcmur_cmd;
+
+	pthread_mutex_lock(&bcmd->lock);
+	bcmd->result = rc;
+	bcmd->finished = true;
+	pthread_cond_signal(&bcmd->cond);
+	pthread_mutex_unlock(&bcmd->lock);
+}
+
+void tcmur_cmd_complete(struct tcmu_device *dev, void *data, int rc)
+{
+	struct tcmur_cmd *tcmur_cmd = data;
+
+	tcmur_cmd->done(dev, tcmur_cmd, rc);
+}
+
+/* unused by the data path, referenced by some handlers */
+void tcmu_notify_conn_lost(struct tcmu_device *dev)
+{
+}
+
+void tcmu_notify_lock_lost(struct tcmu_device *dev)
+{
+}
+
+void tcmu_notify_cmd_timed_out(struct tcmu_device *dev)
+{
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct bench_worker {
+	pthread_t thread;
+	struct tcmu_device *dev;
+	int id;
+
+	uint64_t ios;
+	uint64_t errors;
+	uint32_t *lats_us;
+	uint64_t nr_lats;
+
+	unsigned int seed;
+};
+
+struct replay_entry {
+	bool is_read;
+	uint64_t offset;
+	uint32_t length;
+};
+
+static struct replay_entry *replay;
+static uint64_t nr_replay;
+
+static volatile bool bench_stop;
+
+static int bench_issue(struct bench_worker *worker, bool is_read,
+		       uint64_t offset, uint32_t length, char *buf)
+{
+	struct bench_cmd bcmd;
+	struct iovec iov;
+	int ret;
+
+	memset(&bcmd.cmd, 0, sizeof(bcmd.cmd));
+	pthread_mutex_init(&bcmd.lock, NULL);
+	pthread_cond_init(&bcmd.cond, NULL);
+	bcmd.finished = false;
+	bcmd.cmd.done = bench_cmd_done;
+
+	iov.iov_base = buf;
+	iov.iov_len = length;
+
+	if (is_read)
+		ret = bench_handler->read(worker->dev, &bcmd.cmd, &iov, 1,
+					  length, offset);
+	else
+		ret = bench_handler->write(worker->dev, &bcmd.cmd, &iov, 1,
+					   length, offset);
+
+	/*
+	 * Handlers with worker threads complete from the calling
+	 * context; async handlers (nr_threads 0) return TCMU_STS_OK
+	 * once queued and finish through tcmur_cmd_complete().
+	 */
+	if (ret == TCMU_STS_OK && !bench_handler->nr_threads) {
+		pthread_mutex_lock(&bcmd.lock);
+		while (!bcmd.finished)
+			pthread_cond_wait(&bcmd.cond, &bcmd.lock);
+		ret = bcmd.result;
+		pthread_mutex_unlock(&bcmd.lock);
+	}
+
+	pthread_cond_destroy(&bcmd.cond);
+	pthread_mutex_destroy(&bcmd.lock);
+
+	return ret;
+}
+
+static void *bench_worker_fn(void *arg)
+{
+	struct bench_worker *worker = arg;
+	uint64_t offset, max_blocks, start;
+	uint32_t length;
+	uint64_t ri = worker->id;
+	bool is_read;
+	char *buf;
+	int ret;
+
+	buf = malloc(opts.io_size > opts.block_size ?
+		     opts.io_size : opts.block_size);
+	if (!buf)
+		return NULL;
+	memset(buf, 0x5a, opts.io_size);
+
+	max_blocks = opts.dev_size / opts.io_size;
+
+	while (!bench_stop) {
+		if (replay) {
+			if (ri >= nr_replay)
+				break;
+			is_read = replay[ri].is_read;
+			offset = replay[ri].offset;
+			length = replay[ri].length;
+			if (length > opts.io_size)
+				length = opts.io_size;
+			ri += opts.nr_workers;
+		} else {
+			is_read = (int)(rand_r(&worker->seed) % 100) <
+				  opts.read_pct;
+			offset = (rand_r(&worker->seed) % max_blocks) *
+				 (uint64_t)opts.io_size;
+			length = opts.io_size;
+		}
+
+		start = now_ns();
+		ret = bench_issue(worker, is_read, offset, length, buf);
+		if (ret != TCMU_STS_OK) {
+			worker->errors++;
+			continue;
+		}
+
+		if (worker->nr_lats < BENCH_MAX_LATS)
+			worker->lats_us[worker->nr_lats++] =
+				(now_ns() - start) / 1000;
+		worker->ios++;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int load_replay(const char *path)
+{
+	char dir[8];
+	uint64_t sector, cap = 0;
+	uint32_t sectors;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "could not open replay file %s: %m\n", path);
+		return -1;
+	}
+
+	while (fscanf(f, "%7s %"PRIu64" %"PRIu32"\n", dir, &sector,
+		      &sectors) == 3) {
+		if (nr_replay == cap) {
+			cap = cap ? cap * 2 : 1024;
+			replay = realloc(replay, cap * sizeof(*replay));
+			if (!replay) {
+				fclose(f);
+				return -1;
+			}
+		}
+		replay[nr_replay].is_read = (dir[0] == 'R' || dir[0] == 'r');
+		replay[nr_replay].offset = sector * 512ULL;
+		replay[nr_replay].length = sectors * 512;
+		nr_replay++;
+	}
+
+	fclose(f);
+	printf("loaded %"PRIu64" replay entries from %s\n", nr_replay, path);
+	return nr_replay ? 0 : -1;
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	uint32_t la = *(const uint32_t *)a, lb = *(const uint32_t *)b;
+
+	return la < lb ? -1 : la > lb;
+}
+
+static void report(struct bench_worker *workers, uint64_t elapsed_ns)
+{
+	uint64_t total_ios = 0, total_errs = 0, nr_lats = 0, off = 0;
+	uint32_t *lats;
+	int i;
+
+	for (i = 0; i < opts.nr_workers; i++) {
+		total_ios += workers[i].ios;
+		total_errs += workers[i].errors;
+		nr_lats += workers[i].nr_lats;
+	}
+
+	lats = malloc(nr_lats * sizeof(*lats));
+	if (!lats)
+		return;
+
+	for (i = 0; i < opts.nr_workers; i++) {
+		memcpy(lats + off, workers[i].lats_us,
+		       workers[i].nr_lats * sizeof(*lats));
+		off += workers[i].nr_lats;
+	}
+	qsort(lats, nr_lats, sizeof(*lats), lat_cmp);
+
+	printf("ios: %"PRIu64" errors: %"PRIu64"\n", total_ios, total_errs);
+	printf("iops: %.0f\n",
+	       total_ios / ((double)elapsed_ns / 1000000000.0));
+	if (nr_lats) {
+		printf("lat usec: p50=%u p95=%u p99=%u p999=%u max=%u\n",
+		       lats[nr_lats * 50 / 100],
+		       lats[nr_lats * 95 / 100],
+		       lats[nr_lats * 99 / 100],
+		       lats[nr_lats * 999 / 1000],
+		       lats[nr_lats - 1]);
+	}
+
+	free(lats);
+}
+
+static struct tcmu_device *bench_dev_create(void)
+{
+	struct tcmu_device *dev;
+	struct tcmur_device *rdev;
+
+	dev = calloc(1, sizeof(*dev));
+	rdev = calloc(1, sizeof(*rdev));
+	if (!dev || !rdev) {
+		free(dev);
+		free(rdev);
+		return NULL;
+	}
+
+	dev->hm_private = rdev;
+	rdev->dev = dev;
+
+	snprintf(dev->dev_name, sizeof(dev->dev_name), "bench0");
+	snprintf(dev->tcm_dev_name, sizeof(dev->tcm_dev_name), "bench0");
+	snprintf(dev->cfgstring, sizeof(dev->cfgstring), "%s/%s",
+		 bench_handler->subtype, opts.cfgstring);
+
+	tcmu_dev_set_block_size(dev, opts.block_size);
+	tcmu_dev_set_num_lbas(dev, opts.dev_size / opts.block_size);
+	tcmu_dev_set_max_xfer_len(dev, (1024 * 1024) / opts.block_size);
+
+	return dev;
+}
+
+static void usage(void)
+{
+	printf("Usage: tcmu-bench [options] -H handler.so -c cfgstring\n"
+	       "  -H, --handler    path to the handler_*.so module\n"
+	       "  -c, --cfg        handler cfgstring (without subtype prefix)\n"
+	       "  -s, --size       device size in MiB (default 1024)\n"
+	       "  -b, --bs         I/O size in bytes (default 4096)\n"
+	       "  -q, --qd         queue depth / worker threads (default 1)\n"
+	       "  -r, --read-pct   percentage of reads (default 100)\n"
+	       "  -t, --runtime    seconds to run (default 10)\n"
+	       "  -R, --replay     trace file: one 'R|W sector nr_sectors' per line\n");
+}
+
+int main(int argc, char **argv)
+{
+	static struct option long_opts[] = {
+		{ "handler",  required_argument, NULL, 'H' },
+		{ "cfg",      required_argument, NULL, 'c' },
+		{ "size",     required_argument, NULL, 's' },
+		{ "bs",       required_argument, NULL, 'b' },
+		{ "qd",       required_argument, NULL, 'q' },
+		{ "read-pct", required_argument, NULL, 'r' },
+		{ "runtime",  required_argument, NULL, 't' },
+		{ "replay",   required_argument, NULL, 'R' },
+		{ "help",     no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	int (*handler_init)(void);
+	struct bench_worker *workers;
+	struct tcmu_device *dev;
+	uint64_t start_ns;
+	void *handle;
+	char *error;
+	int c, i, ret;
+
+	while ((c = getopt_long(argc, argv, "H:c:s:b:q:r:t:R:h", long_opts,
+				NULL)) != -1) {
+		switch (c) {
+		case 'H':
+			opts.handler_path = optarg;
+			break;
+		case 'c':
+			opts.cfgstring = optarg;
+			break;
+		case 's':
+			opts.dev_size = strtoull(optarg, NULL, 0) << 20;
+			break;
+		case 'b':
+			opts.io_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			opts.nr_workers = atoi(optarg);
+			break;
+		case 'r':
+			opts.read_pct = atoi(optarg);
+			break;
+		case 't':
+			opts.runtime_secs = atoi(optarg);
+			break;
+		case 'R':
+			opts.replay_path = optarg;
+			break;
+		case 'h':
+		default:
+			usage();
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!opts.handler_path || !opts.cfgstring || opts.nr_workers < 1) {
+		usage();
+		return 1;
+	}
+
+	if (opts.replay_path && load_replay(opts.replay_path))
+		return 1;
+
+	handle = dlopen(opts.handler_path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		fprintf(stderr, "could not open handler: %s\n", dlerror());
+		return 1;
+	}
+
+	dlerror();
+	handler_init = dlsym(handle, "handler_init");
+	if ((error = dlerror())) {
+		fprintf(stderr, "dlsym failure: %s\n", error);
+		return 1;
+	}
+
+	if (handler_init() || !bench_handler) {
+		fprintf(stderr, "handler init failed\n");
+		return 1;
+	}
+
+	dev = bench_dev_create();
+	if (!dev)
+		return 1;
+
+	ret = bench_handler->open(dev, false);
+	if (ret) {
+		fprintf(stderr, "handler open failed: %d\n", ret);
+		return 1;
+	}
+
+	printf("driving %s qd=%d bs=%u read%%=%d for %ds\n",
+	       bench_handler->name, opts.nr_workers, opts.io_size,
+	       opts.read_pct, opts.runtime_secs);
+
+	workers = calloc(opts.nr_workers, sizeof(*workers));
+	if (!workers)
+		return 1;
+
+	start_ns = now_ns();
+	for (i = 0; i < opts.nr_workers; i++) {
+		workers[i].dev = dev;
+		workers[i].id = i;
+		workers[i].seed = i + 1;
+		workers[i].lats_us = calloc(BENCH_MAX_LATS,
+					    sizeof(*workers[i].lats_us));
+		if (!workers[i].lats_us)
+			return 1;
+		pthread_create(&workers[i].thread, NULL, bench_worker_fn,
+			       &workers[i]);
+	}
+
+	if (!opts.replay_path) {
+		sleep(opts.runtime_secs);
+		bench_stop = true;
+	}
+
+	for (i = 0; i < opts.nr_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	report(workers, now_ns() - start_ns);
+
+	bench_handler->close(dev);
+	if (bench_handler->destroy)
+		bench_handler->destroy();
+
+	return 0;
+}
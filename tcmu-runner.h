@@ -46,6 +46,7 @@ struct tcmur_cmd {
 	 */
 	void *iov_base_copy;
 	void *cmd_state;
+	bool state_from_slab;
 
 	/* Bytes to read/write from iovec */
 	size_t requested;
@@ -54,10 +55,28 @@ struct tcmur_cmd {
 	struct timespec start_time;
 	bool timed_out;
 
+	/* completion status while parked on rdev->parked_cmds */
+	int rc;
+
+	/* latency accounting */
+	uint64_t stat_start_ns;
+	uint8_t stat_class;
+
+	/* TCMUR_WRITE_FLAG_* for the handler write callout */
+	uint32_t write_flags;
+
 	/* callback to finish/continue command processing */
 	void (*done)(struct tcmu_device *dev, struct tcmur_cmd *cmd, int ret);
 };
 
+#define TCMUR_WRITE_FLAG_FUA (1 << 0)
+
+/* one byte range handed to the unmap_ranges handler callout */
+struct tcmur_unmap_range {
+	uint64_t off;
+	uint64_t len;
+};
+
 enum tcmur_event {
 	TCMUR_EVT_LOCK_LOST,
 	TCMUR_EVT_CONN_LOST,
@@ -148,14 +167,47 @@ struct tcmur_handler {
 		    struct iovec *iovec, size_t iov_cnt, size_t len, off_t off);
 	int (*write)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
 		     struct iovec *iovec, size_t iov_cnt, size_t len, off_t off);
+
+	/*
+	 * Optional flag-carrying variant of write, preferred when set.
+	 * TCMUR_WRITE_FLAG_FUA asks for the data to be durable when
+	 * the command completes (initiator sent WRITE with FUA), so a
+	 * separate flush round trip can be elided and write cache can
+	 * stay enabled for correctness-conscious configurations.
+	 */
+	int (*write_flags)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			   struct iovec *iovec, size_t iov_cnt, size_t len,
+			   off_t off, uint32_t flags);
 	int (*flush)(struct tcmu_device *dev, struct tcmur_cmd *cmd);
 	int (*unmap)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
 		     uint64_t off, uint64_t len);
+
+	/*
+	 * Optional batched variant of unmap: discard all nr_ranges
+	 * byte ranges in one backend call, so one UNMAP command with
+	 * many descriptors does not pay a scheduling and backend
+	 * round trip per split.
+	 */
+	int (*unmap_ranges)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			    struct tcmur_unmap_range *ranges,
+			    size_t nr_ranges);
 	int (*writesame)(struct tcmu_device *dev, struct tcmur_cmd *cmd, uint64_t off,
 			 uint64_t len, struct iovec *iovec, size_t iov_cnt);
 	int (*caw)(struct tcmu_device *dev, struct tcmur_cmd *cmd, uint64_t off,
 		   uint64_t len, struct iovec *iovec, size_t iov_cnt);
 
+	/*
+	 * Optional copy offload used by the xcopy engine when source
+	 * and destination devices are served by this handler: copy len
+	 * bytes from src_off on src_dev to dst_off on dev without
+	 * bouncing the data through userspace buffers. Return
+	 * TCMU_STS_NOT_HANDLED to have the generic read/write copy
+	 * engine take over.
+	 */
+	int (*copy_range)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			  struct tcmu_device *src_dev, uint64_t src_off,
+			  uint64_t dst_off, uint64_t len);
+
 	/*
 	 * Notify the handler of an event.
 	 *
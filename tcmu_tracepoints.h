@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMU_TRACEPOINTS_H
+#define __TCMU_TRACEPOINTS_H
+
+/*
+ * Static USDT probes (systemtap-sdt) at the command lifecycle
+ * transitions, so bpftrace/perf can build per-stage latency maps on
+ * a live daemon. Every probe carries (dev name, cmd_id, opcode).
+ * Compiled to a single nop when sys/sdt.h is unavailable.
+ *
+ * Providers/probes:
+ *   tcmu:cmd_fetch         - command pulled off the kernel ring
+ *   tcmu:cmd_dispatch      - entering the tcmur command handler
+ *   tcmu:aio_enqueue       - queued for an aio worker
+ *   tcmu:aio_dequeue       - picked up by an aio worker
+ *   tcmu:cmd_handler_done  - handler reported its completion status
+ *   tcmu:cmd_complete      - response written back into the ring
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TCMU_PROBE3(name, arg1, arg2, arg3) \
+	DTRACE_PROBE3(tcmu, name, arg1, arg2, arg3)
+#else
+#define TCMU_PROBE3(name, arg1, arg2, arg3) \
+	do { (void)(arg1); (void)(arg2); (void)(arg3); } while (0)
+#endif
+
+#endif /* __TCMU_TRACEPOINTS_H */
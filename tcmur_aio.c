@@ -11,6 +11,8 @@
 #include <assert.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "ccan/list/list.h"
 
@@ -20,171 +22,547 @@
 #include "tcmur_aio.h"
 #include "tcmu_runner_priv.h"
 #include "tcmu-runner.h"
+#include "tcmu_tracepoints.h"
 
 struct tcmu_work {
 	struct tcmu_device *dev;
 	void *data;
 	tcmu_work_fn_t work_fn;
 	tcmu_done_fn_t done_fn;
+	struct tcmu_work *next;
+};
+
+/*
+ * QoS governor: one lazy global thread ticks every few milliseconds
+ * while any device has deferred work, refilling its token buckets
+ * and releasing parked requests in arrival order.
+ */
+#define TCMUR_QOS_TICK_NS (5 * 1000 * 1000ULL)
+#define TCMUR_QOS_BURST_SECS 2
+
+struct tcmur_qos_deferred {
 	struct list_node entry;
+	struct tcmu_device *dev;
+	void *data;
+	tcmu_work_fn_t work_fn;
+	tcmu_done_fn_t done_fn;
+	size_t bytes;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool running;
+	uint64_t tick;
+	struct list_head devs;
+} qos_gov = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.devs = LIST_HEAD_INIT(qos_gov.devs),
 };
 
-static void _cleanup_mutex_lock(void *arg)
+static int aio_queue(struct tcmu_device *dev, void *data,
+		     tcmu_work_fn_t work_fn, tcmu_done_fn_t done_fn);
+
+static uint64_t qos_now_ns(void)
 {
-	pthread_mutex_unlock(arg);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-void track_aio_request_start(struct tcmur_device *rdev)
+/* called with rdev->qos.lock held */
+static void qos_refill(struct tcmur_device *rdev)
 {
-	struct tcmu_track_aio *aio_track = &rdev->track_queue;
+	uint64_t now = qos_now_ns();
+	double secs;
+
+	if (!rdev->qos.last_refill_ns)
+		rdev->qos.last_refill_ns = now;
+	secs = (double)(now - rdev->qos.last_refill_ns) / 1000000000.0;
+	rdev->qos.last_refill_ns = now;
+
+	if (rdev->qos.iops_limit) {
+		rdev->qos.iops_tokens += secs * rdev->qos.iops_limit;
+		if (rdev->qos.iops_tokens >
+		    (double)rdev->qos.iops_limit * TCMUR_QOS_BURST_SECS)
+			rdev->qos.iops_tokens = (double)rdev->qos.iops_limit *
+						TCMUR_QOS_BURST_SECS;
+	}
+	if (rdev->qos.bps_limit) {
+		rdev->qos.bps_tokens += secs * rdev->qos.bps_limit;
+		if (rdev->qos.bps_tokens >
+		    (double)rdev->qos.bps_limit * TCMUR_QOS_BURST_SECS)
+			rdev->qos.bps_tokens = (double)rdev->qos.bps_limit *
+					       TCMUR_QOS_BURST_SECS;
+	}
+}
 
-	pthread_cleanup_push(_cleanup_mutex_lock, (void *)&aio_track->track_lock);
-	pthread_mutex_lock(&aio_track->track_lock);
+/* called with rdev->qos.lock held */
+static bool qos_charge(struct tcmur_device *rdev, size_t bytes)
+{
+	if (rdev->qos.iops_limit && rdev->qos.iops_tokens < 1.0)
+		return false;
+	if (rdev->qos.bps_limit && rdev->qos.bps_tokens < (double)bytes)
+		return false;
+
+	if (rdev->qos.iops_limit)
+		rdev->qos.iops_tokens -= 1.0;
+	if (rdev->qos.bps_limit)
+		rdev->qos.bps_tokens -= (double)bytes;
+	return true;
+}
 
-	++aio_track->tracked_aio_ops;
+/* run one deferred request exactly as the scheduler would have */
+static void qos_dispatch(struct tcmur_qos_deferred *d)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(d->dev);
+	int ret;
 
-	pthread_mutex_unlock(&aio_track->track_lock);
-	pthread_cleanup_pop(0);
+	if (!rhandler->nr_threads) {
+		ret = d->work_fn(d->dev, d->data);
+		if (ret)
+			d->done_fn(d->dev, d->data, ret);
+	} else {
+		if (aio_queue(d->dev, d->data, d->work_fn, d->done_fn) !=
+		    TCMU_STS_ASYNC_HANDLED)
+			d->done_fn(d->dev, d->data, TCMU_STS_NO_RESOURCE);
+	}
+
+	free(d);
 }
 
-void track_aio_request_finish(struct tcmur_device *rdev, int *wake_up)
+/* release every affordable deferred request, oldest first */
+static void qos_release_dev(struct tcmur_device *rdev)
 {
-	struct tcmu_track_aio *aio_track = &rdev->track_queue;
-	pthread_cond_t *cond;
+	struct tcmur_qos_deferred *d;
 
-	pthread_cleanup_push(_cleanup_mutex_lock, (void *)&aio_track->track_lock);
-	pthread_mutex_lock(&aio_track->track_lock);
+	pthread_mutex_lock(&rdev->qos.lock);
+	qos_refill(rdev);
 
-	assert(aio_track->tracked_aio_ops > 0);
-	--aio_track->tracked_aio_ops;
+	while (!list_empty(&rdev->qos.deferred)) {
+		d = list_first_entry(&rdev->qos.deferred,
+				     struct tcmur_qos_deferred, entry);
+		if (!qos_charge(rdev, d->bytes))
+			break;
+		list_del(&d->entry);
 
-	if (wake_up) {
-		++aio_track->pending_wakeups;
-		*wake_up = (aio_track->pending_wakeups == 1) ? 1 : 0;
+		pthread_mutex_unlock(&rdev->qos.lock);
+		qos_dispatch(d);
+		pthread_mutex_lock(&rdev->qos.lock);
 	}
+	pthread_mutex_unlock(&rdev->qos.lock);
+}
+
+static void *qos_gov_thread(void *arg)
+{
+	struct tcmur_device *rdev, *found;
+	struct timespec ts;
+
+	tcmu_set_thread_name("qos-gov", NULL);
 
-	if (!aio_track->tracked_aio_ops && aio_track->is_empty_cond) {
-		cond = aio_track->is_empty_cond;
-		aio_track->is_empty_cond = NULL;
-		pthread_cond_signal(cond);
+	/*
+	 * qos_gov.lock is dropped around each device's token release,
+	 * so one LUN's blocked backend submit cannot stall deferral or
+	 * release for the others. The per-device sweeping flag (only
+	 * touched under qos_gov.lock) is the barrier device removal
+	 * waits on, and the per-tick stamp makes the rescan after
+	 * relocking visit each governed device exactly once.
+	 */
+	pthread_mutex_lock(&qos_gov.lock);
+	while (1) {
+		while (list_empty(&qos_gov.devs))
+			pthread_cond_wait(&qos_gov.cond, &qos_gov.lock);
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += TCMUR_QOS_TICK_NS;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&qos_gov.cond, &qos_gov.lock, &ts);
+
+		qos_gov.tick++;
+
+		while (1) {
+			found = NULL;
+			list_for_each(&qos_gov.devs, rdev, qos.gov_entry) {
+				if (rdev->qos.last_tick != qos_gov.tick) {
+					found = rdev;
+					break;
+				}
+			}
+			if (!found)
+				break;
+
+			found->qos.last_tick = qos_gov.tick;
+			found->qos.sweeping = true;
+			pthread_mutex_unlock(&qos_gov.lock);
+
+			qos_release_dev(found);
+
+			pthread_mutex_lock(&qos_gov.lock);
+			found->qos.sweeping = false;
+
+			/* removal may have delisted us while unlocked */
+			pthread_mutex_lock(&found->qos.lock);
+			if (found->qos.governed &&
+			    list_empty(&found->qos.deferred)) {
+				list_del(&found->qos.gov_entry);
+				found->qos.governed = false;
+			}
+			pthread_mutex_unlock(&found->qos.lock);
+
+			pthread_cond_broadcast(&qos_gov.cond);
+		}
 	}
 
-	pthread_mutex_unlock(&aio_track->track_lock);
-	pthread_cleanup_pop(0);
+	return NULL;
 }
 
-void track_aio_wakeup_finish(struct tcmur_device *rdev, int *wake_up)
+/* park a request for the governor; takes ownership of the args */
+static int qos_defer(struct tcmu_device *dev, struct tcmur_device *rdev,
+		     void *data, tcmu_work_fn_t work_fn,
+		     tcmu_done_fn_t done_fn, size_t bytes)
+{
+	struct tcmur_qos_deferred *d;
+
+	d = malloc(sizeof(*d));
+	if (!d)
+		return TCMU_STS_NO_RESOURCE;
+
+	d->dev = dev;
+	d->data = data;
+	d->work_fn = work_fn;
+	d->done_fn = done_fn;
+	d->bytes = bytes;
+
+	pthread_mutex_lock(&rdev->qos.lock);
+	list_add_tail(&rdev->qos.deferred, &d->entry);
+	rdev->qos.deferrals++;
+	pthread_mutex_unlock(&rdev->qos.lock);
+
+	pthread_mutex_lock(&qos_gov.lock);
+	if (!qos_gov.running) {
+		if (pthread_create(&qos_gov.thread, NULL, qos_gov_thread,
+				   NULL)) {
+			pthread_mutex_unlock(&qos_gov.lock);
+			/* no governor: run it now rather than lose it */
+			pthread_mutex_lock(&rdev->qos.lock);
+			list_del(&d->entry);
+			pthread_mutex_unlock(&rdev->qos.lock);
+			qos_dispatch(d);
+			return TCMU_STS_ASYNC_HANDLED;
+		}
+		qos_gov.running = true;
+	}
+	pthread_mutex_lock(&rdev->qos.lock);
+	if (!rdev->qos.governed) {
+		list_add_tail(&qos_gov.devs, &rdev->qos.gov_entry);
+		rdev->qos.governed = true;
+	}
+	pthread_mutex_unlock(&rdev->qos.lock);
+	pthread_cond_signal(&qos_gov.cond);
+	pthread_mutex_unlock(&qos_gov.lock);
+
+	return TCMU_STS_ASYNC_HANDLED;
+}
+
+/* flush all deferred work ignoring tokens; used at device removal */
+void tcmur_qos_drain(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_qos_deferred *d;
+
+	/*
+	 * Unhook from the governor first and wait out a release pass
+	 * that has this device in hand, so no later tick can reach the
+	 * rdev's lock or list after teardown frees it.
+	 */
+	if (qos_gov.running) {
+		pthread_mutex_lock(&qos_gov.lock);
+		pthread_mutex_lock(&rdev->qos.lock);
+		if (rdev->qos.governed) {
+			list_del(&rdev->qos.gov_entry);
+			rdev->qos.governed = false;
+		}
+		pthread_mutex_unlock(&rdev->qos.lock);
+		while (rdev->qos.sweeping)
+			pthread_cond_wait(&qos_gov.cond, &qos_gov.lock);
+		pthread_mutex_unlock(&qos_gov.lock);
+	}
+
+	while (1) {
+		pthread_mutex_lock(&rdev->qos.lock);
+		if (list_empty(&rdev->qos.deferred)) {
+			pthread_mutex_unlock(&rdev->qos.lock);
+			return;
+		}
+		d = list_first_entry(&rdev->qos.deferred,
+				     struct tcmur_qos_deferred, entry);
+		list_del(&d->entry);
+		pthread_mutex_unlock(&rdev->qos.lock);
+
+		qos_dispatch(d);
+	}
+}
+
+void track_aio_request_start(struct tcmur_device *rdev)
 {
 	struct tcmu_track_aio *aio_track = &rdev->track_queue;
 
-	pthread_cleanup_push(_cleanup_mutex_lock, (void *)&aio_track->track_lock);
-	pthread_mutex_lock(&aio_track->track_lock);
+	__atomic_add_fetch(&aio_track->tracked_aio_ops, 1, __ATOMIC_ACQ_REL);
+}
 
-	if (aio_track->pending_wakeups > 1) {
-		aio_track->pending_wakeups = 1;
-		*wake_up = 1;
-	} else {
-		assert(aio_track->pending_wakeups > 0);
-		aio_track->pending_wakeups = 0;
-		*wake_up = 0;
+void track_aio_request_finish(struct tcmur_device *rdev, int *wake_up)
+{
+	struct tcmu_track_aio *aio_track = &rdev->track_queue;
+	unsigned int left;
+
+	if (wake_up) {
+		*wake_up = __atomic_fetch_add(&aio_track->pending_wakeups, 1,
+					      __ATOMIC_ACQ_REL) == 0 ? 1 : 0;
 	}
 
-	pthread_mutex_unlock(&aio_track->track_lock);
-	pthread_cleanup_pop(0);
+	left = __atomic_sub_fetch(&aio_track->tracked_aio_ops, 1,
+				  __ATOMIC_ACQ_REL);
+	assert(left != UINT_MAX);
+
+	if (!left && __atomic_load_n(&aio_track->empty_waiters,
+				     __ATOMIC_ACQUIRE)) {
+		/* drain slow path, only taken with a waiter parked */
+		pthread_mutex_lock(&aio_track->track_lock);
+		pthread_cond_broadcast(&aio_track->is_empty_cond);
+		pthread_mutex_unlock(&aio_track->track_lock);
+	}
+}
+
+void track_aio_wakeup_finish(struct tcmur_device *rdev, int *wake_up)
+{
+	struct tcmu_track_aio *aio_track = &rdev->track_queue;
+	unsigned int cur, new;
+
+	cur = __atomic_load_n(&aio_track->pending_wakeups, __ATOMIC_ACQUIRE);
+	do {
+		assert(cur > 0);
+		new = cur > 1 ? 1 : 0;
+	} while (!__atomic_compare_exchange_n(&aio_track->pending_wakeups,
+					      &cur, new, false,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_ACQUIRE));
+
+	*wake_up = new;
 }
 
 static void cleanup_empty_queue_wait(void *arg)
 {
 	struct tcmu_track_aio *aio_track = arg;
 
-	pthread_cond_destroy(aio_track->is_empty_cond);
-	aio_track->is_empty_cond = NULL;
+	__atomic_sub_fetch(&aio_track->empty_waiters, 1, __ATOMIC_ACQ_REL);
 	pthread_mutex_unlock(&aio_track->track_lock);
 }
 
 int aio_wait_for_empty_queue(struct tcmur_device *rdev)
 {
 	struct tcmu_track_aio *aio_track = &rdev->track_queue;
-	pthread_cond_t cond;
-	int ret;
-
-	ret = pthread_cond_init(&cond, NULL);
-	if (ret)
-		return ret;
+	int ret = 0;
 
 	pthread_cleanup_push(cleanup_empty_queue_wait, aio_track);
 	pthread_mutex_lock(&aio_track->track_lock);
+	__atomic_add_fetch(&aio_track->empty_waiters, 1, __ATOMIC_ACQ_REL);
 
-	if (!aio_track->tracked_aio_ops)
-		goto unlock;
-
-	tcmu_dev_dbg(rdev->dev, "waiting for %d commands\n",
-		     rdev->track_queue.tracked_aio_ops);
+	while (__atomic_load_n(&aio_track->tracked_aio_ops,
+			       __ATOMIC_ACQUIRE)) {
+		tcmu_dev_dbg(rdev->dev, "waiting for %d commands\n",
+			     aio_track->tracked_aio_ops);
 
-	aio_track->is_empty_cond = &cond;
-	ret = pthread_cond_wait(&cond, &aio_track->track_lock);
-	aio_track->is_empty_cond = NULL;
+		ret = pthread_cond_wait(&aio_track->is_empty_cond,
+					&aio_track->track_lock);
+		if (ret)
+			break;
+	}
 
-unlock:
+	__atomic_sub_fetch(&aio_track->empty_waiters, 1, __ATOMIC_ACQ_REL);
 	pthread_mutex_unlock(&aio_track->track_lock);
 	pthread_cleanup_pop(0);
 
-	pthread_cond_destroy(&cond);
 	return ret;
 }
 
-static void _cleanup_io_work(void *arg)
+static void _cleanup_io_batch(void *arg)
 {
-	free(arg);
+	struct tcmu_work **batch = arg;
+	struct tcmu_work *work = *batch, *next;
+
+	while (work) {
+		next = work->next;
+		free(work);
+		work = next;
+	}
 }
 
-static void *io_work_queue(void *arg)
+/*
+ * Reverse the LIFO list handed back by the exchange in io_work_queue()
+ * so commands run in submission order.
+ */
+static struct tcmu_work *io_work_reverse(struct tcmu_work *work)
+{
+	struct tcmu_work *prev = NULL, *next;
+
+	while (work) {
+		next = work->next;
+		work->next = prev;
+		prev = work;
+		work = next;
+	}
+
+	return prev;
+}
+
+static void io_work_run(struct tcmu_work *work)
 {
-	struct tcmu_device *dev = arg;
-	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	struct tcmu_io_queue *io_wq = &rdev->work_queue;
 	int ret;
 
+	work = io_work_reverse(work);
+
+	/* don't leak the batch if we are canceled mid-run */
+	pthread_cleanup_push(_cleanup_io_batch, &work);
+
+	while (work) {
+		struct tcmu_work *next = work->next;
+		struct tcmur_cmd *tcmur_cmd = work->data;
+
+		TCMU_PROBE3(aio_dequeue, tcmu_dev_get_uio_name(work->dev),
+			    tcmur_cmd->lib_cmd ? tcmur_cmd->lib_cmd->cmd_id : 0,
+			    0);
+
+		/* kick start I/O request */
+		ret = work->work_fn(work->dev, work->data);
+		work->done_fn(work->dev, work->data, ret);
+
+		free(work);
+		work = next;
+	}
+
+	pthread_cleanup_pop(0);
+}
+
+static void io_worker_queue(struct tcmu_io_worker *worker,
+			    struct tcmu_work *work)
+{
+	struct tcmu_work *old;
+	uint64_t one = 1;
+
+	old = __atomic_load_n(&worker->io_queue, __ATOMIC_RELAXED);
+	do {
+		work->next = old;
+	} while (!__atomic_compare_exchange_n(&worker->io_queue, &old, work,
+					      false, __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	if (write(worker->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+		/*
+		 * Only fails if the eventfd counter would overflow, in
+		 * which case the worker is awake with wakeups to spare.
+		 */
+		tcmu_dev_dbg(work->dev, "aio wakeup already pending\n");
+	}
+}
+
+static void *io_work_queue(void *arg)
+{
+	struct tcmu_io_worker *worker = arg;
+	struct tcmu_device *dev = worker->dev;
+	uint64_t events;
+
 	tcmu_set_thread_name("aio", dev);
 
+	tcmur_apply_cpuset(dev, "aio");
+
 	while (1) {
 		struct tcmu_work *work;
-		void *data;
 
-		pthread_cleanup_push(_cleanup_mutex_lock, &io_wq->io_lock);
-		pthread_mutex_lock(&io_wq->io_lock);
+		/* blocking eventfd read is our cancellation point */
+		if (read(worker->wake_fd, &events, sizeof(events)) !=
+		    sizeof(events))
+			continue;
 
-		while (list_empty(&io_wq->io_queue)) {
-			pthread_cond_wait(&io_wq->io_cond,
-					  &io_wq->io_lock);
-		}
+		work = __atomic_exchange_n(&worker->io_queue, NULL,
+					   __ATOMIC_ACQUIRE);
+		if (work)
+			io_work_run(work);
+	}
 
-		work = list_first_entry(&io_wq->io_queue, struct tcmu_work,
-					entry);
-		list_del(&work->entry);
+	return NULL;
+}
 
-		pthread_mutex_unlock(&io_wq->io_lock);
-		pthread_cleanup_pop(0);
+/*
+ * Optional runner-wide work-stealing pool, shared by all tcmur devices
+ * (see shared_io_threads in tcmu.conf). Commands are submitted to the
+ * pool workers round-robin; a worker that runs dry after a wakeup
+ * steals the entire backlog of a busy neighbour, so a burst on one
+ * LUN can spread across every pool thread.
+ */
+static struct tcmu_io_queue shared_io_pool;
 
-		/* kick start I/O request */
-		data = work->data;
-		pthread_cleanup_push(_cleanup_io_work, work);
+static void *io_pool_worker_fn(void *arg)
+{
+	struct tcmu_io_worker *worker = arg;
+	uint64_t events;
+	int i;
+
+	tcmu_set_thread_name("aio-pool", NULL);
 
-		ret = work->work_fn(work->dev, data);
-		work->done_fn(dev, data, ret);
+	while (1) {
+		struct tcmu_work *work;
 
-		pthread_cleanup_pop(1); /* cleanup work */
+		/* blocking eventfd read is our cancellation point */
+		if (read(worker->wake_fd, &events, sizeof(events)) !=
+		    sizeof(events))
+			continue;
+
+		work = __atomic_exchange_n(&worker->io_queue, NULL,
+					   __ATOMIC_ACQUIRE);
+		if (work)
+			io_work_run(work);
+
+		/* steal a busy neighbour's backlog before blocking */
+		for (i = 0; i < shared_io_pool.nr_workers; i++) {
+			struct tcmu_io_worker *victim =
+						&shared_io_pool.workers[i];
+
+			if (victim == worker ||
+			    !__atomic_load_n(&victim->io_queue,
+					     __ATOMIC_RELAXED))
+				continue;
+
+			work = __atomic_exchange_n(&victim->io_queue, NULL,
+						   __ATOMIC_ACQUIRE);
+			if (work)
+				io_work_run(work);
+		}
 	}
 
 	return NULL;
 }
 
+bool tcmur_shared_pool_enabled(void)
+{
+	return shared_io_pool.workers != NULL;
+}
+
 static int aio_queue(struct tcmu_device *dev, void *data, tcmu_work_fn_t work_fn,
 		     tcmu_done_fn_t done_fn)
 {
 	struct tcmu_work *work;
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmu_io_queue *io_wq = &rdev->work_queue;
+	unsigned int n;
+
+	if (tcmur_shared_pool_enabled())
+		io_wq = &shared_io_pool;
 
 	work = malloc(sizeof(*work));
 	if (!work)
@@ -194,17 +572,13 @@ static int aio_queue(struct tcmu_device *dev, void *data, tcmu_work_fn_t work_fn
 	work->done_fn = done_fn;
 	work->dev = dev;
 	work->data = data;
-	list_node_init(&work->entry);
 
-	/* cleanup push/pop not _really_ required here atm */
-	pthread_cleanup_push(_cleanup_mutex_lock, &io_wq->io_lock);
-	pthread_mutex_lock(&io_wq->io_lock);
+	TCMU_PROBE3(aio_enqueue, tcmu_dev_get_uio_name(dev),
+		    ((struct tcmur_cmd *)data)->lib_cmd ?
+		    ((struct tcmur_cmd *)data)->lib_cmd->cmd_id : 0, 0);
 
-	list_add_tail(&io_wq->io_queue, &work->entry);
-	pthread_cond_signal(&io_wq->io_cond); // TODO: conditional
-
-	pthread_mutex_unlock(&io_wq->io_lock);
-	pthread_cleanup_pop(0);
+	n = __atomic_fetch_add(&io_wq->next_worker, 1, __ATOMIC_RELAXED);
+	io_worker_queue(&io_wq->workers[n % io_wq->nr_workers], work);
 
 	return TCMU_STS_ASYNC_HANDLED;
 }
@@ -213,8 +587,30 @@ int aio_request_schedule(struct tcmu_device *dev, void *data,
 			 tcmu_work_fn_t work_fn, tcmu_done_fn_t done_fn)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	int ret;
 
+	if (rdev->qos.iops_limit || rdev->qos.bps_limit) {
+		struct tcmur_cmd *tcmur_cmd = data;
+		size_t bytes = 0;
+		bool admitted;
+
+		if (tcmur_cmd->lib_cmd)
+			bytes = tcmu_iovec_length(tcmur_cmd->lib_cmd->iovec,
+						  tcmur_cmd->lib_cmd->iov_cnt);
+
+		pthread_mutex_lock(&rdev->qos.lock);
+		qos_refill(rdev);
+		/* keep ordering: park behind already deferred requests */
+		admitted = list_empty(&rdev->qos.deferred) &&
+			   qos_charge(rdev, bytes);
+		pthread_mutex_unlock(&rdev->qos.lock);
+
+		if (!admitted)
+			return qos_defer(dev, rdev, data, work_fn, done_fn,
+					 bytes);
+	}
+
 	if (!rhandler->nr_threads) {
 		ret = work_fn(dev, data);
 		if (!ret)
@@ -233,10 +629,16 @@ int setup_aio_tracking(struct tcmur_device *rdev)
 
 	aio_track->pending_wakeups = 0;
 	aio_track->tracked_aio_ops = 0;
+	aio_track->empty_waiters = 0;
 	ret = pthread_mutex_init(&aio_track->track_lock, NULL);
 	if (ret != 0) {
 		return -ret;
 	}
+	ret = pthread_cond_init(&aio_track->is_empty_cond, NULL);
+	if (ret != 0) {
+		pthread_mutex_destroy(&aio_track->track_lock);
+		return -ret;
+	}
 
 	return 0;
 }
@@ -248,111 +650,162 @@ void cleanup_aio_tracking(struct tcmur_device *rdev)
 
 	assert(aio_track->tracked_aio_ops == 0);
 
+	ret = pthread_cond_destroy(&aio_track->is_empty_cond);
+	if (ret != 0) {
+		tcmu_err("failed to destroy track cond\n");
+	}
+
 	ret = pthread_mutex_destroy(&aio_track->track_lock);
 	if (ret != 0) {
 		tcmu_err("failed to destroy track lock\n");
 	}
 }
 
-void cleanup_io_work_queue_threads(struct tcmu_device *dev)
+static void io_workers_cancel(struct tcmu_io_queue *io_wq)
 {
-	struct tcmur_handler *r_handler = tcmu_get_runner_handler(dev);
-	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	struct tcmu_io_queue *io_wq = &rdev->work_queue;
-	int i, nr_threads = r_handler->nr_threads;
+	int i;
 
-	if (!io_wq->io_wq_threads) {
+	if (!io_wq->workers) {
 		return;
 	}
 
-	for (i = 0; i < nr_threads; i++) {
-		if (io_wq->io_wq_threads[i]) {
-			tcmu_thread_cancel(io_wq->io_wq_threads[i]);
+	for (i = 0; i < io_wq->nr_workers; i++) {
+		if (io_wq->workers[i].thread) {
+			tcmu_thread_cancel(io_wq->workers[i].thread);
 		}
 	}
 }
 
-int setup_io_work_queue(struct tcmu_device *dev)
+static int io_workers_setup(struct tcmu_io_queue *io_wq,
+			    struct tcmu_device *dev, int nr_threads,
+			    void *(*worker_fn)(void *))
 {
-	struct tcmur_handler *r_handler = tcmu_get_runner_handler(dev);
-	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	struct tcmu_io_queue *io_wq = &rdev->work_queue;
-	int ret, i, nr_threads = r_handler->nr_threads;
-
-	if (!nr_threads)
-		return 0;
+	int ret, i;
 
-	list_head_init(&io_wq->io_queue);
-
-	ret = pthread_mutex_init(&io_wq->io_lock, NULL);
-	if (ret != 0) {
+	io_wq->workers = calloc(nr_threads, sizeof(*io_wq->workers));
+	if (!io_wq->workers) {
+		ret = ENOMEM;
 		goto out;
 	}
-	ret = pthread_cond_init(&io_wq->io_cond, NULL);
-	if (ret != 0) {
-		goto cleanup_lock;
-	}
+	io_wq->nr_workers = nr_threads;
+	io_wq->next_worker = 0;
 
-	/* TODO: Allow user to override device defaults */
-	io_wq->io_wq_threads = calloc(nr_threads, sizeof(pthread_t));
-	if (!io_wq->io_wq_threads) {
-		ret = ENOMEM;
-		goto cleanup_cond;
-	}
+	for (i = 0; i < nr_threads; i++)
+		io_wq->workers[i].wake_fd = -1;
 
 	for (i = 0; i < nr_threads; i++) {
-		ret = pthread_create(&io_wq->io_wq_threads[i], NULL,
-				      io_work_queue, dev);
+		struct tcmu_io_worker *worker = &io_wq->workers[i];
+
+		worker->dev = dev;
+		worker->io_queue = NULL;
+		worker->wake_fd = eventfd(0, EFD_CLOEXEC);
+		if (worker->wake_fd < 0) {
+			ret = errno;
+			goto cleanup_workers;
+		}
+
+		ret = pthread_create(&worker->thread, NULL, worker_fn,
+				     worker);
 		if (ret != 0) {
-			goto cleanup_threads;
+			close(worker->wake_fd);
+			worker->wake_fd = -1;
+			goto cleanup_workers;
 		}
 	}
 
 	return 0;
 
-cleanup_threads:
-	cleanup_io_work_queue_threads(dev);
-	free(io_wq->io_wq_threads);
-cleanup_cond:
-	pthread_cond_destroy(&io_wq->io_cond);
-cleanup_lock:
-	pthread_mutex_destroy(&io_wq->io_lock);
+cleanup_workers:
+	io_workers_cancel(io_wq);
+	for (i = 0; i < nr_threads; i++) {
+		if (io_wq->workers[i].wake_fd >= 0)
+			close(io_wq->workers[i].wake_fd);
+	}
+	free(io_wq->workers);
+	io_wq->workers = NULL;
+	io_wq->nr_workers = 0;
 out:
 	return -ret;
 }
 
-void cleanup_io_work_queue(struct tcmu_device *dev, bool cancel)
+static void io_workers_cleanup(struct tcmu_io_queue *io_wq, bool cancel)
 {
-	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	struct tcmu_io_queue *io_wq = &rdev->work_queue;
-	int ret;
+	int i;
 
-	if (!io_wq->io_wq_threads) {
+	if (!io_wq->workers) {
 		return;
 	}
 
 	if (cancel) {
-		cleanup_io_work_queue_threads(dev);
+		io_workers_cancel(io_wq);
+	}
+
+	for (i = 0; i < io_wq->nr_workers; i++) {
+		if (io_wq->workers[i].wake_fd >= 0)
+			close(io_wq->workers[i].wake_fd);
 	}
 
+	free(io_wq->workers);
+	io_wq->workers = NULL;
+	io_wq->nr_workers = 0;
+}
+
+int tcmur_shared_pool_setup(int nr_threads)
+{
+	if (nr_threads < 0) {
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nr_threads < 1)
+			nr_threads = 1;
+	}
+
+	if (!nr_threads)
+		return 0;
+
+	tcmu_info("sharing one %d thread io pool across all devices\n",
+		  nr_threads);
+
+	return io_workers_setup(&shared_io_pool, NULL, nr_threads,
+				io_pool_worker_fn);
+}
+
+void tcmur_shared_pool_cleanup(void)
+{
+	io_workers_cleanup(&shared_io_pool, true);
+}
+
+void cleanup_io_work_queue_threads(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	io_workers_cancel(&rdev->work_queue);
+}
+
+int setup_io_work_queue(struct tcmu_device *dev)
+{
+	struct tcmur_handler *r_handler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	int nr_threads = r_handler->nr_threads;
+
+	/* async work runs on the shared pool instead */
+	if (!nr_threads || tcmur_shared_pool_enabled())
+		return 0;
+
+	/* TODO: Allow user to override device defaults */
+	return io_workers_setup(&rdev->work_queue, dev, nr_threads,
+				io_work_queue);
+}
+
+void cleanup_io_work_queue(struct tcmu_device *dev, bool cancel)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
 	/*
-	 * Note that there's no need to drain ->io_queue at this point
-	 * as it _should_ be empty (target layer would call this path
-	 * when no commands are running - thanks Mike).
+	 * Note that there's no need to drain the worker queues at this
+	 * point as they _should_ be empty (target layer would call this
+	 * path when no commands are running - thanks Mike).
 	 *
 	 * Out of tree handlers which do not use the aio code are not
 	 * supported in this path.
 	 */
-
-	ret = pthread_mutex_destroy(&io_wq->io_lock);
-	if (ret != 0) {
-		tcmu_err("failed to destroy io workqueue lock\n");
-	}
-
-	ret = pthread_cond_destroy(&io_wq->io_cond);
-	if (ret != 0) {
-		tcmu_err("failed to destroy io workqueue cond\n");
-	}
-
-	free(io_wq->io_wq_threads);
+	io_workers_cleanup(&rdev->work_queue, cancel);
 }
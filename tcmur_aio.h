@@ -10,6 +10,7 @@
 #define __TCMUR_AIO_H
 
 #include <pthread.h>
+#include <stdbool.h>
 
 #include "ccan/list/list.h"
 
@@ -17,25 +18,48 @@ struct tcmur_device;
 struct tcmu_device;
 struct tcmulib_cmd;
 
+/*
+ * In-flight accounting is lock-free: the counters are updated with
+ * atomics on every command, and track_lock/is_empty_cond only come
+ * into play while a drainer is parked in aio_wait_for_empty_queue().
+ */
 struct tcmu_track_aio {
 	unsigned int pending_wakeups;
 	unsigned int tracked_aio_ops;
+	int empty_waiters;
 	pthread_mutex_t track_lock;
-	pthread_cond_t *is_empty_cond;
+	pthread_cond_t is_empty_cond;
 };
 
-struct tcmu_io_queue {
-	pthread_mutex_t io_lock;
-	pthread_cond_t io_cond;
+struct tcmu_work;
+
+/*
+ * A single submission worker. Producers push onto ->io_queue with a
+ * lock-free exchange and kick ->wake_fd; the owning thread swaps the
+ * whole list out and runs it, so no lock is ever taken on the I/O path.
+ */
+struct tcmu_io_worker {
+	struct tcmu_device *dev;
+	pthread_t thread;
+	int wake_fd;
+	struct tcmu_work *io_queue;
+};
 
-	pthread_t *io_wq_threads;
-	struct list_head io_queue;
+struct tcmu_io_queue {
+	struct tcmu_io_worker *workers;
+	int nr_workers;
+	unsigned int next_worker;
 };
 
 int setup_io_work_queue(struct tcmu_device *);
 void cleanup_io_work_queue(struct tcmu_device *, bool);
 void cleanup_io_work_queue_threads(struct tcmu_device *);
 
+/* runner-wide work-stealing pool, shared by all devices when enabled */
+int tcmur_shared_pool_setup(int nr_threads);
+void tcmur_shared_pool_cleanup(void);
+bool tcmur_shared_pool_enabled(void);
+
 int setup_aio_tracking(struct tcmur_device *);
 void cleanup_aio_tracking(struct tcmur_device *);
 
@@ -45,6 +69,9 @@ typedef void (*tcmu_done_fn_t)(struct tcmu_device *dev, void *data, int rc);
 int aio_request_schedule(struct tcmu_device *, void *, tcmu_work_fn_t,
 			 tcmu_done_fn_t);
 
+/* QoS: flush deferred requests ignoring tokens (device removal) */
+void tcmur_qos_drain(struct tcmu_device *dev);
+
 /* aio request tracking */
 void track_aio_request_start(struct tcmur_device *);
 void track_aio_request_finish(struct tcmur_device *, int *);
@@ -26,42 +26,391 @@
 #include "tcmu-runner.h"
 #include "tcmu_runner_priv.h"
 #include "tcmur_cmd_handler.h"
+#include "tcmu_tracepoints.h"
 #include "alua.h"
 
+/*
+ * Sequential read-ahead (read_ahead_kb in tcmu.conf): a small stream
+ * table spots sequential readers, prefetches the next window through
+ * the handler's read callout into a per-stream buffer, and serves
+ * hits with a memcpy into the ring iovecs.
+ */
+#define TCMUR_RA_STREAMS 8
+
+enum {
+	TCMUR_RA_IDLE,
+	TCMUR_RA_INFLIGHT,
+	TCMUR_RA_READY,
+};
+
+struct tcmur_ra_stream {
+	uint64_t next_off;
+	int seq_hits;
+
+	struct tcmur_cmd cmd;
+	struct iovec iov;
+	char *buf;
+	uint64_t buf_off;
+	uint32_t buf_len;
+	int state;
+	bool stale;
+};
+
+struct tcmur_ra {
+	pthread_mutex_t lock;
+	struct tcmur_ra_stream streams[TCMUR_RA_STREAMS];
+	uint32_t window_bytes;
+	uint64_t hits;
+	uint64_t misses;
+};
+
+/*
+ * Opt-in RAM read cache (read_cache_mb in tcmu.conf) in front of the
+ * handler read callout: 64K cache blocks with 2Q eviction - first
+ * timers sit in a FIFO (a1) capped at a quarter of the budget,
+ * re-referenced blocks promote to an LRU (am) - so one scan cannot
+ * flush the hot metadata blocks initiators re-read constantly.
+ */
+#define TCMUR_RC_BLOCK_SHIFT 16
+#define TCMUR_RC_BLOCK_SIZE (1U << TCMUR_RC_BLOCK_SHIFT)
+
+struct tcmur_rc_block {
+	struct list_node lru_entry;
+	struct tcmur_rc_block *hash_next;
+	uint64_t idx;
+	bool in_am;
+	char data[];
+};
+
+struct tcmur_rc {
+	pthread_mutex_t lock;
+	struct tcmur_rc_block **hash;
+	unsigned int hash_mask;
+	struct list_head a1;
+	struct list_head am;
+	unsigned int nr_blocks;
+	unsigned int nr_a1;
+	unsigned int max_blocks;
+	unsigned int max_a1;
+	uint64_t gen;		/* bumped by invalidation */
+	uint64_t hits;
+	uint64_t misses;
+};
+
+/* saved at read submission so stale completions cannot repopulate */
+struct tcmur_rc_read_state {
+	uint64_t gen;
+	struct iovec iov[];
+};
+
+/*
+ * Opt-in write coalescing (write_coalesce_kb in tcmu.conf), only
+ * sane with WCE: adjacent small writes accumulate in one buffer and
+ * are written back as a single backend write when the buffer fills,
+ * a flush or conflicting command arrives, or the ring goes idle.
+ */
+enum {
+	TCMUR_WC_EMPTY,
+	TCMUR_WC_DIRTY,
+	TCMUR_WC_INFLIGHT,
+};
+
+struct tcmur_wc {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buf;
+	uint32_t size;
+	uint64_t off;
+	uint32_t len;
+	int state;
+	int error;
+
+	struct tcmur_cmd cmd;
+	struct iovec iov;
+};
+
+static int tcmur_rc_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+
+/* every data-mutating path must drop both caches for its range */
+static void tcmur_cache_invalidate(struct tcmu_device *dev, uint64_t off,
+				   uint64_t len);
+static void tcmur_rc_fill(struct tcmu_device *dev, uint64_t off,
+			  size_t length, uint64_t gen, struct iovec *iov,
+			  size_t iov_cnt);
+static void tcmur_rc_invalidate(struct tcmu_device *dev, uint64_t off,
+				uint64_t len);
+
 static void _cleanup_spin_lock(void *arg)
 {
 	pthread_spin_unlock(arg);
 }
 
+static const char *const tcmur_stat_class_names[TCMUR_STAT_NR_CLASSES] = {
+	[TCMUR_STAT_READ]  = "read",
+	[TCMUR_STAT_WRITE] = "write",
+	[TCMUR_STAT_FLUSH] = "flush",
+	[TCMUR_STAT_UNMAP] = "unmap",
+	[TCMUR_STAT_OTHER] = "other",
+};
+
+static uint8_t tcmur_stat_classify(uint8_t *cdb)
+{
+	switch (cdb[0]) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		return TCMUR_STAT_READ;
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_16:
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+		return TCMUR_STAT_WRITE;
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		return TCMUR_STAT_FLUSH;
+	case UNMAP:
+		return TCMUR_STAT_UNMAP;
+	default:
+		return TCMUR_STAT_OTHER;
+	}
+}
+
+static uint64_t tcmur_stats_now_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void tcmur_stats_cmd_start(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+
+	tcmur_cmd->stat_class = tcmur_stat_classify(cmd->cdb);
+	tcmur_cmd->stat_start_ns = tcmur_stats_now_ns();
+
+	__atomic_add_fetch(&rdev->stats.inflight, 1, __ATOMIC_RELAXED);
+}
+
+void tcmur_stats_cmd_complete(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	uint8_t class = tcmur_cmd->stat_class;
+	uint64_t delta_us;
+	int bucket;
+
+	delta_us = (tcmur_stats_now_ns() - tcmur_cmd->stat_start_ns) / 1000;
+	bucket = delta_us ? 64 - __builtin_clzll(delta_us) : 0;
+	if (bucket >= TCMUR_STAT_BUCKETS)
+		bucket = TCMUR_STAT_BUCKETS - 1;
+
+	__atomic_add_fetch(&rdev->stats.hist[class][bucket], 1,
+			   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&rdev->stats.count[class], 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&rdev->stats.inflight, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * One line per opcode class plus the in-flight gauge, in a stable
+ * plain-text format the Prometheus bridge parses. Bucket N counts
+ * completions with latency < 2^N usec.
+ */
+int tcmur_stats_format(struct tcmu_device *dev, char *buf, size_t len)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	const char *name = dev->tcm_dev_name;
+	int cls, i, n = 0;
+
+	n += snprintf(buf + n, len - n, "%s inflight=%"PRIu64"\n", name,
+		      __atomic_load_n(&rdev->stats.inflight,
+				      __ATOMIC_RELAXED));
+
+	if (rdev->ra)
+		n += snprintf(buf + n, len - n,
+			      "%s readahead hits=%"PRIu64" misses=%"PRIu64"\n",
+			      name, rdev->ra->hits, rdev->ra->misses);
+
+	if (rdev->rc)
+		n += snprintf(buf + n, len - n,
+			      "%s readcache hits=%"PRIu64" misses=%"PRIu64"\n",
+			      name, rdev->rc->hits, rdev->rc->misses);
+
+	n += snprintf(buf + n, len - n, "%s flush epochs=%"PRIu64"\n", name,
+		      __atomic_load_n(&rdev->flush_merge.epochs,
+				      __ATOMIC_RELAXED));
+
+	if (rdev->qos.iops_limit || rdev->qos.bps_limit)
+		n += snprintf(buf + n, len - n, "%s qos deferrals=%"PRIu64"\n",
+			      name,
+			      __atomic_load_n(&rdev->qos.deferrals,
+					      __ATOMIC_RELAXED));
+
+	for (cls = 0; cls < TCMUR_STAT_NR_CLASSES; cls++) {
+		if (n >= len)
+			break;
+
+		n += snprintf(buf + n, len - n, "%s %s count=%"PRIu64" buckets=",
+			      name, tcmur_stat_class_names[cls],
+			      __atomic_load_n(&rdev->stats.count[cls],
+					      __ATOMIC_RELAXED));
+
+		for (i = 0; i < TCMUR_STAT_BUCKETS && n < len; i++) {
+			n += snprintf(buf + n, len - n, "%s%"PRIu64,
+				      i ? "," : "",
+				      __atomic_load_n(&rdev->stats.hist[cls][i],
+						      __ATOMIC_RELAXED));
+		}
+		if (n < len)
+			n += snprintf(buf + n, len - n, "\n");
+	}
+
+	return n;
+}
+
+static void tcmur_log_timed_out_cmd(struct tcmu_device *dev,
+				    struct tcmulib_cmd *cmd, int rc)
+{
+	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	struct timespec curr_time;
+
+	if (tcmur_get_time(dev, &curr_time)) {
+		tcmu_dev_info(dev, "Timed out command id %hu completed with status %d.\n",
+			      cmd->cmd_id, rc);
+	} else {
+		tcmu_dev_info(dev, "Timed out command id %hu completed after %f seconds with status %d.\n",
+			      cmd->cmd_id,
+			      difftime(curr_time.tv_sec,
+				       tcmur_cmd->start_time.tv_sec),
+			      rc);
+	}
+}
+
+/*
+ * Apply parked completions whose entries have reached the ring tail.
+ * Only used when the kernel lacks TCMU_MAILBOX_FLAG_CAP_OOOC, where
+ * responses must be written in ring order. Must be called with
+ * rdev->lock held.
+ */
+static void tcmur_apply_parked_cmds(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd *tcmur_cmd, *next;
+	uint16_t cmd_id;
+	bool progress = true;
+
+	while (progress && tcmulib_peek_tail_cmd_id(dev, &cmd_id)) {
+		progress = false;
+
+		list_for_each_safe(&rdev->parked_cmds, tcmur_cmd, next,
+				   cmds_list_entry) {
+			if (tcmur_cmd->lib_cmd->cmd_id != cmd_id)
+				continue;
+
+			list_del(&tcmur_cmd->cmds_list_entry);
+			tcmulib_command_complete(dev, tcmur_cmd->lib_cmd,
+						 tcmur_cmd->rc);
+			progress = true;
+			break;
+		}
+	}
+}
+
 void tcmur_tcmulib_cmd_complete(struct tcmu_device *dev,
 				struct tcmulib_cmd *cmd, int rc)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
-	struct timespec curr_time;
+
+	/* keep the logging out of the lock hold */
+	if (tcmur_cmd->timed_out)
+		tcmur_log_timed_out_cmd(dev, cmd, rc);
+
+	tcmur_stats_cmd_complete(dev, cmd);
 
 	pthread_cleanup_push(_cleanup_spin_lock, (void *)&rdev->lock);
 	pthread_spin_lock(&rdev->lock);
 
-	if (tcmur_cmd->timed_out) {
-		if (tcmur_get_time(dev, &curr_time)) {
-			tcmu_dev_info(dev, "Timed out command id %hu completed with status %d.\n",
-				      cmd->cmd_id, rc);
-		} else {
-			tcmu_dev_info(dev, "Timed out command id %hu completed after %f seconds with status %d.\n",
-				      cmd->cmd_id,
-				      difftime(curr_time.tv_sec,
-					       tcmur_cmd->start_time.tv_sec),
-				      rc);
-		}
+	list_del(&tcmur_cmd->cmds_list_entry);
+
+	if (tcmu_dev_oooc_supported(dev)) {
+		/*
+		 * Complete in arrival-of-result order: the response is
+		 * written into the next free tail entry and the kernel
+		 * matches it up by cmd_id, so a slow command never
+		 * delays the ones that finished behind it.
+		 */
+		tcmulib_command_complete(dev, cmd, rc);
+	} else {
+		/*
+		 * Responses must be written in ring order: park this
+		 * completion and apply every parked one whose entry
+		 * has reached the tail.
+		 */
+		tcmur_cmd->rc = rc;
+		list_add_tail(&rdev->parked_cmds,
+			      &tcmur_cmd->cmds_list_entry);
+		tcmur_apply_parked_cmds(dev);
 	}
 
-	list_del(&tcmur_cmd->cmds_list_entry);
+	pthread_spin_unlock(&rdev->lock);
+	pthread_cleanup_pop(0);
+}
+
+void tcmur_tcmulib_cmds_complete(struct tcmu_device *dev,
+				 struct tcmulib_cmd **cmds, int *rcs, int cnt)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd *tcmur_cmd;
+	bool oooc = tcmu_dev_oooc_supported(dev);
+	int i;
 
-	tcmulib_command_complete(dev, cmd, rc);
+	if (!cnt)
+		return;
+
+	for (i = 0; i < cnt; i++) {
+		tcmur_cmd = cmds[i]->hm_private;
+
+		if (tcmur_cmd->timed_out)
+			tcmur_log_timed_out_cmd(dev, cmds[i], rcs[i]);
+
+		tcmur_stats_cmd_complete(dev, cmds[i]);
+	}
+
+	pthread_cleanup_push(_cleanup_spin_lock, (void *)&rdev->lock);
+	pthread_spin_lock(&rdev->lock);
+
+	for (i = 0; i < cnt; i++) {
+		tcmur_cmd = cmds[i]->hm_private;
+
+		list_del(&tcmur_cmd->cmds_list_entry);
+
+		if (!oooc) {
+			tcmur_cmd->rc = rcs[i];
+			list_add_tail(&rdev->parked_cmds,
+				      &tcmur_cmd->cmds_list_entry);
+		}
+	}
+
+	if (oooc) {
+		tcmulib_commands_complete(dev, cmds, rcs, cnt);
+	} else {
+		tcmur_apply_parked_cmds(dev);
+	}
 
 	pthread_spin_unlock(&rdev->lock);
 	pthread_cleanup_pop(0);
+
+	if (!oooc)
+		tcmulib_processing_complete(dev);
 }
 
 static void aio_command_finish(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
@@ -82,6 +431,9 @@ void tcmur_cmd_complete(struct tcmu_device *dev, void *data, int rc)
 {
 	struct tcmur_cmd *tcmur_cmd = data;
 
+	TCMU_PROBE3(cmd_handler_done, tcmu_dev_get_uio_name(dev),
+		    tcmur_cmd->lib_cmd ? tcmur_cmd->lib_cmd->cmd_id : 0, rc);
+
 	tcmur_cmd->done(dev, tcmur_cmd, rc);
 }
 
@@ -92,23 +444,138 @@ static void tcmur_cmd_iovec_reset(struct tcmur_cmd *tcmur_cmd,
 	tcmur_cmd->iovec->iov_len = data_length;
 }
 
-static void tcmur_cmd_state_free(struct tcmur_cmd *tcmur_cmd)
+/*
+ * Command-state blocks come from a per-device slab so the emulated
+ * command hot paths (unmap, writesame, caw, write verify, xcopy)
+ * stop paying a calloc/free per command; only oversized requests or
+ * an exhausted slab fall back to the allocator.
+ */
+#define TCMUR_CMD_SLAB_BLOCKS 4
+
+/* covers the largest tcmur state struct plus some slack */
+#define TCMUR_CMD_SLAB_STATE_SIZE 512
+
+int tcmur_cmd_slab_setup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd_slab *slab = &rdev->cmd_slab;
+	unsigned int i;
+	int ret;
+
+	slab->block_size = TCMUR_CMD_SLAB_STATE_SIZE + sizeof(struct iovec) +
+			   tcmu_lba_to_byte(dev,
+					    tcmu_dev_get_max_xfer_len(dev));
+
+	ret = pthread_spin_init(&slab->lock, 0);
+	if (ret)
+		return -ret;
+
+	slab->blocks = calloc(TCMUR_CMD_SLAB_BLOCKS, sizeof(*slab->blocks));
+	if (!slab->blocks)
+		goto cleanup_lock;
+
+	for (i = 0; i < TCMUR_CMD_SLAB_BLOCKS; i++) {
+		slab->blocks[i] = malloc(slab->block_size);
+		if (!slab->blocks[i])
+			goto cleanup_blocks;
+		slab->nr_blocks = slab->nr_free = i + 1;
+	}
+
+	return 0;
+
+cleanup_blocks:
+	for (i = 0; i < slab->nr_blocks; i++)
+		free(slab->blocks[i]);
+	free(slab->blocks);
+	slab->blocks = NULL;
+cleanup_lock:
+	pthread_spin_destroy(&slab->lock);
+	return -ENOMEM;
+}
+
+void tcmur_cmd_slab_cleanup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd_slab *slab = &rdev->cmd_slab;
+	unsigned int i;
+
+	if (!slab->blocks)
+		return;
+
+	for (i = 0; i < slab->nr_free; i++)
+		free(slab->blocks[i]);
+	free(slab->blocks);
+	slab->blocks = NULL;
+	pthread_spin_destroy(&slab->lock);
+}
+
+static void *tcmur_cmd_slab_get(struct tcmur_device *rdev, size_t length)
+{
+	struct tcmur_cmd_slab *slab = &rdev->cmd_slab;
+	void *state = NULL;
+
+	if (!slab->blocks || length > slab->block_size)
+		return NULL;
+
+	pthread_spin_lock(&slab->lock);
+	if (slab->nr_free)
+		state = slab->blocks[--slab->nr_free];
+	pthread_spin_unlock(&slab->lock);
+
+	if (state)
+		memset(state, 0, length);
+	return state;
+}
+
+static bool tcmur_cmd_slab_put(struct tcmur_device *rdev, void *state)
+{
+	struct tcmur_cmd_slab *slab = &rdev->cmd_slab;
+	bool put = false;
+
+	pthread_spin_lock(&slab->lock);
+	if (slab->nr_free < slab->nr_blocks) {
+		slab->blocks[slab->nr_free++] = state;
+		put = true;
+	}
+	pthread_spin_unlock(&slab->lock);
+
+	return put;
+}
+
+static void tcmur_cmd_state_free(struct tcmu_device *dev,
+				 struct tcmur_cmd *tcmur_cmd)
 {
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	if (tcmur_cmd->state_from_slab &&
+	    tcmur_cmd_slab_put(rdev, tcmur_cmd->cmd_state)) {
+		tcmur_cmd->cmd_state = NULL;
+		return;
+	}
+
 	free(tcmur_cmd->cmd_state);
 }
 
-static int tcmur_cmd_state_init(struct tcmur_cmd *tcmur_cmd, int state_length,
+static int tcmur_cmd_state_init(struct tcmu_device *dev,
+				struct tcmur_cmd *tcmur_cmd, int state_length,
 				size_t data_length)
 {
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	void *state;
 	int iov_length = 0;
 
 	if (data_length)
 		iov_length = data_length + sizeof(struct iovec);
 
-	state = calloc(1, state_length + iov_length);
-	if (!state)
-		return -ENOMEM;
+	state = tcmur_cmd_slab_get(rdev, state_length + iov_length);
+	if (state) {
+		tcmur_cmd->state_from_slab = true;
+	} else {
+		state = calloc(1, state_length + iov_length);
+		if (!state)
+			return -ENOMEM;
+		tcmur_cmd->state_from_slab = false;
+	}
 
 	tcmur_cmd->cmd_state = state;
 	tcmur_cmd->requested = data_length;
@@ -178,111 +645,1033 @@ static void handle_generic_cbk(struct tcmu_device *dev,
 	aio_command_finish(dev, tcmur_cmd->lib_cmd, ret);
 }
 
-static int read_work_fn(struct tcmu_device *dev, void *data)
+/*
+ * Write completion: invalidate again. The submission-time
+ * invalidation alone leaves a hole - a read submitted while the
+ * write was in flight can be serviced by the backend first, and its
+ * completion would repopulate the caches with pre-write data.
+ */
+static void handle_write_cbk(struct tcmu_device *dev,
+			     struct tcmur_cmd *tcmur_cmd, int ret)
 {
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
-	struct tcmur_cmd *tcmur_cmd = data;
 	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
 
-	return rhandler->read(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
-			      tcmu_iovec_length(cmd->iovec, cmd->iov_cnt),
-			      tcmu_cdb_to_byte(dev, cmd->cdb));
+	tcmur_cache_invalidate(dev, tcmu_cdb_to_byte(dev, cmd->cdb),
+			       tcmu_lba_to_byte(dev,
+					tcmu_cdb_get_xfer_length(cmd->cdb)));
+
+	aio_command_finish(dev, cmd, ret);
 }
 
-static int write_work_fn(struct tcmu_device *dev, void *data)
+static void handle_read_rc_cbk(struct tcmu_device *dev,
+			       struct tcmur_cmd *tcmur_cmd, int ret)
 {
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
-	struct tcmur_cmd *tcmur_cmd = data;
+	struct tcmur_rc_read_state *rstate = tcmur_cmd->cmd_state;
 	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
 
-	return rhandler->write(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
-				tcmu_iovec_length(cmd->iovec, cmd->iov_cnt),
-				tcmu_cdb_to_byte(dev, cmd->cdb));
+	if (ret == TCMU_STS_OK)
+		tcmur_rc_fill(dev, tcmu_cdb_to_byte(dev, cmd->cdb),
+			      tcmur_cmd->requested, rstate->gen, rstate->iov,
+			      cmd->iov_cnt);
+
+	tcmur_cmd_state_free(dev, tcmur_cmd);
+	aio_command_finish(dev, cmd, ret);
 }
 
-struct unmap_state {
-	pthread_mutex_t lock;
-	unsigned int refcount;
-	int status;
-};
+static void ra_prefetch_cbk(struct tcmu_device *dev,
+			    struct tcmur_cmd *tcmur_cmd, int ret)
+{
+	struct tcmur_ra_stream *stream = container_of(tcmur_cmd,
+						struct tcmur_ra_stream, cmd);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_ra *ra = rdev->ra;
 
-struct unmap_descriptor {
-	uint64_t offset;
-	uint64_t length;
-};
+	pthread_mutex_lock(&ra->lock);
+	if (ret != TCMU_STS_OK || stream->stale) {
+		free(stream->buf);
+		stream->buf = NULL;
+		stream->state = TCMUR_RA_IDLE;
+	} else {
+		stream->state = TCMUR_RA_READY;
+	}
+	stream->stale = false;
+	pthread_mutex_unlock(&ra->lock);
 
-static int unmap_init(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+	track_aio_request_finish(rdev, NULL);
+}
+
+static int ra_prefetch_work_fn(struct tcmu_device *dev, void *data)
 {
-	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
-	struct unmap_state *state;
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_cmd *tcmur_cmd = data;
+	struct tcmur_ra_stream *stream = container_of(tcmur_cmd,
+						struct tcmur_ra_stream, cmd);
+
+	stream->iov.iov_base = stream->buf;
+	stream->iov.iov_len = stream->buf_len;
+
+	return rhandler->read(dev, tcmur_cmd, &stream->iov, 1,
+			      stream->buf_len, stream->buf_off);
+}
+
+/* called with ra->lock held; drops it around the schedule */
+static void ra_kick_prefetch(struct tcmu_device *dev, struct tcmur_ra *ra,
+			     struct tcmur_ra_stream *stream, uint64_t off)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	uint64_t dev_bytes = tcmu_lba_to_byte(dev,
+					      tcmu_dev_get_num_lbas(dev));
 	int ret;
 
-	if (tcmur_cmd_state_init(tcmur_cmd, sizeof(*state), 0))
-		return TCMU_STS_NO_RESOURCE;
-	state = tcmur_cmd->cmd_state;
+	if (off >= dev_bytes)
+		return;
 
-	ret = pthread_mutex_init(&state->lock, NULL);
-	if (ret == -1) {
-		tcmu_dev_err(dev, "Failed to init spin lock in state!\n");
-		ret = TCMU_STS_HW_ERR;
-		goto out_free_state;
-	}
+	stream->buf_len = min((uint64_t)ra->window_bytes, dev_bytes - off);
+	stream->buf = malloc(stream->buf_len);
+	if (!stream->buf)
+		return;
 
-	/* released by allocator when done submitting unmaps */
-	state->refcount = 1;
-	state->status = TCMU_STS_OK;
-	return TCMU_STS_OK;
+	stream->buf_off = off;
+	stream->state = TCMUR_RA_INFLIGHT;
+	stream->stale = false;
+	memset(&stream->cmd, 0, sizeof(stream->cmd));
+	stream->cmd.done = ra_prefetch_cbk;
 
-out_free_state:
-	tcmur_cmd_state_free(tcmur_cmd);
-	return ret;
+	track_aio_request_start(rdev);
+
+	pthread_mutex_unlock(&ra->lock);
+	ret = aio_request_schedule(dev, &stream->cmd, ra_prefetch_work_fn,
+				   tcmur_cmd_complete);
+	pthread_mutex_lock(&ra->lock);
+
+	if (ret != TCMU_STS_ASYNC_HANDLED) {
+		free(stream->buf);
+		stream->buf = NULL;
+		stream->state = TCMUR_RA_IDLE;
+		track_aio_request_finish(rdev, NULL);
+	}
 }
 
-static void unmap_put(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
-		      int ret)
+/*
+ * Serve the READ from a prefetched buffer when it fully hits one,
+ * updating the stream table either way. Returns TCMU_STS_OK when the
+ * data was copied, TCMU_STS_NOT_HANDLED to go to the backend.
+ */
+static int tcmur_ra_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
-	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
-	struct unmap_state *state = tcmur_cmd->cmd_state;
-	int status;
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_ra *ra = rdev->ra;
+	struct tcmur_ra_stream *stream, *lru = NULL;
+	uint64_t off = tcmu_cdb_to_byte(dev, cmd->cdb);
+	size_t length = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+	int i, ret = TCMU_STS_NOT_HANDLED;
+
+	if (!ra)
+		return TCMU_STS_NOT_HANDLED;
+
+	pthread_mutex_lock(&ra->lock);
+
+	for (i = 0; i < TCMUR_RA_STREAMS; i++) {
+		stream = &ra->streams[i];
+
+		/* hit inside a ready prefetch buffer */
+		if (stream->state == TCMUR_RA_READY &&
+		    off >= stream->buf_off &&
+		    off + length <= stream->buf_off + stream->buf_len) {
+			tcmu_memcpy_into_iovec(cmd->iovec, cmd->iov_cnt,
+					       stream->buf +
+					       (off - stream->buf_off),
+					       length);
+			ra->hits++;
+			stream->next_off = off + length;
+
+			/* buffer consumed: refill the window behind it */
+			if (off + length >=
+			    stream->buf_off + stream->buf_len) {
+				free(stream->buf);
+				stream->buf = NULL;
+				stream->state = TCMUR_RA_IDLE;
+				ra_kick_prefetch(dev, ra, stream,
+						 stream->next_off);
+			}
+
+			ret = TCMU_STS_OK;
+			goto unlock;
+		}
+	}
+
+	ra->misses++;
+
+	for (i = 0; i < TCMUR_RA_STREAMS; i++) {
+		stream = &ra->streams[i];
+
+		if (stream->next_off == off) {
+			/* sequential continuation */
+			stream->next_off = off + length;
+			if (++stream->seq_hits >= 2 &&
+			    stream->state == TCMUR_RA_IDLE)
+				ra_kick_prefetch(dev, ra, stream,
+						 stream->next_off);
+			goto unlock;
+		}
+
+		if (!lru || stream->seq_hits < lru->seq_hits)
+			lru = stream;
+	}
+
+	/* new stream: take over the coldest idle slot */
+	if (lru && lru->state == TCMUR_RA_IDLE) {
+		lru->next_off = off + length;
+		lru->seq_hits = 0;
+	}
+
+unlock:
+	pthread_mutex_unlock(&ra->lock);
+	return ret;
+}
+
+/* drop prefetched data the write path is about to make stale */
+static void tcmur_ra_invalidate(struct tcmu_device *dev, uint64_t off,
+				uint64_t len)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_ra *ra = rdev->ra;
+	struct tcmur_ra_stream *stream;
+	int i;
+
+	if (!ra)
+		return;
+
+	pthread_mutex_lock(&ra->lock);
+	for (i = 0; i < TCMUR_RA_STREAMS; i++) {
+		stream = &ra->streams[i];
+
+		if (stream->state == TCMUR_RA_IDLE)
+			continue;
+		if (stream->buf_off >= off + len ||
+		    off >= stream->buf_off + stream->buf_len)
+			continue;
+
+		if (stream->state == TCMUR_RA_READY) {
+			free(stream->buf);
+			stream->buf = NULL;
+			stream->state = TCMUR_RA_IDLE;
+		} else {
+			/* in flight: discarded on completion */
+			stream->stale = true;
+		}
+	}
+	pthread_mutex_unlock(&ra->lock);
+}
+
+static struct tcmur_rc_block *rc_hash_find(struct tcmur_rc *rc, uint64_t idx)
+{
+	struct tcmur_rc_block *block;
+
+	block = rc->hash[idx & rc->hash_mask];
+	while (block && block->idx != idx)
+		block = block->hash_next;
+
+	return block;
+}
+
+static void rc_hash_del(struct tcmur_rc *rc, struct tcmur_rc_block *block)
+{
+	struct tcmur_rc_block **p = &rc->hash[block->idx & rc->hash_mask];
+
+	while (*p != block)
+		p = &(*p)->hash_next;
+	*p = block->hash_next;
+}
+
+static void rc_evict_one(struct tcmur_rc *rc)
+{
+	struct tcmur_rc_block *victim;
+
+	/* take the FIFO first so scans cannot push out the hot set */
+	if (rc->nr_a1 >= rc->max_a1 || list_empty(&rc->am)) {
+		victim = list_first_entry(&rc->a1, struct tcmur_rc_block,
+					  lru_entry);
+		rc->nr_a1--;
+	} else {
+		victim = list_first_entry(&rc->am, struct tcmur_rc_block,
+					  lru_entry);
+	}
+
+	list_del(&victim->lru_entry);
+	rc_hash_del(rc, victim);
+	rc->nr_blocks--;
+	free(victim);
+}
+
+/*
+ * Serve the READ when every spanned cache block is resident.
+ * Returns TCMU_STS_OK on a full hit, TCMU_STS_NOT_HANDLED otherwise.
+ */
+static int tcmur_rc_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_rc *rc = rdev->rc;
+	struct tcmur_rc_block *block;
+	uint64_t off = tcmu_cdb_to_byte(dev, cmd->cdb);
+	size_t length = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+	uint64_t idx, first, last;
+	struct iovec *iov;
+	size_t iov_cnt, part;
+	uint32_t boff;
+
+	if (!rc)
+		return TCMU_STS_NOT_HANDLED;
+
+	first = off >> TCMUR_RC_BLOCK_SHIFT;
+	last = (off + length - 1) >> TCMUR_RC_BLOCK_SHIFT;
+
+	pthread_mutex_lock(&rc->lock);
+
+	for (idx = first; idx <= last; idx++) {
+		if (!rc_hash_find(rc, idx)) {
+			rc->misses++;
+			pthread_mutex_unlock(&rc->lock);
+			return TCMU_STS_NOT_HANDLED;
+		}
+	}
+
+	iov = cmd->iovec;
+	iov_cnt = cmd->iov_cnt;
+	for (idx = first; idx <= last; idx++) {
+		block = rc_hash_find(rc, idx);
+
+		/* re-reference: promote to / refresh the LRU side */
+		list_del(&block->lru_entry);
+		if (!block->in_am) {
+			block->in_am = true;
+			rc->nr_a1--;
+		}
+		list_add_tail(&rc->am, &block->lru_entry);
+
+		boff = off & (TCMUR_RC_BLOCK_SIZE - 1);
+		part = min((size_t)(TCMUR_RC_BLOCK_SIZE - boff), length);
+		tcmu_memcpy_into_iovec(iov, iov_cnt, block->data + boff,
+				       part);
+		off += part;
+		length -= part;
+	}
+
+	rc->hits++;
+	pthread_mutex_unlock(&rc->lock);
+
+	return TCMU_STS_OK;
+}
+
+/* insert the fully covered blocks of a completed backend read */
+static void tcmur_rc_fill(struct tcmu_device *dev, uint64_t off,
+			  size_t length, uint64_t gen, struct iovec *iov,
+			  size_t iov_cnt)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_rc *rc = rdev->rc;
+	struct tcmur_rc_block *block;
+	uint64_t idx, first, last;
+	struct iovec iov_copy[iov_cnt];
+	struct iovec *pos;
+	size_t skip;
+
+	first = (off + TCMUR_RC_BLOCK_SIZE - 1) >> TCMUR_RC_BLOCK_SHIFT;
+	last = (off + length) >> TCMUR_RC_BLOCK_SHIFT;
+	if (first >= last)
+		return;
+
+	pthread_mutex_lock(&rc->lock);
+
+	/* a write invalidated this range while the read was in flight */
+	if (gen != rc->gen) {
+		pthread_mutex_unlock(&rc->lock);
+		return;
+	}
+
+	for (idx = first; idx < last; idx++) {
+		if (rc_hash_find(rc, idx))
+			continue;
+
+		block = malloc(sizeof(*block) + TCMUR_RC_BLOCK_SIZE);
+		if (!block)
+			break;
+
+		/* pull the block's bytes back out of the data area */
+		memcpy(iov_copy, iov, iov_cnt * sizeof(*iov));
+		pos = iov_copy;
+		skip = (idx << TCMUR_RC_BLOCK_SHIFT) - off;
+		tcmu_iovec_seek(pos, skip);
+		tcmu_memcpy_from_iovec(block->data, TCMUR_RC_BLOCK_SIZE,
+				       pos, iov_cnt);
+
+		block->idx = idx;
+		block->in_am = false;
+		block->hash_next = rc->hash[idx & rc->hash_mask];
+		rc->hash[idx & rc->hash_mask] = block;
+		list_add_tail(&rc->a1, &block->lru_entry);
+		rc->nr_a1++;
+		rc->nr_blocks++;
+
+		while (rc->nr_blocks > rc->max_blocks)
+			rc_evict_one(rc);
+	}
+
+	pthread_mutex_unlock(&rc->lock);
+}
+
+static void tcmur_rc_invalidate(struct tcmu_device *dev, uint64_t off,
+				uint64_t len)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_rc *rc = rdev->rc;
+	struct tcmur_rc_block *block;
+	uint64_t idx, first, last;
+
+	if (!rc || !len)
+		return;
+
+	first = off >> TCMUR_RC_BLOCK_SHIFT;
+	last = (off + len - 1) >> TCMUR_RC_BLOCK_SHIFT;
+
+	pthread_mutex_lock(&rc->lock);
+	rc->gen++;
+	for (idx = first; idx <= last; idx++) {
+		block = rc_hash_find(rc, idx);
+		if (!block)
+			continue;
+
+		list_del(&block->lru_entry);
+		if (!block->in_am)
+			rc->nr_a1--;
+		rc_hash_del(rc, block);
+		rc->nr_blocks--;
+		free(block);
+	}
+	pthread_mutex_unlock(&rc->lock);
+}
+
+static void tcmur_cache_invalidate(struct tcmu_device *dev, uint64_t off,
+				   uint64_t len)
+{
+	tcmur_ra_invalidate(dev, off, len);
+	tcmur_rc_invalidate(dev, off, len);
+}
+
+int tcmur_rc_setup(struct tcmu_device *dev, int read_cache_mb)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_rc *rc;
+	unsigned int hash_size = 1;
+
+	if (read_cache_mb <= 0)
+		return 0;
+
+	rc = calloc(1, sizeof(*rc));
+	if (!rc)
+		return -ENOMEM;
+
+	rc->max_blocks = ((uint64_t)read_cache_mb << 20) /
+			 TCMUR_RC_BLOCK_SIZE;
+	if (!rc->max_blocks)
+		rc->max_blocks = 1;
+	rc->max_a1 = rc->max_blocks / 4 ? rc->max_blocks / 4 : 1;
+
+	while (hash_size < rc->max_blocks)
+		hash_size <<= 1;
+	rc->hash_mask = hash_size - 1;
+	rc->hash = calloc(hash_size, sizeof(*rc->hash));
+	if (!rc->hash) {
+		free(rc);
+		return -ENOMEM;
+	}
+
+	if (pthread_mutex_init(&rc->lock, NULL)) {
+		free(rc->hash);
+		free(rc);
+		return -ENOMEM;
+	}
+
+	list_head_init(&rc->a1);
+	list_head_init(&rc->am);
+	rdev->rc = rc;
+
+	return 0;
+}
+
+void tcmur_rc_cleanup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_rc *rc = rdev->rc;
+
+	if (!rc)
+		return;
+
+	while (rc->nr_blocks)
+		rc_evict_one(rc);
+	pthread_mutex_destroy(&rc->lock);
+	free(rc->hash);
+	free(rc);
+	rdev->rc = NULL;
+}
+
+static void wc_writeback_cbk(struct tcmu_device *dev,
+			     struct tcmur_cmd *tcmur_cmd, int ret)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_wc *wc = rdev->wc;
+	uint64_t off;
+	uint32_t len;
+
+	pthread_mutex_lock(&wc->lock);
+	off = wc->off;
+	len = wc->len;
+	if (ret != TCMU_STS_OK && wc->error == TCMU_STS_OK)
+		wc->error = ret;
+	wc->state = TCMUR_WC_EMPTY;
+	wc->len = 0;
+	pthread_cond_broadcast(&wc->cond);
+	pthread_mutex_unlock(&wc->lock);
+
+	/* reads raced against this writeback must not repopulate */
+	tcmur_cache_invalidate(dev, off, len);
+
+	track_aio_request_finish(rdev, NULL);
+}
+
+static int wc_writeback_work_fn(struct tcmu_device *dev, void *data)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_cmd *tcmur_cmd = data;
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_wc *wc = rdev->wc;
+
+	wc->iov.iov_base = wc->buf;
+	wc->iov.iov_len = wc->len;
+
+	return rhandler->write(dev, tcmur_cmd, &wc->iov, 1, wc->len,
+			       wc->off);
+}
+
+/* called with wc->lock held; drops it around the schedule */
+static void wc_submit(struct tcmu_device *dev, struct tcmur_wc *wc)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	int ret;
+
+	if (wc->state != TCMUR_WC_DIRTY)
+		return;
+
+	wc->state = TCMUR_WC_INFLIGHT;
+	memset(&wc->cmd, 0, sizeof(wc->cmd));
+	wc->cmd.done = wc_writeback_cbk;
+
+	track_aio_request_start(rdev);
+
+	pthread_mutex_unlock(&wc->lock);
+	ret = aio_request_schedule(dev, &wc->cmd, wc_writeback_work_fn,
+				   tcmur_cmd_complete);
+	pthread_mutex_lock(&wc->lock);
+
+	if (ret != TCMU_STS_ASYNC_HANDLED) {
+		if (wc->error == TCMU_STS_OK)
+			wc->error = ret;
+		wc->state = TCMUR_WC_EMPTY;
+		wc->len = 0;
+		pthread_cond_broadcast(&wc->cond);
+		track_aio_request_finish(rdev, NULL);
+	}
+}
+
+/*
+ * Wait until no buffered or in-flight coalesced data overlaps
+ * [off, off + len). Reads, flushes and the compound commands that
+ * reach the handler callouts directly must call this first.
+ */
+void tcmur_wc_drain(struct tcmu_device *dev, uint64_t off, uint64_t len)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_wc *wc = rdev->wc;
+
+	if (!wc || !len)
+		return;
+
+	pthread_mutex_lock(&wc->lock);
+	while (wc->state != TCMUR_WC_EMPTY &&
+	       wc->off < off + len && off < wc->off + wc->len) {
+		if (wc->state == TCMUR_WC_DIRTY)
+			wc_submit(dev, wc);
+		else
+			pthread_cond_wait(&wc->cond, &wc->lock);
+	}
+	pthread_mutex_unlock(&wc->lock);
+}
+
+/* kick the buffer out asynchronously once the ring has gone idle */
+void tcmur_wc_idle_submit(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_wc *wc = rdev->wc;
+
+	if (!wc)
+		return;
+
+	pthread_mutex_lock(&wc->lock);
+	wc_submit(dev, wc);
+	pthread_mutex_unlock(&wc->lock);
+}
+
+/* report and clear the first deferred writeback error */
+int tcmur_wc_take_error(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_wc *wc = rdev->wc;
+	int error;
+
+	if (!wc)
+		return TCMU_STS_OK;
+
+	pthread_mutex_lock(&wc->lock);
+	error = wc->error;
+	wc->error = TCMU_STS_OK;
+	pthread_mutex_unlock(&wc->lock);
+
+	return error;
+}
+
+/*
+ * Absorb the WRITE into the coalesce buffer when it extends it (or
+ * starts a fresh one), completing the command immediately under WCE
+ * semantics. Returns TCMU_STS_OK when absorbed, TCMU_STS_NOT_HANDLED
+ * to write through - after draining any conflicting buffered data.
+ */
+static int tcmur_wc_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_wc *wc = rdev->wc;
+	uint64_t off = tcmu_cdb_to_byte(dev, cmd->cdb);
+	size_t length = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+	int ret = TCMU_STS_NOT_HANDLED;
+
+	if (!wc)
+		return TCMU_STS_NOT_HANDLED;
+
+	if (length >= wc->size) {
+		/* too big to coalesce, just keep ordering */
+		tcmur_wc_drain(dev, off, length);
+		return TCMU_STS_NOT_HANDLED;
+	}
+
+	pthread_mutex_lock(&wc->lock);
+
+	while (wc->state == TCMUR_WC_INFLIGHT &&
+	       wc->off < off + length && off < wc->off + wc->len)
+		pthread_cond_wait(&wc->cond, &wc->lock);
+
+	if (wc->state == TCMUR_WC_DIRTY) {
+		if (off == wc->off + wc->len &&
+		    wc->len + length <= wc->size) {
+			/* extends the open buffer */
+			tcmu_memcpy_from_iovec(wc->buf + wc->len, length,
+					       cmd->iovec, cmd->iov_cnt);
+			wc->len += length;
+			if (wc->len == wc->size)
+				wc_submit(dev, wc);
+			ret = TCMU_STS_OK;
+			goto unlock;
+		}
+
+		/* not mergeable: push the old batch out first */
+		wc_submit(dev, wc);
+		while (wc->state == TCMUR_WC_INFLIGHT &&
+		       wc->off < off + length && off < wc->off + wc->len)
+			pthread_cond_wait(&wc->cond, &wc->lock);
+	}
+
+	if (wc->state == TCMUR_WC_EMPTY) {
+		wc->off = off;
+		wc->len = length;
+		tcmu_memcpy_from_iovec(wc->buf, length, cmd->iovec,
+				       cmd->iov_cnt);
+		wc->state = TCMUR_WC_DIRTY;
+		ret = TCMU_STS_OK;
+	}
+
+unlock:
+	pthread_mutex_unlock(&wc->lock);
+	return ret;
+}
+
+int tcmur_wc_setup(struct tcmu_device *dev, int write_coalesce_kb)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_wc *wc;
+
+	if (write_coalesce_kb <= 0)
+		return 0;
+
+	if (!tcmu_dev_get_write_cache_enabled(dev)) {
+		tcmu_dev_warn(dev, "not coalescing writes, WCE is off\n");
+		return 0;
+	}
+
+	wc = calloc(1, sizeof(*wc));
+	if (!wc)
+		return -ENOMEM;
+
+	wc->size = (uint32_t)write_coalesce_kb * 1024;
+	wc->buf = malloc(wc->size);
+	if (!wc->buf)
+		goto free_wc;
+
+	if (pthread_mutex_init(&wc->lock, NULL))
+		goto free_buf;
+	if (pthread_cond_init(&wc->cond, NULL)) {
+		pthread_mutex_destroy(&wc->lock);
+		goto free_buf;
+	}
+
+	wc->state = TCMUR_WC_EMPTY;
+	wc->error = TCMU_STS_OK;
+	rdev->wc = wc;
+
+	return 0;
+
+free_buf:
+	free(wc->buf);
+free_wc:
+	free(wc);
+	return -ENOMEM;
+}
+
+void tcmur_wc_cleanup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_wc *wc = rdev->wc;
+
+	if (!wc)
+		return;
+
+	pthread_cond_destroy(&wc->cond);
+	pthread_mutex_destroy(&wc->lock);
+	free(wc->buf);
+	free(wc);
+	rdev->wc = NULL;
+}
+
+int tcmur_ra_setup(struct tcmu_device *dev, int read_ahead_kb)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_ra *ra;
+
+	if (read_ahead_kb <= 0)
+		return 0;
+
+	ra = calloc(1, sizeof(*ra));
+	if (!ra)
+		return -ENOMEM;
+
+	if (pthread_mutex_init(&ra->lock, NULL)) {
+		free(ra);
+		return -ENOMEM;
+	}
+
+	ra->window_bytes = (uint32_t)read_ahead_kb * 1024;
+	rdev->ra = ra;
+
+	return 0;
+}
+
+void tcmur_ra_cleanup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_ra *ra = rdev->ra;
+	int i;
+
+	if (!ra)
+		return;
+
+	for (i = 0; i < TCMUR_RA_STREAMS; i++)
+		free(ra->streams[i].buf);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra);
+	rdev->ra = NULL;
+}
+
+static int read_work_fn(struct tcmu_device *dev, void *data)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_cmd *tcmur_cmd = data;
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+
+	return rhandler->read(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
+			      tcmu_iovec_length(cmd->iovec, cmd->iov_cnt),
+			      tcmu_cdb_to_byte(dev, cmd->cdb));
+}
+
+static int write_work_fn(struct tcmu_device *dev, void *data)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_cmd *tcmur_cmd = data;
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+
+	if (rhandler->write_flags)
+		return rhandler->write_flags(dev, tcmur_cmd, cmd->iovec,
+				cmd->iov_cnt,
+				tcmu_iovec_length(cmd->iovec, cmd->iov_cnt),
+				tcmu_cdb_to_byte(dev, cmd->cdb),
+				tcmur_cmd->write_flags);
+
+	return rhandler->write(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
+				tcmu_iovec_length(cmd->iovec, cmd->iov_cnt),
+				tcmu_cdb_to_byte(dev, cmd->cdb));
+}
+
+struct unmap_state {
+	pthread_mutex_t lock;
+	unsigned int refcount;
+	int status;
+};
+
+struct unmap_descriptor {
+	uint64_t offset;
+	uint64_t length;
+
+	/* for handlers that only provide unmap_ranges */
+	struct tcmur_unmap_range range;
+};
+
+static int unmap_init(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	struct unmap_state *state;
+	int ret;
+
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, sizeof(*state), 0))
+		return TCMU_STS_NO_RESOURCE;
+	state = tcmur_cmd->cmd_state;
+
+	ret = pthread_mutex_init(&state->lock, NULL);
+	if (ret == -1) {
+		tcmu_dev_err(dev, "Failed to init spin lock in state!\n");
+		ret = TCMU_STS_HW_ERR;
+		goto out_free_state;
+	}
+
+	/* released by allocator when done submitting unmaps */
+	state->refcount = 1;
+	state->status = TCMU_STS_OK;
+	return TCMU_STS_OK;
+
+out_free_state:
+	tcmur_cmd_state_free(dev, tcmur_cmd);
+	return ret;
+}
+
+static void unmap_put(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		      int ret)
+{
+	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	struct unmap_state *state = tcmur_cmd->cmd_state;
+	int status;
+
+	pthread_mutex_lock(&state->lock);
+
+	if (state->status != TCMU_STS_OK && ret)
+		state->status = ret;
+
+	if (--state->refcount > 0) {
+		pthread_mutex_unlock(&state->lock);
+		return;
+	}
+	status = state->status;
+	pthread_mutex_unlock(&state->lock);
+
+	pthread_mutex_destroy(&state->lock);
+	tcmur_cmd_state_free(dev, tcmur_cmd);
+
+	aio_command_finish(dev, cmd, status);
+}
+
+static void handle_unmap_cbk(struct tcmu_device *dev,
+			     struct tcmur_cmd *tcmur_ucmd, int ret)
+{
+	struct unmap_descriptor *desc = tcmur_ucmd->cmd_state;
+	struct tcmulib_cmd *cmd = tcmur_ucmd->lib_cmd;
+
+	tcmur_cache_invalidate(dev, desc->offset, desc->length);
+
+	free(desc);
+	free(tcmur_ucmd);
+
+	unmap_put(dev, cmd, ret);
+}
+
+static int unmap_work_fn(struct tcmu_device *dev, void *data)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_cmd *tcmur_ucmd = data;
+	struct unmap_descriptor *desc = tcmur_ucmd->cmd_state;
+	uint64_t offset = desc->offset, length = desc->length;
+
+	if (!rhandler->unmap) {
+		desc->range.off = offset;
+		desc->range.len = length;
+		return rhandler->unmap_ranges(dev, tcmur_ucmd, &desc->range,
+					      1);
+	}
+
+	return rhandler->unmap(dev, tcmur_ucmd, offset, length);
+}
+
+/*
+ * Batched UNMAP: every descriptor in the parameter list is split by
+ * the usual alignment/granularity rules into one flat range array
+ * and handed to the handler's unmap_ranges callout as a single
+ * backend call with a single completion.
+ */
+struct unmap_ranges_state {
+	struct tcmur_unmap_range *ranges;
+	size_t nr;
+	size_t cap;
+};
+
+static int unmap_ranges_append(struct tcmu_device *dev,
+			       struct unmap_ranges_state *state,
+			       uint64_t lba, uint64_t nlbas)
+{
+	uint64_t opt_unmap_gran, unmap_gran_align, mask, lbas;
+
+	if (!dev->split_unmaps) {
+		opt_unmap_gran = tcmu_dev_get_max_unmap_len(dev);
+		mask = 0;
+	} else {
+		opt_unmap_gran = tcmu_dev_get_opt_unmap_gran(dev);
+		unmap_gran_align = tcmu_dev_get_unmap_gran_align(dev);
+		mask = unmap_gran_align - 1;
+	}
+
+	lbas = opt_unmap_gran - (lba & mask);
+	lbas = min(lbas, nlbas);
+
+	while (nlbas) {
+		if (state->nr == state->cap) {
+			size_t cap = state->cap ? state->cap * 2 : 16;
+			struct tcmur_unmap_range *tmp;
+
+			tmp = realloc(state->ranges, cap * sizeof(*tmp));
+			if (!tmp)
+				return TCMU_STS_NO_RESOURCE;
+			state->ranges = tmp;
+			state->cap = cap;
+		}
+
+		state->ranges[state->nr].off = tcmu_lba_to_byte(dev, lba);
+		state->ranges[state->nr].len = tcmu_lba_to_byte(dev, lbas);
+		state->nr++;
+
+		nlbas -= lbas;
+		lba += lbas;
+		lbas = min(opt_unmap_gran, nlbas);
+	}
+
+	return TCMU_STS_OK;
+}
+
+static int unmap_ranges_work_fn(struct tcmu_device *dev, void *data)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_cmd *tcmur_cmd = data;
+	struct unmap_ranges_state *state = tcmur_cmd->cmd_state;
+
+	return rhandler->unmap_ranges(dev, tcmur_cmd, state->ranges,
+				      state->nr);
+}
+
+static void handle_unmap_ranges_cbk(struct tcmu_device *dev,
+				    struct tcmur_cmd *tcmur_cmd, int ret)
+{
+	struct unmap_ranges_state *state = tcmur_cmd->cmd_state;
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+	size_t i;
+
+	for (i = 0; i < state->nr; i++)
+		tcmur_cache_invalidate(dev, state->ranges[i].off,
+				       state->ranges[i].len);
+
+	free(state->ranges);
+	tcmur_cmd_state_free(dev, tcmur_cmd);
+	aio_command_finish(dev, cmd, ret);
+}
+
+static int handle_unmap_batched(struct tcmu_device *dev,
+				struct tcmulib_cmd *cmd, uint16_t bddl,
+				uint8_t *par)
+{
+	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	struct unmap_ranges_state *state;
+	uint16_t offset = 0;
+	int ret, i = 0;
+
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, sizeof(*state), 0))
+		return TCMU_STS_NO_RESOURCE;
+	state = tcmur_cmd->cmd_state;
+
+	/* The first descriptor list offset is 8 in Data-Out buffer */
+	par += 8;
+	while (bddl) {
+		uint64_t lba;
+		uint64_t nlbas;
+
+		lba = be64toh(*((uint64_t *)&par[offset]));
+		nlbas = be32toh(*((uint32_t *)&par[offset + 8]));
+
+		tcmu_dev_dbg(dev, "Parameter list %d, start lba: %"PRIu64", end lba: %"PRIu64", nlbas: %"PRIu64"\n",
+			     i++, lba, lba + nlbas - 1, nlbas);
+
+		if (nlbas > tcmu_dev_get_max_unmap_len(dev)) {
+			tcmu_dev_err(dev, "Illegal parameter list LBA count %"PRIu64" exceeds:%u\n",
+				     nlbas, tcmu_dev_get_max_unmap_len(dev));
+			ret = TCMU_STS_INVALID_PARAM_LIST;
+			goto free_ranges;
+		}
 
-	pthread_mutex_lock(&state->lock);
+		ret = check_lbas(dev, lba, nlbas);
+		if (ret)
+			goto free_ranges;
 
-	if (state->status != TCMU_STS_OK && ret)
-		state->status = ret;
+		if (nlbas) {
+			tcmur_cache_invalidate(dev, tcmu_lba_to_byte(dev, lba),
+					       tcmu_lba_to_byte(dev, nlbas));
+			ret = unmap_ranges_append(dev, state, lba, nlbas);
+			if (ret)
+				goto free_ranges;
+		}
 
-	if (--state->refcount > 0) {
-		pthread_mutex_unlock(&state->lock);
-		return;
+		/* The unmap block descriptor data length is 16 */
+		offset += 16;
+		bddl -= 16;
 	}
-	status = state->status;
-	pthread_mutex_unlock(&state->lock);
-
-	pthread_mutex_destroy(&state->lock);
-	tcmur_cmd_state_free(tcmur_cmd);
 
-	aio_command_finish(dev, cmd, status);
-}
-
-static void handle_unmap_cbk(struct tcmu_device *dev,
-			     struct tcmur_cmd *tcmur_ucmd, int ret)
-{
-	struct unmap_descriptor *desc = tcmur_ucmd->cmd_state;
-	struct tcmulib_cmd *cmd = tcmur_ucmd->lib_cmd;
+	if (!state->nr) {
+		ret = TCMU_STS_OK;
+		goto free_ranges;
+	}
 
-	free(desc);
-	free(tcmur_ucmd);
+	tcmu_dev_dbg(dev, "Batching %zu unmap ranges into one call\n",
+		     state->nr);
 
-	unmap_put(dev, cmd, ret);
-}
+	tcmur_cmd->done = handle_unmap_ranges_cbk;
 
-static int unmap_work_fn(struct tcmu_device *dev, void *data)
-{
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
-	struct tcmur_cmd *tcmur_ucmd = data;
-	struct unmap_descriptor *desc = tcmur_ucmd->cmd_state;
-	uint64_t offset = desc->offset, length = desc->length;
+	ret = aio_request_schedule(dev, tcmur_cmd, unmap_ranges_work_fn,
+				   tcmur_cmd_complete);
+	if (ret == TCMU_STS_ASYNC_HANDLED)
+		return ret;
 
-	return rhandler->unmap(dev, tcmur_ucmd, offset, length);
+free_ranges:
+	free(state->ranges);
+	tcmur_cmd_state_free(dev, tcmur_cmd);
+	return ret;
 }
 
 static int align_and_split_unmap(struct tcmu_device *dev,
@@ -391,11 +1780,15 @@ free_desc:
 static int handle_unmap_internal(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 				 uint16_t bddl, uint8_t *par)
 {
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
 	struct unmap_state *state;
 	uint16_t offset = 0;
 	int ret = TCMU_STS_OK, i = 0;
 
+	if (rhandler->unmap_ranges)
+		return handle_unmap_batched(dev, cmd, bddl, par);
+
 	ret = unmap_init(dev, cmd);
 	if (ret)
 		return ret;
@@ -425,6 +1818,8 @@ static int handle_unmap_internal(struct tcmu_device *dev, struct tcmulib_cmd *cm
 			goto done;
 
 		if (nlbas) {
+			tcmur_cache_invalidate(dev, tcmu_lba_to_byte(dev, lba),
+					       tcmu_lba_to_byte(dev, nlbas));
 			ret = align_and_split_unmap(dev, tcmur_cmd, lba, nlbas);
 			if (ret != TCMU_STS_ASYNC_HANDLED)
 				goto done;
@@ -461,9 +1856,11 @@ static int handle_unmap(struct tcmu_device *dev, struct tcmulib_cmd *origcmd)
 	uint16_t dl, bddl;
 	int ret;
 
-	if (!rhandler->unmap)
+	if (!rhandler->unmap && !rhandler->unmap_ranges)
 		return TCMU_STS_INVALID_CMD;
 
+	tcmur_wc_drain(dev, 0, UINT64_MAX);
+
 	/*
 	 * ANCHOR bit check
 	 *
@@ -558,16 +1955,91 @@ out_free_par:
 	return ret;
 }
 
+/*
+ * Generic WRITE SAME engine: the range is zeroed/patterned with up
+ * to TCMUR_WRITESAME_WINDOW chunk writes in flight, each chunk
+ * carrying its own pattern-filled buffer, instead of one chunk per
+ * backend round trip. Handlers that advertise a writesame callout
+ * still get the whole range in one call.
+ */
+#define TCMUR_WRITESAME_WINDOW 2
+
 struct write_same {
-	uint64_t cur_lba;
-	uint64_t lba_cnt;
+	struct tcmur_cmd *master_cmd;
+	pthread_mutex_t lock;
+	uint64_t next_lba;
+	uint64_t left_lbas;
+	uint64_t chunk_lbas;
+	unsigned int inflight;
+	int status;
+};
+
+struct write_same_chunk {
+	struct tcmur_cmd cmd;
+	struct write_same *write_same;
+	uint64_t lba;
+	uint64_t lbas;
 };
 
+static void write_same_finish(struct tcmu_device *dev,
+			      struct write_same *write_same)
+{
+	struct tcmur_cmd *master_cmd = write_same->master_cmd;
+	struct tcmulib_cmd *lib_cmd = master_cmd->lib_cmd;
+	int status = write_same->status;
+
+	pthread_mutex_destroy(&write_same->lock);
+	tcmur_cmd_state_free(dev, master_cmd);
+	aio_command_finish(dev, lib_cmd, status);
+}
+
+static bool write_same_claim_chunk(struct write_same *write_same,
+				   struct write_same_chunk *chunk)
+{
+	bool claimed = false;
+
+	pthread_mutex_lock(&write_same->lock);
+	if (write_same->left_lbas && write_same->status == TCMU_STS_OK) {
+		chunk->lbas = min(write_same->chunk_lbas,
+				  write_same->left_lbas);
+		chunk->lba = write_same->next_lba;
+		write_same->next_lba += chunk->lbas;
+		write_same->left_lbas -= chunk->lbas;
+		claimed = true;
+	}
+	pthread_mutex_unlock(&write_same->lock);
+
+	return claimed;
+}
+
+static void write_same_chunk_done(struct tcmu_device *dev,
+				  struct write_same_chunk *chunk, int ret)
+{
+	struct write_same *write_same = chunk->write_same;
+	bool finished;
+
+	tcmur_cache_invalidate(dev, tcmu_lba_to_byte(dev, chunk->lba),
+			       tcmu_lba_to_byte(dev, chunk->lbas));
+
+	tcmur_cmd_state_free(dev, &chunk->cmd);
+	free(chunk);
+
+	pthread_mutex_lock(&write_same->lock);
+	if (ret != TCMU_STS_OK && write_same->status == TCMU_STS_OK)
+		write_same->status = ret;
+	finished = !--write_same->inflight;
+	pthread_mutex_unlock(&write_same->lock);
+
+	if (finished)
+		write_same_finish(dev, write_same);
+}
+
 static int writesame_work_fn(struct tcmu_device *dev, void *data)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_cmd *tcmur_cmd = data;
-	struct write_same *write_same = tcmur_cmd->cmd_state;
+	struct write_same_chunk *chunk = container_of(tcmur_cmd,
+						struct write_same_chunk, cmd);
 
 	tcmur_cmd_iovec_reset(tcmur_cmd, tcmur_cmd->requested);
 	/*
@@ -576,52 +2048,96 @@ static int writesame_work_fn(struct tcmu_device *dev, void *data)
 	 */
 	return rhandler->write(dev, tcmur_cmd, tcmur_cmd->iovec,
 			       tcmur_cmd->iov_cnt, tcmur_cmd->requested,
-			       tcmu_lba_to_byte(dev, write_same->cur_lba));
+			       tcmu_lba_to_byte(dev, chunk->lba));
 }
 
 static void handle_writesame_cbk(struct tcmu_device *dev,
 				  struct tcmur_cmd *tcmur_cmd, int ret)
 {
-	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
-	struct write_same *write_same = tcmur_cmd->cmd_state;
-	uint64_t write_lbas = tcmu_byte_to_lba(dev, tcmur_cmd->requested);
-	uint64_t left_lbas;
-	int rc;
+	struct write_same_chunk *chunk = container_of(tcmur_cmd,
+						struct write_same_chunk, cmd);
+	struct write_same *write_same = chunk->write_same;
 
 	/* write failed - bail out */
 	if (ret != TCMU_STS_OK)
-		goto finish_err;
-
-	write_same->cur_lba += write_lbas;
-	write_same->lba_cnt -= write_lbas;
-	left_lbas = write_same->lba_cnt;
+		goto done;
 
-	if (!left_lbas)
-		goto finish_err;
+	/* reuse this chunk's pattern buffer for the next range */
+	if (!write_same_claim_chunk(write_same, chunk))
+		goto done;
 
-	if (left_lbas <= write_lbas) {
-		tcmu_dev_dbg(dev, "Last lba: %"PRIu64", write lbas: %"PRIu64"\n",
-			     write_same->cur_lba, left_lbas);
+	tcmu_dev_dbg(dev, "Next lba: %"PRIu64", write lbas: %"PRIu64"\n",
+		     chunk->lba, chunk->lbas);
 
-		tcmur_cmd->requested = tcmu_lba_to_byte(dev, left_lbas);
-	} else {
-		tcmu_dev_dbg(dev, "Next lba: %"PRIu64", write lbas: %"PRIu64"\n",
-			     write_same->cur_lba, write_lbas);
-	}
+	tcmur_cmd->requested = tcmu_lba_to_byte(dev, chunk->lbas);
 
-	rc = aio_request_schedule(dev, tcmur_cmd, writesame_work_fn,
-				  tcmur_cmd_complete);
-	if (rc != TCMU_STS_ASYNC_HANDLED) {
+	ret = aio_request_schedule(dev, tcmur_cmd, writesame_work_fn,
+				   tcmur_cmd_complete);
+	if (ret != TCMU_STS_ASYNC_HANDLED) {
 		tcmu_dev_err(dev, "Write same async handle cmd failure\n");
 		ret = TCMU_STS_WR_ERR;
-		goto finish_err;
+		goto done;
 	}
 
 	return;
 
-finish_err:
-	tcmur_cmd_state_free(tcmur_cmd);
-	aio_command_finish(dev, cmd, ret);
+done:
+	write_same_chunk_done(dev, chunk, ret);
+}
+
+/*
+ * Allocate a chunk with a pattern-filled buffer and put it to work.
+ * Returns TCMU_STS_ASYNC_HANDLED when in flight, TCMU_STS_OK when no
+ * work was left, or an error.
+ */
+static int write_same_start_chunk(struct tcmu_device *dev,
+				  struct write_same *write_same)
+{
+	struct tcmulib_cmd *lib_cmd = write_same->master_cmd->lib_cmd;
+	uint32_t block_size = tcmu_dev_get_block_size(dev);
+	struct write_same_chunk *chunk;
+	uint64_t i;
+	int ret;
+
+	chunk = calloc(1, sizeof(*chunk));
+	if (!chunk)
+		return TCMU_STS_NO_RESOURCE;
+
+	chunk->write_same = write_same;
+	chunk->cmd.lib_cmd = lib_cmd;
+
+	if (tcmur_cmd_state_init(dev, &chunk->cmd, 0,
+				 tcmu_lba_to_byte(dev,
+						  write_same->chunk_lbas))) {
+		free(chunk);
+		return TCMU_STS_NO_RESOURCE;
+	}
+
+	if (!write_same_claim_chunk(write_same, chunk)) {
+		tcmur_cmd_state_free(dev, &chunk->cmd);
+		free(chunk);
+		return TCMU_STS_OK;
+	}
+
+	for (i = 0; i < write_same->chunk_lbas; i++)
+		memcpy(chunk->cmd.iovec->iov_base + i * block_size,
+		       lib_cmd->iovec->iov_base, block_size);
+
+	chunk->cmd.requested = tcmu_lba_to_byte(dev, chunk->lbas);
+	chunk->cmd.done = handle_writesame_cbk;
+
+	pthread_mutex_lock(&write_same->lock);
+	write_same->inflight++;
+	pthread_mutex_unlock(&write_same->lock);
+
+	ret = aio_request_schedule(dev, &chunk->cmd, writesame_work_fn,
+				   tcmur_cmd_complete);
+	if (ret != TCMU_STS_ASYNC_HANDLED) {
+		write_same_chunk_done(dev, chunk, ret);
+		return ret;
+	}
+
+	return TCMU_STS_ASYNC_HANDLED;
 }
 
 static int handle_writesame_check(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
@@ -736,7 +2252,6 @@ static int handle_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	uint32_t lba_cnt = tcmu_cdb_get_xfer_length(cdb);
 	uint32_t block_size = tcmu_dev_get_block_size(dev);
 	uint64_t start_lba = tcmu_cdb_get_lba(cdb);
-	uint64_t write_lbas;
 	size_t max_xfer_length, length = 1024 * 1024;
 	struct write_same *write_same;
 	int i, ret;
@@ -752,7 +2267,19 @@ static int handle_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (ret)
 		return ret;
 
-	if (rhandler->unmap && (cmd->cdb[1] & 0x08)) {
+	tcmur_wc_drain(dev, 0, UINT64_MAX);
+
+	tcmur_cache_invalidate(dev, tcmu_lba_to_byte(dev, start_lba),
+			       tcmu_lba_to_byte(dev, lba_cnt));
+
+	/*
+	 * Only take the unmap shortcut for an all-zero pattern, so the
+	 * blocks read back as the initiator wrote them. The vectored
+	 * zero check makes this cheap even for large pattern blocks.
+	 */
+	if ((rhandler->unmap || rhandler->unmap_ranges) &&
+	    (cmd->cdb[1] & 0x08) &&
+	    tcmu_iovec_zeroed(cmd->iovec, cmd->iov_cnt)) {
 		ret = handle_unmap_in_writesame(dev, cmd);
 		if (ret != TCMU_STS_NOT_HANDLED)
 			return ret;
@@ -770,26 +2297,52 @@ static int handle_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	length = round_up(length, max_xfer_length);
 	length = min(length, tcmu_lba_to_byte(dev, lba_cnt));
 
-	if (tcmur_cmd_state_init(tcmur_cmd, sizeof(*write_same), length)) {
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, sizeof(*write_same), 0)) {
 		tcmu_dev_err(dev, "Failed to calloc write_same data!\n");
 		return TCMU_STS_NO_RESOURCE;
 	}
-	tcmur_cmd->done = handle_writesame_cbk;
-
-	write_lbas = tcmu_byte_to_lba(dev, length);
-	for (i = 0; i < write_lbas; i++)
-		memcpy(tcmur_cmd->iovec->iov_base + i * block_size,
-		       cmd->iovec->iov_base, block_size);
 
 	write_same = tcmur_cmd->cmd_state;
-	write_same->cur_lba = start_lba;
-	write_same->lba_cnt = lba_cnt;
+	write_same->master_cmd = tcmur_cmd;
+	write_same->next_lba = start_lba;
+	write_same->left_lbas = lba_cnt;
+	write_same->chunk_lbas = tcmu_byte_to_lba(dev, length);
+	write_same->status = TCMU_STS_OK;
+
+	ret = pthread_mutex_init(&write_same->lock, NULL);
+	if (ret) {
+		tcmur_cmd_state_free(dev, tcmur_cmd);
+		return TCMU_STS_NO_RESOURCE;
+	}
 
 	tcmu_dev_dbg(dev, "First lba: %"PRIu64", write lbas: %"PRIu64"\n",
-		     start_lba, write_lbas);
+		     start_lba, write_same->chunk_lbas);
 
-	return aio_request_schedule(dev, tcmur_cmd, writesame_work_fn,
-				    tcmur_cmd_complete);
+	/* hold a setup reference while the window is being filled */
+	write_same->inflight = 1;
+
+	ret = write_same_start_chunk(dev, write_same);
+	if (ret != TCMU_STS_ASYNC_HANDLED) {
+		/* nothing in flight yet, unwind synchronously */
+		pthread_mutex_destroy(&write_same->lock);
+		tcmur_cmd_state_free(dev, tcmur_cmd);
+		return ret;
+	}
+
+	for (i = 1; i < TCMUR_WRITESAME_WINDOW; i++) {
+		if (write_same_start_chunk(dev, write_same) !=
+		    TCMU_STS_ASYNC_HANDLED)
+			break;
+	}
+
+	/* drop the setup reference */
+	pthread_mutex_lock(&write_same->lock);
+	i = !--write_same->inflight;
+	pthread_mutex_unlock(&write_same->lock);
+	if (i)
+		write_same_finish(dev, write_same);
+
+	return TCMU_STS_ASYNC_HANDLED;
 }
 
 /* async write verify */
@@ -819,7 +2372,7 @@ static void handle_write_verify_read_cbk(struct tcmu_device *dev,
 	}
 
 done:
-	tcmur_cmd_state_free(tcmur_cmd);
+	tcmur_cmd_state_free(dev, tcmur_cmd);
 	aio_command_finish(dev, cmd, ret);
 }
 
@@ -840,6 +2393,10 @@ static void handle_write_verify_write_cbk(struct tcmu_device *dev,
 {
 	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
 
+	tcmur_cache_invalidate(dev, tcmu_cdb_to_byte(dev, cmd->cdb),
+			       tcmu_lba_to_byte(dev,
+					tcmu_cdb_get_xfer_length(cmd->cdb)));
+
 	/* write error - bail out */
 	if (ret != TCMU_STS_OK)
 		goto finish_err;
@@ -853,7 +2410,7 @@ static void handle_write_verify_write_cbk(struct tcmu_device *dev,
 	return;
 
 finish_err:
-	tcmur_cmd_state_free(tcmur_cmd);
+	tcmur_cmd_state_free(dev, tcmur_cmd);
 	aio_command_finish(dev, cmd, ret);
 }
 
@@ -869,9 +2426,12 @@ static int handle_write_verify(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (ret)
 		return ret;
 
+	tcmur_wc_drain(dev, 0, UINT64_MAX);
+	tcmur_cache_invalidate(dev, tcmu_cdb_to_byte(dev, cdb), length);
+
 	state_len = sizeof(*state) + (cmd->iov_cnt * sizeof(struct iovec));
 
-	if (tcmur_cmd_state_init(tcmur_cmd, state_len, length))
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, state_len, length))
 		return TCMU_STS_NO_RESOURCE;
 	tcmur_cmd->done = handle_write_verify_write_cbk;
 
@@ -895,7 +2455,7 @@ static int handle_write_verify(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	return TCMU_STS_ASYNC_HANDLED;
 
 free_state:
-	tcmur_cmd_state_free(tcmur_cmd);
+	tcmur_cmd_state_free(dev, tcmur_cmd);
 	return ret;
 }
 
@@ -917,6 +2477,15 @@ struct xcopy {
 	uint32_t dtdi;
 	uint32_t lba_cnt;
 	uint32_t copy_lbas;
+
+	/* pipeline bookkeeping, all under lock */
+	struct tcmur_cmd *master_cmd;
+	pthread_mutex_t lock;
+	uint64_t next_src_lba;
+	uint64_t next_dst_lba;
+	uint64_t left;
+	unsigned int inflight;
+	int status;
 };
 
 /* For now only supports block -> block type */
@@ -1400,107 +2969,329 @@ static int xcopy_parse_parameter_list(struct tcmu_device *dev,
 		goto err;
 	}
 
-	free(par);
-	return TCMU_STS_OK;
+	free(par);
+	return TCMU_STS_OK;
+
+err:
+	free(par);
+
+	return ret;
+}
+
+/*
+ * Pipelined copy engine: up to tcmur_xcopy_window chunks are kept in
+ * flight, each with its own buffer, so chunk N+1 is being read from
+ * the source while chunk N is being written to the destination
+ * instead of strictly read-write-next.
+ */
+#define TCMUR_XCOPY_WINDOW_MAX 8
+
+static int tcmur_xcopy_window = 2;
+
+void tcmur_set_xcopy_window(int window)
+{
+	if (window >= 1 && window <= TCMUR_XCOPY_WINDOW_MAX)
+		tcmur_xcopy_window = window;
+}
+
+struct xcopy_chunk {
+	struct tcmur_cmd cmd;
+	struct xcopy *xcopy;
+	uint64_t src_lba;
+	uint64_t dst_lba;
+	uint64_t lbas;
+};
+
+/* finish the EXTENDED COPY once the last chunk has drained */
+static void xcopy_finish(struct xcopy *xcopy)
+{
+	struct tcmu_device *dev = xcopy->origdev;
+	struct tcmur_cmd *master_cmd = xcopy->master_cmd;
+	struct tcmulib_cmd *lib_cmd = master_cmd->lib_cmd;
+	int status = xcopy->status;
+
+	pthread_mutex_destroy(&xcopy->lock);
+	tcmur_cmd_state_free(dev, master_cmd);
+	aio_command_finish(dev, lib_cmd, status);
+}
+
+/* grab the next chunk-sized range to copy, false when none is left */
+static bool xcopy_claim_chunk(struct xcopy *xcopy, struct xcopy_chunk *chunk)
+{
+	bool claimed = false;
+
+	pthread_mutex_lock(&xcopy->lock);
+	if (xcopy->left && xcopy->status == TCMU_STS_OK) {
+		chunk->lbas = min((uint64_t)xcopy->copy_lbas, xcopy->left);
+		chunk->src_lba = xcopy->next_src_lba;
+		chunk->dst_lba = xcopy->next_dst_lba;
+		xcopy->next_src_lba += chunk->lbas;
+		xcopy->next_dst_lba += chunk->lbas;
+		xcopy->left -= chunk->lbas;
+		claimed = true;
+	}
+	pthread_mutex_unlock(&xcopy->lock);
+
+	return claimed;
+}
+
+/* take/drop one reference on the pipeline, finishing on the last put */
+static void xcopy_get(struct xcopy *xcopy)
+{
+	pthread_mutex_lock(&xcopy->lock);
+	xcopy->inflight++;
+	pthread_mutex_unlock(&xcopy->lock);
+}
+
+static void xcopy_put(struct xcopy *xcopy)
+{
+	bool finished;
+
+	pthread_mutex_lock(&xcopy->lock);
+	finished = !--xcopy->inflight;
+	pthread_mutex_unlock(&xcopy->lock);
+
+	if (finished)
+		xcopy_finish(xcopy);
+}
+
+static void xcopy_chunk_done(struct xcopy_chunk *chunk, int ret)
+{
+	struct xcopy *xcopy = chunk->xcopy;
+
+	tcmur_cmd_state_free(xcopy->origdev, &chunk->cmd);
+	free(chunk);
+
+	pthread_mutex_lock(&xcopy->lock);
+	if (ret != TCMU_STS_OK && xcopy->status == TCMU_STS_OK)
+		xcopy->status = ret;
+	pthread_mutex_unlock(&xcopy->lock);
+
+	xcopy_put(xcopy);
+}
+
+static int xcopy_read_work_fn(struct tcmu_device *src_dev, void *data)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(src_dev);
+	struct tcmur_cmd *tcmur_cmd = data;
+	struct xcopy_chunk *chunk = container_of(tcmur_cmd,
+						 struct xcopy_chunk, cmd);
+
+	tcmu_dev_dbg(src_dev,
+		     "Copying %"PRIu64" sectors from src (lba:%"PRIu64") to dst (lba:%"PRIu64")\n",
+		     chunk->lbas, chunk->src_lba, chunk->dst_lba);
+
+	tcmur_cmd_iovec_reset(tcmur_cmd, tcmur_cmd->requested);
+
+	return rhandler->read(src_dev, tcmur_cmd, tcmur_cmd->iovec,
+			      tcmur_cmd->iov_cnt, tcmur_cmd->requested,
+			      tcmu_lba_to_byte(src_dev, chunk->src_lba));
+}
+
+static int xcopy_write_work_fn(struct tcmu_device *dst_dev, void *data)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dst_dev);
+	struct tcmur_cmd *tcmur_cmd = data;
+	struct xcopy_chunk *chunk = container_of(tcmur_cmd,
+						 struct xcopy_chunk, cmd);
+
+	tcmur_cache_invalidate(dst_dev,
+			       tcmu_lba_to_byte(dst_dev, chunk->dst_lba),
+			       tcmur_cmd->requested);
+
+	tcmur_cmd_iovec_reset(tcmur_cmd, tcmur_cmd->requested);
+
+	return rhandler->write(dst_dev, tcmur_cmd, tcmur_cmd->iovec,
+			       tcmur_cmd->iov_cnt, tcmur_cmd->requested,
+			       tcmu_lba_to_byte(dst_dev, chunk->dst_lba));
+}
+
+static void xcopy_chunk_read_cbk(struct tcmu_device *src_dev,
+				 struct tcmur_cmd *tcmur_cmd, int ret);
+
+static int xcopy_chunk_submit_read(struct xcopy *xcopy,
+				   struct xcopy_chunk *chunk)
+{
+	chunk->cmd.requested = tcmu_lba_to_byte(xcopy->src_dev, chunk->lbas);
+	chunk->cmd.done = xcopy_chunk_read_cbk;
+
+	return aio_request_schedule(xcopy->src_dev, &chunk->cmd,
+				    xcopy_read_work_fn, tcmur_cmd_complete);
+}
+
+static void xcopy_chunk_write_cbk(struct tcmu_device *dst_dev,
+				  struct tcmur_cmd *tcmur_cmd, int ret)
+{
+	struct xcopy_chunk *chunk = container_of(tcmur_cmd,
+						 struct xcopy_chunk, cmd);
+	struct xcopy *xcopy = chunk->xcopy;
+	bool claimed_next;
+
+	tcmur_cache_invalidate(dst_dev,
+			       tcmu_lba_to_byte(dst_dev, chunk->dst_lba),
+			       tcmu_lba_to_byte(dst_dev, chunk->lbas));
+
+	if (ret != TCMU_STS_OK) {
+		tcmu_dev_err(dst_dev, "Failed to write to dst device!\n");
+		goto done;
+	}
+
+	/* reuse this chunk's buffer for the next unclaimed range */
+	claimed_next = xcopy_claim_chunk(xcopy, chunk);
+	if (!claimed_next)
+		goto done;
+
+	ret = xcopy_chunk_submit_read(xcopy, chunk);
+	if (ret == TCMU_STS_ASYNC_HANDLED)
+		return;
+
+done:
+	xcopy_chunk_done(chunk, ret);
+}
+
+static void xcopy_chunk_read_cbk(struct tcmu_device *src_dev,
+				 struct tcmur_cmd *tcmur_cmd, int ret)
+{
+	struct xcopy_chunk *chunk = container_of(tcmur_cmd,
+						 struct xcopy_chunk, cmd);
+	struct xcopy *xcopy = chunk->xcopy;
+
+	/* read failed - bail out */
+	if (ret != TCMU_STS_OK) {
+		tcmu_dev_err(src_dev, "Failed to read from src device!\n");
+		goto done;
+	}
+
+	tcmur_cmd->done = xcopy_chunk_write_cbk;
+
+	ret = aio_request_schedule(xcopy->dst_dev, tcmur_cmd,
+				   xcopy_write_work_fn, tcmur_cmd_complete);
+	if (ret == TCMU_STS_ASYNC_HANDLED)
+		return;
+
+done:
+	xcopy_chunk_done(chunk, ret);
+}
+
+/*
+ * Allocate a chunk and put it to work on the next unclaimed range.
+ * Returns TCMU_STS_ASYNC_HANDLED when the chunk is in flight,
+ * TCMU_STS_OK when there was no work left, or an error.
+ */
+static int xcopy_start_chunk(struct tcmu_device *dev, struct xcopy *xcopy)
+{
+	struct xcopy_chunk *chunk;
+	int ret;
+
+	chunk = calloc(1, sizeof(*chunk));
+	if (!chunk)
+		return TCMU_STS_NO_RESOURCE;
+
+	chunk->xcopy = xcopy;
+	chunk->cmd.lib_cmd = xcopy->master_cmd->lib_cmd;
+
+	if (tcmur_cmd_state_init(dev, &chunk->cmd, 0,
+				 tcmu_lba_to_byte(xcopy->src_dev,
+						  xcopy->copy_lbas))) {
+		free(chunk);
+		return TCMU_STS_NO_RESOURCE;
+	}
+
+	if (!xcopy_claim_chunk(xcopy, chunk)) {
+		tcmur_cmd_state_free(dev, &chunk->cmd);
+		free(chunk);
+		return TCMU_STS_OK;
+	}
 
-err:
-	free(par);
+	xcopy_get(xcopy);
 
-	return ret;
-}
+	ret = xcopy_chunk_submit_read(xcopy, chunk);
+	if (ret != TCMU_STS_ASYNC_HANDLED) {
+		/* stop the pipeline, xcopy_chunk_done settles the rest */
+		xcopy_chunk_done(chunk, ret);
+		return ret;
+	}
 
-static int xcopy_read_work_fn(struct tcmu_device *src_dev, void *data);
-static void handle_xcopy_read_cbk(struct tcmu_device *src_dev,
-				  struct tcmur_cmd *tcmur_cmd, int ret);
+	return TCMU_STS_ASYNC_HANDLED;
+}
 
-static void handle_xcopy_write_cbk(struct tcmu_device *dst_dev,
-				  struct tcmur_cmd *tcmur_cmd, int ret)
+/*
+ * Kick off the generic bounce-buffer copy pipeline. The caller owns
+ * the xcopy state until this returns TCMU_STS_ASYNC_HANDLED.
+ */
+static int xcopy_start_pipeline(struct tcmu_device *dev, struct xcopy *xcopy)
 {
-	struct xcopy *xcopy = tcmur_cmd->cmd_state;
-	struct tcmu_device *src_dev = xcopy->src_dev;
+	int ret, i;
 
-	/* write failed - bail out */
-	if (ret != TCMU_STS_OK) {
-		tcmu_dev_err(src_dev, "Failed to write to dst device!\n");
-		goto out;
-	}
+	ret = pthread_mutex_init(&xcopy->lock, NULL);
+	if (ret)
+		return TCMU_STS_NO_RESOURCE;
 
-	xcopy->lba_cnt -= xcopy->copy_lbas;
-	if (!xcopy->lba_cnt)
-		goto out;
+	/* hold a setup reference while the window is being filled */
+	xcopy->inflight = 1;
 
-	xcopy->src_lba += xcopy->copy_lbas;
-	xcopy->dst_lba += xcopy->copy_lbas;
-	xcopy->copy_lbas = min(xcopy->lba_cnt, xcopy->copy_lbas);
-	tcmur_cmd->requested = tcmu_lba_to_byte(src_dev, xcopy->copy_lbas);
+	ret = xcopy_start_chunk(dev, xcopy);
+	if (ret != TCMU_STS_ASYNC_HANDLED) {
+		/* nothing in flight yet, unwind synchronously */
+		pthread_mutex_destroy(&xcopy->lock);
+		return ret;
+	}
 
-	tcmur_cmd->done = handle_xcopy_read_cbk;
-	ret = aio_request_schedule(xcopy->src_dev, tcmur_cmd,
-				   xcopy_read_work_fn, tcmur_cmd_complete);
-	if (ret != TCMU_STS_ASYNC_HANDLED)
-		goto out;
+	for (i = 1; i < tcmur_xcopy_window; i++) {
+		if (xcopy_start_chunk(dev, xcopy) != TCMU_STS_ASYNC_HANDLED)
+			break;
+	}
 
-	return;
+	/* drop the setup reference */
+	xcopy_put(xcopy);
 
-out:
-	aio_command_finish(xcopy->origdev, tcmur_cmd->lib_cmd, ret);
-	tcmur_cmd_state_free(tcmur_cmd);
+	return TCMU_STS_ASYNC_HANDLED;
 }
 
-static int xcopy_write_work_fn(struct tcmu_device *dst_dev, void *data)
+static int xcopy_offload_work_fn(struct tcmu_device *dst_dev, void *data)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dst_dev);
 	struct tcmur_cmd *tcmur_cmd = data;
 	struct xcopy *xcopy = tcmur_cmd->cmd_state;
 
-	tcmur_cmd_iovec_reset(tcmur_cmd, tcmur_cmd->requested);
-
-	return rhandler->write(dst_dev, tcmur_cmd, tcmur_cmd->iovec,
-			       tcmur_cmd->iov_cnt, tcmur_cmd->requested,
-			       tcmu_lba_to_byte(dst_dev, xcopy->dst_lba));
-}
-
-static void handle_xcopy_read_cbk(struct tcmu_device *src_dev,
-				  struct tcmur_cmd *tcmur_cmd,
-				  int ret)
-{
-	struct xcopy *xcopy = tcmur_cmd->cmd_state;
-
-	/* read failed - bail out */
-	if (ret != TCMU_STS_OK) {
-		tcmu_dev_err(src_dev, "Failed to read from src device!\n");
-		goto err;
-	}
-
-	tcmur_cmd->done = handle_xcopy_write_cbk;
-
-	ret = aio_request_schedule(xcopy->dst_dev, tcmur_cmd,
-				   xcopy_write_work_fn, tcmur_cmd_complete);
-	if (ret != TCMU_STS_ASYNC_HANDLED)
-		goto err;
+	tcmu_dev_dbg(dst_dev,
+		     "Offloading copy of %u sectors (src lba:%"PRIu64", dst lba:%"PRIu64")\n",
+		     xcopy->lba_cnt, xcopy->src_lba, xcopy->dst_lba);
 
-	return;
+	tcmur_cache_invalidate(dst_dev,
+			       tcmu_lba_to_byte(dst_dev, xcopy->dst_lba),
+			       tcmu_lba_to_byte(dst_dev, xcopy->lba_cnt));
 
-err:
-	aio_command_finish(xcopy->origdev, tcmur_cmd->lib_cmd, ret);
-	tcmur_cmd_state_free(tcmur_cmd);
+	return rhandler->copy_range(dst_dev, tcmur_cmd, xcopy->src_dev,
+				    tcmu_lba_to_byte(xcopy->src_dev,
+						     xcopy->src_lba),
+				    tcmu_lba_to_byte(dst_dev, xcopy->dst_lba),
+				    tcmu_lba_to_byte(xcopy->src_dev,
+						     xcopy->lba_cnt));
 }
 
-static int xcopy_read_work_fn(struct tcmu_device *src_dev, void *data)
+static void handle_xcopy_offload_cbk(struct tcmu_device *dev,
+				     struct tcmur_cmd *tcmur_cmd, int ret)
 {
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(src_dev);
-	struct tcmur_cmd *tcmur_cmd = data;
 	struct xcopy *xcopy = tcmur_cmd->cmd_state;
+	struct tcmu_device *origdev = xcopy->origdev;
+	struct tcmulib_cmd *lib_cmd = tcmur_cmd->lib_cmd;
+
+	tcmur_cache_invalidate(xcopy->dst_dev,
+			       tcmu_lba_to_byte(xcopy->dst_dev,
+						xcopy->dst_lba),
+			       tcmu_lba_to_byte(xcopy->dst_dev,
+						xcopy->lba_cnt));
+
+	if (ret == TCMU_STS_NOT_HANDLED) {
+		/* backend can't offload this range, bounce it instead */
+		ret = xcopy_start_pipeline(origdev, xcopy);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
 
-	tcmu_dev_dbg(src_dev,
-		     "Copying %u sectors from src (lba:%"PRIu64") to dst (lba:%"PRIu64")\n",
-		     xcopy->copy_lbas, xcopy->src_lba, xcopy->dst_lba);
-
-	tcmur_cmd_iovec_reset(tcmur_cmd, tcmur_cmd->requested);
-
-	return rhandler->read(src_dev, tcmur_cmd, tcmur_cmd->iovec,
-			      tcmur_cmd->iov_cnt, tcmur_cmd->requested,
-			      tcmu_lba_to_byte(src_dev, xcopy->src_lba));
+	tcmur_cmd_state_free(origdev, tcmur_cmd);
+	aio_command_finish(origdev, lib_cmd, ret);
 }
 
 /* async xcopy */
@@ -1510,6 +3301,7 @@ static int handle_xcopy(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	uint8_t *cdb = cmd->cdb;
 	size_t data_length = tcmu_cdb_get_xfer_length(cdb);
 	uint32_t max_sectors, src_max_sectors, dst_max_sectors;
+	struct tcmur_handler *src_handler, *dst_handler;
 	struct xcopy *xcopy, xcopy_parse;
 	int ret;
 
@@ -1554,37 +3346,105 @@ static int handle_xcopy(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	max_sectors = min(src_max_sectors, dst_max_sectors);
 	xcopy_parse.copy_lbas = min(max_sectors, xcopy_parse.lba_cnt);
 
-	if (tcmur_cmd_state_init(tcmur_cmd, sizeof(*xcopy),
-				 tcmu_lba_to_byte(xcopy_parse.src_dev,
-						  xcopy_parse.copy_lbas))) {
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, sizeof(*xcopy), 0)) {
 		tcmu_dev_err(dev, "calloc xcopy data error\n");
 		return TCMU_STS_NO_RESOURCE;
 	}
-	tcmur_cmd->done = handle_xcopy_read_cbk;
 
 	xcopy = tcmur_cmd->cmd_state;
-	memcpy(xcopy, &xcopy_parse, sizeof(*xcopy));
+	memcpy(xcopy, &xcopy_parse, sizeof(xcopy_parse));
 	xcopy->origdev = dev;
+	xcopy->master_cmd = tcmur_cmd;
+	xcopy->next_src_lba = xcopy->src_lba;
+	xcopy->next_dst_lba = xcopy->dst_lba;
+	xcopy->left = xcopy->lba_cnt;
+	xcopy->status = TCMU_STS_OK;
 
-	ret = aio_request_schedule(xcopy->src_dev, tcmur_cmd,
-				   xcopy_read_work_fn, tcmur_cmd_complete);
-	if (ret == TCMU_STS_ASYNC_HANDLED)
+	tcmur_wc_drain(xcopy->src_dev, 0, UINT64_MAX);
+	tcmur_wc_drain(xcopy->dst_dev, 0, UINT64_MAX);
+
+	src_handler = tcmu_get_runner_handler(xcopy->src_dev);
+	dst_handler = tcmu_get_runner_handler(xcopy->dst_dev);
+
+	/*
+	 * Same-backend copies go through the handler's native copy
+	 * offload when it has one, so the data never crosses through
+	 * userspace buffers. NOT_HANDLED from the callout falls back
+	 * to the generic pipeline in handle_xcopy_offload_cbk.
+	 */
+	if (src_handler == dst_handler && dst_handler->copy_range) {
+		tcmur_cmd->done = handle_xcopy_offload_cbk;
+
+		ret = aio_request_schedule(xcopy->dst_dev, tcmur_cmd,
+					   xcopy_offload_work_fn,
+					   tcmur_cmd_complete);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return ret;
+		if (ret == TCMU_STS_NOT_HANDLED)
+			goto start_pipeline;
+
+		tcmur_cmd_state_free(dev, tcmur_cmd);
 		return ret;
+	}
 
-	tcmur_cmd_state_free(tcmur_cmd);
+start_pipeline:
+	ret = xcopy_start_pipeline(dev, xcopy);
+	if (ret != TCMU_STS_ASYNC_HANDLED)
+		tcmur_cmd_state_free(dev, tcmur_cmd);
 	return ret;
 }
 
 /* async compare_and_write */
 
+/*
+ * Block until no locked range overlaps [start, end), then take it.
+ * Plain reads and writes never touch this, only CAWs serialize, and
+ * only against CAWs they actually overlap.
+ */
+static void tcmur_range_lock(struct tcmur_device *rdev,
+			     struct tcmur_locked_range *range,
+			     uint64_t start, uint64_t end)
+{
+	struct tcmur_locked_range *r;
+	bool conflict;
+
+	range->start = start;
+	range->end = end;
+
+	pthread_mutex_lock(&rdev->caw_ranges.lock);
+	do {
+		conflict = false;
+		list_for_each(&rdev->caw_ranges.ranges, r, entry) {
+			if (r->start < end && start < r->end) {
+				conflict = true;
+				break;
+			}
+		}
+		if (conflict)
+			pthread_cond_wait(&rdev->caw_ranges.cond,
+					  &rdev->caw_ranges.lock);
+	} while (conflict);
+	list_add_tail(&rdev->caw_ranges.ranges, &range->entry);
+	pthread_mutex_unlock(&rdev->caw_ranges.lock);
+}
+
+static void tcmur_range_unlock(struct tcmur_device *rdev,
+			       struct tcmur_locked_range *range)
+{
+	pthread_mutex_lock(&rdev->caw_ranges.lock);
+	list_del(&range->entry);
+	pthread_cond_broadcast(&rdev->caw_ranges.cond);
+	pthread_mutex_unlock(&rdev->caw_ranges.lock);
+}
+
 static void handle_caw_write_cbk(struct tcmu_device *dev,
 				 struct tcmur_cmd *tcmur_cmd, int ret)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
 
-	pthread_mutex_unlock(&rdev->caw_lock);
-	tcmur_cmd_state_free(tcmur_cmd);
+	tcmur_range_unlock(rdev, tcmur_cmd->cmd_state);
+	tcmur_cmd_state_free(dev, tcmur_cmd);
 	aio_command_finish(dev, cmd, ret);
 }
 
@@ -1638,8 +3498,8 @@ static void handle_caw_read_cbk(struct tcmu_device *dev,
 	return;
 
 finish_err:
-	pthread_mutex_unlock(&rdev->caw_lock);
-	tcmur_cmd_state_free(tcmur_cmd);
+	tcmur_range_unlock(rdev, tcmur_cmd->cmd_state);
+	tcmur_cmd_state_free(dev, tcmur_cmd);
 	aio_command_finish(dev, cmd, ret);
 }
 
@@ -1716,6 +3576,8 @@ static int handle_caw(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (ret)
 		return ret;
 
+	tcmur_wc_drain(dev, 0, UINT64_MAX);
+
 	if (rhandler->caw) {
 		tcmur_cmd->cmd_state = rhandler->caw;
 		tcmur_cmd->done = handle_generic_cbk;
@@ -1723,20 +3585,23 @@ static int handle_caw(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 					    tcmur_cmd_complete);
 	}
 
-	if (tcmur_cmd_state_init(tcmur_cmd, 0, half))
+	if (tcmur_cmd_state_init(dev, tcmur_cmd,
+				 sizeof(struct tcmur_locked_range), half))
 		return TCMU_STS_NO_RESOURCE;
 
 	tcmur_cmd->done = handle_caw_read_cbk;
 
-	pthread_mutex_lock(&rdev->caw_lock);
+	tcmur_range_lock(rdev, tcmur_cmd->cmd_state,
+			 tcmu_cdb_get_lba(cmd->cdb),
+			 tcmu_cdb_get_lba(cmd->cdb) + sectors);
 
 	ret = aio_request_schedule(dev, tcmur_cmd, caw_work_fn,
 				   tcmur_cmd_complete);
 	if (ret == TCMU_STS_ASYNC_HANDLED)
 		return TCMU_STS_ASYNC_HANDLED;
 
-	pthread_mutex_unlock(&rdev->caw_lock);
-	tcmur_cmd_state_free(tcmur_cmd);
+	tcmur_range_unlock(rdev, tcmur_cmd->cmd_state);
+	tcmur_cmd_state_free(dev, tcmur_cmd);
 	return ret;
 }
 
@@ -1748,17 +3613,111 @@ static int flush_work_fn(struct tcmu_device *dev, void *data)
 	return rhandler->flush(dev, data);
 }
 
+/* per-flush state: a parked waiter or the head of a merged batch */
+struct flush_state {
+	struct list_node entry;
+	struct tcmur_cmd *cmd;
+	struct list_head covered;
+};
+
+static void handle_flush_merge_cbk(struct tcmu_device *dev,
+				   struct tcmur_cmd *tcmur_cmd, int ret);
+
+/* schedule one backend flush for the batch head; may complete on error */
+static void flush_merge_submit(struct tcmu_device *dev,
+			       struct tcmur_cmd *tcmur_cmd)
+{
+	int ret;
+
+	tcmur_cmd->done = handle_flush_merge_cbk;
+	ret = aio_request_schedule(dev, tcmur_cmd, flush_work_fn,
+				   tcmur_cmd_complete);
+	if (ret != TCMU_STS_ASYNC_HANDLED)
+		handle_flush_merge_cbk(dev, tcmur_cmd,
+				       ret == TCMU_STS_OK ?
+				       TCMU_STS_HW_ERR : ret);
+}
+
+static void handle_flush_merge_cbk(struct tcmu_device *dev,
+				   struct tcmur_cmd *tcmur_cmd, int ret)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct flush_state *state = tcmur_cmd->cmd_state;
+	struct flush_state *covered, *next, *head;
+
+	__atomic_add_fetch(&rdev->flush_merge.epochs, 1, __ATOMIC_RELAXED);
+
+	/* everyone who arrived before this flush started rides it */
+	list_for_each_safe(&state->covered, covered, next, entry) {
+		struct tcmur_cmd *ccmd = covered->cmd;
+
+		list_del(&covered->entry);
+		tcmur_cmd_state_free(dev, ccmd);
+		aio_command_finish(dev, ccmd->lib_cmd, ret);
+	}
+
+	tcmur_cmd_state_free(dev, tcmur_cmd);
+	aio_command_finish(dev, tcmur_cmd->lib_cmd, ret);
+
+	pthread_mutex_lock(&rdev->flush_merge.lock);
+	if (list_empty(&rdev->flush_merge.waiters)) {
+		rdev->flush_merge.inflight = false;
+		pthread_mutex_unlock(&rdev->flush_merge.lock);
+		return;
+	}
+
+	/* promote the parked flushes onto one follow-up backend flush */
+	head = list_first_entry(&rdev->flush_merge.waiters,
+				struct flush_state, entry);
+	list_del(&head->entry);
+	list_head_init(&head->covered);
+	while (!list_empty(&rdev->flush_merge.waiters)) {
+		covered = list_first_entry(&rdev->flush_merge.waiters,
+					   struct flush_state, entry);
+		list_del(&covered->entry);
+		list_add_tail(&head->covered, &covered->entry);
+	}
+	pthread_mutex_unlock(&rdev->flush_merge.lock);
+
+	flush_merge_submit(dev, head->cmd);
+}
+
 static int handle_flush(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	struct flush_state *state;
+	int ret;
 
 	if (!rhandler->flush)
 		return TCMU_STS_INVALID_CMD;
 
-	tcmur_cmd->done = handle_generic_cbk;
-	return aio_request_schedule(dev, tcmur_cmd, flush_work_fn,
-				    tcmur_cmd_complete);
+	/* push buffered writes out and surface any deferred error */
+	tcmur_wc_drain(dev, 0, UINT64_MAX);
+	ret = tcmur_wc_take_error(dev);
+	if (ret != TCMU_STS_OK)
+		return ret;
+
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, sizeof(*state), 0))
+		return TCMU_STS_NO_RESOURCE;
+	state = tcmur_cmd->cmd_state;
+	state->cmd = tcmur_cmd;
+	list_head_init(&state->covered);
+	list_node_init(&state->entry);
+
+	pthread_mutex_lock(&rdev->flush_merge.lock);
+	if (rdev->flush_merge.inflight) {
+		/* ride the next backend flush */
+		list_add_tail(&rdev->flush_merge.waiters, &state->entry);
+		pthread_mutex_unlock(&rdev->flush_merge.lock);
+		return TCMU_STS_ASYNC_HANDLED;
+	}
+	rdev->flush_merge.inflight = true;
+	pthread_mutex_unlock(&rdev->flush_merge.lock);
+
+	flush_merge_submit(dev, tcmur_cmd);
+	return TCMU_STS_ASYNC_HANDLED;
 }
 
 static int handle_recv_copy_result(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
@@ -1886,6 +3845,24 @@ static int handle_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (ret)
 		return ret;
 
+	tcmur_cache_invalidate(dev, tcmu_cdb_to_byte(dev, cmd->cdb),
+			       tcmu_lba_to_byte(dev,
+					tcmu_cdb_get_xfer_length(cmd->cdb)));
+
+	/* WRITE(10/12/16) carry FUA in byte 1 bit 3, WRITE(6) cannot */
+	if (cmd->cdb[0] != WRITE_6 && (cmd->cdb[1] & 0x08))
+		tcmur_cmd->write_flags |= TCMUR_WRITE_FLAG_FUA;
+
+	if (tcmur_cmd->write_flags & TCMUR_WRITE_FLAG_FUA) {
+		/* keep ordering against older coalesced data */
+		tcmur_wc_drain(dev, tcmu_cdb_to_byte(dev, cmd->cdb),
+			       tcmu_lba_to_byte(dev,
+					tcmu_cdb_get_xfer_length(cmd->cdb)));
+	} else if (tcmur_wc_write(dev, cmd) == TCMU_STS_OK) {
+		/* small adjacent writes are absorbed into the buffer */
+		return TCMU_STS_OK;
+	}
+
 	tcmur_cmd->done = handle_generic_cbk;
 	return aio_request_schedule(dev, tcmur_cmd, write_work_fn,
 				    tcmur_cmd_complete);
@@ -1895,13 +3872,48 @@ static int handle_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 static int handle_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	struct tcmur_device *rdev;
 	int ret;
 
 	ret = check_lba_and_length(dev, cmd, tcmu_cdb_get_xfer_length(cmd->cdb));
 	if (ret)
 		return ret;
 
-	tcmur_cmd->done = handle_generic_cbk;
+	/* reads must observe coalesced writes that have not landed yet */
+	tcmur_wc_drain(dev, tcmu_cdb_to_byte(dev, cmd->cdb),
+		       tcmu_lba_to_byte(dev,
+					tcmu_cdb_get_xfer_length(cmd->cdb)));
+
+	/* sequential streams may be served from the read-ahead buffers */
+	if (tcmur_ra_read(dev, cmd) == TCMU_STS_OK)
+		return TCMU_STS_OK;
+
+	if (tcmur_rc_read(dev, cmd) == TCMU_STS_OK)
+		return TCMU_STS_OK;
+
+	/*
+	 * With the read cache enabled, keep a copy of the iovec bases
+	 * so the completed data can be pulled back out of the data
+	 * area for insertion (handlers consume the iovec in place).
+	 */
+	rdev = tcmu_dev_get_private(dev);
+	if (rdev->rc &&
+	    !tcmur_cmd_state_init(dev, tcmur_cmd,
+				  sizeof(struct tcmur_rc_read_state) +
+				  cmd->iov_cnt * sizeof(struct iovec), 0)) {
+		struct tcmur_rc_read_state *rstate = tcmur_cmd->cmd_state;
+
+		rstate->gen = __atomic_load_n(&rdev->rc->gen,
+					      __ATOMIC_RELAXED);
+		memcpy(rstate->iov, cmd->iovec,
+		       cmd->iov_cnt * sizeof(struct iovec));
+		tcmur_cmd->requested = tcmu_iovec_length(cmd->iovec,
+							 cmd->iov_cnt);
+		tcmur_cmd->done = handle_read_rc_cbk;
+	} else {
+		tcmur_cmd->done = handle_generic_cbk;
+	}
+
 	return aio_request_schedule(dev, tcmur_cmd, read_work_fn,
 				    tcmur_cmd_complete);
 }
@@ -1971,7 +3983,7 @@ static void handle_format_unit_cbk(struct tcmu_device *dev,
 	return;
 
 free_state:
-	tcmur_cmd_state_free(tcmur_cmd);
+	tcmur_cmd_state_free(dev, tcmur_cmd);
 	pthread_mutex_lock(&rdev->format_lock);
 	rdev->flags &= ~TCMUR_DEV_FLAG_FORMATTING;
 	pthread_mutex_unlock(&rdev->format_lock);
@@ -2003,7 +4015,7 @@ static int handle_format_unit(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (tcmu_lba_to_byte(dev, num_lbas) < length)
 		length = tcmu_lba_to_byte(dev, num_lbas);
 
-	if (tcmur_cmd_state_init(tcmur_cmd, sizeof(struct format_unit_state),
+	if (tcmur_cmd_state_init(dev, tcmur_cmd, sizeof(struct format_unit_state),
 				 length))
 		goto clear_format;
 	tcmur_cmd->done = handle_format_unit_cbk;
@@ -2019,7 +4031,7 @@ static int handle_format_unit(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	return TCMU_STS_ASYNC_HANDLED;
 
 free_state:
-	tcmur_cmd_state_free(tcmur_cmd);
+	tcmur_cmd_state_free(dev, tcmur_cmd);
 clear_format:
 	pthread_mutex_lock(&rdev->format_lock);
 	rdev->flags &= ~TCMUR_DEV_FLAG_FORMATTING;
@@ -2040,20 +4052,100 @@ static int handle_stpg(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 
 	ret = tcmu_emulate_set_tgt_port_grps(dev, &group_list, cmd);
 	tcmu_release_alua_grps(&group_list);
+
+	/* the group states may just have changed */
+	tcmur_rtpg_cache_invalidate(dev);
+
 	return ret;
 }
 
+void tcmur_rtpg_cache_invalidate(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	int i;
+
+	pthread_mutex_lock(&rdev->rtpg_cache.lock);
+	for (i = 0; i < ARRAY_SIZE(rdev->rtpg_cache.buf); i++) {
+		free(rdev->rtpg_cache.buf[i]);
+		rdev->rtpg_cache.buf[i] = NULL;
+		rdev->rtpg_cache.len[i] = 0;
+	}
+	pthread_mutex_unlock(&rdev->rtpg_cache.lock);
+}
+
+/* build size for the cached payload; larger requests are re-derived */
+#define TCMUR_RTPG_BUILD_LEN 1024
+
 static int handle_rtpg(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	uint32_t alloc_len = tcmu_cdb_get_xfer_length(cmd->cdb);
+	int slot = !!(cmd->cdb[1] & 0x20);
+	uint8_t buf[TCMUR_RTPG_BUILD_LEN];
+	uint8_t build_cdb[16];
+	uint32_t build_len;
 	struct list_head group_list;
+	struct iovec iov;
+	size_t len;
 	int ret;
 
+	/*
+	 * Multipath initiators issue RTPG every few seconds per path;
+	 * serve the encoded payload from the cache and only walk the
+	 * ALUA configfs tree when it has been invalidated.
+	 */
+	if (alloc_len <= sizeof(buf)) {
+		pthread_mutex_lock(&rdev->rtpg_cache.lock);
+		if (rdev->rtpg_cache.buf[slot]) {
+			tcmu_memcpy_into_iovec(cmd->iovec, cmd->iov_cnt,
+					       rdev->rtpg_cache.buf[slot],
+					       rdev->rtpg_cache.len[slot]);
+			pthread_mutex_unlock(&rdev->rtpg_cache.lock);
+			return TCMU_STS_OK;
+		}
+		pthread_mutex_unlock(&rdev->rtpg_cache.lock);
+	}
+
 	list_head_init(&group_list);
 
 	if (tcmu_get_alua_grps(dev, &group_list))
 		return TCMU_STS_HW_ERR;
 
-	ret = tcmu_emulate_report_tgt_port_grps(dev, &group_list, cmd);
+	if (alloc_len > sizeof(buf)) {
+		/* oversized request, build straight into the iovec */
+		ret = tcmu_emulate_report_tgt_port_grps(dev, &group_list,
+							cmd);
+		goto release;
+	}
+
+	/* build the full payload once and remember it */
+	memcpy(build_cdb, cmd->cdb, sizeof(build_cdb));
+	build_len = htobe32(sizeof(buf));
+	memcpy(&build_cdb[6], &build_len, 4);
+
+	memset(buf, 0, sizeof(buf));
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+
+	ret = __tcmu_emulate_report_tgt_port_grps(dev, &group_list,
+						  build_cdb, &iov, 1);
+	if (ret != TCMU_STS_OK)
+		goto release;
+
+	len = sizeof(buf) - iov.iov_len;
+	tcmu_memcpy_into_iovec(cmd->iovec, cmd->iov_cnt, buf, len);
+
+	pthread_mutex_lock(&rdev->rtpg_cache.lock);
+	if (!rdev->rtpg_cache.buf[slot]) {
+		rdev->rtpg_cache.buf[slot] = malloc(len);
+		if (rdev->rtpg_cache.buf[slot]) {
+			memcpy(rdev->rtpg_cache.buf[slot], buf, len);
+			rdev->rtpg_cache.len[slot] = len;
+		}
+	}
+	pthread_mutex_unlock(&rdev->rtpg_cache.lock);
+
+release:
 	tcmu_release_alua_grps(&group_list);
 	return ret;
 }
@@ -2114,13 +4206,85 @@ int tcmur_cmd_passthrough_handler(struct tcmu_device *dev,
 	return ret;
 }
 
+/*
+ * Per-device opcode dispatch table, built once at device add and
+ * specialized by the device's capabilities (handler callouts, unmap
+ * support), so the per-command path is one indexed load plus an
+ * indirect call instead of two opcode switches and repeated
+ * capability tests. Slots carry the ALUA treatment so the implicit
+ * transition check stays exactly where the old switch put it.
+ */
+enum {
+	TCMUR_DISP_ALUA_NONE,
+	TCMUR_DISP_ALUA_READ,
+	TCMUR_DISP_ALUA_WRITE,
+};
+
+static int handle_unsupported_cmd(struct tcmu_device *dev,
+				  struct tcmulib_cmd *cmd)
+{
+	return TCMU_STS_NOT_HANDLED;
+}
+
+static void dispatch_set(struct tcmur_device *rdev, uint8_t op,
+			 tcmur_dispatch_fn_t fn, uint8_t alua)
+{
+	rdev->dispatch[op].fn = fn;
+	rdev->dispatch[op].alua = alua;
+}
+
+void tcmur_dispatch_table_setup(struct tcmu_device *dev)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	int op;
+
+	for (op = 0; op < 256; op++)
+		dispatch_set(rdev, op, handle_unsupported_cmd,
+			     TCMUR_DISP_ALUA_NONE);
+
+	dispatch_set(rdev, READ_6, handle_read, TCMUR_DISP_ALUA_READ);
+	dispatch_set(rdev, READ_10, handle_read, TCMUR_DISP_ALUA_READ);
+	dispatch_set(rdev, READ_12, handle_read, TCMUR_DISP_ALUA_READ);
+	dispatch_set(rdev, READ_16, handle_read, TCMUR_DISP_ALUA_READ);
+
+	dispatch_set(rdev, WRITE_6, handle_write, TCMUR_DISP_ALUA_WRITE);
+	dispatch_set(rdev, WRITE_10, handle_write, TCMUR_DISP_ALUA_WRITE);
+	dispatch_set(rdev, WRITE_12, handle_write, TCMUR_DISP_ALUA_WRITE);
+	dispatch_set(rdev, WRITE_16, handle_write, TCMUR_DISP_ALUA_WRITE);
+
+	if (rhandler->unmap || rhandler->unmap_ranges)
+		dispatch_set(rdev, UNMAP, handle_unmap,
+			     TCMUR_DISP_ALUA_WRITE);
+
+	if (rhandler->flush) {
+		dispatch_set(rdev, SYNCHRONIZE_CACHE, handle_flush,
+			     TCMUR_DISP_ALUA_WRITE);
+		dispatch_set(rdev, SYNCHRONIZE_CACHE_16, handle_flush,
+			     TCMUR_DISP_ALUA_WRITE);
+	}
+
+	dispatch_set(rdev, EXTENDED_COPY, handle_xcopy,
+		     TCMUR_DISP_ALUA_WRITE);
+	dispatch_set(rdev, COMPARE_AND_WRITE, handle_caw,
+		     TCMUR_DISP_ALUA_WRITE);
+	dispatch_set(rdev, WRITE_VERIFY, handle_write_verify,
+		     TCMUR_DISP_ALUA_WRITE);
+	dispatch_set(rdev, WRITE_VERIFY_16, handle_write_verify,
+		     TCMUR_DISP_ALUA_WRITE);
+	dispatch_set(rdev, WRITE_SAME, handle_writesame,
+		     TCMUR_DISP_ALUA_WRITE);
+	dispatch_set(rdev, WRITE_SAME_16, handle_writesame,
+		     TCMUR_DISP_ALUA_WRITE);
+	dispatch_set(rdev, FORMAT_UNIT, handle_format_unit,
+		     TCMUR_DISP_ALUA_WRITE);
+}
+
 static int tcmur_cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	int ret = TCMU_STS_NOT_HANDLED;
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	uint8_t *cdb = cmd->cdb;
-	bool is_read = false;
+	struct tcmur_dispatch_ent *ent = &rdev->dispatch[cmd->cdb[0]];
 
 	track_aio_request_start(rdev);
 
@@ -2130,76 +4294,15 @@ static int tcmur_cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	}
 
 	/* Don't perform alua implicit transition if command is not supported */
-	switch(cdb[0]) {
-	/* Skip to grab the lock for reads */
-	case READ_6:
-	case READ_10:
-	case READ_12:
-	case READ_16:
-		is_read = true;
-	case WRITE_6:
-	case WRITE_10:
-	case WRITE_12:
-	case WRITE_16:
-	case UNMAP:
-	case SYNCHRONIZE_CACHE:
-	case SYNCHRONIZE_CACHE_16:
-	case EXTENDED_COPY:
-	case COMPARE_AND_WRITE:
-	case WRITE_VERIFY:
-	case WRITE_VERIFY_16:
-	case WRITE_SAME:
-	case WRITE_SAME_16:
-	case FORMAT_UNIT:
-		ret = alua_check_state(dev, cmd, is_read);
+	if (ent->alua != TCMUR_DISP_ALUA_NONE &&
+	    ent->fn != handle_unsupported_cmd) {
+		ret = alua_check_state(dev, cmd,
+				       ent->alua == TCMUR_DISP_ALUA_READ);
 		if (ret)
 			goto untrack;
-		break;
-	default:
-		break;
 	}
 
-	switch(cdb[0]) {
-	case READ_6:
-	case READ_10:
-	case READ_12:
-	case READ_16:
-		ret = handle_read(dev, cmd);
-		break;
-	case WRITE_6:
-	case WRITE_10:
-	case WRITE_12:
-	case WRITE_16:
-		ret = handle_write(dev, cmd);
-		break;
-	case UNMAP:
-		ret = handle_unmap(dev, cmd);
-		break;
-	case SYNCHRONIZE_CACHE:
-	case SYNCHRONIZE_CACHE_16:
-		if (rhandler->flush)
-			ret = handle_flush(dev, cmd);
-		break;
-	case EXTENDED_COPY:
-		ret = handle_xcopy(dev, cmd);
-		break;
-	case COMPARE_AND_WRITE:
-		ret = handle_caw(dev, cmd);
-		break;
-	case WRITE_VERIFY:
-	case WRITE_VERIFY_16:
-		ret = handle_write_verify(dev, cmd);
-		break;
-	case WRITE_SAME:
-	case WRITE_SAME_16:
-		ret = handle_writesame(dev, cmd);
-		break;
-	case FORMAT_UNIT:
-		ret = handle_format_unit(dev, cmd);
-		break;
-	default:
-		ret = TCMU_STS_NOT_HANDLED;
-	}
+	ret = ent->fn(dev, cmd);
 
 untrack:
 	if (ret != TCMU_STS_ASYNC_HANDLED)
@@ -2207,11 +4310,80 @@ untrack:
 	return ret;
 }
 
+/*
+ * Initiators probe INQUIRY and the VPD pages constantly, and building
+ * them means configfs reads (WWN fields) and an ALUA directory walk.
+ * Build each response once, serve it with a memcpy into the ring
+ * iovec, and throw it away on reconfigure.
+ */
+static int tcmur_inq_cache_slot(uint8_t *cdb)
+{
+	if (!(cdb[1] & 0x01))
+		return cdb[2] ? -1 : 0;
+
+	switch (cdb[2]) {
+	case 0x00:
+		return 1;
+	case 0x80:
+		return 2;
+	case 0x83:
+		return 3;
+	case 0xb0:
+		return 4;
+	case 0xb1:
+		return 5;
+	case 0xb2:
+		return 6;
+	}
+
+	return -1;
+}
+
+void tcmur_inq_cache_invalidate(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	int i;
+
+	pthread_mutex_lock(&rdev->inq_cache.lock);
+	for (i = 0; i < ARRAY_SIZE(rdev->inq_cache.buf); i++) {
+		free(rdev->inq_cache.buf[i]);
+		rdev->inq_cache.buf[i] = NULL;
+		rdev->inq_cache.len[i] = 0;
+	}
+	pthread_mutex_unlock(&rdev->inq_cache.lock);
+}
+
 static int handle_inquiry(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct list_head group_list;
 	struct tgt_port *port;
-	int ret;
+	uint8_t buf[512];
+	uint8_t build_cdb[6];
+	struct iovec iov;
+	bool has_port;
+	size_t len;
+	int slot, ret;
+
+	slot = tcmur_inq_cache_slot(cmd->cdb);
+
+	if (slot >= 0) {
+		pthread_mutex_lock(&rdev->inq_cache.lock);
+		if (rdev->inq_cache.buf[slot]) {
+			has_port = rdev->inq_cache.has_port;
+			tcmu_memcpy_into_iovec(cmd->iovec, cmd->iov_cnt,
+					       rdev->inq_cache.buf[slot],
+					       rdev->inq_cache.len[slot]);
+			pthread_mutex_unlock(&rdev->inq_cache.lock);
+
+			/* keep the INQUIRY-triggered lock-state resync */
+			if (has_port)
+				tcmu_update_dev_lock_state(dev);
+
+			return TCMU_STS_OK;
+		}
+		pthread_mutex_unlock(&rdev->inq_cache.lock);
+	}
 
 	list_head_init(&group_list);
 
@@ -2225,8 +4397,46 @@ static int handle_inquiry(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 		tcmu_update_dev_lock_state(dev);
 	}
 
-	ret = tcmu_emulate_inquiry(dev, port, cmd->cdb, cmd->iovec,
-				   cmd->iov_cnt);
+	if (slot < 0) {
+		/* unsupported page, let the emulation set the error */
+		ret = tcmu_emulate_inquiry(dev, port, cmd->cdb, cmd->iovec,
+					   cmd->iov_cnt);
+		goto release;
+	}
+
+	/*
+	 * Build the full response once and remember it. The emulation
+	 * truncates to the CDB's allocation length, so build with a
+	 * full-size one - otherwise the first requester's (often tiny)
+	 * allocation length would become the permanent cache content.
+	 */
+	memcpy(build_cdb, cmd->cdb, sizeof(build_cdb));
+	build_cdb[3] = (sizeof(buf) >> 8) & 0xff;
+	build_cdb[4] = sizeof(buf) & 0xff;
+
+	memset(buf, 0, sizeof(buf));
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+
+	ret = tcmu_emulate_inquiry(dev, port, build_cdb, &iov, 1);
+	if (ret != TCMU_STS_OK)
+		goto release;
+
+	len = sizeof(buf) - iov.iov_len;
+	tcmu_memcpy_into_iovec(cmd->iovec, cmd->iov_cnt, buf, len);
+
+	pthread_mutex_lock(&rdev->inq_cache.lock);
+	rdev->inq_cache.has_port = !!port;
+	if (!rdev->inq_cache.buf[slot]) {
+		rdev->inq_cache.buf[slot] = malloc(len);
+		if (rdev->inq_cache.buf[slot]) {
+			memcpy(rdev->inq_cache.buf[slot], buf, len);
+			rdev->inq_cache.len[slot] = len;
+		}
+	}
+	pthread_mutex_unlock(&rdev->inq_cache.lock);
+
+release:
 	tcmu_release_alua_grps(&group_list);
 	return ret;
 }
@@ -2373,6 +4583,9 @@ int tcmur_generic_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	int ret;
 
+	TCMU_PROBE3(cmd_dispatch, tcmu_dev_get_uio_name(dev), cmd->cmd_id,
+		    cmd->cdb[0]);
+
 	ret = handle_pending_ua(rdev, cmd);
 	if (ret != TCMU_STS_NOT_HANDLED)
 		return ret;
@@ -17,6 +17,37 @@ struct tcmur_cmd;
 struct timespec;
 
 int tcmur_get_time(struct tcmu_device *dev, struct timespec *time);
+void tcmur_dispatch_table_setup(struct tcmu_device *dev);
+int tcmur_cmd_slab_setup(struct tcmu_device *dev);
+void tcmur_cmd_slab_cleanup(struct tcmu_device *dev);
+void tcmur_set_xcopy_window(int window);
+void tcmur_inq_cache_invalidate(struct tcmu_device *dev);
+void tcmur_rtpg_cache_invalidate(struct tcmu_device *dev);
+
+/* per-device, per-opcode-class latency accounting */
+enum tcmur_stat_class {
+	TCMUR_STAT_READ,
+	TCMUR_STAT_WRITE,
+	TCMUR_STAT_FLUSH,
+	TCMUR_STAT_UNMAP,
+	TCMUR_STAT_OTHER,
+	TCMUR_STAT_NR_CLASSES,
+};
+
+int tcmur_ra_setup(struct tcmu_device *dev, int read_ahead_kb);
+void tcmur_ra_cleanup(struct tcmu_device *dev);
+int tcmur_rc_setup(struct tcmu_device *dev, int read_cache_mb);
+void tcmur_rc_cleanup(struct tcmu_device *dev);
+int tcmur_wc_setup(struct tcmu_device *dev, int write_coalesce_kb);
+void tcmur_wc_cleanup(struct tcmu_device *dev);
+void tcmur_wc_drain(struct tcmu_device *dev, uint64_t off, uint64_t len);
+void tcmur_wc_idle_submit(struct tcmu_device *dev);
+int tcmur_wc_take_error(struct tcmu_device *dev);
+
+void tcmur_stats_cmd_start(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+void tcmur_stats_cmd_complete(struct tcmu_device *dev,
+			      struct tcmulib_cmd *cmd);
+int tcmur_stats_format(struct tcmu_device *dev, char *buf, size_t len);
 int tcmur_dev_update_size(struct tcmu_device *dev, uint64_t new_size);
 void tcmur_set_pending_ua(struct tcmu_device *dev, int ua);
 int tcmur_generic_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
@@ -24,6 +55,8 @@ int tcmur_cmd_passthrough_handler(struct tcmu_device *dev, struct tcmulib_cmd *c
 bool tcmur_handler_is_passthrough_only(struct tcmur_handler *rhandler);
 void tcmur_tcmulib_cmd_complete(struct tcmu_device *dev,
 				struct tcmulib_cmd *cmd, int ret);
+void tcmur_tcmulib_cmds_complete(struct tcmu_device *dev,
+				 struct tcmulib_cmd **cmds, int *rcs, int cnt);
 
 typedef int (*tcmur_writesame_fn_t)(struct tcmu_device *dev,
 				    struct tcmur_cmd *tcmur_cmd, uint64_t off,
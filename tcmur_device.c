@@ -8,6 +8,7 @@
 
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
@@ -15,6 +16,7 @@
 #include <errno.h>
 #include <unistd.h>
 
+#include "libtcmu.h"
 #include "libtcmu_log.h"
 #include "libtcmu_common.h"
 #include "tcmu-runner.h"
@@ -24,6 +26,176 @@
 #include "tcmu_runner_priv.h"
 #include "target.h"
 
+/*
+ * Thread placement: parse a "0-3,8"-style cpu list and pin the
+ * calling thread to it, logging the placement so LUNs can be checked
+ * against the NICs/HBAs their traffic arrives on.
+ */
+int tcmur_parse_cpuset(const char *str, cpu_set_t *set)
+{
+	const char *p = str;
+	char *end;
+	long a, b;
+
+	CPU_ZERO(set);
+
+	while (*p) {
+		a = strtol(p, &end, 10);
+		if (end == p || a < 0 || a >= CPU_SETSIZE)
+			return -EINVAL;
+		b = a;
+		p = end;
+
+		if (*p == '-') {
+			p++;
+			b = strtol(p, &end, 10);
+			if (end == p || b < a || b >= CPU_SETSIZE)
+				return -EINVAL;
+			p = end;
+		}
+
+		for (; a <= b; a++)
+			CPU_SET(a, set);
+
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -EINVAL;
+	}
+
+	return CPU_COUNT(set) ? 0 : -EINVAL;
+}
+
+void tcmur_apply_cpuset(struct tcmu_device *dev, const char *role)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	cpu_set_t set;
+
+	if (!rdev->cpuset[0])
+		return;
+
+	if (tcmur_parse_cpuset(rdev->cpuset, &set)) {
+		tcmu_dev_warn(dev, "invalid cpuset '%s'\n", rdev->cpuset);
+		return;
+	}
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+		tcmu_dev_warn(dev, "could not pin %s thread to %s\n",
+			      role, rdev->cpuset);
+		return;
+	}
+
+	tcmu_dev_info(dev, "pinned %s thread to cpus %s\n", role,
+		      rdev->cpuset);
+}
+
+struct tcmur_parked_cmd {
+	struct list_node entry;
+	struct tcmulib_cmd *cmd;
+};
+
+/* called with rdev->state_lock held (the ALUA transition decision) */
+int tcmur_park_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_parked_cmd *parked;
+
+	if (rdev->lock_waiters.nr >= TCMUR_LOCK_WAITERS_MAX)
+		return TCMU_STS_BUSY;
+
+	parked = malloc(sizeof(*parked));
+	if (!parked)
+		return TCMU_STS_BUSY;
+
+	parked->cmd = cmd;
+	list_add_tail(&rdev->lock_waiters.cmds, &parked->entry);
+	rdev->lock_waiters.nr++;
+
+	/*
+	 * Drop the aio tracking while parked: the lock acquisition
+	 * drains tracked_aio_ops, so a held reference would deadlock
+	 * the handoff against its own waiters. The re-dispatch (or
+	 * the failure completion) tracks the command afresh.
+	 */
+	track_aio_request_finish(rdev, NULL);
+
+	return TCMU_STS_ASYNC_HANDLED;
+}
+
+/* take the whole parked list; called with state_lock held */
+static struct tcmur_parked_cmd *
+tcmur_claim_parked_cmds(struct tcmur_device *rdev, struct list_head *list)
+{
+	struct tcmur_parked_cmd *parked;
+
+	list_head_init(list);
+	while (!list_empty(&rdev->lock_waiters.cmds)) {
+		parked = list_first_entry(&rdev->lock_waiters.cmds,
+					  struct tcmur_parked_cmd, entry);
+		list_del(&parked->entry);
+		list_add_tail(list, &parked->entry);
+	}
+	rdev->lock_waiters.nr = 0;
+
+	return NULL;
+}
+
+/* re-dispatch every parked command in arrival order */
+void tcmur_release_parked_cmds(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_parked_cmd *parked;
+	struct list_head list;
+	bool completed = false;
+	int ret;
+
+	pthread_mutex_lock(&rdev->state_lock);
+	tcmur_claim_parked_cmds(rdev, &list);
+	pthread_mutex_unlock(&rdev->state_lock);
+
+	while (!list_empty(&list)) {
+		parked = list_first_entry(&list, struct tcmur_parked_cmd,
+					  entry);
+		list_del(&parked->entry);
+
+		ret = tcmur_generic_handle_cmd(dev, parked->cmd);
+		if (ret != TCMU_STS_ASYNC_HANDLED) {
+			tcmur_tcmulib_cmd_complete(dev, parked->cmd, ret);
+			completed = true;
+		}
+		free(parked);
+	}
+
+	if (completed)
+		tcmulib_processing_complete(dev);
+}
+
+/* fail parked commands out, for device teardown */
+void tcmur_fail_parked_cmds(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_parked_cmd *parked;
+	struct list_head list;
+	bool completed = false;
+
+	pthread_mutex_lock(&rdev->state_lock);
+	tcmur_claim_parked_cmds(rdev, &list);
+	pthread_mutex_unlock(&rdev->state_lock);
+
+	while (!list_empty(&list)) {
+		parked = list_first_entry(&list, struct tcmur_parked_cmd,
+					  entry);
+		list_del(&parked->entry);
+
+		tcmur_tcmulib_cmd_complete(dev, parked->cmd, TCMU_STS_BUSY);
+		completed = true;
+		free(parked);
+	}
+
+	if (completed)
+		tcmulib_processing_complete(dev);
+}
+
 bool tcmu_dev_in_recovery(struct tcmu_device *dev)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
@@ -277,6 +449,9 @@ void tcmu_notify_lock_lost(struct tcmu_device *dev)
 		__tcmu_notify_lock_lost(dev);
 	}
 	pthread_mutex_unlock(&rdev->state_lock);
+
+	/* the cached RTPG payload reports the old ALUA state */
+	tcmur_rtpg_cache_invalidate(dev);
 }
 
 void tcmu_release_dev_lock(struct tcmu_device *dev)
@@ -312,6 +487,8 @@ void tcmu_release_dev_lock(struct tcmu_device *dev)
 	pthread_mutex_lock(&rdev->state_lock);
 	rdev->lock_state = TCMUR_DEV_LOCK_UNLOCKED;
 	pthread_mutex_unlock(&rdev->state_lock);
+
+	tcmur_rtpg_cache_invalidate(dev);
 }
 
 int tcmu_get_lock_tag(struct tcmu_device *dev, uint16_t *tag)
@@ -500,6 +677,18 @@ done:
 
 	pthread_mutex_unlock(&rdev->state_lock);
 
+	tcmur_rtpg_cache_invalidate(dev);
+
+	/*
+	 * Settle the commands that parked during the handoff: on
+	 * success they re-dispatch in arrival order, on failure they
+	 * go back to the initiator for session-level retry.
+	 */
+	if (ret == TCMU_STS_OK)
+		tcmur_release_parked_cmds(dev);
+	else
+		tcmur_fail_parked_cmds(dev);
+
 	return ret;
 }
 
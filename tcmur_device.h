@@ -10,6 +10,7 @@
 #define __TCMUR_DEVICE_H
 
 #include "pthread.h"
+#include <sched.h>
 
 #include "ccan/list/list.h"
 
@@ -41,11 +42,49 @@ enum {
 };
 
 struct tcmur_work;
+struct tcmur_ra;
+struct tcmur_rc;
+struct tcmur_wc;
+
+/* one locked [start, end) LBA range on rdev->caw_ranges */
+struct tcmur_locked_range {
+	uint64_t start;
+	uint64_t end;
+	struct list_node entry;
+};
+
+/*
+ * Fixed-size pool of command-state blocks, each big enough for the
+ * common emulated-command cases (state struct + iovec + one
+ * max_xfer_len data buffer). Oversized requests fall back to the
+ * allocator.
+ */
+struct tcmur_cmd_slab {
+	pthread_spinlock_t lock;
+	void **blocks;
+	unsigned int nr_free;
+	unsigned int nr_blocks;
+	size_t block_size;
+};
+
+struct tcmu_device;
+struct tcmulib_cmd;
+typedef int (*tcmur_dispatch_fn_t)(struct tcmu_device *dev,
+				   struct tcmulib_cmd *cmd);
+
+/* one per-opcode dispatch slot (see tcmur_dispatch_table_setup) */
+struct tcmur_dispatch_ent {
+	tcmur_dispatch_fn_t fn;
+	uint8_t alua;
+};
 
 struct tcmur_device {
 	struct tcmu_device *dev;
 	void *hm_private;
 
+	/* per-opcode dispatch, specialized at device add */
+	struct tcmur_dispatch_ent dispatch[256];
+
 	pthread_t cmdproc_thread;
 
 	/* TCMUR_DEV flags */
@@ -68,21 +107,144 @@ struct tcmur_device {
 	int pending_uas;
 
 	/*
-	 * lock order:
-	 *  work_queue->aio_lock
-	 *    track_queue->track_lock
+	 * Event-loop mode: set under state_lock while a loop thread is
+	 * dispatching this device, so removal can wait the dispatch
+	 * out before tearing the device down.
 	 */
+	bool evloop_busy;
+	pthread_cond_t evloop_cond;
+
+	/* work_queue submission is lock-free; see tcmur_aio.c */
         struct tcmu_io_queue work_queue;
         struct tcmu_track_aio track_queue;
 
 	pthread_spinlock_t lock; /* protects concurrent updates to mailbox */
-	pthread_mutex_t caw_lock; /* for atomic CAW operation */
+
+	/*
+	 * LBA range locking for atomic CAW operation: only CAWs whose
+	 * ranges overlap serialize, disjoint ones run concurrently.
+	 */
+	struct {
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		struct list_head ranges;
+	} caw_ranges;
 
 	uint32_t format_progress;
 	pthread_mutex_t format_lock; /* for atomic format operations */
 
 	int cmd_time_out;
-	struct list_head cmds_list;
+
+	/* busy-poll window after the ring runs dry, 0 disables */
+	int cmdproc_spin_us;
+
+	/* cpu list the device's threads are pinned to, empty = free */
+	char cpuset[64];
+
+	/*
+	 * Hashed timer wheel for command timeouts: arming is an O(1)
+	 * list add into the deadline's one-second bucket, expiry only
+	 * touches the buckets whose tick has passed. A command whose
+	 * deadline wraps the wheel is skipped until its real deadline.
+	 */
+#define TCMUR_TIMEOUT_WHEEL_SLOTS 128
+	struct list_head timeout_wheel[TCMUR_TIMEOUT_WHEEL_SLOTS];
+	time_t timeout_last_check;
+
+	/* completions waiting for ring order on non-OOOC kernels */
+	struct list_head parked_cmds;
+
+	struct tcmur_cmd_slab cmd_slab;
+
+	/*
+	 * Per-device QoS: token buckets for IOPS and bytes/sec with a
+	 * two-second burst allowance, enforced at aio scheduling by
+	 * deferring dispatch instead of returning sense errors.
+	 */
+	struct {
+		pthread_mutex_t lock;
+		uint64_t iops_limit;
+		uint64_t bps_limit;
+		double iops_tokens;
+		double bps_tokens;
+		uint64_t last_refill_ns;
+		struct list_head deferred;
+		struct list_node gov_entry;
+		bool governed;
+		/* governor-tick bookkeeping, under qos_gov.lock */
+		bool sweeping;
+		uint64_t last_tick;
+		uint64_t deferrals;
+	} qos;
+
+	/*
+	 * Commands arriving during an implicit ALUA lock handoff park
+	 * here (bounded) and are re-dispatched in order once the
+	 * acquisition settles, instead of bouncing BUSY sense at the
+	 * initiator for the whole handoff window.
+	 */
+#define TCMUR_LOCK_WAITERS_MAX 128
+	struct {
+		struct list_head cmds;
+		int nr;
+	} lock_waiters;
+
+	/*
+	 * Flush merging: while one backend flush is in flight, later
+	 * SYNCHRONIZE CACHE commands park here and ride the next one,
+	 * so N overlapping flushes cost at most two backend calls.
+	 */
+	struct {
+		pthread_mutex_t lock;
+		struct list_head waiters;
+		bool inflight;
+		uint64_t epochs;
+	} flush_merge;
+
+	/* optional sequential read-ahead engine, NULL when disabled */
+	struct tcmur_ra *ra;
+
+	/* optional RAM read cache, NULL when disabled */
+	struct tcmur_rc *rc;
+
+	/* optional write coalescing buffer, NULL when disabled */
+	struct tcmur_wc *wc;
+
+	/*
+	 * Always-on latency accounting: log2(usec) bucketed histograms
+	 * per opcode class plus an in-flight gauge, updated with
+	 * relaxed atomics and scraped over D-Bus (GetStats).
+	 */
+#define TCMUR_STAT_BUCKETS 32
+	struct {
+		uint64_t hist[5][TCMUR_STAT_BUCKETS];
+		uint64_t count[5];
+		uint64_t inflight;
+	} stats;
+
+	/*
+	 * Cached INQUIRY/VPD responses, built on first use and served
+	 * with a memcpy; invalidated on reconfigure. Slot 0 is the
+	 * standard INQUIRY, the rest are the supported VPD pages.
+	 */
+	struct {
+		pthread_mutex_t lock;
+		uint8_t *buf[7];
+		size_t len[7];
+		/* an enabled port existed when the cache was built */
+		bool has_port;
+	} inq_cache;
+
+	/*
+	 * Cached encoded RTPG payload (one slot per extended-header
+	 * variant), rebuilt after STPG, lock events and reconfigure
+	 * instead of rescanning the ALUA configfs tree per RTPG.
+	 */
+	struct {
+		pthread_mutex_t lock;
+		uint8_t *buf[2];
+		size_t len[2];
+	} rtpg_cache;
 };
 
 bool tcmu_dev_in_recovery(struct tcmu_device *dev);
@@ -103,4 +265,12 @@ void tcmu_update_dev_lock_state(struct tcmu_device *dev);
 void tcmur_dev_set_private(struct tcmu_device *dev, void *private);
 void *tcmur_dev_get_private(struct tcmu_device *dev);
 
+int tcmur_parse_cpuset(const char *str, cpu_set_t *set);
+void tcmur_apply_cpuset(struct tcmu_device *dev, const char *role);
+
+/* implicit-ALUA command parking, guarded by rdev->state_lock */
+int tcmur_park_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+void tcmur_release_parked_cmds(struct tcmu_device *dev);
+void tcmur_fail_parked_cmds(struct tcmu_device *dev);
+
 #endif
@@ -11,11 +11,101 @@
 #include <errno.h>
 #include <pthread.h>
 
+#include "ccan/list/list.h"
+
 #include "libtcmu.h"
 #include "libtcmu_log.h"
 #include "tcmur_device.h"
 #include "tcmur_work.h"
 
+/*
+ * Event work (lock recovery, STPG transitions, device recovery) runs
+ * on a persistent pool shared across devices instead of a freshly
+ * created thread per call, so failover-critical work starts in
+ * microseconds. The pool grows while every worker is busy - recovery
+ * work can block for a long time - up to a bound that keeps a
+ * flapping path from spawning threads without limit.
+ */
+#define TCMUR_EWORK_MIN_THREADS 2
+#define TCMUR_EWORK_MAX_THREADS 64
+
+struct ework_item {
+	struct list_node entry;
+	void *data;
+	void (*work_fn)(void *);
+	struct tcmur_work *work;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head items;
+	int nr_threads;
+	int nr_idle;
+} ework_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *ework_pool_fn(void *arg)
+{
+	struct ework_item *item;
+	struct tcmur_work *work;
+
+	tcmu_set_thread_name("ework-thread", NULL);
+	__tcmu_is_ework_thread = 1;
+
+	while (1) {
+		pthread_mutex_lock(&ework_pool.lock);
+		ework_pool.nr_idle++;
+		while (list_empty(&ework_pool.items))
+			pthread_cond_wait(&ework_pool.cond, &ework_pool.lock);
+		ework_pool.nr_idle--;
+		item = list_first_entry(&ework_pool.items, struct ework_item,
+					entry);
+		list_del(&item->entry);
+		pthread_mutex_unlock(&ework_pool.lock);
+
+		item->work_fn(item->data);
+
+		work = item->work;
+		pthread_mutex_lock(&work->lock);
+		if (--work->refcnt == 0)
+			pthread_cond_signal(&work->cond);
+		pthread_mutex_unlock(&work->lock);
+
+		free(item);
+	}
+
+	return NULL;
+}
+
+/* called with ework_pool.lock held */
+static int ework_pool_grow(void)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	int ret;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, ework_pool_fn, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (!ret)
+		ework_pool.nr_threads++;
+	return ret;
+}
+
+static void ework_pool_init_once(void)
+{
+	int i;
+
+	list_head_init(&ework_pool.items);
+	for (i = 0; i < TCMUR_EWORK_MIN_THREADS; i++)
+		ework_pool_grow();
+}
+
 struct tcmur_work *tcmur_create_work(void)
 {
 	struct tcmur_work *work;
@@ -51,8 +141,8 @@ static void __tcmur_flush_work(struct tcmur_work *work)
 	/*
 	 * Some handlers will crash if we do a cancel so we just wait.
 	 */
-	tcmu_dbg("waiting for %d work thread to complete\n", work->refcnt);
-	if (work->refcnt)
+	tcmu_dbg("waiting for %d work items to complete\n", work->refcnt);
+	while (work->refcnt)
 		pthread_cond_wait(&work->cond, &work->lock);
 }
 
@@ -63,58 +153,47 @@ void tcmur_flush_work(struct tcmur_work *work)
 	pthread_mutex_unlock(&work->lock);
 }
 
-struct private {
-	void *data;
-	void (*work_fn)(void *);
-	struct tcmur_work *work;
-};
-
-static void *tcmur_work_fn(void *data)
-{
-	struct private *p = data;
-
-	tcmu_set_thread_name("ework-thread", NULL);
-	__tcmu_is_ework_thread = 1;
-
-	p->work_fn(p->data);
-
-	pthread_mutex_lock(&p->work->lock);
-	if (--p->work->refcnt == 0)
-		pthread_cond_signal(&p->work->cond);
-	pthread_mutex_unlock(&p->work->lock);
-
-	free(p);
-	return NULL;
-}
-
 int tcmur_run_work(struct tcmur_work *work, void *data, void (*work_fn)(void *))
 {
-	pthread_attr_t attr;
-	pthread_t thread;
-	struct private *p;
-	int ret;
+	static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+	struct ework_item *item;
+	int ret = 0;
 
-	p = malloc(sizeof(struct private));
-	if (!p)
+	pthread_once(&pool_once, ework_pool_init_once);
+
+	item = malloc(sizeof(*item));
+	if (!item)
 		return -ENOMEM;
 
-	p->data = data;
-	p->work_fn = work_fn;
-	p->work = work;
-
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	item->data = data;
+	item->work_fn = work_fn;
+	item->work = work;
 
 	pthread_mutex_lock(&work->lock);
-	ret = pthread_create(&thread, &attr, tcmur_work_fn, p);
-	if (!ret)
-		work->refcnt++;
+	work->refcnt++;
 	pthread_mutex_unlock(&work->lock);
 
-	pthread_attr_destroy(&attr);
+	pthread_mutex_lock(&ework_pool.lock);
+
+	/* recovery work can block for a long time, add hands if busy */
+	if (!ework_pool.nr_idle &&
+	    ework_pool.nr_threads < TCMUR_EWORK_MAX_THREADS)
+		ework_pool_grow();
+
+	if (!ework_pool.nr_threads) {
+		/* no worker ever started, give up */
+		pthread_mutex_unlock(&ework_pool.lock);
+		pthread_mutex_lock(&work->lock);
+		work->refcnt--;
+		pthread_mutex_unlock(&work->lock);
+		free(item);
+		return -ENOMEM;
+	}
+
+	list_add_tail(&ework_pool.items, &item->entry);
+	pthread_cond_signal(&ework_pool.cond);
+	pthread_mutex_unlock(&ework_pool.lock);
 
-	if (ret)
-		free(p);
 	return ret;
 }
 